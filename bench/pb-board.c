@@ -0,0 +1,303 @@
+/*
+** Playback manager - state board read benchmark
+**
+** Reader threads read the allowed states and the settings from a state
+** board while a writer thread publishes updates, and report the read
+** rate.  The writer always publishes mute and privacy override with the
+** same value, so a reader seeing them differ has read a torn update;
+** the count must stay 0.  Failed reads are readers giving up on a
+** board that kept changing under them, which only a writer going back
+** to back should cause.
+**
+** With -d, the same number of GetAllowedState round trips to a stand-in
+** manager on the session bus are timed for comparison:
+**
+**   bench/run-bench.sh ./pb-board -t 4 -w 1000 -d 20000
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libplayback/playback.h"
+
+#define MANAGER_SERVICE   "org.maemo.Playback.Manager"
+#define MANAGER_PATH      "/org/maemo/Playback/Manager"
+#define MANAGER_INTERFACE "org.maemo.Playback.Manager"
+
+typedef struct reader_s reader_t;
+
+struct reader_s
+{
+  pthread_t thread;
+  pb_board_t *board;
+  long reads;
+  long torn;
+  long failed;
+};
+
+static volatile int running = TRUE;
+static long write_rate;
+
+static double
+_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+_reader(void *data)
+{
+  reader_t *reader = (reader_t *)data;
+  int allowed_state[PB_STATE_LAST];
+  int mute, privacy;
+
+  while (running)
+  {
+    if (!pb_board_read_allowed_state(reader->board, PB_CLASS_MEDIA,
+                                     allowed_state) ||
+        !pb_board_read_settings(reader->board, &mute, &privacy, NULL))
+      reader->failed++;
+    else if (mute != privacy)
+      reader->torn++;
+
+    reader->reads += 2;
+  }
+
+  return NULL;
+}
+
+static void *
+_writer(void *data)
+{
+  pb_board_t *board = (pb_board_t *)data;
+  int allowed_state[PB_STATE_LAST] = {FALSE, TRUE, FALSE};
+  struct timespec ts = {0, write_rate ? 1000000000 / write_rate : 0};
+  int value = 0;
+
+  while (running)
+  {
+    value = !value;
+    allowed_state[PB_STATE_PLAY] = value;
+    pb_board_publish_allowed_state(board, PB_CLASS_MEDIA, allowed_state);
+    pb_board_publish_settings(board, value, value, BT_OVERRIDE_OFF);
+
+    if (write_rate)
+      nanosleep(&ts, NULL);
+  }
+
+  return NULL;
+}
+
+static DBusHandlerResult
+_manager_filter(DBusConnection *connection,
+                DBusMessage *message,
+                void *user_data)
+{
+  static const char *_states[] = {"Stop", "Play"};
+  const char **states = _states;
+  DBusMessage *reply;
+
+  if (!dbus_message_is_method_call(message, MANAGER_INTERFACE,
+                                   "GetAllowedState"))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if ((reply = dbus_message_new_method_return(message)))
+  {
+    dbus_message_append_args(reply,
+                             DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &states, 2,
+                             DBUS_TYPE_INVALID);
+    dbus_connection_send(connection, reply, NULL);
+    dbus_message_unref(reply);
+  }
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static void *
+_manager(void *data)
+{
+  DBusConnection *connection = (DBusConnection *)data;
+
+  while (running && dbus_connection_read_write_dispatch(connection, 10))
+    ;
+
+  return NULL;
+}
+
+/* Times @n blocking GetAllowedState calls to a stand-in manager */
+static void
+_bench_dbus(long n)
+{
+  DBusConnection *manager, *client;
+  pthread_t thread;
+  const char *path = "/org/maemo/playback0";
+  double start, elapsed;
+  long i;
+
+  manager = dbus_bus_get_private(DBUS_BUS_SESSION, NULL);
+  client = dbus_bus_get_private(DBUS_BUS_SESSION, NULL);
+
+  if (!manager || !client ||
+      dbus_bus_request_name(manager, MANAGER_SERVICE,
+                            DBUS_NAME_FLAG_DO_NOT_QUEUE, NULL) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+  {
+    fprintf(stderr, "pb-board: no session bus for -d\n");
+    exit(1);
+  }
+
+  dbus_connection_add_filter(manager, _manager_filter, NULL, NULL);
+  running = TRUE;
+  pthread_create(&thread, NULL, _manager, manager);
+  start = _now();
+
+  for (i = 0; i < n; i++)
+  {
+    DBusMessage *message, *reply;
+
+    message = dbus_message_new_method_call(MANAGER_SERVICE, MANAGER_PATH,
+                                           MANAGER_INTERFACE,
+                                           "GetAllowedState");
+    dbus_message_append_args(message, DBUS_TYPE_OBJECT_PATH, &path,
+                             DBUS_TYPE_INVALID);
+    reply = dbus_connection_send_with_reply_and_block(client, message, -1,
+                                                      NULL);
+    dbus_message_unref(message);
+
+    if (reply)
+      dbus_message_unref(reply);
+  }
+
+  elapsed = _now() - start;
+  running = FALSE;
+  pthread_join(thread, NULL);
+
+  printf("d-bus round trips:    %.0f/s, %.0f ns each\n", n / elapsed,
+         elapsed * 1e9 / n);
+
+  dbus_connection_close(client);
+  dbus_connection_unref(client);
+  dbus_connection_close(manager);
+  dbus_connection_unref(manager);
+}
+
+static void
+_usage(void)
+{
+  fprintf(stderr,
+          "usage: pb-board [-t readers] [-s seconds] [-w rate] "
+          "[-d round trips]\n"
+          "  -w  run a writer thread publishing rate updates/s, "
+          "0 for back to back\n");
+  exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+  pb_board_t *board;
+  reader_t *readers;
+  pthread_t writer;
+  int n_readers = 1;
+  double seconds = 2;
+  int write = FALSE;
+  long dbus_calls = 0;
+  long reads = 0, torn = 0, failed = 0;
+  int allowed_state[PB_STATE_LAST] = {FALSE, TRUE, TRUE};
+  double start, elapsed;
+  int i, c;
+
+  while ((c = getopt(argc, argv, "t:s:w:d:")) != -1)
+  {
+    switch (c)
+    {
+      case 't':
+        n_readers = atoi(optarg);
+        break;
+      case 's':
+        seconds = atof(optarg);
+        break;
+      case 'w':
+        write = TRUE;
+        write_rate = atol(optarg);
+        break;
+      case 'd':
+        dbus_calls = atol(optarg);
+        break;
+      default:
+        _usage();
+    }
+  }
+
+  if (n_readers <= 0 || seconds <= 0)
+    _usage();
+
+  if (!(board = pb_board_create()))
+  {
+    perror("pb-board: pb_board_create");
+    return 1;
+  }
+
+  pb_board_publish_allowed_state(board, PB_CLASS_MEDIA, allowed_state);
+  pb_board_publish_settings(board, FALSE, FALSE, BT_OVERRIDE_OFF);
+  readers = (reader_t *)calloc(n_readers, sizeof(reader_t));
+
+  /* the readers map the board through its fd, as clients do */
+  for (i = 0; i < n_readers; i++)
+  {
+    if (!(readers[i].board = pb_board_open(pb_board_get_fd(board))))
+    {
+      fprintf(stderr, "pb-board: unable to open the board\n");
+      return 1;
+    }
+  }
+
+  if (write)
+    pthread_create(&writer, NULL, _writer, board);
+
+  start = _now();
+
+  for (i = 0; i < n_readers; i++)
+    pthread_create(&readers[i].thread, NULL, _reader, &readers[i]);
+
+  usleep(seconds * 1e6);
+  running = FALSE;
+
+  for (i = 0; i < n_readers; i++)
+  {
+    pthread_join(readers[i].thread, NULL);
+    reads += readers[i].reads;
+    torn += readers[i].torn;
+    failed += readers[i].failed;
+  }
+
+  elapsed = _now() - start;
+
+  if (write)
+    pthread_join(writer, NULL);
+
+  printf("readers:              %d%s\n", n_readers,
+         write ? ", one writer" : "");
+  printf("board reads:          %.0f/s, %.1f ns each per reader\n",
+         reads / elapsed, elapsed * 1e9 * n_readers / reads);
+  printf("torn reads:           %ld\n", torn);
+  printf("failed reads:         %ld\n", failed);
+
+  for (i = 0; i < n_readers; i++)
+    pb_board_close(readers[i].board);
+
+  free(readers);
+  pb_board_close(board);
+
+  if (dbus_calls > 0)
+    _bench_dbus(dbus_calls);
+
+  return torn ? 1 : 0;
+}
@@ -0,0 +1,396 @@
+/*
+** Playback manager - playback create/destroy churn benchmark
+**
+** Creates and destroys playback objects in a loop and reports the
+** lifecycle rate, the number of messages the client puts on the bus for
+** each lifecycle and the resident set size, which must stay flat.  The
+** rate is reported per interval as well, so that any slowdown over
+** millions of iterations shows up.
+**
+** A stand-in manager owning org.maemo.Playback.Manager runs on a second
+** connection of the same process and grants every request.  Use
+** bench/run-bench.sh to run against a private bus daemon, or run it
+** under valgrind:
+**
+**   bench/run-bench.sh valgrind --leak-check=full ./pb-churn -n 100000
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libplayback/playback.h"
+
+#define MANAGER_SERVICE   "org.maemo.Playback.Manager"
+#define MANAGER_INTERFACE "org.maemo.Playback.Manager"
+
+static struct
+{
+  long total;
+  long method_calls;
+  long signals;
+} sent;
+
+static int replied;
+
+static void
+_state_request(pb_playback_t *pb,
+               enum pb_state_e req_state,
+               pb_req_t *ext_req,
+               void *data)
+{
+  pb_playback_req_completed(pb, ext_req);
+}
+
+static void
+_state_reply(pb_playback_t *pb,
+             enum pb_state_e granted_state,
+             const char *reason,
+             pb_req_t *req,
+             void *data)
+{
+  pb_playback_req_completed(pb, req);
+  replied = TRUE;
+}
+
+static long
+_rss_kb(void)
+{
+  FILE *f = fopen("/proc/self/statm", "r");
+  long size, rss = 0;
+
+  if (f)
+  {
+    if (fscanf(f, "%ld %ld", &size, &rss) != 2)
+      rss = 0;
+
+    fclose(f);
+  }
+
+  return rss * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static double
+_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static DBusHandlerResult
+_manager_filter(DBusConnection *connection,
+                DBusMessage *message,
+                void *user_data)
+{
+  DBusMessage *reply = NULL;
+
+  if (dbus_message_is_method_call(message, MANAGER_INTERFACE, "RequestState"))
+  {
+    const char *path, *state, *pid, *stream;
+
+    if (dbus_message_get_args(message, NULL,
+                              DBUS_TYPE_OBJECT_PATH, &path,
+                              DBUS_TYPE_STRING, &state,
+                              DBUS_TYPE_STRING, &pid,
+                              DBUS_TYPE_STRING, &stream,
+                              DBUS_TYPE_INVALID) &&
+        (reply = dbus_message_new_method_return(message)))
+    {
+      dbus_message_append_args(reply,
+                               DBUS_TYPE_STRING, &state,
+                               DBUS_TYPE_INVALID);
+    }
+  }
+  else if (dbus_message_is_method_call(message, MANAGER_INTERFACE,
+                                       "GetAllowedState"))
+  {
+    static const char *_states[] = {"Stop", "Play"};
+    const char **states = _states;
+
+    if ((reply = dbus_message_new_method_return(message)))
+    {
+      dbus_message_append_args(reply,
+                               DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &states, 2,
+                               DBUS_TYPE_INVALID);
+    }
+  }
+  else if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_METHOD_CALL)
+  {
+    reply = dbus_message_new_error(message, DBUS_ERROR_UNKNOWN_METHOD, "");
+  }
+  else
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (reply)
+  {
+    dbus_connection_send(connection, reply, NULL);
+    dbus_message_unref(reply);
+  }
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult
+_monitor_filter(DBusConnection *connection,
+                DBusMessage *message,
+                void *user_data)
+{
+  switch (dbus_message_get_type(message))
+  {
+    case DBUS_MESSAGE_TYPE_METHOD_CALL:
+      sent.method_calls++;
+      break;
+    case DBUS_MESSAGE_TYPE_SIGNAL:
+      sent.signals++;
+      break;
+    default:
+      break;
+  }
+
+  sent.total++;
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusConnection *
+_connect(void)
+{
+  DBusConnection *connection;
+  DBusError error;
+
+  dbus_error_init(&error);
+  connection = dbus_bus_get_private(DBUS_BUS_SESSION, &error);
+
+  if (!connection)
+  {
+    fprintf(stderr, "pb-churn: %s\n", error.message);
+    dbus_error_free(&error);
+    exit(1);
+  }
+
+  dbus_connection_set_exit_on_disconnect(connection, FALSE);
+
+  return connection;
+}
+
+static DBusConnection *
+_manager_new(void)
+{
+  DBusConnection *connection = _connect();
+  DBusError error;
+
+  dbus_error_init(&error);
+
+  if (dbus_bus_request_name(connection, MANAGER_SERVICE,
+                            DBUS_NAME_FLAG_DO_NOT_QUEUE, &error) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+  {
+    fprintf(stderr, "pb-churn: unable to own " MANAGER_SERVICE "\n");
+    exit(1);
+  }
+
+  dbus_bus_add_match(connection,
+                     "type='signal',interface='org.maemo.Playback'", NULL);
+  dbus_connection_add_filter(connection, _manager_filter, NULL, NULL);
+
+  return connection;
+}
+
+/* Counts everything the client sends, through the bus monitoring
+ * interface, so that bus daemon calls like AddMatch are included. */
+static DBusConnection *
+_monitor_new(DBusConnection *client)
+{
+  DBusConnection *connection = _connect();
+  DBusMessage *message, *reply;
+  DBusMessageIter iter, array;
+  char rule[256];
+  const char *r = rule;
+  dbus_uint32_t flags = 0;
+
+  snprintf(rule, sizeof(rule), "sender='%s'",
+           dbus_bus_get_unique_name(client));
+  message = dbus_message_new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                         DBUS_INTERFACE_MONITORING,
+                                         "BecomeMonitor");
+  dbus_message_iter_init_append(message, &iter);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+                                   DBUS_TYPE_STRING_AS_STRING, &array);
+  dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING, &r);
+  dbus_message_iter_close_container(&iter, &array);
+  dbus_message_iter_append_basic(&iter, DBUS_TYPE_UINT32, &flags);
+  reply = dbus_connection_send_with_reply_and_block(connection, message,
+                                                    -1, NULL);
+  dbus_message_unref(message);
+
+  if (!reply)
+  {
+    fprintf(stderr, "pb-churn: message counting not available\n");
+    dbus_connection_close(connection);
+    dbus_connection_unref(connection);
+    return NULL;
+  }
+
+  dbus_message_unref(reply);
+  dbus_connection_add_filter(connection, _monitor_filter, NULL, NULL);
+
+  return connection;
+}
+
+static void
+_pump(DBusConnection *connection)
+{
+  if (!connection)
+    return;
+
+  dbus_connection_read_write(connection, 0);
+
+  while (dbus_connection_dispatch(connection) == DBUS_DISPATCH_DATA_REMAINS)
+    ;
+}
+
+static void
+_usage(void)
+{
+  fprintf(stderr,
+          "usage: pb-churn [-n iterations] [-i report interval] [-p] [-l]\n"
+          "  -p  request PLAY and wait for the reply in every lifecycle\n"
+          "  -l  create the playbacks with PB_FLAG_LAZY\n");
+  exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+  DBusConnection *connection, *manager, *monitor;
+  long iterations = 100000;
+  long interval = 0;
+  int play = FALSE;
+  uint32_t flags = PB_FLAG_AUDIO;
+  long warmup;
+  long rss_start = 0;
+  long sent_start = 0;
+  double start = 0, last;
+  long i;
+  int c;
+
+  while ((c = getopt(argc, argv, "n:i:pl")) != -1)
+  {
+    switch (c)
+    {
+      case 'n':
+        iterations = atol(optarg);
+        break;
+      case 'i':
+        interval = atol(optarg);
+        break;
+      case 'p':
+        play = TRUE;
+        break;
+      case 'l':
+        flags |= PB_FLAG_LAZY;
+        break;
+      default:
+        _usage();
+    }
+  }
+
+  if (iterations <= 0)
+    _usage();
+
+  if (interval <= 0)
+    interval = iterations / 10 ? iterations / 10 : 1;
+
+  warmup = iterations / 100;
+  manager = _manager_new();
+  connection = _connect();
+  monitor = _monitor_new(connection);
+
+  printf("%12s %12s %10s\n", "lifecycle", "cycles/s", "rss kB");
+  last = _now();
+
+  for (i = 0; i < iterations + warmup; i++)
+  {
+    pb_playback_t *pb = pb_playback_new_2(connection, PB_CLASS_EVENT,
+                                          flags, PB_STATE_STOP,
+                                          _state_request, NULL);
+
+    if (play)
+    {
+      replied = FALSE;
+      pb_playback_req_state(pb, PB_STATE_PLAY, _state_reply, NULL);
+
+      while (!replied)
+      {
+        dbus_connection_read_write_dispatch(manager, 0);
+        dbus_connection_read_write_dispatch(connection, 0);
+      }
+    }
+
+    pb_playback_destroy(pb);
+    dbus_connection_flush(connection);
+    _pump(connection);
+    _pump(manager);
+    _pump(monitor);
+
+    if (i == warmup)
+    {
+      /* let the monitor catch up before taking the baseline */
+      dbus_connection_read_write_dispatch(monitor, 10);
+      _pump(monitor);
+      rss_start = _rss_kb();
+      sent_start = sent.total;
+      start = last = _now();
+    }
+    else if (i > warmup && (i - warmup) % interval == 0)
+    {
+      double now = _now();
+
+      printf("%12ld %12.0f %10ld\n", i - warmup, interval / (now - last),
+             _rss_kb());
+      last = now;
+    }
+  }
+
+  last = _now();
+
+  /* drain what the monitor still has queued */
+  for (c = 0; c < 50; c++)
+  {
+    dbus_connection_read_write_dispatch(monitor, 10);
+    _pump(monitor);
+  }
+
+  printf("\n");
+  printf("lifecycles:           %ld\n", iterations);
+  printf("lifecycles/s:         %.0f\n", iterations / (last - start));
+
+  if (monitor)
+  {
+    printf("messages/lifecycle:   %.2f (%ld method calls, %ld signals total)\n",
+           (double)(sent.total - sent_start) / iterations,
+           sent.method_calls, sent.signals);
+  }
+
+  printf("rss start:            %ld kB\n", rss_start);
+  printf("rss end:              %ld kB\n", _rss_kb());
+
+  if (monitor)
+  {
+    dbus_connection_close(monitor);
+    dbus_connection_unref(monitor);
+  }
+
+  dbus_connection_close(connection);
+  dbus_connection_unref(connection);
+  dbus_connection_close(manager);
+  dbus_connection_unref(manager);
+  dbus_shutdown();
+
+  return 0;
+}
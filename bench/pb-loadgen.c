@@ -0,0 +1,615 @@
+/*
+** Playback manager - multi-process load generator
+**
+** Forks processes that each create playbacks with pb_playback_new_2()
+** and request states with pb_playback_req_state(), all at once against
+** the manager, and reports the aggregate throughput, the distribution
+** of the request round trips and what became of the requests.  Granted
+** requests got the state they asked for, refused ones got none, which
+** is a denial from the manager or a failed call; failed ones could not
+** be sent and unanswered ones were still waiting at the end.
+**
+** The class mix is a list of class=weight, the pattern the states each
+** playback requests in turn, P for Play and S for Stop.  Without a rate
+** every playback asks again as soon as it has an answer; with one, each
+** process sends that many requests per second, to whichever playbacks
+** are not waiting.
+**
+** With -m the manager is started from the given command and, with -b,
+** restarted every so many seconds; otherwise one must already be on the
+** bus.  For instance, against a private bus daemon:
+**
+**   bench/run-bench.sh ./pb-loadgen -p 32 -n 128 -c Media=4,VoIP=1 \
+**       -m ./pb-manager -b 2 -t 10
+**
+** With -w each process captures its traffic to the given prefix followed
+** by its number, for pb-replay.  With -o the playbacks are announced
+** with InterfacesAdded, see pb_set_object_manager(), rather than Hello.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libplayback/playback.h"
+
+#define MANAGER_SERVICE "org.maemo.Playback.Manager"
+
+/* four buckets per power of two of microseconds, as in the library */
+#define BUCKETS 128
+#define MAX_MIX 16
+
+typedef struct
+{
+  long granted;
+  long refused;
+  long failed;
+  long unanswered;
+  long preempted;
+  uint64_t total_us;
+  uint32_t max_us;
+  uint32_t histogram[BUCKETS];
+} result_t;
+
+typedef struct
+{
+  pb_playback_t *pb;
+  unsigned int step;
+  enum pb_state_e requested;
+  int waiting;
+  double sent;
+} player_t;
+
+static struct
+{
+  enum pb_class_e pb_class[MAX_MIX];
+  unsigned int weight[MAX_MIX];
+  unsigned int n;
+  unsigned int total;
+} mix;
+
+static const char *pattern = "PS";
+static const char *capture;
+static int object_manager;
+static double rate;
+static int running;
+static long waiting;
+static result_t result;
+
+static double
+_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int
+_bucket(uint32_t usec)
+{
+  unsigned int msb;
+
+  if (usec < 4)
+    return usec;
+
+  msb = 31 - __builtin_clz(usec);
+
+  return 4 * (msb - 1) + ((usec >> (msb - 2)) & 3);
+}
+
+static uint32_t
+_bucket_max(unsigned int bucket)
+{
+  unsigned int shift;
+
+  if (bucket < 4)
+    return bucket;
+
+  shift = bucket / 4 - 1;
+
+  return ((5U + bucket % 4) << shift) - 1;
+}
+
+static void _request(player_t *player);
+
+static void
+_state_request(pb_playback_t *pb,
+               enum pb_state_e req_state,
+               pb_req_t *ext_req,
+               void *data)
+{
+  result.preempted++;
+  pb_playback_req_completed(pb, ext_req);
+}
+
+static void
+_state_reply(pb_playback_t *pb,
+             enum pb_state_e granted_state,
+             const char *reason,
+             pb_req_t *req,
+             void *data)
+{
+  player_t *player = (player_t *)data;
+  double usec = (_now() - player->sent) * 1e6;
+  uint32_t us = usec < UINT32_MAX ? (uint32_t)usec : UINT32_MAX;
+
+  pb_playback_req_completed(pb, req);
+  player->waiting = FALSE;
+  waiting--;
+
+  result.total_us += us;
+  result.histogram[_bucket(us)]++;
+
+  if (us > result.max_us)
+    result.max_us = us;
+
+  if (granted_state == player->requested)
+    result.granted++;
+  else
+    result.refused++;
+
+  if (running && !rate)
+    _request(player);
+}
+
+static void
+_request(player_t *player)
+{
+  char c = pattern[player->step++ % strlen(pattern)];
+
+  player->requested = c == 'P' ? PB_STATE_PLAY : PB_STATE_STOP;
+  player->sent = _now();
+
+  if (!pb_playback_req_state(player->pb, player->requested, _state_reply,
+                             player))
+  {
+    result.failed++;
+    return;
+  }
+
+  player->waiting = TRUE;
+  waiting++;
+}
+
+static enum pb_class_e
+_player_class(long i)
+{
+  unsigned int slot = i % mix.total, k;
+
+  for (k = 0; slot >= mix.weight[k]; k++)
+    slot -= mix.weight[k];
+
+  return mix.pb_class[k];
+}
+
+static void
+_pump(DBusConnection *connection,
+      int timeout)
+{
+  dbus_connection_read_write(connection, timeout);
+
+  while (dbus_connection_dispatch(connection) == DBUS_DISPATCH_DATA_REMAINS)
+    ;
+}
+
+/* Load process @index: announces itself ready on @ready, starts when
+ * @start is closed and writes its result_t to @out */
+static void
+_worker(long index,
+        long n,
+        double duration,
+        int ready,
+        int start,
+        int out)
+{
+  DBusConnection *connection;
+  player_t *players;
+  double begin, end, now;
+  long i, next = 0, sent = 0;
+  char c = 0, path[1024];
+  int fd = -1;
+
+  if (!(connection = dbus_bus_get_private(DBUS_BUS_SESSION, NULL)) ||
+      !(players = (player_t *)calloc(n, sizeof(player_t))))
+    _exit(1);
+
+  dbus_connection_set_exit_on_disconnect(connection, FALSE);
+
+  if (object_manager)
+    pb_set_object_manager(connection, TRUE);
+
+  if (capture)
+  {
+    snprintf(path, sizeof(path), "%s.%ld", capture, index);
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 ||
+        !pb_capture_start(connection, fd))
+      _exit(1);
+  }
+
+  for (i = 0; i < n; i++)
+  {
+    players[i].pb = pb_playback_new_2(connection, _player_class(i),
+                                      PB_FLAG_AUDIO, PB_STATE_STOP,
+                                      _state_request, &players[i]);
+  }
+
+  dbus_connection_flush(connection);
+
+  if (write(ready, &c, 1) != 1 || read(start, &c, 1) < 0)
+    _exit(1);
+
+  running = TRUE;
+  begin = _now();
+  end = begin + duration;
+
+  if (!rate)
+  {
+    for (i = 0; i < n; i++)
+      _request(&players[i]);
+  }
+
+  while ((now = _now()) < end)
+  {
+    /* the requests due by now, to the playbacks free to take them */
+    for (; rate && sent < (long)((now - begin) * rate); sent++)
+    {
+      for (i = 0; i < n && players[next].waiting; i++)
+        next = (next + 1) % n;
+
+      if (players[next].waiting)
+      {
+        result.failed++;
+        continue;
+      }
+
+      _request(&players[next]);
+      next = (next + 1) % n;
+    }
+
+    _pump(connection, rate ? 1 : 100);
+  }
+
+  running = FALSE;
+
+  for (end = _now() + 2; waiting > 0 && _now() < end;)
+    _pump(connection, 100);
+
+  result.unanswered = waiting;
+
+  if (fd >= 0 && (!pb_capture_stop(connection) || close(fd)))
+    _exit(1);
+
+  if (write(out, &result, sizeof(result)) != sizeof(result))
+    _exit(1);
+
+  _exit(0);
+}
+
+static int
+_manager_wait(DBusConnection *connection,
+              int present)
+{
+  double end = _now() + 5;
+
+  while (_now() < end)
+  {
+    if (dbus_bus_name_has_owner(connection, MANAGER_SERVICE, NULL) ==
+        present)
+      return TRUE;
+
+    usleep(10000);
+  }
+
+  return FALSE;
+}
+
+static pid_t
+_manager_start(DBusConnection *connection,
+               const char *command)
+{
+  char line[1024];
+  pid_t pid;
+
+  snprintf(line, sizeof(line), "exec %s", command);
+
+  if ((pid = fork()) == 0)
+  {
+    execl("/bin/sh", "sh", "-c", line, (char *)NULL);
+    _exit(127);
+  }
+
+  if (pid < 0 || !_manager_wait(connection, TRUE))
+  {
+    fprintf(stderr, "pb-loadgen: the manager did not start\n");
+    exit(1);
+  }
+
+  return pid;
+}
+
+static void
+_manager_stop(DBusConnection *connection,
+              pid_t pid)
+{
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  _manager_wait(connection, FALSE);
+}
+
+static int
+_parse_mix(char *spec)
+{
+  char *save, *item;
+
+  mix.n = mix.total = 0;
+
+  for (item = strtok_r(spec, ",", &save); item;
+       item = strtok_r(NULL, ",", &save))
+  {
+    char *weight = strchr(item, '=');
+    enum pb_class_e pb_class;
+    long w = 1;
+
+    if (weight)
+    {
+      *weight++ = '\0';
+      w = atol(weight);
+    }
+
+    pb_class = pb_string_to_class(item);
+
+    if (mix.n == MAX_MIX || w <= 0 ||
+        (pb_class == PB_CLASS_NONE && strcmp(item, "None")))
+      return FALSE;
+
+    mix.pb_class[mix.n] = pb_class;
+    mix.weight[mix.n++] = w;
+    mix.total += w;
+  }
+
+  return mix.n > 0;
+}
+
+static uint32_t
+_percentile(const result_t *total,
+            long count,
+            double percent)
+{
+  long rank = (long)(count * percent / 100 + 0.5), seen = 0;
+  unsigned int i;
+
+  for (i = 0; i < BUCKETS - 1; i++)
+  {
+    seen += total->histogram[i];
+
+    if (seen >= rank && seen)
+      break;
+  }
+
+  return _bucket_max(i) < total->max_us ? _bucket_max(i) : total->max_us;
+}
+
+static void
+_usage(void)
+{
+  fprintf(stderr,
+          "usage: pb-loadgen [-p processes] [-n playbacks] [-c mix] "
+          "[-r rate] [-s pattern]\n"
+          "                  [-t seconds] [-m manager command] "
+          "[-b seconds]\n"
+          "                  [-w capture prefix] [-o]\n"
+          "  -c  classes and weights, e.g. Media=4,VoIP=1 (Media)\n"
+          "  -r  requests per second per process, 0 for as fast as the\n"
+          "      answers come (0)\n"
+          "  -s  states requested in turn, P for Play, S for Stop (PS)\n"
+          "  -b  restart the manager of -m every so many seconds\n"
+          "  -w  capture the traffic of each process to prefix.N\n"
+          "  -o  announce the playbacks with ObjectManager signals\n");
+  exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+  DBusConnection *connection;
+  const char *command = NULL;
+  char default_mix[] = "Media";
+  long processes = 8, n = 64;
+  double duration = 10, bounce = 0, begin, next_bounce;
+  int ready[2], start[2];
+  int *out;
+  pid_t *pids, manager = 0;
+  result_t total;
+  long i, answered, bounces = 0;
+  unsigned int b;
+  char byte;
+  int c;
+
+  if (!_parse_mix(default_mix))
+    return 2;
+
+  while ((c = getopt(argc, argv, "p:n:c:r:s:t:m:b:w:o")) != -1)
+  {
+    switch (c)
+    {
+      case 'p':
+        processes = atol(optarg);
+        break;
+      case 'n':
+        n = atol(optarg);
+        break;
+      case 'c':
+        if (!_parse_mix(optarg))
+          _usage();
+        break;
+      case 'r':
+        rate = atof(optarg);
+        break;
+      case 's':
+        pattern = optarg;
+        break;
+      case 't':
+        duration = atof(optarg);
+        break;
+      case 'm':
+        command = optarg;
+        break;
+      case 'b':
+        bounce = atof(optarg);
+        break;
+      case 'w':
+        capture = optarg;
+        break;
+      case 'o':
+        object_manager = TRUE;
+        break;
+      default:
+        _usage();
+    }
+  }
+
+  if (processes <= 0 || n <= 0 || duration <= 0 || rate < 0 ||
+      !*pattern || strspn(pattern, "PS") != strlen(pattern) ||
+      (bounce > 0 && !command))
+    _usage();
+
+  if (!(connection = dbus_bus_get_private(DBUS_BUS_SESSION, NULL)))
+  {
+    fprintf(stderr, "pb-loadgen: no session bus\n");
+    return 1;
+  }
+
+  if (command)
+    manager = _manager_start(connection, command);
+  else if (!dbus_bus_name_has_owner(connection, MANAGER_SERVICE, NULL))
+  {
+    fprintf(stderr, "pb-loadgen: no manager on the bus, see -m\n");
+    return 1;
+  }
+
+  pids = (pid_t *)calloc(processes, sizeof(pid_t));
+  out = (int *)calloc(processes, sizeof(int));
+
+  if (!pids || !out || pipe(ready) || pipe(start))
+    return 1;
+
+  for (i = 0; i < processes; i++)
+  {
+    int fds[2];
+
+    if (pipe(fds) || (pids[i] = fork()) < 0)
+    {
+      fprintf(stderr, "pb-loadgen: %s\n", strerror(errno));
+      return 1;
+    }
+
+    if (pids[i] == 0)
+    {
+      close(fds[0]);
+      close(start[1]);
+      _worker(i, n, duration, ready[1], start[0], fds[1]);
+    }
+
+    close(fds[1]);
+    out[i] = fds[0];
+  }
+
+  close(ready[1]);
+  close(start[0]);
+
+  for (i = 0; i < processes; i++)
+  {
+    if (read(ready[0], &byte, 1) != 1)
+    {
+      fprintf(stderr, "pb-loadgen: a process did not start\n");
+      return 1;
+    }
+  }
+
+  /* all processes start together */
+  close(start[1]);
+  begin = _now();
+  next_bounce = bounce > 0 ? begin + bounce : 0;
+
+  while (_now() < begin + duration)
+  {
+    if (next_bounce && _now() >= next_bounce)
+    {
+      _manager_stop(connection, manager);
+      manager = _manager_start(connection, command);
+      bounces++;
+      next_bounce += bounce;
+    }
+
+    usleep(10000);
+  }
+
+  memset(&total, 0, sizeof(total));
+
+  for (i = 0; i < processes; i++)
+  {
+    result_t r;
+
+    if (read(out[i], &r, sizeof(r)) != sizeof(r))
+    {
+      fprintf(stderr, "pb-loadgen: process %ld failed\n", i);
+      return 1;
+    }
+
+    waitpid(pids[i], NULL, 0);
+    total.granted += r.granted;
+    total.refused += r.refused;
+    total.failed += r.failed;
+    total.unanswered += r.unanswered;
+    total.preempted += r.preempted;
+    total.total_us += r.total_us;
+
+    if (r.max_us > total.max_us)
+      total.max_us = r.max_us;
+
+    for (b = 0; b < BUCKETS; b++)
+      total.histogram[b] += r.histogram[b];
+  }
+
+  answered = total.granted + total.refused;
+
+  if (manager)
+    _manager_stop(connection, manager);
+
+  printf("%ld processes, %ld playbacks, %.1f s, %ld manager restarts\n",
+         processes, processes * n, duration, bounces);
+  printf("%12s %12s %10s %10s %10s %10s %10s\n", "answered", "req/s",
+         "granted", "refused", "failed", "unanswered", "preempted");
+  printf("%12ld %12.0f %10ld %10ld %10ld %10ld %10ld\n", answered,
+         answered / duration, total.granted, total.refused, total.failed,
+         total.unanswered, total.preempted);
+
+  if (answered)
+  {
+    printf("%10s %10s %10s %10s %10s %10s (us)\n", "mean", "p50", "p90",
+           "p99", "p99.9", "max");
+    printf("%10.1f %10u %10u %10u %10u %10u\n",
+           (double)total.total_us / answered,
+           _percentile(&total, answered, 50),
+           _percentile(&total, answered, 90),
+           _percentile(&total, answered, 99),
+           _percentile(&total, answered, 99.9), total.max_us);
+  }
+
+  dbus_connection_close(connection);
+  dbus_connection_unref(connection);
+  free(pids);
+  free(out);
+
+  return 0;
+}
@@ -0,0 +1,726 @@
+/*
+** Playback manager - replay of a pb_capture_start() capture
+**
+** Plays the application side of a capture again against the library:
+** the playbacks are created and destroyed, and the states and settings
+** requested, as they were.  The manager is played by an engine on the
+** loopback transport that gives each request the answer it got in the
+** capture, and the AllowedState and setting signals and the Set calls
+** of the manager are delivered at the point they were received.  The
+** library does all it did during the capture, minus the bus.
+**
+** By default the events are spaced as recorded; with -f they follow
+** each other as fast as possible, and the rate of requests measures the
+** library alone.  -n plays the capture several times:
+**
+**   bench/run-bench.sh ./pb-replay -f -n 100 capture.0
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libplayback/playback.h"
+
+#define MANAGER_INTERFACE  "org.maemo.Playback.Manager"
+#define PLAYBACK_INTERFACE "org.maemo.Playback"
+#define PLAYBACK_PREFIX    "/org/maemo/playback"
+
+typedef struct
+{
+  enum pb_state_e pb_state;
+  const char *reason;
+} answer_t;
+
+typedef struct
+{
+  uint64_t time_us;
+  uint32_t type;
+  DBusMessage *message;
+  pb_capture_playback_t playback;
+  answer_t *answers;            /* for the state requests */
+  unsigned int n_answers;
+} event_t;
+
+typedef struct
+{
+  pb_playback_t *pb;
+  answer_t *answers;
+  unsigned int head;
+  unsigned int tail;
+  unsigned int size;
+} player_t;
+
+static DBusConnection *connection;
+static event_t *events;
+static long n_events;
+static player_t *players;
+static uint32_t n_players;
+
+/* live playbacks by address, for the engine */
+static struct
+{
+  pb_playback_t **keys;
+  uint32_t *ids;
+  uint32_t mask;
+  uint32_t n;
+} index_;
+
+static struct
+{
+  long requests;
+  long replies;
+  long sets;
+  long signals;
+  long unmatched;
+} count;
+
+static double
+_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+_die(const char *what)
+{
+  fprintf(stderr, "pb-replay: %s\n", what);
+  exit(1);
+}
+
+static uint32_t
+_slot(pb_playback_t *pb)
+{
+  uint32_t i = ((uintptr_t)pb >> 4) & index_.mask;
+
+  while (index_.keys[i] && index_.keys[i] != pb)
+    i = (i + 1) & index_.mask;
+
+  return i;
+}
+
+static void
+_index_rebuild(uint32_t size)
+{
+  uint32_t id, i;
+
+  free(index_.keys);
+  free(index_.ids);
+  index_.keys = (pb_playback_t **)calloc(size, sizeof(pb_playback_t *));
+  index_.ids = (uint32_t *)calloc(size, sizeof(uint32_t));
+
+  if (!index_.keys || !index_.ids)
+    _die("out of memory");
+
+  index_.mask = size - 1;
+  index_.n = 0;
+
+  for (id = 0; id < n_players; id++)
+  {
+    if (!players[id].pb)
+      continue;
+
+    i = _slot(players[id].pb);
+    index_.keys[i] = players[id].pb;
+    index_.ids[i] = id;
+    index_.n++;
+  }
+}
+
+/* Stale entries of destroyed playbacks stay until the next rebuild, or
+ * are taken over by a playback at the same address */
+static void
+_index_add(pb_playback_t *pb,
+           uint32_t id)
+{
+  uint32_t i;
+
+  if (2 * (index_.n + 1) > index_.mask + 1)
+    _index_rebuild(4 * (index_.mask + 1));
+
+  i = _slot(pb);
+  index_.n += !index_.keys[i];
+  index_.keys[i] = pb;
+  index_.ids[i] = id;
+}
+
+static player_t *
+_player(uint32_t id,
+        int create)
+{
+  if (id >= n_players)
+  {
+    uint32_t n = id + 64;
+
+    if (!create)
+      return NULL;
+
+    if (!(players = (player_t *)realloc(players, n * sizeof(player_t))))
+      _die("out of memory");
+
+    memset(players + n_players, 0, (n - n_players) * sizeof(player_t));
+    n_players = n;
+  }
+
+  return &players[id];
+}
+
+static player_t *
+_player_from_path(const char *path)
+{
+  player_t *player;
+  char *end;
+  unsigned long id;
+
+  if (strncmp(path, PLAYBACK_PREFIX, strlen(PLAYBACK_PREFIX)))
+    return NULL;
+
+  id = strtoul(path + strlen(PLAYBACK_PREFIX), &end, 10);
+
+  if (*end || !(player = _player(id, FALSE)) || !player->pb)
+    return NULL;
+
+  return player;
+}
+
+static void
+_player_push(player_t *player,
+             const answer_t *answer)
+{
+  if (player->tail - player->head == player->size)
+  {
+    unsigned int size = player->size ? 2 * player->size : 4, i;
+    answer_t *answers = (answer_t *)malloc(size * sizeof(answer_t));
+
+    if (!answers)
+      _die("out of memory");
+
+    for (i = player->head; i != player->tail; i++)
+      answers[i - player->head] = player->answers[i % player->size];
+
+    free(player->answers);
+    player->answers = answers;
+    player->tail -= player->head;
+    player->head = 0;
+    player->size = size;
+  }
+
+  player->answers[player->tail++ % player->size] = *answer;
+}
+
+static enum pb_state_e
+_engine_request_state(const pb_engine_req_t *req,
+                      const char **reason,
+                      void *data)
+{
+  uint32_t i = _slot(req->pb);
+  player_t *player;
+  answer_t *answer;
+
+  if (index_.keys[i] != req->pb)
+  {
+    count.unmatched++;
+    return req->pb_state;
+  }
+
+  player = &players[index_.ids[i]];
+
+  if (player->head == player->tail)
+  {
+    count.unmatched++;
+    return req->pb_state;
+  }
+
+  answer = &player->answers[player->head++ % player->size];
+  *reason = answer->reason;
+
+  return answer->pb_state;
+}
+
+static const pb_engine_t engine =
+{
+  _engine_request_state,
+  NULL,
+  NULL,
+  NULL,
+  NULL
+};
+
+static void
+_state_request(pb_playback_t *pb,
+               enum pb_state_e req_state,
+               pb_req_t *ext_req,
+               void *data)
+{
+  pb_playback_req_completed(pb, ext_req);
+}
+
+static void
+_state_reply(pb_playback_t *pb,
+             enum pb_state_e granted_state,
+             const char *reason,
+             pb_req_t *req,
+             void *data)
+{
+  count.replies++;
+  pb_playback_req_completed(pb, req);
+}
+
+/* The answers the manager gave to the state request of @events[i],
+ * from its reply further on */
+static void
+_event_answers(long i)
+{
+  event_t *event = &events[i];
+  dbus_uint32_t serial = dbus_message_get_serial(event->message);
+  DBusMessageIter iter, array;
+  const char *state;
+  long j;
+
+  for (j = i + 1; j < n_events; j++)
+  {
+    DBusMessage *reply = events[j].message;
+
+    if (events[j].type == PB_CAPTURE_RECEIVED &&
+        dbus_message_get_type(reply) != DBUS_MESSAGE_TYPE_METHOD_CALL &&
+        dbus_message_get_type(reply) != DBUS_MESSAGE_TYPE_SIGNAL &&
+        dbus_message_get_reply_serial(reply) == serial)
+      break;
+  }
+
+  if (j == n_events)
+    return;
+
+  if (dbus_message_get_type(events[j].message) == DBUS_MESSAGE_TYPE_ERROR)
+  {
+    if (!(event->answers = (answer_t *)malloc(sizeof(answer_t))))
+      _die("out of memory");
+
+    event->answers[0].pb_state = PB_STATE_NONE;
+
+    if (!dbus_message_get_args(events[j].message, NULL,
+                               DBUS_TYPE_STRING, &event->answers[0].reason,
+                               DBUS_TYPE_INVALID))
+      event->answers[0].reason = dbus_message_get_error_name(
+          events[j].message);
+
+    event->n_answers = 1;
+    return;
+  }
+
+  if (!dbus_message_iter_init(events[j].message, &iter))
+    return;
+
+  if (dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_ARRAY)
+  {
+    event->answers = (answer_t *)calloc(
+        dbus_message_iter_get_element_count(&iter) + 1, sizeof(answer_t));
+
+    if (!event->answers)
+      _die("out of memory");
+
+    for (dbus_message_iter_recurse(&iter, &array);
+         dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRING;
+         dbus_message_iter_next(&array))
+    {
+      dbus_message_iter_get_basic(&array, &state);
+      event->answers[event->n_answers++].pb_state =
+          pb_string_to_state(state);
+    }
+  }
+  else if (dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_STRING)
+  {
+    if (!(event->answers = (answer_t *)calloc(1, sizeof(answer_t))))
+      _die("out of memory");
+
+    dbus_message_iter_get_basic(&iter, &state);
+    event->answers[0].pb_state = pb_string_to_state(state);
+    event->n_answers = 1;
+  }
+}
+
+static void
+_load(const char *path)
+{
+  pb_capture_record_t record;
+  char magic[8];
+  FILE *file;
+  long size = 0;
+
+  if (!(file = fopen(path, "rb")))
+  {
+    perror(path);
+    exit(1);
+  }
+
+  if (fread(magic, sizeof(magic), 1, file) != 1 ||
+      memcmp(magic, PB_CAPTURE_MAGIC, sizeof(magic)))
+    _die("not a capture");
+
+  while (fread(&record, sizeof(record), 1, file) == 1)
+  {
+    event_t *event;
+    char *data;
+
+    if (n_events == size)
+    {
+      size = size ? 2 * size : 1024;
+
+      if (!(events = (event_t *)realloc(events, size * sizeof(event_t))))
+        _die("out of memory");
+    }
+
+    if (!(data = (char *)malloc(record.length ? record.length : 1)) ||
+        fread(data, 1, record.length, file) != record.length)
+      _die("truncated capture");
+
+    event = &events[n_events];
+    memset(event, 0, sizeof(*event));
+    event->time_us = record.time_us;
+    event->type = record.type;
+
+    switch (record.type)
+    {
+      case PB_CAPTURE_SENT:
+      case PB_CAPTURE_RECEIVED:
+        if (!(event->message = dbus_message_demarshal(data, record.length,
+                                                      NULL)))
+          _die("invalid message in the capture");
+        n_events++;
+        break;
+      case PB_CAPTURE_PLAYBACK:
+      case PB_CAPTURE_DESTROY:
+        if (record.length < sizeof(pb_capture_playback_t))
+          _die("invalid playback record");
+        memcpy(&event->playback, data, sizeof(pb_capture_playback_t));
+        n_events++;
+        break;
+      default:
+        break;
+    }
+
+    free(data);
+  }
+
+  fclose(file);
+}
+
+static void
+_prepare(void)
+{
+  long i;
+
+  for (i = 0; i < n_events; i++)
+  {
+    if (events[i].type == PB_CAPTURE_SENT &&
+        (dbus_message_is_method_call(events[i].message, MANAGER_INTERFACE,
+                                     "RequestState") ||
+         dbus_message_is_method_call(events[i].message, MANAGER_INTERFACE,
+                                     "RequestStates")))
+      _event_answers(i);
+  }
+}
+
+static void
+_request(player_t *player,
+         const char *state,
+         const answer_t *answer)
+{
+  if (answer)
+    _player_push(player, answer);
+
+  count.requests++;
+  pb_playback_req_state(player->pb, pb_string_to_state(state), _state_reply,
+                        NULL);
+}
+
+static void
+_replay_sent(event_t *event)
+{
+  DBusMessage *message = event->message;
+  DBusMessageIter iter, array, entry;
+  const char *path, *state;
+  player_t *player;
+  dbus_bool_t b;
+  dbus_int32_t i;
+  unsigned int n = 0;
+
+  if (dbus_message_is_method_call(message, MANAGER_INTERFACE,
+                                  "RequestState"))
+  {
+    if (dbus_message_get_args(message, NULL,
+                              DBUS_TYPE_OBJECT_PATH, &path,
+                              DBUS_TYPE_STRING, &state,
+                              DBUS_TYPE_INVALID) &&
+        (player = _player_from_path(path)))
+      _request(player, state, event->n_answers ? event->answers : NULL);
+  }
+  else if (dbus_message_is_method_call(message, MANAGER_INTERFACE,
+                                       "RequestStates"))
+  {
+    dbus_message_iter_init(message, &iter);
+
+    for (dbus_message_iter_recurse(&iter, &array);
+         dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT;
+         dbus_message_iter_next(&array), n++)
+    {
+      dbus_message_iter_recurse(&array, &entry);
+      dbus_message_iter_get_basic(&entry, &path);
+      dbus_message_iter_next(&entry);
+      dbus_message_iter_get_basic(&entry, &state);
+
+      if ((player = _player_from_path(path)))
+        _request(player, state,
+                 n < event->n_answers ? &event->answers[n] : NULL);
+    }
+  }
+  else if (dbus_message_is_method_call(message, MANAGER_INTERFACE,
+                                       "RequestMute") &&
+           dbus_message_get_args(message, NULL, DBUS_TYPE_BOOLEAN, &b,
+                                 DBUS_TYPE_INVALID))
+    pb_req_mute(connection, b);
+  else if (dbus_message_is_method_call(message, MANAGER_INTERFACE,
+                                       "RequestPrivacyOverride") &&
+           dbus_message_get_args(message, NULL, DBUS_TYPE_BOOLEAN, &b,
+                                 DBUS_TYPE_INVALID))
+    pb_req_privacy_override(connection, b);
+  else if (dbus_message_is_method_call(message, MANAGER_INTERFACE,
+                                       "RequestBluetoothOverride") &&
+           dbus_message_get_args(message, NULL, DBUS_TYPE_INT32, &i,
+                                 DBUS_TYPE_INVALID))
+    pb_req_bluetooth_override(connection, i);
+}
+
+static void
+_replay_set(DBusMessage *message)
+{
+  DBusMessageIter iter, value;
+  const char *iface, *prop, *state;
+  player_t *player;
+
+  if (!(player = _player_from_path(dbus_message_get_path(message))) ||
+      !dbus_message_iter_init(message, &iter) ||
+      dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
+    return;
+
+  dbus_message_iter_get_basic(&iter, &iface);
+  dbus_message_iter_next(&iter);
+
+  if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
+    return;
+
+  dbus_message_iter_get_basic(&iter, &prop);
+  dbus_message_iter_next(&iter);
+
+  if (dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_VARIANT)
+  {
+    dbus_message_iter_recurse(&iter, &value);
+    iter = value;
+  }
+
+  if (strcmp(iface, PLAYBACK_INTERFACE) || strcmp(prop, "State") ||
+      dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
+    return;
+
+  dbus_message_iter_get_basic(&iter, &state);
+  count.sets++;
+  pb_loopback_set_state(connection, player->pb, pb_string_to_state(state));
+}
+
+static void
+_replay_received(event_t *event)
+{
+  DBusMessage *message = event->message;
+  int allowed_state[PB_STATE_LAST] = {FALSE};
+  const char *cls;
+  char **states;
+  dbus_bool_t b;
+  dbus_int32_t i;
+  int len, k;
+
+  switch (dbus_message_get_type(message))
+  {
+    case DBUS_MESSAGE_TYPE_METHOD_CALL:
+      if (dbus_message_is_method_call(message, DBUS_INTERFACE_PROPERTIES,
+                                      "Set"))
+        _replay_set(message);
+      break;
+    case DBUS_MESSAGE_TYPE_SIGNAL:
+      count.signals++;
+
+      if (dbus_message_is_signal(message, MANAGER_INTERFACE, "AllowedState") &&
+          dbus_message_get_args(message, NULL,
+                                DBUS_TYPE_STRING, &cls,
+                                DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &states,
+                                &len,
+                                DBUS_TYPE_INVALID))
+      {
+        for (k = 0; k < len; k++)
+          allowed_state[pb_string_to_state(states[k])] = TRUE;
+
+        dbus_free_string_array(states);
+        pb_loopback_set_allowed_state(connection, pb_string_to_class(cls),
+                                      allowed_state);
+      }
+      else if (dbus_message_is_signal(message, MANAGER_INTERFACE, "Mute") &&
+               dbus_message_get_args(message, NULL, DBUS_TYPE_BOOLEAN, &b,
+                                     DBUS_TYPE_INVALID))
+        pb_loopback_set_mute(connection, b);
+      else if (dbus_message_is_signal(message, MANAGER_INTERFACE,
+                                      "PrivacyOverride") &&
+               dbus_message_get_args(message, NULL, DBUS_TYPE_BOOLEAN, &b,
+                                     DBUS_TYPE_INVALID))
+        pb_loopback_set_privacy_override(connection, b);
+      else if (dbus_message_is_signal(message, MANAGER_INTERFACE,
+                                      "BluetoothOverride") &&
+               dbus_message_get_args(message, NULL, DBUS_TYPE_INT32, &i,
+                                     DBUS_TYPE_INVALID))
+        pb_loopback_set_bluetooth_override(connection, i);
+      break;
+    default:
+      /* a reply: the answer of the engine is delivered now */
+      break;
+  }
+
+  pb_loopback_dispatch(connection);
+}
+
+static void
+_replay_playback(event_t *event)
+{
+  const pb_capture_playback_t *record = &event->playback;
+  player_t *player = _player(record->object_id, TRUE);
+
+  if (player->pb)
+    pb_playback_destroy(player->pb);
+
+  player->pb = NULL;
+  player->head = player->tail = 0;
+
+  if (event->type == PB_CAPTURE_DESTROY)
+    return;
+
+  player->pb = pb_playback_new_2(connection, record->pb_class, record->flags,
+                                 record->pb_state, _state_request, NULL);
+
+  if (player->pb)
+    _index_add(player->pb, record->object_id);
+}
+
+static void
+_replay(int fast)
+{
+  double start = _now();
+  uint32_t id;
+  long i;
+
+  for (i = 0; i < n_events; i++)
+  {
+    event_t *event = &events[i];
+    double delay;
+
+    if (!fast && (delay = event->time_us / 1e6 - (_now() - start)) > 0)
+      usleep(delay * 1e6);
+
+    switch (event->type)
+    {
+      case PB_CAPTURE_SENT:
+        _replay_sent(event);
+        break;
+      case PB_CAPTURE_RECEIVED:
+        _replay_received(event);
+        break;
+      default:
+        _replay_playback(event);
+        break;
+    }
+  }
+
+  pb_loopback_dispatch(connection);
+
+  for (id = 0; id < n_players; id++)
+  {
+    if (players[id].pb)
+      pb_playback_destroy(players[id].pb);
+
+    players[id].pb = NULL;
+    players[id].head = players[id].tail = 0;
+  }
+
+  pb_loopback_dispatch(connection);
+}
+
+int
+main(int argc, char **argv)
+{
+  DBusError error;
+  double start, elapsed;
+  int fast = FALSE;
+  long loops = 1, i;
+  int c;
+
+  while ((c = getopt(argc, argv, "fn:")) != -1)
+  {
+    switch (c)
+    {
+      case 'f':
+        fast = TRUE;
+        break;
+      case 'n':
+        loops = atol(optarg);
+        break;
+      default:
+        optind = argc;
+        break;
+    }
+  }
+
+  if (optind != argc - 1 || loops <= 0)
+  {
+    fprintf(stderr, "usage: pb-replay [-f] [-n loops] capture\n"
+                    "  -f  as fast as possible, not at the recorded pace\n");
+    return 2;
+  }
+
+  _load(argv[optind]);
+  _prepare();
+  _index_rebuild(64);
+
+  dbus_error_init(&error);
+
+  if (!(connection = dbus_bus_get_private(DBUS_BUS_SESSION, &error)))
+    _die(error.message);
+
+  dbus_connection_set_exit_on_disconnect(connection, FALSE);
+
+  if (!pb_loopback_attach(connection, &engine, NULL))
+    _die("unable to attach the engine");
+
+  start = _now();
+
+  for (i = 0; i < loops; i++)
+    _replay(fast);
+
+  elapsed = _now() - start;
+
+  printf("%ld events, %.3f s of capture, replayed %ld times in %.3f s\n",
+         n_events, n_events ? events[n_events - 1].time_us / 1e6 : 0.0,
+         loops, elapsed);
+  printf("%10s %10s %10s %10s %10s %12s\n", "requests", "replies", "sets",
+         "signals", "unmatched", "requests/s");
+  printf("%10ld %10ld %10ld %10ld %10ld %12.0f\n", count.requests,
+         count.replies, count.sets, count.signals, count.unmatched,
+         count.requests / elapsed);
+
+  pb_loopback_detach(connection);
+  dbus_connection_close(connection);
+  dbus_connection_unref(connection);
+
+  return 0;
+}
@@ -0,0 +1,456 @@
+/*
+** Playback manager - state request round trip benchmark
+**
+** Times pb_playback_req_state() from the call to the reply, first with
+** the manager calls going through the bus daemon, then over a peer
+** connection from pb_peer_connect().  Built with SDBUS=1, a third run
+** sends them with sd-bus, see pb_sdbus_attach().  The stand-in manager
+** runs in a thread of the same process, owns org.maemo.Playback.Manager
+** on the bus and listens for peer connections.
+**
+**   bench/run-bench.sh ./pb-rtt -n 20000
+*/
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libplayback/playback.h"
+#ifdef HAVE_SD_BUS
+#include "libplayback/playback-sdbus.h"
+#endif
+
+#define MANAGER_SERVICE   "org.maemo.Playback.Manager"
+#define MANAGER_INTERFACE "org.maemo.Playback.Manager"
+#define MAX_PEERS 8
+
+static struct
+{
+  DBusConnection *bus;
+  DBusServer *server;
+  DBusWatch *watch;
+  DBusConnection *peers[MAX_PEERS];
+  int n_peers;
+  long peer_calls;
+} manager;
+
+static volatile int running = TRUE;
+static DBusConnection *peer;
+#ifdef HAVE_SD_BUS
+static sd_bus *sdbus;
+#endif
+static int replied;
+static int connected;
+
+static double
+_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static DBusHandlerResult
+_manager_filter(DBusConnection *connection,
+                DBusMessage *message,
+                void *user_data)
+{
+  DBusMessage *reply = NULL;
+
+  if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (connection != manager.bus)
+    manager.peer_calls++;
+
+  if (dbus_message_is_method_call(message, MANAGER_INTERFACE, "RequestState"))
+  {
+    const char *path, *state, *pid, *stream;
+
+    if (dbus_message_get_args(message, NULL,
+                              DBUS_TYPE_OBJECT_PATH, &path,
+                              DBUS_TYPE_STRING, &state,
+                              DBUS_TYPE_STRING, &pid,
+                              DBUS_TYPE_STRING, &stream,
+                              DBUS_TYPE_INVALID) &&
+        (reply = dbus_message_new_method_return(message)))
+    {
+      dbus_message_append_args(reply,
+                               DBUS_TYPE_STRING, &state,
+                               DBUS_TYPE_INVALID);
+    }
+  }
+  else if (dbus_message_is_method_call(message, MANAGER_INTERFACE,
+                                       "GetPeerAddress"))
+  {
+    char *address = dbus_server_get_address(manager.server);
+
+    if ((reply = dbus_message_new_method_return(message)))
+    {
+      dbus_message_append_args(reply,
+                               DBUS_TYPE_STRING, &address,
+                               DBUS_TYPE_INVALID);
+    }
+
+    dbus_free(address);
+  }
+  else if (dbus_message_is_method_call(message, MANAGER_INTERFACE,
+                                       "RegisterPeer"))
+    reply = dbus_message_new_method_return(message);
+  else
+    reply = dbus_message_new_error(message, DBUS_ERROR_UNKNOWN_METHOD, "");
+
+  if (reply)
+  {
+    dbus_connection_send(connection, reply, NULL);
+    dbus_message_unref(reply);
+  }
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static dbus_bool_t
+_add_watch(DBusWatch *watch,
+           void *data)
+{
+  if (dbus_watch_get_flags(watch) & DBUS_WATCH_READABLE)
+    manager.watch = watch;
+
+  return TRUE;
+}
+
+static void
+_remove_watch(DBusWatch *watch,
+              void *data)
+{
+  if (manager.watch == watch)
+    manager.watch = NULL;
+}
+
+static void
+_new_connection(DBusServer *server,
+                DBusConnection *connection,
+                void *data)
+{
+  if (manager.n_peers == MAX_PEERS)
+    return;
+
+  dbus_connection_ref(connection);
+  dbus_connection_add_filter(connection, _manager_filter, NULL, NULL);
+  manager.peers[manager.n_peers++] = connection;
+}
+
+/* Leaves nothing queued in either direction, so that waiting on the
+ * socket afterwards cannot sleep over a message already read */
+static void
+_pump(DBusConnection *connection)
+{
+  do
+  {
+    dbus_connection_read_write(connection, 0);
+
+    while (dbus_connection_dispatch(connection) == DBUS_DISPATCH_DATA_REMAINS)
+      ;
+  }
+  while (dbus_connection_has_messages_to_send(connection));
+}
+
+/* Waits for any of the @n connections to be readable */
+static void
+_wait(DBusConnection **connections,
+      int n,
+      int timeout)
+{
+  struct pollfd fds[MAX_PEERS + 3];
+  int i, fd, nfds = 0;
+
+  for (i = 0; i < n; i++)
+  {
+    if (connections[i] && dbus_connection_get_unix_fd(connections[i], &fd))
+    {
+      fds[nfds].fd = fd;
+      fds[nfds++].events = POLLIN;
+    }
+  }
+
+#ifdef HAVE_SD_BUS
+  if (sdbus)
+  {
+    fds[nfds].fd = sd_bus_get_fd(sdbus);
+    fds[nfds++].events = POLLIN;
+  }
+#endif
+
+  poll(fds, nfds, timeout);
+}
+
+static void *
+_manager_thread(void *data)
+{
+  while (running)
+  {
+    DBusConnection *connections[MAX_PEERS + 1];
+    struct pollfd fds[MAX_PEERS + 2];
+    int i, fd, nfds = 0;
+
+    connections[0] = manager.bus;
+    memcpy(connections + 1, manager.peers,
+           manager.n_peers * sizeof(DBusConnection *));
+
+    for (i = 0; i <= manager.n_peers; i++)
+    {
+      if (dbus_connection_get_unix_fd(connections[i], &fd))
+      {
+        fds[nfds].fd = fd;
+        fds[nfds++].events = POLLIN;
+      }
+    }
+
+    if (manager.watch)
+    {
+      fds[nfds].fd = dbus_watch_get_unix_fd(manager.watch);
+      fds[nfds++].events = POLLIN;
+    }
+
+    poll(fds, nfds, 10);
+
+    if (manager.watch && (fds[nfds - 1].revents & POLLIN))
+      dbus_watch_handle(manager.watch, DBUS_WATCH_READABLE);
+
+    /* the server may have added a peer meanwhile */
+    _pump(manager.bus);
+
+    for (i = 0; i < manager.n_peers; i++)
+      _pump(manager.peers[i]);
+  }
+
+  return NULL;
+}
+
+static void
+_state_request(pb_playback_t *pb,
+               enum pb_state_e req_state,
+               pb_req_t *ext_req,
+               void *data)
+{
+  pb_playback_req_completed(pb, ext_req);
+}
+
+static void
+_state_reply(pb_playback_t *pb,
+             enum pb_state_e granted_state,
+             const char *reason,
+             pb_req_t *req,
+             void *data)
+{
+  pb_playback_req_completed(pb, req);
+  replied = TRUE;
+}
+
+static void
+_peer_connected(DBusConnection *connection,
+                const char *error,
+                void *data)
+{
+  if (error)
+  {
+    fprintf(stderr, "pb-rtt: %s\n", error);
+    exit(1);
+  }
+
+  peer = connection;
+  connected = TRUE;
+}
+
+static int
+_compare(const void *a,
+         const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Dispatches the application side until *@done is set */
+static void
+_client_run(DBusConnection *connection,
+            int *done)
+{
+  DBusConnection *connections[2];
+
+  for (;;)
+  {
+    _pump(connection);
+
+    if (peer)
+      _pump(peer);
+
+#ifdef HAVE_SD_BUS
+    if (sdbus)
+    {
+      while (sd_bus_process(sdbus, NULL) > 0)
+        ;
+
+      sd_bus_flush(sdbus);
+    }
+#endif
+
+    if (*done)
+      return;
+
+    connections[0] = connection;
+    connections[1] = peer;
+    _wait(connections, 2, 10);
+  }
+}
+
+static void
+_run(const char *name,
+     DBusConnection *connection,
+     pb_playback_t *pb,
+     long n,
+     double *rtt)
+{
+  double total = 0;
+  long i;
+
+  for (i = 0; i < n; i++)
+  {
+    double start = _now();
+
+    replied = FALSE;
+    pb_playback_req_state(pb, i & 1 ? PB_STATE_STOP : PB_STATE_PLAY,
+                          _state_reply, NULL);
+
+    _client_run(connection, &replied);
+
+    rtt[i] = (_now() - start) * 1e6;
+    total += rtt[i];
+  }
+
+  qsort(rtt, n, sizeof(double), _compare);
+  printf("%-6s %10.1f %10.1f %10.1f %10.1f\n", name, total / n,
+         rtt[n / 2], rtt[n * 9 / 10], rtt[n * 99 / 100]);
+}
+
+static DBusConnection *
+_connect(void)
+{
+  DBusConnection *connection;
+  DBusError error;
+
+  dbus_error_init(&error);
+  connection = dbus_bus_get_private(DBUS_BUS_SESSION, &error);
+
+  if (!connection)
+  {
+    fprintf(stderr, "pb-rtt: %s\n", error.message);
+    exit(1);
+  }
+
+  dbus_connection_set_exit_on_disconnect(connection, FALSE);
+
+  return connection;
+}
+
+int
+main(int argc, char **argv)
+{
+  DBusConnection *connection;
+  pb_playback_t *pb;
+  pthread_t thread;
+  DBusError error;
+  double *rtt;
+  long n = 20000;
+  int c;
+
+  while ((c = getopt(argc, argv, "n:")) != -1)
+  {
+    switch (c)
+    {
+      case 'n':
+        n = atol(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: pb-rtt [-n requests]\n");
+        return 2;
+    }
+  }
+
+  if (n <= 0 || !(rtt = (double *)malloc(n * sizeof(double))))
+    return 2;
+
+  dbus_threads_init_default();
+  dbus_error_init(&error);
+  manager.bus = _connect();
+
+  if (dbus_bus_request_name(manager.bus, MANAGER_SERVICE,
+                            DBUS_NAME_FLAG_DO_NOT_QUEUE, NULL) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER ||
+      !(manager.server = dbus_server_listen("unix:tmpdir=/tmp", &error)))
+  {
+    fprintf(stderr, "pb-rtt: unable to set up the manager\n");
+    return 1;
+  }
+
+  dbus_connection_add_filter(manager.bus, _manager_filter, NULL, NULL);
+  dbus_server_set_new_connection_function(manager.server, _new_connection,
+                                          NULL, NULL);
+  dbus_server_set_watch_functions(manager.server, _add_watch, _remove_watch,
+                                  NULL, NULL, NULL);
+  pthread_create(&thread, NULL, _manager_thread, NULL);
+
+  connection = _connect();
+  pb = pb_playback_new_2(connection, PB_CLASS_MEDIA, PB_FLAG_AUDIO,
+                         PB_STATE_STOP, _state_request, NULL);
+
+  printf("%-6s %10s %10s %10s %10s (us)\n", "route", "mean", "p50", "p90",
+         "p99");
+  _run("bus", connection, pb, n, rtt);
+
+  pb_peer_connect(connection, _peer_connected, NULL);
+
+  _client_run(connection, &connected);
+
+  _run("peer", connection, pb, n, rtt);
+
+  if (manager.peer_calls < n)
+  {
+    fprintf(stderr, "pb-rtt: only %ld calls went over the peer\n",
+            manager.peer_calls);
+    return 1;
+  }
+
+  pb_peer_disconnect(connection);
+  peer = NULL;
+
+#ifdef HAVE_SD_BUS
+  if (sd_bus_open_user(&sdbus) < 0 || !pb_sdbus_attach(connection, sdbus))
+  {
+    fprintf(stderr, "pb-rtt: unable to set up sd-bus\n");
+    return 1;
+  }
+
+  _run("sd-bus", connection, pb, n, rtt);
+  pb_sdbus_detach(connection);
+#endif
+
+  pb_playback_destroy(pb);
+  running = FALSE;
+  pthread_join(thread, NULL);
+
+  dbus_connection_close(connection);
+  dbus_connection_unref(connection);
+#ifdef HAVE_SD_BUS
+  sd_bus_flush_close_unref(sdbus);
+#endif
+  free(rtt);
+
+  return 0;
+}
@@ -0,0 +1,445 @@
+/*
+** Playback manager - sharded connections benchmark
+**
+** Hosts playbacks on pb_shards_new() pools of increasing size and
+** reports the request throughput of each, and its speedup over the
+** first.  Every playback asks for Play and Stop in turn as soon as it
+** has an answer, from the thread of its shard; the requests the manager
+** sends to the playbacks, preempting them, are answered there too.
+**
+** The playbacks are spread by their number, or by class with -p class;
+** the classes follow -c as in pb-loadgen.  With -m the manager is
+** started from the given command, otherwise one must already be on the
+** bus:
+**
+**   bench/run-bench.sh ./pb-shards -s 1,2,4,8 -n 256 -m ./pb-manager
+**
+** The manager is a single thread as well, so past the cores left to it
+** adding shards only moves the bottleneck.
+*/
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libplayback/playback.h"
+
+#define MANAGER_SERVICE "org.maemo.Playback.Manager"
+#define MAX_MIX 16
+#define MAX_RUNS 16
+
+typedef struct
+{
+  pb_playback_t *pb;
+  enum pb_class_e pb_class;
+  unsigned int step;
+  enum pb_state_e requested;
+} player_t;
+
+static struct
+{
+  enum pb_class_e pb_class[MAX_MIX];
+  unsigned int weight[MAX_MIX];
+  unsigned int n;
+  unsigned int total;
+} mix;
+
+static int running;
+static long waiting;
+static long granted;
+static long refused;
+static long failed;
+static long preempted;
+
+static double
+_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void _request(player_t *player);
+
+static void
+_state_request(pb_playback_t *pb,
+               enum pb_state_e req_state,
+               pb_req_t *ext_req,
+               void *data)
+{
+  __atomic_add_fetch(&preempted, 1, __ATOMIC_RELAXED);
+  pb_playback_req_completed(pb, ext_req);
+}
+
+static void
+_state_reply(pb_playback_t *pb,
+             enum pb_state_e granted_state,
+             const char *reason,
+             pb_req_t *req,
+             void *data)
+{
+  player_t *player = (player_t *)data;
+
+  pb_playback_req_completed(pb, req);
+  __atomic_sub_fetch(&waiting, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(granted_state == player->requested ? &granted : &refused,
+                     1, __ATOMIC_RELAXED);
+
+  if (__atomic_load_n(&running, __ATOMIC_RELAXED))
+    _request(player);
+}
+
+static void
+_request(player_t *player)
+{
+  player->requested = player->step++ % 2 ? PB_STATE_STOP : PB_STATE_PLAY;
+
+  if (!pb_playback_req_state(player->pb, player->requested, _state_reply,
+                             player))
+  {
+    __atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  __atomic_add_fetch(&waiting, 1, __ATOMIC_RELAXED);
+}
+
+/* the jobs run on the shards with pb_shards_call() */
+static void
+_create(DBusConnection *connection,
+        void *data)
+{
+  player_t *player = (player_t *)data;
+
+  player->pb = pb_playback_new_2(connection, player->pb_class, PB_FLAG_AUDIO,
+                                 PB_STATE_STOP, _state_request, player);
+}
+
+static void
+_start(DBusConnection *connection,
+       void *data)
+{
+  player_t *player = (player_t *)data;
+
+  if (player->pb)
+    _request(player);
+  else
+    __atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+}
+
+static void
+_destroy(DBusConnection *connection,
+         void *data)
+{
+  player_t *player = (player_t *)data;
+
+  if (player->pb)
+    pb_playback_destroy(player->pb);
+
+  player->pb = NULL;
+}
+
+static void
+_barrier(DBusConnection *connection,
+         void *data)
+{
+  __atomic_sub_fetch((long *)data, 1, __ATOMIC_RELEASE);
+}
+
+/* Waits for the calls queued on every shard so far */
+static void
+_sync(pb_shards_t *shards)
+{
+  unsigned int i;
+  long pending = pb_shards_size(shards);
+
+  for (i = 0; i < pb_shards_size(shards); i++)
+  {
+    if (!pb_shards_call(shards, i, _barrier, &pending))
+      __atomic_sub_fetch(&pending, 1, __ATOMIC_RELEASE);
+  }
+
+  while (__atomic_load_n(&pending, __ATOMIC_ACQUIRE) > 0)
+    usleep(1000);
+}
+
+static double
+_run(unsigned int n_shards,
+     enum pb_shard_policy_e policy,
+     player_t *players,
+     long n,
+     double duration)
+{
+  pb_shards_t *shards;
+  unsigned int *shard;
+  double begin, end, elapsed;
+  long i, answered;
+
+  if (!(shards = pb_shards_new(DBUS_BUS_SESSION, n_shards, policy)) ||
+      !(shard = (unsigned int *)calloc(n, sizeof(unsigned int))))
+  {
+    fprintf(stderr, "pb-shards: cannot start %u shards\n", n_shards);
+    exit(1);
+  }
+
+  granted = refused = failed = preempted = waiting = 0;
+
+  for (i = 0; i < n; i++)
+  {
+    shard[i] = pb_shards_pick(shards, players[i].pb_class, i);
+    players[i].step = 0;
+    pb_shards_call(shards, shard[i], _create, &players[i]);
+  }
+
+  _sync(shards);
+  __atomic_store_n(&running, TRUE, __ATOMIC_RELAXED);
+  begin = _now();
+
+  for (i = 0; i < n; i++)
+    pb_shards_call(shards, shard[i], _start, &players[i]);
+
+  usleep((useconds_t)(duration * 1e6));
+  __atomic_store_n(&running, FALSE, __ATOMIC_RELAXED);
+  answered = __atomic_load_n(&granted, __ATOMIC_RELAXED) +
+             __atomic_load_n(&refused, __ATOMIC_RELAXED);
+  elapsed = _now() - begin;
+
+  for (end = _now() + 2;
+       __atomic_load_n(&waiting, __ATOMIC_RELAXED) > 0 && _now() < end;)
+    usleep(10000);
+
+  for (i = 0; i < n; i++)
+    pb_shards_call(shards, shard[i], _destroy, &players[i]);
+
+  printf("%6u %12ld %12.0f %9ld %9ld %9ld %11ld",
+         n_shards, answered, answered / elapsed, refused, failed, preempted,
+         __atomic_load_n(&waiting, __ATOMIC_RELAXED));
+
+  pb_shards_free(shards);
+  free(shard);
+
+  return answered / elapsed;
+}
+
+static int
+_manager_wait(DBusConnection *connection,
+              int present)
+{
+  double end = _now() + 5;
+
+  while (_now() < end)
+  {
+    if (dbus_bus_name_has_owner(connection, MANAGER_SERVICE, NULL) ==
+        present)
+      return TRUE;
+
+    usleep(10000);
+  }
+
+  return FALSE;
+}
+
+static pid_t
+_manager_start(DBusConnection *connection,
+               const char *command)
+{
+  char line[1024];
+  pid_t pid;
+
+  snprintf(line, sizeof(line), "exec %s", command);
+
+  if ((pid = fork()) == 0)
+  {
+    execl("/bin/sh", "sh", "-c", line, (char *)NULL);
+    _exit(127);
+  }
+
+  if (pid < 0 || !_manager_wait(connection, TRUE))
+  {
+    fprintf(stderr, "pb-shards: the manager did not start\n");
+    exit(1);
+  }
+
+  return pid;
+}
+
+static void
+_manager_stop(DBusConnection *connection,
+              pid_t pid)
+{
+  kill(pid, SIGTERM);
+  waitpid(pid, NULL, 0);
+  _manager_wait(connection, FALSE);
+}
+
+static int
+_parse_mix(char *spec)
+{
+  char *save, *item;
+
+  mix.n = mix.total = 0;
+
+  for (item = strtok_r(spec, ",", &save); item;
+       item = strtok_r(NULL, ",", &save))
+  {
+    char *weight = strchr(item, '=');
+    enum pb_class_e pb_class;
+    long w = 1;
+
+    if (weight)
+    {
+      *weight++ = '\0';
+      w = atol(weight);
+    }
+
+    pb_class = pb_string_to_class(item);
+
+    if (mix.n == MAX_MIX || w <= 0 ||
+        (pb_class == PB_CLASS_NONE && strcmp(item, "None")))
+      return FALSE;
+
+    mix.pb_class[mix.n] = pb_class;
+    mix.weight[mix.n++] = w;
+    mix.total += w;
+  }
+
+  return mix.n > 0;
+}
+
+static enum pb_class_e
+_player_class(long i)
+{
+  unsigned int slot = i % mix.total, k;
+
+  for (k = 0; slot >= mix.weight[k]; k++)
+    slot -= mix.weight[k];
+
+  return mix.pb_class[k];
+}
+
+static void
+_usage(void)
+{
+  fprintf(stderr,
+          "usage: pb-shards [-s shard counts] [-n playbacks] [-c mix] "
+          "[-p policy]\n"
+          "                 [-t seconds] [-m manager command]\n"
+          "  -s  comma separated shard counts to run with (1,2,4,8)\n"
+          "  -c  classes and weights, e.g. Media=4,VoIP=1 (Media)\n"
+          "  -p  hash or class, how playbacks are assigned to shards "
+          "(hash)\n");
+  exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+  DBusConnection *connection;
+  const char *command = NULL;
+  char default_mix[] = "Media", default_counts[] = "1,2,4,8";
+  char *counts = default_counts, *save, *item;
+  enum pb_shard_policy_e policy = PB_SHARD_BY_HASH;
+  unsigned int runs[MAX_RUNS], n_runs = 0, r;
+  long n = 256, i;
+  double duration = 5, base = 0, rate;
+  player_t *players;
+  pid_t manager = 0;
+  int c;
+
+  if (!_parse_mix(default_mix))
+    return 2;
+
+  while ((c = getopt(argc, argv, "s:n:c:p:t:m:")) != -1)
+  {
+    switch (c)
+    {
+      case 's':
+        counts = optarg;
+        break;
+      case 'n':
+        n = atol(optarg);
+        break;
+      case 'c':
+        if (!_parse_mix(optarg))
+          _usage();
+        break;
+      case 'p':
+        if (!strcmp(optarg, "class"))
+          policy = PB_SHARD_BY_CLASS;
+        else if (strcmp(optarg, "hash"))
+          _usage();
+        break;
+      case 't':
+        duration = atof(optarg);
+        break;
+      case 'm':
+        command = optarg;
+        break;
+      default:
+        _usage();
+    }
+  }
+
+  for (item = strtok_r(counts, ",", &save); item;
+       item = strtok_r(NULL, ",", &save))
+  {
+    if (n_runs == MAX_RUNS || atoi(item) <= 0)
+      _usage();
+
+    runs[n_runs++] = atoi(item);
+  }
+
+  if (!n_runs || n <= 0 || duration <= 0)
+    _usage();
+
+  if (!(connection = dbus_bus_get_private(DBUS_BUS_SESSION, NULL)))
+  {
+    fprintf(stderr, "pb-shards: no session bus\n");
+    return 1;
+  }
+
+  dbus_connection_set_exit_on_disconnect(connection, FALSE);
+
+  if (command)
+    manager = _manager_start(connection, command);
+  else if (!dbus_bus_name_has_owner(connection, MANAGER_SERVICE, NULL))
+  {
+    fprintf(stderr, "pb-shards: no manager on the bus, see -m\n");
+    return 1;
+  }
+
+  if (!(players = (player_t *)calloc(n, sizeof(player_t))))
+    return 1;
+
+  for (i = 0; i < n; i++)
+    players[i].pb_class = _player_class(i);
+
+  printf("%ld playbacks, %.1f s per run\n", n, duration);
+  printf("%6s %12s %12s %9s %9s %9s %11s %8s\n", "shards", "answered",
+         "req/s", "refused", "failed", "preempted", "unanswered", "speedup");
+
+  for (r = 0; r < n_runs; r++)
+  {
+    rate = _run(runs[r], policy, players, n, duration);
+
+    if (!r)
+      base = rate;
+
+    printf(" %7.2fx\n", base > 0 ? rate / base : 0);
+  }
+
+  if (manager)
+    _manager_stop(connection, manager);
+
+  dbus_connection_close(connection);
+  dbus_connection_unref(connection);
+  free(players);
+
+  return 0;
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# Runs a command against a private bus daemon, for example:
+#
+#   bench/run-bench.sh ./pb-churn -n 1000000 -i 100000
+#
+
+if [ $# -eq 0 ]; then
+  echo "usage: $0 command [args...]" >&2
+  exit 2
+fi
+
+conf=$(dirname "$0")/bus.conf
+info=$(mktemp) || exit 1
+
+dbus-daemon --config-file="$conf" --fork --print-address=3 --print-pid=4 \
+  3>"$info" 4>"$info.pid" || exit 1
+
+DBUS_SESSION_BUS_ADDRESS=$(head -n 1 "$info")
+export DBUS_SESSION_BUS_ADDRESS
+
+"$@"
+rv=$?
+
+kill $(cat "$info.pid")
+rm -f "$info" "$info.pid"
+
+exit $rv
@@ -0,0 +1,48 @@
+/*
+** Playback manager - sd-bus transport of the client library
+**
+** Only installed when the library is built with SDBUS=1.
+*/
+
+#ifndef PLAYBACK_SDBUS_H_
+# define PLAYBACK_SDBUS_H_
+
+#include <systemd/sd-bus.h>
+
+#include <libplayback/playback.h>
+
+PB_BEGIN_DECLS
+
+/**
+ * pb_sdbus_attach:
+ * @param[in] connection D-Bus Connection
+ * @param[in] bus an sd-bus connection to the same bus, referenced
+ * @return FALSE if @connection already has an sd_bus
+ *
+ * Sends the calls of @connection to the manager (state requests,
+ * allowed states, settings) over @bus, and takes the manager's signals
+ * from it, instead of using libdbus.  The API stays the same:
+ * @connection remains the handle of the playbacks, which are still
+ * served on it, and announced from it.  The manager is told with
+ * RegisterPeer which client the calls from @bus are for; if it fails,
+ * as with a manager that does not implement it, @bus is detached.  The
+ * application dispatches @bus, for instance with sd_bus_attach_event().
+ * The match rules of the playbacks that already exist move to @bus;
+ * the peer connection of pb_peer_connect() is not used while @bus is
+ * attached.
+ */
+int pb_sdbus_attach(DBusConnection *connection, sd_bus *bus);
+
+/**
+ * pb_sdbus_detach:
+ * @param[in] connection D-Bus Connection
+ *
+ * Goes back to libdbus for the calls made from now on, and for the
+ * signals of the manager.  The replies to the calls in flight still
+ * arrive on the sd_bus.
+ */
+void pb_sdbus_detach(DBusConnection *connection);
+
+PB_END_DECLS
+
+#endif /* !PLAYBACK_SDBUS_H_ */
@@ -30,6 +30,11 @@ enum pb_state_e {
 #define PB_FLAG_AUDIO_RECORDING 0x4
 #define PB_FLAG_VIDEO_RECORDING 0x8
 
+/* Not a request domain: delays the registration of the playback on the
+ * bus (object path, Hello signal) until the first state request or state
+ * hint.  Never reported to the manager. */
+#define PB_FLAG_LAZY 0x100
+
 enum pb_class_e {
   PB_CLASS_NONE,	/**<  declare an "unknown" (or undefined) PLAYBACK class */
   PB_CLASS_TEST,	/**< "test" class */
@@ -49,12 +54,31 @@ enum pb_class_e {
   PB_CLASS_LAST,
 };
 
+/* Highest priority of the request scheduler, see pb_set_class_priority() */
+#define PB_PRIORITY_MAX 7
+
 enum pb_bt_override_status_e {
     BT_OVERRIDE_DISCONNECTED = -1,
     BT_OVERRIDE_OFF = 0,
     BT_OVERRIDE_ON = 1
 };
 
+/* What pb_playback_req_state() does when the request queue of a
+ * playback is full, see pb_playback_set_queue_limit(). */
+enum pb_queue_policy_e {
+  PB_QUEUE_REJECT,	/**< fail the new request */
+  PB_QUEUE_DROP_OLDEST,	/**< fail the oldest request not yet sent */
+  PB_QUEUE_REPLACE_TAIL,	/**< fail the newest request, queue the new one */
+};
+
+enum pb_log_level_e {
+  PB_LOG_LEVEL_NONE,	/**< logging disabled (default) */
+  PB_LOG_LEVEL_ERROR,
+  PB_LOG_LEVEL_WARNING,
+  PB_LOG_LEVEL_INFO,
+  PB_LOG_LEVEL_DEBUG,
+};
+
 enum pb_state_e	pb_string_to_state		(const char		*state);
 const char *	pb_state_to_string		(enum pb_state_e	pb_state);
 
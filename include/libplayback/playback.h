@@ -97,6 +97,22 @@ typedef void (* PBMuteCb) (int mute, const char *error, void *data);
 typedef void (* PBBluetoothCb) (enum pb_bt_override_status_e, const char *error, void *data);
 
 
+/**
+ * PBManagerSettingsCb:
+ * @param[out] mute Boolean state of the mute setting
+ * @param[out] privacy_override Boolean state of the privacy override
+ * @param[out] bluetooth_override Status of the bluetooth override
+ * @param[out] error Error string or NULL if no errors
+ * @param[out] data The pointer associated to the callback
+ *
+ * Reply from pb_get_manager_settings().  The settings are only
+ * meaningful if @error is NULL.
+ */
+typedef void (* PBManagerSettingsCb) (int mute, int privacy_override,
+                                      enum pb_bt_override_status_e bluetooth_override,
+                                      const char *error, void *data);
+
+
 /* FIXME: why is PB_STATE_NONE if denied? Why doesn't the manager just
  * tell the correct state? */
 /**
@@ -133,6 +149,10 @@ typedef void	(* PBStateReply)		(pb_playback_t *pb, enum pb_state_e granted_state
  * A client  should declare the different playbacks  (for example, the
  * different pipelines, or tracks: voice, music, event...)  A playback
  * *must be* controllable and provide a req_state_handler.
+ *
+ * With PB_FLAG_LAZY in @flags the playback stays invisible to the
+ * manager until the first pb_playback_req_state() or
+ * pb_playback_set_state_hint() call.
  */
 pb_playback_t *	pb_playback_new_2			(DBusConnection *connection,
 						 enum pb_class_e pb_class, uint32_t flags, enum pb_state_e pb_state,
@@ -174,6 +194,41 @@ void		pb_playback_set_state_hint	(pb_playback_t *pb, PBStateHint state_hint_hand
  */
 pb_req_t*	pb_playback_req_state		(pb_playback_t *pb, enum pb_state_e pb_state, PBStateReply state_reply, void *data);
 
+/**
+ * pb_state_req_t:
+ * @pb: the playback object
+ * @pb_state: the state @pb wants to be in
+ * @state_reply: the callback that gets the answer
+ * @data: user data associated with the callback
+ * @req: [out] the request handler, or NULL
+ *
+ * One state request of pb_playback_req_state_many().
+ */
+typedef struct pb_state_req_s
+{
+  pb_playback_t *pb;
+  enum pb_state_e pb_state;
+  PBStateReply state_reply;
+  void *data;
+  pb_req_t *req;
+} pb_state_req_t;
+
+/**
+ * pb_playback_req_state_many:
+ * @param[in,out] reqs the state requests
+ * @param[in] n the number of requests in @reqs
+ * @return the number of request handlers returned in @reqs
+ *
+ * Makes the requests of @reqs as pb_playback_req_state() would, each
+ * with its own reply and request handler, but sends them to the manager
+ * in one RequestStates call where possible.  Only the first request of
+ * a playback and only playbacks on the same connection as the first one
+ * can share the call; the other requests are queued or sent as usual.
+ * If the manager does not implement RequestStates, the requests are
+ * sent one by one, and so are later ones until the manager changes.
+ */
+int pb_playback_req_state_many(pb_state_req_t *reqs, unsigned int n);
+
 /* returns only error status, the current privacy override status comes
  * to the callback. */
 
@@ -197,6 +252,10 @@ int pb_get_privacy_override(DBusConnection *connection);
  *
  * The privacy override status will be returned as a parameter to a
  * call to the (previously defined) privacy callback.
+ *
+ * Nothing is sent if the value is known to be in effect already, and
+ * while a request is in flight only the last value requested meanwhile
+ * is sent after it.
  */
 int pb_req_privacy_override(DBusConnection *connection, int override);
 
@@ -223,6 +282,8 @@ int pb_get_mute(DBusConnection *connection);
  * The mute status will be returned as a parameter to a
  * call to the (previously defined) muting callback. You need to set a
  * callback before using the pb_get_mute function.
+ *
+ * Redundant requests are dropped as in pb_req_privacy_override().
  */
 int pb_req_mute(DBusConnection *connection, int mute);
 
@@ -249,10 +310,331 @@ int pb_get_bluetooth_override(DBusConnection *connection);
  *
  * The bluetooth override status will be returned as a parameter to a
  * call to the (previously defined) bluetooth callback.
+ *
+ * Redundant requests are dropped as in pb_req_privacy_override().
  */
 int pb_req_bluetooth_override(DBusConnection *connection, int override);
+
+/**
+ * pb_get_manager_settings:
+ * @param[in] connection D-Bus Connection
+ * @param[in] settings_cb the callback receiving all the settings
+ * @param[in] data user data for the callback
+ * @return success value indicating whether starting the query
+ * succeeded.
+ *
+ * Fetches the mute, privacy override and bluetooth override settings
+ * with a single org.freedesktop.DBus.Properties.GetAll call to the
+ * manager, and calls @settings_cb once with all of them.  Managers that
+ * do not export the settings as properties are asked with the
+ * individual Get methods instead.  Unlike pb_get_mute() and friends,
+ * this does not use the callbacks set with pb_set_mute_cb() and friends.
+ */
+int pb_get_manager_settings(DBusConnection *connection, PBManagerSettingsCb settings_cb, void *data);
+
 /* setters for the callbacks */
 
+/**
+ * pb_board_t:
+ *
+ * The state board: a page of shared memory where the manager publishes
+ * the allowed states of every class and the global settings, so that
+ * clients read them without any message.  Writes are protected by a
+ * sequence lock, readers never block the manager.
+ */
+typedef struct pb_board_s pb_board_t;
+
+/**
+ * PBBoardCb:
+ * @param[out] board the board attached to the connection, or NULL
+ * @param[out] error error message if @board is NULL
+ * @param[out] data the pointer given to pb_board_attach()
+ */
+typedef void (* PBBoardCb) (pb_board_t *board, const char *error, void *data);
+
+/**
+ * pb_board_create:
+ * @return a new, empty board, or NULL
+ *
+ * For the manager, or a stand-in in the client process: creates a board
+ * in a sealed memfd.  Hand pb_board_get_fd() out to the readers.
+ */
+pb_board_t *pb_board_create(void);
+
+/**
+ * pb_board_open:
+ * @param[in] fd file descriptor of a board, duplicated
+ * @return a read only board, or NULL if @fd is not a valid board
+ */
+pb_board_t *pb_board_open(int fd);
+void pb_board_close(pb_board_t *board);
+int pb_board_get_fd(pb_board_t *board);
+
+/**
+ * pb_board_publish_allowed_state:
+ * @param[in] board a board from pb_board_create()
+ * @param[in] pb_class the class the states apply to
+ * @param[in] allowed_state TRUE for each allowed state, indexed by state
+ */
+void pb_board_publish_allowed_state(pb_board_t *board, enum pb_class_e pb_class, const int allowed_state[]);
+void pb_board_publish_settings(pb_board_t *board, int mute, int privacy_override, enum pb_bt_override_status_e bluetooth_override);
+
+/**
+ * pb_board_read_allowed_state:
+ * @param[in] board the board
+ * @param[in] pb_class the class
+ * @param[out] allowed_state TRUE for each allowed state, indexed by state
+ * @return FALSE if nothing was published for @pb_class yet
+ */
+int pb_board_read_allowed_state(pb_board_t *board, enum pb_class_e pb_class, int allowed_state[]);
+int pb_board_read_settings(pb_board_t *board, int *mute, int *privacy_override, enum pb_bt_override_status_e *bluetooth_override);
+
+/**
+ * pb_board_generation:
+ * @param[in] board the board
+ * @return a number that changes with every update of @board
+ *
+ * Lets a reader poll for changes instead of subscribing to signals.
+ */
+uint32_t pb_board_generation(pb_board_t *board);
+
+/**
+ * pb_board_attach:
+ * @param[in] connection D-Bus Connection
+ * @param[in] board_cb callback for the result
+ * @param[in] data user data for the callback
+ * @return success value indicating whether starting the query succeeded
+ *
+ * Asks the manager for its board with the GetStateBoard method, which
+ * returns a unix fd, and attaches the board to @connection; see
+ * pb_board_attach_fd().
+ */
+int pb_board_attach(DBusConnection *connection, PBBoardCb board_cb, void *data);
+
+/**
+ * pb_board_attach_fd:
+ * @param[in] connection D-Bus Connection
+ * @param[in] fd file descriptor of a board, duplicated
+ * @return TRUE if @fd is a valid board
+ *
+ * Once a board is attached, playbacks registered on @connection take
+ * their allowed states from it, and only subscribe to the manager's
+ * broadcasts when given a state hint handler with
+ * pb_playback_set_state_hint().  The board stays attached until the
+ * connection is freed.
+ */
+int pb_board_attach_fd(DBusConnection *connection, int fd);
+
+/**
+ * pb_board_get:
+ * @param[in] connection D-Bus Connection
+ * @return the board attached to @connection, or NULL
+ */
+pb_board_t *pb_board_get(DBusConnection *connection);
+
+/**
+ * PBPeerCb:
+ * @param[out] peer the peer connection to the manager, or NULL
+ * @param[out] error error message if @peer is NULL
+ * @param[out] data the pointer given to pb_peer_connect()
+ *
+ * The application must dispatch @peer from its main loop, for instance
+ * with dbus_connection_setup_with_g_main(), as the replies of the
+ * manager arrive there.  @peer belongs to the library.
+ */
+typedef void (* PBPeerCb) (DBusConnection *peer, const char *error, void *data);
+
+/**
+ * pb_peer_connect:
+ * @param[in] connection D-Bus Connection
+ * @param[in] peer_cb callback for the result
+ * @param[in] data user data for the callback
+ * @return success value indicating whether starting the query succeeded
+ *
+ * Opens a direct connection to the manager, at the address returned by
+ * its GetPeerAddress method, and registers it with RegisterPeer.  From
+ * then on the calls to the manager (state requests, settings, allowed
+ * states) skip the bus daemon; the playbacks, their Hello signals and
+ * the manager's signals stay on the bus.  If the peer connection is
+ * lost, the calls go over the bus again, and the state requests that
+ * were waiting on it are sent again.
+ */
+int pb_peer_connect(DBusConnection *connection, PBPeerCb peer_cb, void *data);
+
+/**
+ * pb_peer_disconnect:
+ * @param[in] connection D-Bus Connection
+ *
+ * Closes the peer connection of @connection, if any.  The state requests
+ * waiting for a reply on it are sent again on the bus.
+ */
+void pb_peer_disconnect(DBusConnection *connection);
+
+/**
+ * pb_engine_req_t:
+ * @pb: the playback
+ * @pb_class: its class
+ * @flags: its PB_FLAG_* flags
+ * @pb_state: the state requested, or the current state for events
+ * @pid: the process doing the playback
+ * @stream: the stream name, may be NULL
+ *
+ * A playback as a policy engine sees it.  Only valid during the call.
+ */
+typedef struct pb_engine_req_s
+{
+  pb_playback_t *pb;
+  enum pb_class_e pb_class;
+  uint32_t flags;
+  enum pb_state_e pb_state;
+  pid_t pid;
+  const char *stream;
+} pb_engine_req_t;
+
+enum pb_engine_event_e
+{
+  PB_ENGINE_HELLO,
+  PB_ENGINE_STATE,
+  PB_ENGINE_GOODBYE
+};
+
+/**
+ * pb_engine_t:
+ * @request_state: grants a state: returns the state to grant, or
+ * PB_STATE_NONE to deny the request, with an optional *@reason
+ * @request_mute: TRUE to accept a mute change, NULL accepts all
+ * @request_privacy_override: the same for the privacy override
+ * @request_bluetooth_override: the same for the bluetooth override
+ * @playback_event: a playback appeared, changed state or went away, may
+ * be NULL
+ *
+ * A policy engine serving the calls of a connection in place of the
+ * Playback Manager, see pb_loopback_attach().  The functions must not
+ * call back into the library, except for the pb_loopback_set_*()
+ * functions.
+ */
+typedef struct pb_engine_s
+{
+  enum pb_state_e (*request_state) (const pb_engine_req_t *req, const char **reason, void *data);
+  int (*request_mute) (int mute, void *data);
+  int (*request_privacy_override) (int override, void *data);
+  int (*request_bluetooth_override) (int override, void *data);
+  void (*playback_event) (const pb_engine_req_t *req, enum pb_engine_event_e event, void *data);
+} pb_engine_t;
+
+/**
+ * PBLoopbackWakeup:
+ * @param[out] connection the connection with replies to dispatch
+ * @param[out] data the pointer given to pb_loopback_set_wakeup()
+ */
+typedef void (* PBLoopbackWakeup) (DBusConnection *connection, void *data);
+
+/**
+ * pb_loopback_attach:
+ * @param[in] connection D-Bus Connection
+ * @param[in] engine the policy engine, copied
+ * @param[in] data user data for the engine
+ * @return FALSE if @connection already has an engine
+ *
+ * Serves the manager calls of @connection (state requests, allowed
+ * states, settings) with @engine in this process: nothing is marshalled
+ * and no message is sent.  The engine runs when the call is made, and
+ * the reply is queued, to be delivered from pb_loopback_dispatch() as
+ * the replies of the manager are delivered from the main loop.  The
+ * signals of pb_loopback_set_allowed_state() and friends are queued in
+ * the same order.  Attach the engine before creating playbacks.
+ *
+ * @connection stays the handle of the playbacks: the calls the manager
+ * makes on the playback objects, the state board and the peer
+ * connection still need D-Bus.
+ */
+int pb_loopback_attach(DBusConnection *connection, const pb_engine_t *engine, void *data);
+
+/**
+ * pb_loopback_detach:
+ * @param[in] connection D-Bus Connection
+ *
+ * Dispatches what is queued and goes back to the manager on the bus.
+ */
+void pb_loopback_detach(DBusConnection *connection);
+
+/**
+ * pb_loopback_set_wakeup:
+ * @param[in] connection D-Bus Connection
+ * @param[in] wakeup called when a reply or signal is queued on an empty
+ * queue, NULL for none
+ * @param[in] data user data for @wakeup
+ *
+ * Lets the main loop schedule pb_loopback_dispatch(), for instance with
+ * an idle source.
+ */
+void pb_loopback_set_wakeup(DBusConnection *connection, PBLoopbackWakeup wakeup, void *data);
+
+/**
+ * pb_loopback_dispatch:
+ * @param[in] connection D-Bus Connection
+ * @return the number of replies and signals delivered
+ *
+ * Delivers the queued replies and signals in order, including those
+ * queued meanwhile by the callbacks.
+ */
+int pb_loopback_dispatch(DBusConnection *connection);
+
+/**
+ * pb_loopback_set_allowed_state:
+ * @param[in] connection D-Bus Connection
+ * @param[in] pb_class the class the states apply to
+ * @param[in] allowed_state TRUE for each allowed state, indexed by state
+ *
+ * For the engine: the AllowedState signal.  All states are allowed
+ * until this is called.
+ */
+void pb_loopback_set_allowed_state(DBusConnection *connection, enum pb_class_e pb_class, const int allowed_state[]);
+
+/**
+ * pb_loopback_set_state:
+ * @param[in] connection D-Bus Connection
+ * @param[in] pb a playback of @connection
+ * @param[in] pb_state the state @pb must go to
+ *
+ * For the engine: the manager setting the State property of @pb.  The
+ * state request handler of @pb is called from pb_loopback_dispatch(),
+ * unless @pb is in @pb_state by then.
+ */
+void pb_loopback_set_state(DBusConnection *connection, pb_playback_t *pb, enum pb_state_e pb_state);
+void pb_loopback_set_mute(DBusConnection *connection, int mute);
+void pb_loopback_set_privacy_override(DBusConnection *connection, int override);
+void pb_loopback_set_bluetooth_override(DBusConnection *connection, enum pb_bt_override_status_e override);
+
+/**
+ * pb_set_local_policy:
+ * @param[in] connection D-Bus Connection
+ * @param[in] path the policy table, NULL for the built-in one
+ * @return FALSE if the table could not be read
+ *
+ * Decides the state requests of @connection in this process while there
+ * is no Playback Manager on the bus, instead of waiting for the bus to
+ * tell so.  The policy takes over at once if the manager is not there,
+ * or as soon as it goes away, with the loopback transport (see
+ * pb_loopback_attach()), and hands back to a new manager.
+ *
+ * Each line of @path reads "class priority [class...]": a class as in
+ * pb_class_to_string(), its priority from 0 to PB_PRIORITY_MAX, and the
+ * classes it preempts.  "#" starts a comment.  A playback is denied PLAY
+ * while a playback of a higher priority class that preempts its class
+ * plays; once it plays, the playbacks of the classes it preempts with
+ * the same or a lower priority are set to STOP through their state
+ * request handlers.  The classes not in @path keep the built-in entry:
+ * the scheduler priorities of pb_set_class_priority(), calls preempting
+ * media, ringtones, alarms and events, ringtones and alarms preempting
+ * media, and media, game and flash playbacks preempting each other.
+ *
+ * The replies are delivered from the main loop: unless the application
+ * dispatches the loopback itself with pb_loopback_set_wakeup(), the
+ * library wakes it up with a signal to its own connection.
+ */
+int pb_set_local_policy(DBusConnection *connection, const char *path);
+
 /**
  * pb_set_privacy_override_cb:
  * @param[in] connection d-bus connection
@@ -299,9 +681,499 @@ void pb_set_bluetooth_override_cb(DBusConnection *connection, PBBluetoothCb blue
 void pb_playback_set_pid(pb_playback_t *pb, pid_t pid);
 void pb_playback_set_stream(pb_playback_t *pb, char *stream);
 
+/**
+ * pb_set_object_manager:
+ * @param[in] connection d-bus connection
+ * @param[in] enable TRUE to announce the playbacks the ObjectManager way
+ *
+ * The playbacks of a connection are always listed, with all their
+ * properties, by GetManagedObjects of org.freedesktop.DBus.ObjectManager
+ * on /org/maemo, so that a manager or a monitoring tool gets them in one
+ * round trip.  With @enable, the playbacks registered from then on are
+ * announced with the InterfacesAdded signal of that interface, which
+ * carries the properties, instead of Hello, and retired with
+ * InterfacesRemoved instead of Goodbye.  The switch only affects new
+ * playbacks, and those announced again to a new manager: a playback
+ * announced with Hello still says Goodbye.  Only enable it for a
+ * manager that listens to these signals.
+ */
+void pb_set_object_manager(DBusConnection *connection, int enable);
+
+/**
+ * pb_context_t:
+ *
+ * What the library keeps for one DBusConnection: its playbacks and
+ * their object ids, its filter and match rules, the name it owns, the
+ * cached manager settings and the callbacks of pb_set_mute_cb() and
+ * friends.  It is created by the first call given the connection and
+ * freed with it.  Connections share nothing: a process may use the
+ * system and the session bus, or several private connections, at once.
+ */
+typedef struct pb_context_s pb_context_t;
+
+/**
+ * PBContextReady:
+ * @param[out] context the context that is ready
+ * @param[out] error why the name could not be owned, or NULL
+ * @param[out] data the pointer given to pb_context_prepare()
+ */
+typedef void (* PBContextReady) (pb_context_t *context, const char *error, void *data);
+
+/**
+ * pb_context_get:
+ * @param[in] connection D-Bus Connection
+ * @return the context of @connection, or NULL if out of memory
+ */
+pb_context_t *pb_context_get(DBusConnection *connection);
+DBusConnection *pb_context_get_connection(pb_context_t *context);
+
+/**
+ * pb_context_prepare:
+ * @param[in] connection D-Bus Connection
+ * @param[in] ready_cb called once everything is in place, may be NULL
+ * @param[in] data user data for the callback
+ * @return FALSE if the setup could not be started
+ *
+ * Does ahead of time, without blocking, what the first playback would
+ * otherwise do while the application waits: adds the match rules for
+ * the manager, asks for the org.maemo.Playback name and fetches the
+ * manager settings, which are cached from then on.  Call it at startup,
+ * from the thread dispatching @connection; playbacks may be created
+ * before @ready_cb runs.  A missing manager is not an error.
+ */
+int pb_context_prepare(DBusConnection *connection, PBContextReady ready_cb, void *data);
+
+/**
+ * pb_shards_t:
+ *
+ * A pool of private connections to the bus, the shards, each with a
+ * thread of its own dispatching it.  A process hosting many playbacks
+ * spreads them over the shards, so that their requests, the calls of
+ * the manager to them and their replies are handled in parallel rather
+ * than one at a time under the lock of a single connection.  Every shard
+ * is a peer of its own on the bus, with its own pb_context_t.
+ */
+typedef struct pb_shards_s pb_shards_t;
+
+enum pb_shard_policy_e
+{
+  PB_SHARD_BY_HASH,             /* spread by the key given to pb_shards_pick() */
+  PB_SHARD_BY_CLASS             /* the playbacks of a class stay together */
+};
+
+/**
+ * PBShardFunc:
+ * @param[out] connection the connection of the shard
+ * @param[out] data the pointer given to pb_shards_call()
+ */
+typedef void (* PBShardFunc) (DBusConnection *connection, void *data);
+
+/**
+ * pb_shards_new:
+ * @param[in] type the bus to connect to
+ * @param[in] n_shards the number of connections and threads
+ * @param[in] policy how pb_shards_pick() assigns playbacks
+ * @return the shards, running, or NULL on error
+ *
+ * Calls dbus_threads_init_default().  Each connection is prepared with
+ * pb_context_prepare() from its thread.
+ */
+pb_shards_t *pb_shards_new(DBusBusType type, unsigned int n_shards,
+                           enum pb_shard_policy_e policy);
+
+/**
+ * pb_shards_free:
+ * @param[in] shards the shards
+ *
+ * Runs the calls still queued, stops the threads and closes the
+ * connections.  The playbacks must have been destroyed, from their
+ * shards, before.
+ */
+void pb_shards_free(pb_shards_t *shards);
+
+unsigned int pb_shards_size(pb_shards_t *shards);
+DBusConnection *pb_shards_get_connection(pb_shards_t *shards,
+                                         unsigned int shard);
+
+/**
+ * pb_shards_pick:
+ * @param[in] shards the shards
+ * @param[in] pb_class the class of the playback
+ * @param[in] key a key of the playback, a stream or pipeline id
+ * @return the shard the playback belongs to
+ */
+unsigned int pb_shards_pick(pb_shards_t *shards, enum pb_class_e pb_class,
+                            uint32_t key);
+
+/**
+ * pb_shards_call:
+ * @param[in] shards the shards
+ * @param[in] shard the shard to run @func on
+ * @param[in] func the function
+ * @param[in] data user data for @func
+ * @return FALSE if out of memory or the shards are being freed
+ *
+ * Runs @func on the thread of @shard, after the calls queued before it.
+ * The library is not thread safe within a connection: the playbacks of a
+ * shard are created, used and destroyed from its thread only, that is
+ * from @func or from their callbacks.  Callable from any thread.
+ */
+int pb_shards_call(pb_shards_t *shards, unsigned int shard, PBShardFunc func,
+                   void *data);
+
+/**
+ * pb_set_log_level:
+ * @param[in] level the most verbose level to record
+ *
+ * Sets the log level of the library for the whole process.  The initial
+ * level is read from the LIBPLAYBACK_LOG environment variable ("error",
+ * "warning", "info", "debug" or a number), logging is off by default.
+ * Records are kept in binary form in a fixed size ring per connection,
+ * the oldest are overwritten, and only formatted by pb_log_drain().
+ */
+void pb_set_log_level(enum pb_log_level_e level);
+
+/**
+ * pb_log_drain:
+ * @param[in] connection d-bus connection
+ * @param[in] fd file descriptor the records are written to as text
+ * @return the number of records written, or -1 on error
+ *
+ * Formats and removes the log records of @connection.  Never blocks the
+ * threads that log; if another thread is draining, returns 0.
+ */
+int pb_log_drain(DBusConnection *connection, int fd);
+
+/**
+ * pb_queue_stats_t:
+ * @depth: requests queued, including the one waiting for its reply
+ * @max_depth: highest depth seen
+ * @rejected: requests failed by PB_QUEUE_REJECT
+ * @dropped: queued requests failed by PB_QUEUE_DROP_OLDEST or
+ * PB_QUEUE_REPLACE_TAIL
+ */
+typedef struct pb_queue_stats_s
+{
+  unsigned int depth;
+  unsigned int max_depth;
+  unsigned long rejected;
+  unsigned long dropped;
+} pb_queue_stats_t;
+
+/**
+ * pb_playback_set_queue_limit:
+ * @param[in] pb the playback object
+ * @param[in] capacity the most requests queued at once, 0 for no limit
+ * @param[in] policy what to do with a request that does not fit
+ *
+ * Bounds the requests pb_playback_req_state() keeps waiting for the
+ * manager, the first of which is on the wire.  When the queue is full,
+ * PB_QUEUE_REJECT fails the new request.  PB_QUEUE_DROP_OLDEST and
+ * PB_QUEUE_REPLACE_TAIL fail the oldest or the newest request not yet
+ * sent and queue the new one; the failed request gets a PB_STATE_NONE
+ * reply and must still be completed or discarded.  If only the request
+ * on the wire is queued, the new request is rejected.  There is no
+ * limit by default.
+ */
+void pb_playback_set_queue_limit(pb_playback_t *pb, unsigned int capacity, enum pb_queue_policy_e policy);
+
+/**
+ * pb_playback_get_queue_stats:
+ * @param[in] pb the playback object
+ * @param[out] stats the request queue counters of @pb
+ */
+void pb_playback_get_queue_stats(pb_playback_t *pb, pb_queue_stats_t *stats);
+
+/**
+ * pb_set_request_window:
+ * @param[in] connection d-bus connection
+ * @param[in] window most state requests waiting for the manager, 0 for
+ * no limit
+ *
+ * Limits the pb_playback_req_state() calls of all the playbacks of
+ * @connection that are on the wire at once.  Requests beyond the window
+ * wait in the library and are sent by class priority, oldest first
+ * within a priority, see pb_set_class_priority().  There is no limit by
+ * default, so requests go out in the order they are made.
+ */
+void pb_set_request_window(DBusConnection *connection, unsigned int window);
+
+/**
+ * pb_set_class_priority:
+ * @param[in] connection d-bus connection
+ * @param[in] pb_class the playback class
+ * @param[in] priority 0 (lowest) to PB_PRIORITY_MAX
+ *
+ * Sets the scheduling priority of the requests of @pb_class playbacks on
+ * @connection.  The defaults favour PB_CLASS_CALL (PB_PRIORITY_MAX), then
+ * ringtones and alarms, then event, system and input sounds, and put
+ * PB_CLASS_BACKGROUND last.  Requests already waiting keep their
+ * priority.
+ */
+void pb_set_class_priority(DBusConnection *connection, enum pb_class_e pb_class, unsigned int priority);
+
+/**
+ * pb_manager_latency_t:
+ * @ewma: moving average of the round trip of a state request, in
+ * microseconds
+ * @deviation: mean deviation from @ewma
+ * @p50: median round trip of the recent requests
+ * @p99: 99th percentile of the recent requests
+ * @budget: how long a request may wait before a degraded grant, 0 until
+ * enough round trips have been seen
+ * @samples: round trips measured
+ * @degraded_grants: requests granted locally, see
+ * pb_set_degraded_grants()
+ * @confirmed: degraded grants the manager answered the same way
+ * @reconciled: degraded grants the manager answered differently
+ */
+typedef struct pb_manager_latency_s
+{
+  uint32_t ewma;
+  uint32_t deviation;
+  uint32_t p50;
+  uint32_t p99;
+  uint64_t budget;
+  unsigned long samples;
+  unsigned long degraded_grants;
+  unsigned long confirmed;
+  unsigned long reconciled;
+} pb_manager_latency_t;
+
+/**
+ * pb_get_manager_latency:
+ * @param[in] connection d-bus connection
+ * @param[out] stats the round trips of the state requests of @connection
+ * and the degraded grants
+ */
+void pb_get_manager_latency(DBusConnection *connection, pb_manager_latency_t *stats);
+
+/**
+ * PBDegradedTimer:
+ * @param[out] connection the connection to dispatch
+ * @param[out] timeout milliseconds after which pb_degraded_dispatch()
+ * is due
+ * @param[out] data the pointer given to pb_set_degraded_grants()
+ *
+ * Replaces the timeout asked for by the previous call, if it has not
+ * expired yet.
+ */
+typedef void (* PBDegradedTimer) (DBusConnection *connection, int timeout, void *data);
+
+/**
+ * pb_set_degraded_grants:
+ * @param[in] connection d-bus connection
+ * @param[in] classes the classes allowed degraded grants, bit 1 <<
+ * pb_class_e for each, 0 to turn them off (the default)
+ * @param[in] min_budget the shortest wait, in milliseconds
+ * @param[in] timer schedules pb_degraded_dispatch()
+ * @param[in] data user data for @timer
+ *
+ * Lets the state requests of @classes that wait too long for a slow
+ * manager be granted locally.  The budget is the largest of
+ * @min_budget, the average round trip plus four deviations, and the
+ * 99th percentile, see pb_get_manager_latency(); there is no budget
+ * until a few round trips have been measured.  Only a request on its
+ * own for a state the manager allows the playback is granted this way,
+ * not those sent with pb_playback_req_state_many().
+ *
+ * The request stays on the wire.  If the manager then denies it or
+ * grants another state, and the playback has not been asked to change
+ * state since, the state request handler of the playback is called
+ * with the manager's answer, as if the manager had set the state.
+ */
+void pb_set_degraded_grants(DBusConnection *connection, uint32_t classes, unsigned int min_budget, PBDegradedTimer timer, void *data);
+
+/**
+ * pb_degraded_dispatch:
+ * @param[in] connection d-bus connection
+ * @return milliseconds until the next request is due, or -1
+ *
+ * Grants the requests that have waited past the budget.  The timer is
+ * asked again for the next one.
+ */
+int pb_degraded_dispatch(DBusConnection *connection);
+
+/**
+ * pb_capture_record_t:
+ * @time_us: CLOCK_MONOTONIC microseconds since pb_capture_start()
+ * @type: a pb_capture_type_e
+ * @length: bytes of data following the record
+ *
+ * A capture file starts with the 8 bytes of PB_CAPTURE_MAGIC, followed
+ * by records, in the byte order of the host.  The data of
+ * PB_CAPTURE_SENT and PB_CAPTURE_RECEIVED is the message as
+ * dbus_message_marshal() writes it, that of PB_CAPTURE_PLAYBACK and
+ * PB_CAPTURE_DESTROY a pb_capture_playback_t.
+ */
+#define PB_CAPTURE_MAGIC "PBCAPT01"
+
+enum pb_capture_type_e
+{
+  PB_CAPTURE_SENT = 1,
+  PB_CAPTURE_RECEIVED,
+  PB_CAPTURE_PLAYBACK,
+  PB_CAPTURE_DESTROY
+};
+
+typedef struct pb_capture_record_s
+{
+  uint64_t time_us;
+  uint32_t type;
+  uint32_t length;
+} pb_capture_record_t;
+
+/**
+ * pb_capture_playback_t:
+ * @object_id: the N of the /org/maemo/playbackN object path
+ * @pb_class: the class of the playback
+ * @flags: the flags given to pb_playback_new_2()
+ * @pb_state: its state when created, or when the capture started
+ */
+typedef struct pb_capture_playback_s
+{
+  uint32_t object_id;
+  uint32_t pb_class;
+  uint32_t flags;
+  uint32_t pb_state;
+} pb_capture_playback_t;
+
+/**
+ * pb_capture_start:
+ * @param[in] connection D-Bus Connection
+ * @param[in] fd file descriptor the capture is written to
+ * @return FALSE if @connection is already captured or on error
+ *
+ * Records the messages the library exchanges on @connection with the
+ * manager and with the callers of the playback objects, with their
+ * time, as well as the playbacks created and destroyed, starting with
+ * those that exist.  Records are buffered and written to @fd as the
+ * buffer fills up and by pb_capture_stop(); call both from the thread
+ * dispatching @connection.  Only the libdbus transport is captured.
+ * bench/pb-replay.c plays a capture back.
+ */
+int pb_capture_start(DBusConnection *connection, int fd);
+
+/**
+ * pb_capture_stop:
+ * @param[in] connection D-Bus Connection
+ * @return FALSE if some of the capture could not be written
+ *
+ * Writes out what is buffered and ends the capture.  @fd is not closed.
+ */
+int pb_capture_stop(DBusConnection *connection);
+
+/**
+ * pb_recorder_event_t:
+ * @time_ns: CLOCK_MONOTONIC nanoseconds
+ * @seq: position of the event in the recorder, from 1
+ * @object_id: the N of the /org/maemo/playbackN object path
+ * @event: a pb_recorder_event_e
+ * @pb_class: the class of the playback
+ * @pb_state: the state requested, granted, set or completed
+ * @old_state: the state of the playback before the event
+ * @arg: PB_RECORDER_ALLOWED_STATE: the allowed states as a bit mask of
+ * 1 << state; PB_RECORDER_GRANTED: TRUE for a degraded grant
+ * @flags: the flags of the playback
+ *
+ * An event of the flight recorder.  Every connection keeps the last
+ * PB_RECORDER_SIZE events, recording is always on and costs a clock read
+ * and an atomic add.
+ */
+#define PB_RECORDER_SIZE 512
+
+enum pb_recorder_event_e
+{
+  PB_RECORDER_REQUESTED = 1,    /* pb_playback_req_state() */
+  PB_RECORDER_GRANTED,          /* answer of the manager */
+  PB_RECORDER_DENIED,           /* refusal or failure */
+  PB_RECORDER_SET,              /* the manager sets the State property */
+  PB_RECORDER_SET_LOCAL,        /* local policy or degraded grant undone */
+  PB_RECORDER_COMPLETED,        /* pb_playback_req_completed() */
+  PB_RECORDER_DISCARDED,        /* pb_playback_req_discarded() */
+  PB_RECORDER_ALLOWED_STATE     /* new allowed states */
+};
+
+typedef struct pb_recorder_event_s
+{
+  uint64_t time_ns;
+  uint64_t seq;
+  uint32_t object_id;
+  uint8_t event;
+  uint8_t pb_class;
+  uint8_t pb_state;
+  uint8_t old_state;
+  uint32_t arg;
+  uint32_t flags;
+} pb_recorder_event_t;
+
+/**
+ * pb_recorder_read:
+ * @param[in] connection D-Bus Connection
+ * @param[out] events room for PB_RECORDER_SIZE events
+ * @return the number of events copied, oldest first, or -1 on error
+ *
+ * Copies the flight recorder of @connection without stopping the
+ * threads recording to it; events overwritten while being copied are
+ * left out.
+ */
+int pb_recorder_read(DBusConnection *connection, pb_recorder_event_t *events);
+
+/**
+ * pb_recorder_format:
+ * @param[in] event the event
+ * @param[out] buf where the text goes, with a newline
+ * @param[in] size size of @buf, 128 is always enough
+ * @return the length of the text
+ *
+ * Formats an event as pb_recorder_dump() does.  Async-signal-safe.
+ */
+int pb_recorder_format(const pb_recorder_event_t *event, char *buf,
+                       size_t size);
+
+/**
+ * pb_recorder_dump:
+ * @param[in] connection D-Bus Connection
+ * @param[in] fd file descriptor the events are written to as text
+ * @return the number of events written, or -1 on error
+ *
+ * Writes the flight recorder of @connection, oldest event first.  The
+ * events stay in the recorder.  The same text is returned by the
+ * org.maemo.Playback.Debug.GetFlightRecorder method of the playback
+ * objects, as an array of lines.
+ */
+int pb_recorder_dump(DBusConnection *connection, int fd);
+
+/**
+ * pb_recorder_dump_on_signal:
+ * @param[in] connection D-Bus Connection
+ * @param[in] signum the signal, for instance SIGUSR2
+ * @param[in] fd file descriptor the events are written to
+ * @return FALSE if the handler could not be installed
+ *
+ * Installs a handler of @signum that does pb_recorder_dump() of
+ * @connection to @fd, for a process that is stuck or has no main loop
+ * to spare.  Only one connection is dumped on a signal; the handler
+ * stays installed, and does nothing once @connection is freed.  The
+ * recorder of @connection is then left allocated, since a handler
+ * running on another thread may still be reading it.
+ */
+int pb_recorder_dump_on_signal(DBusConnection *connection, int signum,
+                               int fd);
+
 int		pb_playback_req_discarded	(pb_playback_t *pb, pb_req_t *req, const char *reason);
 int		pb_playback_req_completed	(pb_playback_t *pb, pb_req_t *req);
 
+/**
+ * pb_playback_destroy:
+ * @param[in] pb the playback object
+ *
+ * Unregisters the playback and drops the caller's reference to it.
+ * Requests still queued by pb_playback_req_state() are cancelled and
+ * freed, their handlers must not be used afterwards.  Requests from the
+ * manager that have not been completed or discarded keep the playback
+ * alive until they are.
+ */
 void		pb_playback_destroy		(pb_playback_t *pb);
 
 PB_END_DECLS
@@ -0,0 +1,1686 @@
+/*
+** Playback manager - reference org.maemo.Playback.Manager
+**
+** A single threaded, event driven manager, for testing the library and
+** for systems without a policy daemon of their own.  It decides the
+** state requests with the class priorities and preemptions of the local
+** policy of the library, optionally read from a table in the format of
+** pb_set_local_policy(), stops the playbacks it preempts with
+** Properties.Set, and serves the mute, privacy and Bluetooth settings
+** and the state board.
+**
+** The playbacks are kept in a hash table by client and object path, and
+** the playing ones in a list per class, so that a request only looks at
+** the classes involved.  The class of a playback is fetched with GetAll
+** the first time it is seen; its requests wait for the reply.  Clients
+** announcing their playbacks with the InterfacesAdded signal of
+** org.freedesktop.DBus.ObjectManager, see pb_set_object_manager(), send
+** the class along, which saves the call.  A client whose manager calls
+** come from a second connection, as with the sd-bus transport, names
+** its first one with RegisterPeer; if both are of the same process, or
+** of the same user, the calls are then taken for it.  The
+** AllowedState and setting signals are sent once per main loop
+** iteration, for the classes and settings whose value changed since
+** the last ones, however many requests were handled in between.
+**
+**   ./pb-manager [-c table] [-y] [-v]
+**
+** -y uses the system bus instead of the session bus, -v prints counters
+** on exit.  With 4 clients of 1024 playbacks each, all of them
+** requesting Play and Stop in turn through bench/run-bench.sh, it takes
+** about 17us of CPU per request, some 58000 requests per second of
+** CPU; on a single core shared with the bus daemon and the clients the
+** whole setup does about 10000 requests per second.
+*/
+
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libplayback/playback.h"
+
+#define MANAGER_SERVICE    "org.maemo.Playback.Manager"
+#define MANAGER_PATH       "/org/maemo/Playback/Manager"
+#define MANAGER_INTERFACE  "org.maemo.Playback.Manager"
+#define PLAYBACK_INTERFACE "org.maemo.Playback"
+#define DENIED_ERROR       "org.maemo.Error.RequestDenied"
+
+#define CLIENT_MATCH \
+  "type='signal',sender='" DBUS_SERVICE_DBUS "',member='NameOwnerChanged'," \
+  "arg2=''"
+#define PLAYBACK_MATCH "type='signal',interface='" PLAYBACK_INTERFACE "'"
+#define NOTIFY_MATCH \
+  "type='signal',interface='" DBUS_INTERFACE_PROPERTIES "',member='Notify'"
+#define OBJECT_MANAGER_INTERFACE "org.freedesktop.DBus.ObjectManager"
+#define OBJECTS_MATCH \
+  "type='signal',interface='" OBJECT_MANAGER_INTERFACE "',path='/org/maemo'"
+
+#define CLASS_BIT(pb_class) (1U << (pb_class))
+#define STATE_BIT(pb_state) (1U << (pb_state))
+
+#define MEDIA_CLASSES \
+  (CLASS_BIT(PB_CLASS_MEDIA) | CLASS_BIT(PB_CLASS_GAME) | \
+   CLASS_BIT(PB_CLASS_FLASH) | CLASS_BIT(PB_CLASS_BACKGROUND))
+
+/* the defaults of the library, see connection.c and policy.c */
+static const uint8_t default_priority[PB_CLASS_LAST] = {
+  [PB_CLASS_NONE] = 2,
+  [PB_CLASS_TEST] = 2,
+  [PB_CLASS_EVENT] = 4,
+  [PB_CLASS_VOIP] = 7,
+  [PB_CLASS_MEDIA] = 2,
+  [PB_CLASS_BACKGROUND] = 0,
+  [PB_CLASS_RINGTONE] = 6,
+  [PB_CLASS_VOICEUI] = 4,
+  [PB_CLASS_CAMERA] = 3,
+  [PB_CLASS_GAME] = 2,
+  [PB_CLASS_ALARM] = 6,
+  [PB_CLASS_FLASH] = 2,
+  [PB_CLASS_SYSTEM] = 4,
+  [PB_CLASS_INPUT] = 4,
+};
+
+static const uint32_t default_preempts[PB_CLASS_LAST] = {
+  [PB_CLASS_VOIP] = MEDIA_CLASSES | CLASS_BIT(PB_CLASS_RINGTONE) |
+                    CLASS_BIT(PB_CLASS_ALARM) | CLASS_BIT(PB_CLASS_EVENT) |
+                    CLASS_BIT(PB_CLASS_VOICEUI),
+  [PB_CLASS_RINGTONE] = MEDIA_CLASSES,
+  [PB_CLASS_ALARM] = MEDIA_CLASSES,
+  [PB_CLASS_MEDIA] = MEDIA_CLASSES,
+  [PB_CLASS_GAME] = MEDIA_CLASSES,
+  [PB_CLASS_FLASH] = MEDIA_CLASSES,
+};
+
+enum setting_e
+{
+  SETTING_MUTE,
+  SETTING_PRIVACY,
+  SETTING_BLUETOOTH,
+  SETTING_LAST
+};
+
+static const struct
+{
+  const char *request;
+  const char *get;
+  const char *name;             /* signal and property */
+  int type;
+} settings_table[SETTING_LAST] = {
+  {"RequestMute", "GetMute", "Mute", DBUS_TYPE_BOOLEAN},
+  {"RequestPrivacyOverride", "GetPrivacyOverride", "PrivacyOverride",
+   DBUS_TYPE_BOOLEAN},
+  {"RequestBluetoothOverride", "GetBluetoothOverride", "BluetoothOverride",
+   DBUS_TYPE_INT32}
+};
+
+typedef struct entry_s entry_t;
+typedef struct table_s table_t;
+typedef struct client_s client_t;
+typedef struct deferred_s deferred_t;
+typedef struct playback_s playback_t;
+typedef struct alias_s alias_t;
+
+/* Head of the hashed objects */
+struct entry_s
+{
+  entry_t *next;
+  uint32_t hash;
+};
+
+struct table_s
+{
+  entry_t **buckets;
+  uint32_t mask;
+  uint32_t n;
+};
+
+struct client_s
+{
+  entry_t entry;
+  char *name;
+  playback_t *playbacks;
+};
+
+/* A second connection of a client, from RegisterPeer: the calls from
+ * @name are for the playbacks of @client */
+struct alias_s
+{
+  entry_t entry;
+  char *name;
+  char *client;
+};
+
+/* A call that waits for the class of a playback */
+struct deferred_s
+{
+  deferred_t *next;
+  DBusMessage *message;
+};
+
+struct playback_s
+{
+  entry_t entry;
+  client_t *client;
+  char *path;
+  int pb_class;                 /* -1 until fetched */
+  enum pb_state_e pb_state;
+  playback_t *client_next;
+  playback_t **client_prev;
+  playback_t *playing_next;
+  playback_t **playing_prev;
+  DBusPendingCall *fetch;
+  deferred_t *deferred;
+};
+
+typedef struct
+{
+  playback_t *playing;
+  unsigned int n_playing;
+  unsigned int allowed;         /* announced, STATE_BIT()s */
+} class_t;
+
+static struct
+{
+  DBusConnection *bus;
+  pb_board_t *board;
+  table_t clients;
+  table_t aliases;
+  table_t playbacks;
+  class_t classes[PB_CLASS_LAST];
+  uint8_t priority[PB_CLASS_LAST];
+  uint32_t preempts[PB_CLASS_LAST];
+  int allowed_dirty;
+  int settings[SETTING_LAST];
+  int announced[SETTING_LAST];
+} manager;
+
+static struct
+{
+  unsigned long requests;
+  unsigned long denied;
+  unsigned long preempted;
+  unsigned long deferred;
+  unsigned long signals;
+  unsigned long iterations;
+  unsigned long playbacks;
+} stats;
+
+static volatile sig_atomic_t running = TRUE;
+
+static uint32_t
+_hash(uint32_t hash,
+      const char *s)
+{
+  while (*s)
+    hash = (hash ^ (unsigned char)*s++) * 16777619U;
+
+  return hash;
+}
+
+static uint32_t
+_playback_hash(const char *name,
+               const char *path)
+{
+  return _hash(_hash(2166136261U, name) * 16777619U, path);
+}
+
+static int
+_table_insert(table_t *table,
+              entry_t *entry)
+{
+  if (table->n >= table->mask)
+  {
+    uint32_t size = table->buckets ? 2 * (table->mask + 1) : 64;
+    entry_t **buckets = (entry_t **)calloc(size, sizeof(entry_t *));
+    uint32_t i;
+
+    if (!buckets)
+      return FALSE;
+
+    for (i = 0; table->buckets && i <= table->mask; i++)
+    {
+      entry_t *e, *next;
+
+      for (e = table->buckets[i]; e; e = next)
+      {
+        next = e->next;
+        e->next = buckets[e->hash & (size - 1)];
+        buckets[e->hash & (size - 1)] = e;
+      }
+    }
+
+    free(table->buckets);
+    table->buckets = buckets;
+    table->mask = size - 1;
+  }
+
+  entry->next = table->buckets[entry->hash & table->mask];
+  table->buckets[entry->hash & table->mask] = entry;
+  table->n++;
+
+  return TRUE;
+}
+
+static void
+_table_remove(table_t *table,
+              entry_t *entry)
+{
+  entry_t **e;
+
+  for (e = &table->buckets[entry->hash & table->mask]; *e; e = &(*e)->next)
+  {
+    if (*e == entry)
+    {
+      *e = entry->next;
+      table->n--;
+      return;
+    }
+  }
+}
+
+static client_t *
+_client_get(const char *name,
+            int create)
+{
+  uint32_t hash = _hash(2166136261U, name);
+  client_t *client;
+  entry_t *e;
+
+  for (e = manager.clients.buckets ?
+           manager.clients.buckets[hash & manager.clients.mask] : NULL;
+       e; e = e->next)
+  {
+    client = (client_t *)e;
+
+    if (e->hash == hash && !strcmp(client->name, name))
+      return client;
+  }
+
+  if (!create || !(client = (client_t *)calloc(1, sizeof(client_t))))
+    return NULL;
+
+  client->entry.hash = hash;
+
+  if (!(client->name = strdup(name)) ||
+      !_table_insert(&manager.clients, &client->entry))
+  {
+    free(client->name);
+    free(client);
+    return NULL;
+  }
+
+  return client;
+}
+
+static alias_t *
+_alias_lookup(const char *name)
+{
+  uint32_t hash = _hash(2166136261U, name);
+  entry_t *e;
+
+  for (e = manager.aliases.buckets ?
+           manager.aliases.buckets[hash & manager.aliases.mask] : NULL;
+       e; e = e->next)
+  {
+    if (e->hash == hash && !strcmp(((alias_t *)e)->name, name))
+      return (alias_t *)e;
+  }
+
+  return NULL;
+}
+
+static void
+_alias_free(alias_t *alias)
+{
+  _table_remove(&manager.aliases, &alias->entry);
+  free(alias->name);
+  free(alias->client);
+  free(alias);
+}
+
+/* Drops the aliases of a name that left the bus, from it or to it */
+static void
+_alias_forget(const char *name)
+{
+  alias_t *alias;
+  uint32_t i;
+
+  if ((alias = _alias_lookup(name)))
+    _alias_free(alias);
+
+  for (i = 0; manager.aliases.n && i <= manager.aliases.mask; i++)
+  {
+    entry_t *e, *next;
+
+    for (e = manager.aliases.buckets[i]; e; e = next)
+    {
+      next = e->next;
+
+      if (!strcmp(((alias_t *)e)->client, name))
+        _alias_free((alias_t *)e);
+    }
+  }
+}
+
+/* The client a call is for: its sender, or the client it registered as
+ * the peer of */
+static const char *
+_caller(DBusMessage *message)
+{
+  const char *sender = dbus_message_get_sender(message);
+  alias_t *alias;
+
+  if (sender && (alias = _alias_lookup(sender)))
+    return alias->client;
+
+  return sender;
+}
+
+static playback_t *
+_playback_lookup(const char *name,
+                 const char *path)
+{
+  uint32_t hash = _playback_hash(name, path);
+  entry_t *e;
+
+  for (e = manager.playbacks.buckets ?
+           manager.playbacks.buckets[hash & manager.playbacks.mask] : NULL;
+       e; e = e->next)
+  {
+    playback_t *p = (playback_t *)e;
+
+    if (e->hash == hash && !strcmp(p->path, path) &&
+        !strcmp(p->client->name, name))
+      return p;
+  }
+
+  return NULL;
+}
+
+/* The allowed states of a class, from the playing classes that preempt
+ * it */
+static unsigned int
+_class_allowed(int pb_class)
+{
+  int other;
+
+  for (other = 0; other < PB_CLASS_LAST; other++)
+  {
+    if (manager.classes[other].n_playing &&
+        (manager.preempts[other] & CLASS_BIT(pb_class)) &&
+        manager.priority[other] > manager.priority[pb_class])
+      return STATE_BIT(PB_STATE_STOP);
+  }
+
+  return STATE_BIT(PB_STATE_STOP) | STATE_BIT(PB_STATE_PLAY);
+}
+
+static void
+_playback_set_state(playback_t *p,
+                    enum pb_state_e pb_state)
+{
+  class_t *cls;
+
+  if (p->pb_class < 0 || pb_state == p->pb_state)
+  {
+    p->pb_state = pb_state;
+    return;
+  }
+
+  cls = &manager.classes[p->pb_class];
+
+  if (pb_state == PB_STATE_PLAY)
+  {
+    if ((p->playing_next = cls->playing))
+      cls->playing->playing_prev = &p->playing_next;
+
+    cls->playing = p;
+    p->playing_prev = &cls->playing;
+    manager.allowed_dirty |= !cls->n_playing++;
+  }
+  else if (p->pb_state == PB_STATE_PLAY)
+  {
+    if ((*p->playing_prev = p->playing_next))
+      p->playing_next->playing_prev = p->playing_prev;
+
+    manager.allowed_dirty |= !--cls->n_playing;
+  }
+
+  p->pb_state = pb_state;
+}
+
+static void
+_reply_error(DBusMessage *message,
+             const char *name,
+             const char *text)
+{
+  DBusMessage *reply;
+
+  if (dbus_message_get_no_reply(message) ||
+      !(reply = dbus_message_new_error(message, name, text)))
+    return;
+
+  dbus_connection_send(manager.bus, reply, NULL);
+  dbus_message_unref(reply);
+}
+
+static void
+_reply(DBusMessage *message,
+       int first_type,
+       ...)
+{
+  DBusMessage *reply;
+  va_list args;
+
+  if (dbus_message_get_no_reply(message) ||
+      !(reply = dbus_message_new_method_return(message)))
+    return;
+
+  va_start(args, first_type);
+
+  if (dbus_message_append_args_valist(reply, first_type, args))
+    dbus_connection_send(manager.bus, reply, NULL);
+
+  va_end(args);
+  dbus_message_unref(reply);
+}
+
+static void
+_playback_free(playback_t *p)
+{
+  deferred_t *d;
+
+  _playback_set_state(p, PB_STATE_STOP);
+  _table_remove(&manager.playbacks, &p->entry);
+
+  if ((*p->client_prev = p->client_next))
+    p->client_next->client_prev = p->client_prev;
+
+  if (p->fetch)
+  {
+    dbus_pending_call_cancel(p->fetch);
+    dbus_pending_call_unref(p->fetch);
+  }
+
+  while ((d = p->deferred))
+  {
+    p->deferred = d->next;
+    _reply_error(d->message, DBUS_ERROR_UNKNOWN_OBJECT, "Playback is gone");
+    dbus_message_unref(d->message);
+    free(d);
+  }
+
+  free(p->path);
+  free(p);
+}
+
+static void
+_client_free(client_t *client)
+{
+  while (client->playbacks)
+    _playback_free(client->playbacks);
+
+  _table_remove(&manager.clients, &client->entry);
+  free(client->name);
+  free(client);
+}
+
+static void _manager_call(DBusMessage *message);
+
+/* The Class and State in the a{sv} of the properties at @iter, whose
+ * signature the caller checked */
+static void
+_playback_properties(playback_t *p,
+                     DBusMessageIter *iter,
+                     enum pb_state_e *pb_state)
+{
+  DBusMessageIter array, entry, value;
+
+  if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY)
+    return;
+
+  for (dbus_message_iter_recurse(iter, &array);
+       dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_DICT_ENTRY;
+       dbus_message_iter_next(&array))
+  {
+    const char *name, *s;
+
+    dbus_message_iter_recurse(&array, &entry);
+    dbus_message_iter_get_basic(&entry, &name);
+    dbus_message_iter_next(&entry);
+    dbus_message_iter_recurse(&entry, &value);
+
+    if (dbus_message_iter_get_arg_type(&value) != DBUS_TYPE_STRING)
+      continue;
+
+    dbus_message_iter_get_basic(&value, &s);
+
+    if (!strcmp(name, "Class"))
+      p->pb_class = pb_string_to_class(s);
+    else if (!strcmp(name, "State"))
+      *pb_state = pb_string_to_state(s);
+  }
+}
+
+/* Its calls are run again with the class known, or PB_CLASS_NONE if the
+ * client would not say */
+static void
+_playback_known(playback_t *p,
+                enum pb_state_e pb_state)
+{
+  deferred_t *d;
+
+  /* what the client reported, unless it notified a change since */
+  if (p->pb_state != PB_STATE_NONE)
+    pb_state = p->pb_state;
+
+  p->pb_state = PB_STATE_NONE;
+  _playback_set_state(p, pb_state);
+
+  while ((d = p->deferred))
+  {
+    p->deferred = d->next;
+    _manager_call(d->message);
+    dbus_message_unref(d->message);
+    free(d);
+  }
+}
+
+/* The properties of a playback, from GetAll */
+static void
+_playback_fetched(DBusPendingCall *pending,
+                  void *user_data)
+{
+  playback_t *p = (playback_t *)user_data;
+  DBusMessage *reply = dbus_pending_call_steal_reply(pending);
+  enum pb_state_e pb_state = PB_STATE_STOP;
+  DBusMessageIter iter;
+
+  p->pb_class = PB_CLASS_NONE;
+
+  /* anything but a{sv} is a failed fetch, the client is not trusted */
+  if (reply && dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+      dbus_message_has_signature(reply, "a{sv}") &&
+      dbus_message_iter_init(reply, &iter))
+    _playback_properties(p, &iter, &pb_state);
+
+  if (reply)
+    dbus_message_unref(reply);
+
+  dbus_pending_call_unref(p->fetch);
+  p->fetch = NULL;
+  _playback_known(p, pb_state);
+}
+
+static void
+_playback_fetch(playback_t *p)
+{
+  const char *iface = PLAYBACK_INTERFACE;
+  DBusMessage *message;
+
+  message = dbus_message_new_method_call(p->client->name, p->path,
+                                         DBUS_INTERFACE_PROPERTIES, "GetAll");
+
+  if (message &&
+      dbus_message_append_args(message,
+                               DBUS_TYPE_STRING, &iface,
+                               DBUS_TYPE_INVALID) &&
+      dbus_connection_send_with_reply(manager.bus, message, &p->fetch, -1) &&
+      p->fetch)
+    dbus_pending_call_set_notify(p->fetch, _playback_fetched, p, NULL);
+  else
+    p->pb_class = PB_CLASS_NONE;
+
+  if (message)
+    dbus_message_unref(message);
+}
+
+static playback_t *
+_playback_new(const char *name,
+              const char *path)
+{
+  playback_t *p;
+  client_t *client;
+
+  if (!(client = _client_get(name, TRUE)) ||
+      !(p = (playback_t *)calloc(1, sizeof(playback_t))))
+    return NULL;
+
+  p->entry.hash = _playback_hash(name, path);
+  p->client = client;
+  p->pb_class = -1;
+  p->pb_state = PB_STATE_NONE;
+
+  if (!(p->path = strdup(path)) ||
+      !_table_insert(&manager.playbacks, &p->entry))
+  {
+    free(p->path);
+    free(p);
+    return NULL;
+  }
+
+  if ((p->client_next = client->playbacks))
+    client->playbacks->client_prev = &p->client_next;
+
+  client->playbacks = p;
+  p->client_prev = &client->playbacks;
+  stats.playbacks++;
+
+  return p;
+}
+
+static playback_t *
+_playback_get(const char *name,
+              const char *path)
+{
+  playback_t *p;
+
+  if ((p = _playback_lookup(name, path)))
+    return p;
+
+  if ((p = _playback_new(name, path)))
+    _playback_fetch(p);
+
+  return p;
+}
+
+/* InterfacesAdded carries the properties, nothing to fetch */
+static void
+_playback_added(const char *name,
+                DBusMessage *message)
+{
+  enum pb_state_e pb_state = PB_STATE_STOP;
+  DBusMessageIter iter, array, entry;
+  const char *path, *iface;
+  playback_t *p;
+
+  if (!dbus_message_has_signature(message, "oa{sa{sv}}") ||
+      !dbus_message_iter_init(message, &iter))
+    return;
+
+  dbus_message_iter_get_basic(&iter, &path);
+  dbus_message_iter_next(&iter);
+
+  if (_playback_lookup(name, path))
+    return;
+
+  for (dbus_message_iter_recurse(&iter, &array);
+       dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_DICT_ENTRY;
+       dbus_message_iter_next(&array))
+  {
+    dbus_message_iter_recurse(&array, &entry);
+    dbus_message_iter_get_basic(&entry, &iface);
+    dbus_message_iter_next(&entry);
+
+    if (strcmp(iface, PLAYBACK_INTERFACE) || !(p = _playback_new(name, path)))
+      continue;
+
+    p->pb_class = PB_CLASS_NONE;
+    _playback_properties(p, &entry, &pb_state);
+    _playback_known(p, pb_state);
+    return;
+  }
+}
+
+/* FALSE if @message has to wait for the class of @p */
+static int
+_playback_ready(playback_t *p,
+                DBusMessage *message)
+{
+  deferred_t *d, **last;
+
+  if (p->pb_class >= 0)
+    return TRUE;
+
+  if (!(d = (deferred_t *)calloc(1, sizeof(deferred_t))))
+  {
+    _reply_error(message, DBUS_ERROR_NO_MEMORY, "Out of memory");
+    return FALSE;
+  }
+
+  for (last = &p->deferred; *last; last = &(*last)->next)
+    ;
+
+  d->message = dbus_message_ref(message);
+  *last = d;
+  stats.deferred++;
+
+  return FALSE;
+}
+
+static void
+_playback_stop(playback_t *p)
+{
+  const char *iface = PLAYBACK_INTERFACE;
+  const char *prop = "State";
+  const char *state = pb_state_to_string(PB_STATE_STOP);
+  DBusMessage *message;
+
+  message = dbus_message_new_method_call(p->client->name, p->path,
+                                         DBUS_INTERFACE_PROPERTIES, "Set");
+
+  if (message &&
+      dbus_message_append_args(message,
+                               DBUS_TYPE_STRING, &iface,
+                               DBUS_TYPE_STRING, &prop,
+                               DBUS_TYPE_STRING, &state,
+                               DBUS_TYPE_INVALID))
+    dbus_connection_send(manager.bus, message, NULL);
+
+  if (message)
+    dbus_message_unref(message);
+
+  _playback_set_state(p, PB_STATE_STOP);
+  stats.preempted++;
+}
+
+/* The state granted to @p, PB_STATE_NONE if denied */
+static enum pb_state_e
+_playback_decide(playback_t *p,
+                 enum pb_state_e pb_state,
+                 const char **reason)
+{
+  uint8_t priority = manager.priority[p->pb_class];
+  int other;
+
+  stats.requests++;
+
+  if (pb_state == PB_STATE_NONE || pb_state >= PB_STATE_LAST)
+  {
+    *reason = "Unknown state";
+    stats.denied++;
+    return PB_STATE_NONE;
+  }
+
+  if (pb_state == PB_STATE_PLAY)
+  {
+    if (!(_class_allowed(p->pb_class) & STATE_BIT(PB_STATE_PLAY)))
+    {
+      *reason = "Preempted by a higher priority playback";
+      stats.denied++;
+      return PB_STATE_NONE;
+    }
+
+    for (other = 0; other < PB_CLASS_LAST; other++)
+    {
+      playback_t *q, *next;
+
+      if (!(manager.preempts[p->pb_class] & CLASS_BIT(other)) ||
+          manager.priority[other] > priority)
+        continue;
+
+      for (q = manager.classes[other].playing; q; q = next)
+      {
+        next = q->playing_next;
+
+        if (q != p)
+          _playback_stop(q);
+      }
+    }
+  }
+
+  _playback_set_state(p, pb_state);
+
+  return pb_state;
+}
+
+static void
+_manager_request_state(DBusMessage *message)
+{
+  const char *path, *state, *pid, *stream, *reason = NULL;
+  enum pb_state_e pb_state;
+  playback_t *p;
+
+  if (!dbus_message_get_args(message, NULL,
+                             DBUS_TYPE_OBJECT_PATH, &path,
+                             DBUS_TYPE_STRING, &state,
+                             DBUS_TYPE_STRING, &pid,
+                             DBUS_TYPE_STRING, &stream,
+                             DBUS_TYPE_INVALID))
+  {
+    _reply_error(message, DBUS_ERROR_INVALID_ARGS, "Expected (osss)");
+    return;
+  }
+
+  if (!(p = _playback_get(_caller(message), path)))
+  {
+    _reply_error(message, DBUS_ERROR_NO_MEMORY, "Out of memory");
+    return;
+  }
+
+  if (!_playback_ready(p, message))
+    return;
+
+  pb_state = _playback_decide(p, pb_string_to_state(state), &reason);
+
+  if (pb_state == PB_STATE_NONE)
+  {
+    _reply_error(message, DENIED_ERROR, reason);
+    return;
+  }
+
+  state = pb_state_to_string(pb_state);
+  _reply(message, DBUS_TYPE_STRING, &state, DBUS_TYPE_INVALID);
+}
+
+/* Calls @func on the playbacks of a RequestStates array, until it
+ * returns FALSE */
+static int
+_manager_foreach_state(DBusMessage *message,
+                       int (*func)(DBusMessage *message, playback_t *p,
+                                   const char *state, void *data),
+                       void *data)
+{
+  DBusMessageIter iter, array, entry;
+  const char *path, *state;
+  playback_t *p;
+
+  dbus_message_iter_init(message, &iter);
+
+  for (dbus_message_iter_recurse(&iter, &array);
+       dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT;
+       dbus_message_iter_next(&array))
+  {
+    dbus_message_iter_recurse(&array, &entry);
+    dbus_message_iter_get_basic(&entry, &path);
+    dbus_message_iter_next(&entry);
+    dbus_message_iter_get_basic(&entry, &state);
+
+    if (!(p = _playback_get(_caller(message), path)))
+    {
+      _reply_error(message, DBUS_ERROR_NO_MEMORY, "Out of memory");
+      return FALSE;
+    }
+
+    if (!func(message, p, state, data))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static int
+_manager_states_ready(DBusMessage *message,
+                      playback_t *p,
+                      const char *state,
+                      void *data)
+{
+  return _playback_ready(p, message);
+}
+
+static int
+_manager_states_decide(DBusMessage *message,
+                       playback_t *p,
+                       const char *state,
+                       void *data)
+{
+  DBusMessageIter *array = (DBusMessageIter *)data;
+  const char *reason;
+
+  state = pb_state_to_string(_playback_decide(p, pb_string_to_state(state),
+                                              &reason));
+
+  return dbus_message_iter_append_basic(array, DBUS_TYPE_STRING, &state);
+}
+
+static void
+_manager_request_states(DBusMessage *message)
+{
+  DBusMessageIter iter, array;
+  DBusMessage *reply;
+
+  if (strcmp(dbus_message_get_signature(message), "a(osss)"))
+  {
+    _reply_error(message, DBUS_ERROR_INVALID_ARGS, "Expected a(osss)");
+    return;
+  }
+
+  /* all the classes are known before anything is decided */
+  if (!_manager_foreach_state(message, _manager_states_ready, NULL))
+    return;
+
+  if (!(reply = dbus_message_new_method_return(message)))
+    return;
+
+  dbus_message_iter_init_append(reply, &iter);
+
+  if (dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s", &array))
+  {
+    _manager_foreach_state(message, _manager_states_decide, &array);
+    dbus_message_iter_close_container(&iter, &array);
+
+    if (!dbus_message_get_no_reply(message))
+      dbus_connection_send(manager.bus, reply, NULL);
+  }
+
+  dbus_message_unref(reply);
+}
+
+static int
+_append_states(DBusMessageIter *iter,
+               unsigned int allowed)
+{
+  DBusMessageIter array;
+  int pb_state;
+
+  if (!dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "s", &array))
+    return FALSE;
+
+  for (pb_state = 0; pb_state < PB_STATE_LAST; pb_state++)
+  {
+    const char *s = pb_state_to_string(pb_state);
+
+    if ((allowed & STATE_BIT(pb_state)) &&
+        !dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING, &s))
+      return FALSE;
+  }
+
+  return dbus_message_iter_close_container(iter, &array);
+}
+
+static void
+_manager_get_allowed_state(DBusMessage *message)
+{
+  DBusMessageIter iter;
+  DBusMessage *reply;
+  const char *path;
+  playback_t *p;
+
+  if (!dbus_message_get_args(message, NULL,
+                             DBUS_TYPE_OBJECT_PATH, &path,
+                             DBUS_TYPE_INVALID))
+  {
+    _reply_error(message, DBUS_ERROR_INVALID_ARGS, "Expected (o)");
+    return;
+  }
+
+  if (!(p = _playback_get(_caller(message), path)))
+  {
+    _reply_error(message, DBUS_ERROR_NO_MEMORY, "Out of memory");
+    return;
+  }
+
+  if (!_playback_ready(p, message) ||
+      !(reply = dbus_message_new_method_return(message)))
+    return;
+
+  dbus_message_iter_init_append(reply, &iter);
+
+  if (_append_states(&iter, _class_allowed(p->pb_class)))
+    dbus_connection_send(manager.bus, reply, NULL);
+
+  dbus_message_unref(reply);
+}
+
+static void
+_manager_request_setting(DBusMessage *message,
+                         enum setting_e setting)
+{
+  dbus_int32_t i = 0;
+  dbus_bool_t b = FALSE;
+  int ok;
+
+  if (settings_table[setting].type == DBUS_TYPE_BOOLEAN)
+    ok = dbus_message_get_args(message, NULL, DBUS_TYPE_BOOLEAN, &b,
+                               DBUS_TYPE_INVALID);
+  else
+    ok = dbus_message_get_args(message, NULL, DBUS_TYPE_INT32, &i,
+                               DBUS_TYPE_INVALID);
+
+  if (!ok)
+  {
+    _reply_error(message, DBUS_ERROR_INVALID_ARGS, "Invalid setting");
+    return;
+  }
+
+  manager.settings[setting] =
+      settings_table[setting].type == DBUS_TYPE_BOOLEAN ? !!b : i;
+  _reply(message, DBUS_TYPE_INVALID);
+}
+
+static void
+_manager_get_setting(DBusMessage *message,
+                     enum setting_e setting)
+{
+  dbus_bool_t b = manager.settings[setting];
+  dbus_int32_t i = manager.settings[setting];
+
+  if (settings_table[setting].type == DBUS_TYPE_BOOLEAN)
+    _reply(message, DBUS_TYPE_BOOLEAN, &b, DBUS_TYPE_INVALID);
+  else
+    _reply(message, DBUS_TYPE_INT32, &i, DBUS_TYPE_INVALID);
+}
+
+static void
+_manager_get_all(DBusMessage *message)
+{
+  DBusMessageIter iter, array, entry, value;
+  DBusMessage *reply;
+  const char *iface;
+  int setting;
+
+  if (!dbus_message_get_args(message, NULL,
+                             DBUS_TYPE_STRING, &iface,
+                             DBUS_TYPE_INVALID) ||
+      strcmp(iface, MANAGER_INTERFACE))
+  {
+    _reply_error(message, DBUS_ERROR_INVALID_ARGS, "Unknown interface");
+    return;
+  }
+
+  if (!(reply = dbus_message_new_method_return(message)))
+    return;
+
+  dbus_message_iter_init_append(reply, &iter);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}", &array);
+
+  for (setting = 0; setting < SETTING_LAST; setting++)
+  {
+    dbus_bool_t b = manager.settings[setting];
+    dbus_int32_t i = manager.settings[setting];
+    int type = settings_table[setting].type;
+    char signature[2] = {type, '\0'};
+
+    dbus_message_iter_open_container(&array, DBUS_TYPE_DICT_ENTRY, NULL,
+                                     &entry);
+    dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+                                   &settings_table[setting].name);
+    dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, signature,
+                                     &value);
+    dbus_message_iter_append_basic(&value, type,
+                                   type == DBUS_TYPE_BOOLEAN ?
+                                   (void *)&b : (void *)&i);
+    dbus_message_iter_close_container(&entry, &value);
+    dbus_message_iter_close_container(&array, &entry);
+  }
+
+  dbus_message_iter_close_container(&iter, &array);
+  dbus_connection_send(manager.bus, reply, NULL);
+  dbus_message_unref(reply);
+}
+
+static void
+_manager_get_board(DBusMessage *message)
+{
+  int fd;
+
+  if (!manager.board || (fd = pb_board_get_fd(manager.board)) < 0)
+  {
+    _reply_error(message, DBUS_ERROR_NOT_SUPPORTED, "No state board");
+    return;
+  }
+
+  _reply(message, DBUS_TYPE_UNIX_FD, &fd, DBUS_TYPE_INVALID);
+}
+
+/* The process of a bus name, or (unsigned long)-1 if the bus does not
+ * know it */
+static unsigned long
+_unix_process(const char *name)
+{
+  DBusMessage *message, *reply = NULL;
+  dbus_uint32_t pid = (dbus_uint32_t)-1;
+
+  if ((message = dbus_message_new_method_call(DBUS_SERVICE_DBUS,
+                                              DBUS_PATH_DBUS,
+                                              DBUS_INTERFACE_DBUS,
+                                              "GetConnectionUnixProcessID")) &&
+      dbus_message_append_args(message, DBUS_TYPE_STRING, &name,
+                               DBUS_TYPE_INVALID))
+    reply = dbus_connection_send_with_reply_and_block(manager.bus, message,
+                                                      -1, NULL);
+
+  if (reply &&
+      !dbus_message_get_args(reply, NULL, DBUS_TYPE_UINT32, &pid,
+                             DBUS_TYPE_INVALID))
+    pid = (dbus_uint32_t)-1;
+
+  if (reply)
+    dbus_message_unref(reply);
+
+  if (message)
+    dbus_message_unref(message);
+
+  return pid == (dbus_uint32_t)-1 ? (unsigned long)-1 : pid;
+}
+
+/* Whether two bus names are the same process, or the same user where
+ * the bus cannot tell the processes.  The calls block, on the bus
+ * daemon only, once per client registering a peer. */
+static int
+_same_owner(const char *a,
+            const char *b)
+{
+  unsigned long x = _unix_process(a), y;
+
+  if (x != (unsigned long)-1 && (y = _unix_process(b)) != (unsigned long)-1)
+    return x == y;
+
+  x = dbus_bus_get_unix_user(manager.bus, a, NULL);
+  y = dbus_bus_get_unix_user(manager.bus, b, NULL);
+
+  return x != (unsigned long)-1 && x == y;
+}
+
+/* A connection may only stand for a client of its own process, or of
+ * its own user, or it could request and preempt the playbacks of
+ * anyone else */
+static void
+_manager_register_peer(DBusMessage *message)
+{
+  const char *sender = dbus_message_get_sender(message);
+  const char *client;
+  alias_t *alias;
+
+  if (!sender ||
+      !dbus_message_get_args(message, NULL,
+                             DBUS_TYPE_STRING, &client,
+                             DBUS_TYPE_INVALID))
+  {
+    _reply_error(message, DBUS_ERROR_INVALID_ARGS, "Expected (s)");
+    return;
+  }
+
+  if (strcmp(sender, client) && !_same_owner(sender, client))
+  {
+    _reply_error(message, DBUS_ERROR_ACCESS_DENIED,
+                 "Not a connection of the same process or user");
+    return;
+  }
+
+  if ((alias = _alias_lookup(sender)))
+    _alias_free(alias);
+
+  if (strcmp(sender, client))
+  {
+    if (!(alias = (alias_t *)calloc(1, sizeof(alias_t))))
+    {
+      _reply_error(message, DBUS_ERROR_NO_MEMORY, "Out of memory");
+      return;
+    }
+
+    alias->entry.hash = _hash(2166136261U, sender);
+    alias->name = strdup(sender);
+    alias->client = strdup(client);
+
+    if (!alias->name || !alias->client ||
+        !_table_insert(&manager.aliases, &alias->entry))
+    {
+      free(alias->name);
+      free(alias->client);
+      free(alias);
+      _reply_error(message, DBUS_ERROR_NO_MEMORY, "Out of memory");
+      return;
+    }
+  }
+
+  _reply(message, DBUS_TYPE_INVALID);
+}
+
+/* The calls to the manager object; the others, GetPeerAddress included,
+ * get UnknownMethod and the clients stay on the bus */
+static void
+_manager_call(DBusMessage *message)
+{
+  const char *interface = dbus_message_get_interface(message);
+  const char *member = dbus_message_get_member(message);
+  int setting;
+
+  if (!interface || !member)
+    return;
+
+  if (!strcmp(interface, MANAGER_INTERFACE))
+  {
+    if (!strcmp(member, "RequestState"))
+    {
+      _manager_request_state(message);
+      return;
+    }
+
+    if (!strcmp(member, "RequestStates"))
+    {
+      _manager_request_states(message);
+      return;
+    }
+
+    if (!strcmp(member, "GetAllowedState"))
+    {
+      _manager_get_allowed_state(message);
+      return;
+    }
+
+    if (!strcmp(member, "RegisterPeer"))
+    {
+      _manager_register_peer(message);
+      return;
+    }
+
+    if (!strcmp(member, "GetStateBoard"))
+    {
+      _manager_get_board(message);
+      return;
+    }
+
+    for (setting = 0; setting < SETTING_LAST; setting++)
+    {
+      if (!strcmp(member, settings_table[setting].request))
+      {
+        _manager_request_setting(message, setting);
+        return;
+      }
+
+      if (!strcmp(member, settings_table[setting].get))
+      {
+        _manager_get_setting(message, setting);
+        return;
+      }
+    }
+  }
+  else if (!strcmp(interface, DBUS_INTERFACE_PROPERTIES) &&
+           !strcmp(member, "GetAll"))
+  {
+    _manager_get_all(message);
+    return;
+  }
+
+  _reply_error(message, DBUS_ERROR_UNKNOWN_METHOD, member);
+}
+
+static void
+_playback_signal(DBusMessage *message)
+{
+  const char *sender = dbus_message_get_sender(message);
+  const char *path = dbus_message_get_path(message);
+  const char *iface, *prop, *state;
+  playback_t *p;
+
+  if (!sender || !path)
+    return;
+
+  if (dbus_message_is_signal(message, PLAYBACK_INTERFACE, "Goodbye"))
+  {
+    if ((p = _playback_lookup(sender, path)))
+      _playback_free(p);
+  }
+  else if (dbus_message_is_signal(message, OBJECT_MANAGER_INTERFACE,
+                                  "InterfacesAdded"))
+    _playback_added(sender, message);
+  else if (dbus_message_is_signal(message, OBJECT_MANAGER_INTERFACE,
+                                  "InterfacesRemoved"))
+  {
+    /* the playback interface is the only one of the objects */
+    if (dbus_message_get_args(message, NULL,
+                              DBUS_TYPE_OBJECT_PATH, &path,
+                              DBUS_TYPE_INVALID) &&
+        (p = _playback_lookup(sender, path)))
+      _playback_free(p);
+  }
+  else if (dbus_message_is_signal(message, PLAYBACK_INTERFACE, "Hello"))
+    _playback_get(sender, path);
+  else if (dbus_message_get_args(message, NULL,
+                                 DBUS_TYPE_STRING, &iface,
+                                 DBUS_TYPE_STRING, &prop,
+                                 DBUS_TYPE_STRING, &state,
+                                 DBUS_TYPE_INVALID) &&
+           !strcmp(iface, PLAYBACK_INTERFACE) && !strcmp(prop, "State") &&
+           (p = _playback_get(sender, path)))
+    _playback_set_state(p, pb_string_to_state(state));
+}
+
+static DBusHandlerResult
+_manager_filter(DBusConnection *connection,
+                DBusMessage *message,
+                void *user_data)
+{
+  const char *name, *old, *new;
+  client_t *client;
+
+  switch (dbus_message_get_type(message))
+  {
+    case DBUS_MESSAGE_TYPE_METHOD_CALL:
+      if (!dbus_message_has_path(message, MANAGER_PATH))
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+      _manager_call(message);
+      return DBUS_HANDLER_RESULT_HANDLED;
+
+    case DBUS_MESSAGE_TYPE_SIGNAL:
+      if (dbus_message_is_signal(message, DBUS_INTERFACE_DBUS,
+                                 "NameOwnerChanged"))
+      {
+        if (dbus_message_get_args(message, NULL,
+                                  DBUS_TYPE_STRING, &name,
+                                  DBUS_TYPE_STRING, &old,
+                                  DBUS_TYPE_STRING, &new,
+                                  DBUS_TYPE_INVALID) && !*new)
+        {
+          if ((client = _client_get(name, FALSE)))
+            _client_free(client);
+
+          _alias_forget(name);
+        }
+      }
+      else if (dbus_message_has_interface(message, PLAYBACK_INTERFACE) ||
+               dbus_message_has_interface(message,
+                                          OBJECT_MANAGER_INTERFACE) ||
+               dbus_message_is_signal(message, DBUS_INTERFACE_PROPERTIES,
+                                      "Notify"))
+        _playback_signal(message);
+
+      return DBUS_HANDLER_RESULT_HANDLED;
+
+    default:
+      /* the replies to Properties.Set */
+      return DBUS_HANDLER_RESULT_HANDLED;
+  }
+}
+
+static void
+_emit(const char *name,
+      int first_type,
+      ...)
+{
+  DBusMessage *message;
+  va_list args;
+
+  if (!(message = dbus_message_new_signal(MANAGER_PATH, MANAGER_INTERFACE,
+                                          name)))
+    return;
+
+  va_start(args, first_type);
+
+  if (dbus_message_append_args_valist(message, first_type, args) &&
+      dbus_connection_send(manager.bus, message, NULL))
+    stats.signals++;
+
+  va_end(args);
+  dbus_message_unref(message);
+}
+
+static void
+_publish_allowed_state(int pb_class,
+                       unsigned int allowed)
+{
+  int allowed_state[PB_STATE_LAST];
+  int pb_state;
+
+  for (pb_state = 0; pb_state < PB_STATE_LAST; pb_state++)
+    allowed_state[pb_state] = !!(allowed & STATE_BIT(pb_state));
+
+  if (manager.board)
+    pb_board_publish_allowed_state(manager.board, pb_class, allowed_state);
+}
+
+/* Announces what changed since the last iteration */
+static void
+_manager_flush(void)
+{
+  int pb_class, setting, changed = FALSE;
+
+  for (pb_class = 0; manager.allowed_dirty && pb_class < PB_CLASS_LAST;
+       pb_class++)
+  {
+    unsigned int allowed = _class_allowed(pb_class);
+    const char *name = pb_class_to_string(pb_class);
+    DBusMessageIter iter;
+    DBusMessage *message;
+
+    if (allowed == manager.classes[pb_class].allowed)
+      continue;
+
+    manager.classes[pb_class].allowed = allowed;
+    _publish_allowed_state(pb_class, allowed);
+
+    message = dbus_message_new_signal(MANAGER_PATH, MANAGER_INTERFACE,
+                                      "AllowedState");
+
+    if (!message)
+      continue;
+
+    dbus_message_iter_init_append(message, &iter);
+
+    if (dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &name) &&
+        _append_states(&iter, allowed) &&
+        dbus_connection_send(manager.bus, message, NULL))
+      stats.signals++;
+
+    dbus_message_unref(message);
+  }
+
+  manager.allowed_dirty = FALSE;
+
+  for (setting = 0; setting < SETTING_LAST; setting++)
+  {
+    dbus_bool_t b = manager.settings[setting];
+    dbus_int32_t i = manager.settings[setting];
+
+    if (manager.settings[setting] == manager.announced[setting])
+      continue;
+
+    manager.announced[setting] = manager.settings[setting];
+    changed = TRUE;
+
+    if (settings_table[setting].type == DBUS_TYPE_BOOLEAN)
+      _emit(settings_table[setting].name, DBUS_TYPE_BOOLEAN, &b,
+            DBUS_TYPE_INVALID);
+    else
+      _emit(settings_table[setting].name, DBUS_TYPE_INT32, &i,
+            DBUS_TYPE_INVALID);
+  }
+
+  if (changed && manager.board)
+  {
+    pb_board_publish_settings(manager.board,
+                              manager.settings[SETTING_MUTE],
+                              manager.settings[SETTING_PRIVACY],
+                              manager.settings[SETTING_BLUETOOTH]);
+  }
+}
+
+static int
+_table_class(const char *name)
+{
+  enum pb_class_e pb_class = pb_string_to_class(name);
+
+  if (pb_class == PB_CLASS_NONE && strcmp(name, "None"))
+    return -1;
+
+  return pb_class;
+}
+
+/* Lines of "class priority [preempted classes...]", as for
+ * pb_set_local_policy() */
+static int
+_load_table(const char *path)
+{
+  char line[256];
+  long lineno = 0;
+  FILE *file;
+  int ok = TRUE;
+
+  if (!(file = fopen(path, "r")))
+  {
+    perror(path);
+    return FALSE;
+  }
+
+  while (ok && fgets(line, sizeof(line), file))
+  {
+    char *save, *word, *end;
+    int pb_class, other;
+    long value;
+
+    lineno++;
+
+    if (!(word = strtok_r(line, " \t\r\n", &save)) || *word == '#')
+      continue;
+
+    if ((pb_class = _table_class(word)) < 0 ||
+        !(word = strtok_r(NULL, " \t\r\n", &save)))
+    {
+      ok = FALSE;
+      break;
+    }
+
+    value = strtol(word, &end, 10);
+
+    if (*end || value < 0 || value > PB_PRIORITY_MAX)
+    {
+      ok = FALSE;
+      break;
+    }
+
+    manager.priority[pb_class] = value;
+    manager.preempts[pb_class] = 0;
+
+    while ((word = strtok_r(NULL, " \t\r\n", &save)) && *word != '#' &&
+           (other = _table_class(word)) >= 0)
+      manager.preempts[pb_class] |= CLASS_BIT(other);
+
+    ok = !word || *word == '#';
+  }
+
+  fclose(file);
+
+  if (!ok)
+    fprintf(stderr, "pb-manager: %s: error at line %ld\n", path, lineno);
+
+  return ok;
+}
+
+static void
+_stop(int sig)
+{
+  running = FALSE;
+}
+
+int
+main(int argc, char **argv)
+{
+  DBusBusType type = DBUS_BUS_SESSION;
+  const char *table = NULL;
+  struct sigaction sa;
+  DBusError error;
+  int verbose = FALSE;
+  int c, pb_class;
+
+  while ((c = getopt(argc, argv, "c:yv")) != -1)
+  {
+    switch (c)
+    {
+      case 'c':
+        table = optarg;
+        break;
+      case 'y':
+        type = DBUS_BUS_SYSTEM;
+        break;
+      case 'v':
+        verbose = TRUE;
+        break;
+      default:
+        fprintf(stderr, "usage: pb-manager [-c table] [-y] [-v]\n");
+        return 2;
+    }
+  }
+
+  memcpy(manager.priority, default_priority, sizeof(manager.priority));
+  memcpy(manager.preempts, default_preempts, sizeof(manager.preempts));
+
+  if (table && !_load_table(table))
+    return 1;
+
+  dbus_error_init(&error);
+
+  if (!(manager.bus = dbus_bus_get_private(type, &error)))
+  {
+    fprintf(stderr, "pb-manager: %s\n", error.message);
+    return 1;
+  }
+
+  dbus_connection_set_exit_on_disconnect(manager.bus, FALSE);
+
+  if (dbus_bus_request_name(manager.bus, MANAGER_SERVICE,
+                            DBUS_NAME_FLAG_DO_NOT_QUEUE, NULL) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+  {
+    fprintf(stderr, "pb-manager: %s is taken\n", MANAGER_SERVICE);
+    return 1;
+  }
+
+  dbus_bus_add_match(manager.bus, CLIENT_MATCH, NULL);
+  dbus_bus_add_match(manager.bus, PLAYBACK_MATCH, NULL);
+  dbus_bus_add_match(manager.bus, NOTIFY_MATCH, NULL);
+  dbus_bus_add_match(manager.bus, OBJECTS_MATCH, NULL);
+  dbus_connection_add_filter(manager.bus, _manager_filter, NULL, NULL);
+
+  /* everything is allowed until something plays */
+  manager.board = pb_board_create();
+
+  for (pb_class = 0; pb_class < PB_CLASS_LAST; pb_class++)
+  {
+    manager.classes[pb_class].allowed = _class_allowed(pb_class);
+    _publish_allowed_state(pb_class, manager.classes[pb_class].allowed);
+  }
+
+  if (manager.board)
+    pb_board_publish_settings(manager.board, FALSE, FALSE, BT_OVERRIDE_OFF);
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = _stop;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  /* libdbus polls again when interrupted, hence the timeout */
+  while (running && dbus_connection_read_write(manager.bus, 500))
+  {
+    while (dbus_connection_dispatch(manager.bus) ==
+           DBUS_DISPATCH_DATA_REMAINS)
+      ;
+
+    _manager_flush();
+    stats.iterations++;
+  }
+
+  if (verbose)
+  {
+    fprintf(stderr,
+            "pb-manager: %lu requests, %lu denied, %lu preempted, "
+            "%lu deferred, %lu signals, %lu iterations, %lu playbacks\n",
+            stats.requests, stats.denied, stats.preempted, stats.deferred,
+            stats.signals, stats.iterations, stats.playbacks);
+  }
+
+  while (manager.clients.n)
+  {
+    uint32_t i;
+
+    for (i = 0; i <= manager.clients.mask; i++)
+    {
+      while (manager.clients.buckets[i])
+        _client_free((client_t *)manager.clients.buckets[i]);
+    }
+  }
+
+  while (manager.aliases.n)
+  {
+    uint32_t i;
+
+    for (i = 0; i <= manager.aliases.mask; i++)
+    {
+      while (manager.aliases.buckets[i])
+        _alias_free((alias_t *)manager.aliases.buckets[i]);
+    }
+  }
+
+  free(manager.clients.buckets);
+  free(manager.aliases.buckets);
+  free(manager.playbacks.buckets);
+  dbus_connection_close(manager.bus);
+  dbus_connection_unref(manager.bus);
+
+  return 0;
+}
@@ -1,36 +1,22 @@
 #include <dbus/dbus.h>
-#include <string.h>
 
 #include "libplayback/playback.h"
-#include "playback-dbus.h"
+#include "playback-probes.h"
+#include "playback-transport.h"
 
-static PBBluetoothCb _bluetooth_cb = NULL;
-static void *_bluetooth_data = NULL;
-
-static DBusHandlerResult
-_bluetooth_override_filter(DBusConnection *connection, DBusMessage *message,
-                           void *user_data)
+void
+_pb_bluetooth_changed(DBusConnection *connection,
+                      int override)
 {
-  if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_SIGNAL &&
-      !strcmp(dbus_message_get_interface(message),
-              DBUS_PLAYBACK_MANAGER_INTERFACE) &&
-      !strcmp(dbus_message_get_member(message), DBUS_BLUETOOTH_SIGNAL) )
-  {
-    DBusError error;
-    dbus_int32_t status;
-
-    dbus_error_init(&error);
-    dbus_message_get_args(message, &error,
-                          DBUS_TYPE_INT32, &status,
-                          DBUS_TYPE_INVALID);
+  pb_connection_t *conn = _pb_connection_get(connection);
 
-    if (dbus_error_is_set(&error))
-      dbus_error_free(&error);
-    else if (_bluetooth_cb)
-      _bluetooth_cb(status, NULL, _bluetooth_data);
-  }
+  if (!conn || !conn->bluetooth_cb)
+    return;
 
-  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  PB_PROBE_SETTING(bluetooth_override, override);
+  PB_LOG_EVENT(conn, PB_LOG_LEVEL_DEBUG, PB_LOG_NO_OBJECT,
+               "bluetooth override %ld", NULL, override, 0);
+  conn->bluetooth_cb(override, NULL, conn->bluetooth_data);
 }
 
 void
@@ -38,100 +24,44 @@ pb_set_bluetooth_override_cb(DBusConnection *connection,
                              PBBluetoothCb bluetooth_cb,
                              void *data)
 {
-  if (bluetooth_cb)
+  pb_connection_t *conn;
+
+  if (bluetooth_cb && (conn = _pb_connection_get(connection)))
   {
-    _bluetooth_cb = bluetooth_cb;
-    _bluetooth_data = data;
-    dbus_connection_add_filter(connection, _bluetooth_override_filter, 0, 0);
+    conn->bluetooth_cb = bluetooth_cb;
+    conn->bluetooth_data = data;
+    _pb_transport(conn)->watch(connection, 0);
   }
 }
 
 static void
-_request_override_reply(DBusPendingCall *pending, void *user_data)
+_request_override_error(DBusConnection *connection,
+                        const char *error)
 {
-  DBusMessage *reply;
+  pb_connection_t *conn = _pb_connection_get(connection);
 
-  if (!pending)
-    return;
-
-  reply = dbus_pending_call_steal_reply(pending);
-  dbus_pending_call_unref(pending);
-
-  if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR && _bluetooth_cb)
-    _bluetooth_cb(FALSE, dbus_message_get_error_name(reply), _bluetooth_data);
-
-  dbus_message_unref(reply);
+  if (conn && conn->bluetooth_cb)
+    conn->bluetooth_cb(FALSE, error, conn->bluetooth_data);
 }
 
 int
 pb_req_bluetooth_override(DBusConnection *connection,
                           int override)
 {
-  dbus_bool_t ovr = override ? TRUE : FALSE;
-  DBusMessage *message;
-  DBusPendingCall *pending;
-  int rv = FALSE;
-
-  message = dbus_message_new_method_call(DBUS_PLAYBACK_MANAGER_SERVICE,
-                                         DBUS_PLAYBACK_MANAGER_PATH,
-                                         DBUS_PLAYBACK_MANAGER_INTERFACE,
-                                         DBUS_PLAYBACK_REQ_BLUETOOTH_METHOD);
-  if (!message)
-    return FALSE;
-
-  dbus_message_append_args(message,
-                           DBUS_TYPE_BOOLEAN, &ovr,
-                           DBUS_TYPE_INVALID);
-
-  if (dbus_connection_send_with_reply(connection, message, &pending, -1))
-  {
-    dbus_pending_call_set_notify(pending, _request_override_reply, NULL, NULL);
-    rv = TRUE;
-  }
-
-  dbus_message_unref(message);
-
-  return rv;
+  return _pb_setting_request(connection, PB_SETTING_BLUETOOTH, override,
+                             _request_override_error);
 }
 
 static void
-_get_override_reply(DBusPendingCall *pending, void *user_data)
+_get_override_reply(const pb_reply_t *reply, void *data)
 {
-  DBusMessage *reply;
-
-  if (!pending)
-    return;
-
-  reply = dbus_pending_call_steal_reply(pending);
-  dbus_pending_call_unref(pending);
-
-  if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR && _bluetooth_cb)
-    _bluetooth_cb(FALSE, dbus_message_get_error_name(reply), _bluetooth_data);
-
-  dbus_message_unref(reply);
+  if (reply->error)
+    _request_override_error((DBusConnection *)data, reply->error);
 }
 
 int
 pb_get_bluetooth_override(DBusConnection *connection)
 {
-  DBusMessage *message;
-  DBusPendingCall *pending;
-  int rv = FALSE;
-
-  message = dbus_message_new_method_call(DBUS_PLAYBACK_MANAGER_SERVICE,
-                                         DBUS_PLAYBACK_MANAGER_PATH,
-                                         DBUS_PLAYBACK_MANAGER_INTERFACE,
-                                         DBUS_PLAYBACK_GET_BLUETOOTH_METHOD);
-  if (!message)
-    return FALSE;
-
-  if (dbus_connection_send_with_reply(connection, message, &pending, -1))
-  {
-    dbus_pending_call_set_notify(pending, _get_override_reply, NULL, NULL);
-    rv = TRUE;
-  }
-
-  dbus_message_unref(message);
-
-  return rv;
+  return _pb_setting_get(connection, PB_SETTING_BLUETOOTH,
+                         _get_override_reply);
 }
@@ -0,0 +1,428 @@
+#define _GNU_SOURCE
+
+#include <dbus/dbus.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libplayback/playback.h"
+#include "playback-dbus.h"
+#include "playback-private.h"
+
+/* The board is one page of shared memory written by the manager and
+ * mapped read only by the clients.  The layout is shared between
+ * processes built from different versions of the library: only append
+ * fields, and bump BOARD_VERSION for anything else.
+ *
+ * The writer makes seq odd, updates the fields and makes seq even
+ * again; readers copy the fields and retry if seq was odd or changed
+ * meanwhile. */
+#define BOARD_MAGIC 0x42427050 /* "PpBB" */
+#define BOARD_VERSION 1
+#define BOARD_CLASSES 32
+#define BOARD_SIZE 4096
+
+/* a few milliseconds of retries: only a writer that died half way,
+ * leaving seq odd for good, should exhaust them */
+#define BOARD_READ_TRIES 1000000
+
+#define BOARD_VALID_SETTINGS 0x1
+
+typedef struct pb_board_layout_s pb_board_layout_t;
+
+struct pb_board_layout_s
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seq;
+  uint32_t valid;
+  int32_t mute;
+  int32_t privacy_override;
+  int32_t bluetooth_override;
+  uint32_t allowed_valid;
+  uint32_t allowed[BOARD_CLASSES];
+};
+
+struct pb_board_s
+{
+  int fd;
+  int writable;
+  pb_board_layout_t *layout;
+};
+
+typedef struct pb_board_attach_s pb_board_attach_t;
+
+struct pb_board_attach_s
+{
+  DBusConnection *connection;
+  PBBoardCb board_cb;
+  void *data;
+};
+
+#define BOARD_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+#define BOARD_STORE(field, value) \
+  __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+
+static void
+_board_write_begin(pb_board_layout_t *layout)
+{
+  BOARD_STORE(layout->seq, layout->seq + 1);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+_board_write_end(pb_board_layout_t *layout)
+{
+  __atomic_store_n(&layout->seq, layout->seq + 1, __ATOMIC_RELEASE);
+}
+
+static uint32_t
+_board_read_begin(const pb_board_layout_t *layout)
+{
+  return __atomic_load_n(&layout->seq, __ATOMIC_ACQUIRE);
+}
+
+/* TRUE if the fields read since _board_read_begin() must be read again */
+static int
+_board_read_retry(const pb_board_layout_t *layout,
+                  uint32_t seq)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+  return (seq & 1) || BOARD_LOAD(layout->seq) != seq;
+}
+
+pb_board_t *
+pb_board_create(void)
+{
+  pb_board_t *board = (pb_board_t *)calloc(1, sizeof(pb_board_t));
+  void *map;
+
+  if (!board)
+    return NULL;
+
+  board->fd = memfd_create("libplayback-board",
+                           MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+  if (board->fd < 0 || ftruncate(board->fd, BOARD_SIZE) < 0 ||
+      fcntl(board->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0 ||
+      (map = mmap(NULL, BOARD_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  board->fd, 0)) == MAP_FAILED)
+  {
+    if (board->fd >= 0)
+      close(board->fd);
+
+    free(board);
+    return NULL;
+  }
+
+#ifdef F_SEAL_FUTURE_WRITE
+  /* readers get the same fd, keep them from mapping it writable */
+  fcntl(board->fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE);
+#endif
+
+  board->writable = TRUE;
+  board->layout = (pb_board_layout_t *)map;
+  board->layout->magic = BOARD_MAGIC;
+  board->layout->version = BOARD_VERSION;
+
+  return board;
+}
+
+pb_board_t *
+pb_board_open(int fd)
+{
+  pb_board_t *board;
+  struct stat st;
+  int seals;
+  void *map;
+
+  /* a board that can shrink under the readers would SIGBUS them */
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < BOARD_SIZE ||
+      (seals = fcntl(fd, F_GET_SEALS)) < 0 || !(seals & F_SEAL_SHRINK))
+    return NULL;
+
+  if (!(board = (pb_board_t *)calloc(1, sizeof(pb_board_t))))
+    return NULL;
+
+  if ((board->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0 ||
+      (map = mmap(NULL, BOARD_SIZE, PROT_READ, MAP_SHARED, board->fd,
+                  0)) == MAP_FAILED)
+  {
+    if (board->fd >= 0)
+      close(board->fd);
+
+    free(board);
+    return NULL;
+  }
+
+  board->layout = (pb_board_layout_t *)map;
+
+  if (board->layout->magic != BOARD_MAGIC ||
+      board->layout->version != BOARD_VERSION)
+  {
+    pb_board_close(board);
+    return NULL;
+  }
+
+  return board;
+}
+
+void
+pb_board_close(pb_board_t *board)
+{
+  if (!board)
+    return;
+
+  munmap(board->layout, BOARD_SIZE);
+  close(board->fd);
+  free(board);
+}
+
+int
+pb_board_get_fd(pb_board_t *board)
+{
+  return board ? board->fd : -1;
+}
+
+void
+pb_board_publish_allowed_state(pb_board_t *board,
+                               enum pb_class_e pb_class,
+                               const int allowed_state[])
+{
+  uint32_t mask = 0;
+  int state;
+
+  if (!board || !board->writable || !allowed_state ||
+      pb_class < 0 || pb_class >= BOARD_CLASSES)
+    return;
+
+  for (state = PB_STATE_NONE; state < PB_STATE_LAST; state++)
+  {
+    if (allowed_state[state])
+      mask |= 1 << state;
+  }
+
+  _board_write_begin(board->layout);
+  BOARD_STORE(board->layout->allowed[pb_class], mask);
+  BOARD_STORE(board->layout->allowed_valid,
+              board->layout->allowed_valid | 1U << pb_class);
+  _board_write_end(board->layout);
+}
+
+void
+pb_board_publish_settings(pb_board_t *board,
+                          int mute,
+                          int privacy_override,
+                          enum pb_bt_override_status_e bluetooth_override)
+{
+  if (!board || !board->writable)
+    return;
+
+  _board_write_begin(board->layout);
+  BOARD_STORE(board->layout->mute, !!mute);
+  BOARD_STORE(board->layout->privacy_override, !!privacy_override);
+  BOARD_STORE(board->layout->bluetooth_override, bluetooth_override);
+  BOARD_STORE(board->layout->valid,
+              board->layout->valid | BOARD_VALID_SETTINGS);
+  _board_write_end(board->layout);
+}
+
+int
+pb_board_read_allowed_state(pb_board_t *board,
+                            enum pb_class_e pb_class,
+                            int allowed_state[])
+{
+  uint32_t mask, valid, seq;
+  int tries = BOARD_READ_TRIES;
+  int state;
+
+  if (!board || !allowed_state || pb_class < 0 || pb_class >= BOARD_CLASSES)
+    return FALSE;
+
+  do
+  {
+    if (!tries--)
+      return FALSE;
+
+    seq = _board_read_begin(board->layout);
+    valid = BOARD_LOAD(board->layout->allowed_valid);
+    mask = BOARD_LOAD(board->layout->allowed[pb_class]);
+  }
+  while (_board_read_retry(board->layout, seq));
+
+  if (!(valid & 1U << pb_class))
+    return FALSE;
+
+  for (state = PB_STATE_NONE; state < PB_STATE_LAST; state++)
+    allowed_state[state] = !!(mask & 1 << state);
+
+  return TRUE;
+}
+
+int
+pb_board_read_settings(pb_board_t *board,
+                       int *mute,
+                       int *privacy_override,
+                       enum pb_bt_override_status_e *bluetooth_override)
+{
+  int32_t m, p, b;
+  uint32_t valid, seq;
+  int tries = BOARD_READ_TRIES;
+
+  if (!board)
+    return FALSE;
+
+  do
+  {
+    if (!tries--)
+      return FALSE;
+
+    seq = _board_read_begin(board->layout);
+    valid = BOARD_LOAD(board->layout->valid);
+    m = BOARD_LOAD(board->layout->mute);
+    p = BOARD_LOAD(board->layout->privacy_override);
+    b = BOARD_LOAD(board->layout->bluetooth_override);
+  }
+  while (_board_read_retry(board->layout, seq));
+
+  if (!(valid & BOARD_VALID_SETTINGS))
+    return FALSE;
+
+  if (mute)
+    *mute = m;
+
+  if (privacy_override)
+    *privacy_override = p;
+
+  if (bluetooth_override)
+    *bluetooth_override = (enum pb_bt_override_status_e)b;
+
+  return TRUE;
+}
+
+uint32_t
+pb_board_generation(pb_board_t *board)
+{
+  return board ? __atomic_load_n(&board->layout->seq, __ATOMIC_ACQUIRE) : 0;
+}
+
+int
+pb_board_attach_fd(DBusConnection *connection,
+                   int fd)
+{
+  pb_connection_t *conn;
+  pb_board_t *board;
+
+  if (!connection || !(conn = _pb_connection_get(connection)) ||
+      !(board = pb_board_open(fd)))
+    return FALSE;
+
+  pb_board_close(conn->board);
+  conn->board = board;
+
+  return TRUE;
+}
+
+pb_board_t *
+pb_board_get(DBusConnection *connection)
+{
+  pb_connection_t *conn;
+
+  if (!connection || !(conn = _pb_connection_get(connection)))
+    return NULL;
+
+  return conn->board;
+}
+
+static void
+_board_attach_reply(DBusPendingCall *pending,
+                    void *user_data)
+{
+  pb_board_attach_t *attach = (pb_board_attach_t *)user_data;
+  DBusMessage *reply = dbus_pending_call_steal_reply(pending);
+  const char *error = NULL;
+  DBusError err;
+  int fd = -1;
+
+  dbus_error_init(&err);
+
+  if (dbus_set_error_from_message(&err, reply) ||
+      !dbus_message_get_args(reply, &err,
+                             DBUS_TYPE_UNIX_FD, &fd,
+                             DBUS_TYPE_INVALID))
+    error = err.message;
+  else if (!pb_board_attach_fd(attach->connection, fd))
+    error = "Invalid state board";
+
+  if (fd >= 0)
+    close(fd);
+
+  if (attach->board_cb)
+  {
+    attach->board_cb(error ? NULL : pb_board_get(attach->connection), error,
+                     attach->data);
+  }
+
+  dbus_error_free(&err);
+  dbus_message_unref(reply);
+  dbus_pending_call_unref(pending);
+}
+
+static void
+_board_attach_free(void *data)
+{
+  pb_board_attach_t *attach = (pb_board_attach_t *)data;
+
+  dbus_connection_unref(attach->connection);
+  free(attach);
+}
+
+int
+pb_board_attach(DBusConnection *connection,
+                PBBoardCb board_cb,
+                void *data)
+{
+  DBusConnection *route;
+  DBusMessage *message;
+  DBusPendingCall *pending;
+  pb_board_attach_t *attach;
+
+  if (!connection)
+    return FALSE;
+
+  /* the descriptor comes back on the connection the call goes out on,
+   * which is the peer one when there is a peer */
+  route = _pb_manager_route(connection);
+
+  if (!dbus_connection_can_send_type(route, DBUS_TYPE_UNIX_FD))
+    return FALSE;
+
+  message = dbus_message_new_method_call(DBUS_PLAYBACK_MANAGER_SERVICE,
+                                         DBUS_PLAYBACK_MANAGER_PATH,
+                                         DBUS_PLAYBACK_MANAGER_INTERFACE,
+                                         DBUS_PLAYBACK_GET_BOARD_METHOD);
+
+  if (!message)
+    return FALSE;
+
+  if (!(attach = (pb_board_attach_t *)calloc(1, sizeof(pb_board_attach_t))) ||
+      !dbus_connection_send_with_reply(route, message, &pending, -1) ||
+      !pending)
+  {
+    free(attach);
+    dbus_message_unref(message);
+    return FALSE;
+  }
+
+  attach->connection = dbus_connection_ref(connection);
+  attach->board_cb = board_cb;
+  attach->data = data;
+  dbus_pending_call_set_notify(pending, _board_attach_reply, attach,
+                               _board_attach_free);
+  dbus_message_unref(message);
+
+  return TRUE;
+}
@@ -0,0 +1,221 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libplayback/playback.h"
+#include "playback-dbus.h"
+#include "playback-private.h"
+
+/* Capture of the traffic of a connection, see pb_capture_start().  The
+ * messages are marshalled as they go by and appended to a buffer, which
+ * is only written out when full, so that capturing changes the timing
+ * of the library as little as possible.  The sent messages are recorded
+ * after they are queued, when they have their serial, which the replies
+ * refer to. */
+
+#define CAPTURE_BUFFER_SIZE 65536
+
+struct pb_capture_s
+{
+  int fd;
+  int failed;
+  uint64_t start;
+  size_t used;
+  char buffer[CAPTURE_BUFFER_SIZE];
+};
+
+static int
+_capture_write(int fd,
+               const char *buf,
+               size_t len)
+{
+  while (len)
+  {
+    ssize_t n = write(fd, buf, len);
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      return FALSE;
+    }
+
+    buf += n;
+    len -= n;
+  }
+
+  return TRUE;
+}
+
+static void
+_capture_flush(pb_capture_t *capture)
+{
+  if (capture->used && !capture->failed &&
+      !_capture_write(capture->fd, capture->buffer, capture->used))
+    capture->failed = TRUE;
+
+  capture->used = 0;
+}
+
+static void
+_capture_append(pb_capture_t *capture,
+                const void *data,
+                size_t len)
+{
+  if (capture->used + len > CAPTURE_BUFFER_SIZE)
+    _capture_flush(capture);
+
+  if (len > CAPTURE_BUFFER_SIZE)
+  {
+    if (!capture->failed && !_capture_write(capture->fd, data, len))
+      capture->failed = TRUE;
+
+    return;
+  }
+
+  memcpy(capture->buffer + capture->used, data, len);
+  capture->used += len;
+}
+
+static void
+_capture_record(pb_capture_t *capture,
+                enum pb_capture_type_e type,
+                const void *data,
+                uint32_t length)
+{
+  pb_capture_record_t record;
+
+  record.time_us = _pb_time_us() - capture->start;
+  record.type = type;
+  record.length = length;
+  _capture_append(capture, &record, sizeof(record));
+  _capture_append(capture, data, length);
+}
+
+void
+_pb_capture_message(pb_connection_t *conn,
+                    enum pb_capture_type_e type,
+                    DBusMessage *message)
+{
+  char *data;
+  int len;
+
+  if (!conn || !conn->capture || !message ||
+      !dbus_message_marshal(message, &data, &len))
+    return;
+
+  _capture_record(conn->capture, type, data, len);
+  dbus_free(data);
+}
+
+void
+_pb_capture_data(pb_connection_t *conn,
+                 enum pb_capture_type_e type,
+                 const void *data,
+                 uint32_t length)
+{
+  if (conn->capture)
+    _capture_record(conn->capture, type, data, length);
+}
+
+/* The signals of the manager and the calls on the playback objects; the
+ * replies to the calls of the library are recorded by the transport, as
+ * libdbus hands them to the pending calls without running the filters */
+static DBusHandlerResult
+_capture_filter(DBusConnection *connection,
+                DBusMessage *message,
+                void *user_data)
+{
+  const char *path;
+
+  switch (dbus_message_get_type(message))
+  {
+    case DBUS_MESSAGE_TYPE_SIGNAL:
+      if (!dbus_message_has_interface(message,
+                                      DBUS_PLAYBACK_MANAGER_INTERFACE))
+        break;
+
+      _pb_capture_message(user_data, PB_CAPTURE_RECEIVED, message);
+      break;
+    case DBUS_MESSAGE_TYPE_METHOD_CALL:
+      if (!(path = dbus_message_get_path(message)) ||
+          strncmp(path, PLAYBACK_PATH_PREFIX, strlen(PLAYBACK_PATH_PREFIX)))
+        break;
+
+      _pb_capture_message(user_data, PB_CAPTURE_RECEIVED, message);
+      break;
+    default:
+      break;
+  }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+int
+pb_capture_start(DBusConnection *connection,
+                 int fd)
+{
+  pb_connection_t *conn;
+  pb_capture_t *capture;
+  uint32_t i;
+
+  if (!connection || fd < 0 || !(conn = _pb_connection_get(connection)) ||
+      conn->capture)
+    return FALSE;
+
+  if (!(capture = (pb_capture_t *)malloc(sizeof(pb_capture_t))))
+    return FALSE;
+
+  capture->fd = fd;
+  capture->failed = FALSE;
+  capture->start = _pb_time_us();
+  capture->used = 0;
+  _capture_append(capture, PB_CAPTURE_MAGIC, strlen(PB_CAPTURE_MAGIC));
+
+  if (!dbus_connection_add_filter(connection, _capture_filter, conn, NULL))
+  {
+    free(capture);
+    return FALSE;
+  }
+
+  conn->capture = capture;
+
+  for (i = 0; i < conn->size; i++)
+  {
+    if (conn->playbacks[i])
+      _pb_playback_capture(conn->playbacks[i], PB_CAPTURE_PLAYBACK);
+  }
+
+  return TRUE;
+}
+
+void
+_pb_capture_free(pb_capture_t *capture)
+{
+  if (!capture)
+    return;
+
+  _capture_flush(capture);
+  free(capture);
+}
+
+int
+pb_capture_stop(DBusConnection *connection)
+{
+  pb_connection_t *conn;
+  int ok;
+
+  if (!connection || !(conn = _pb_connection_get(connection)) ||
+      !conn->capture)
+    return FALSE;
+
+  dbus_connection_remove_filter(connection, _capture_filter, conn);
+  _capture_flush(conn->capture);
+  ok = !conn->capture->failed;
+  _pb_capture_free(conn->capture);
+  conn->capture = NULL;
+
+  return ok;
+}
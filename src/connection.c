@@ -0,0 +1,260 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "playback-dbus.h"
+#include "playback-private.h"
+#include "playback-transport.h"
+
+static dbus_int32_t connection_slot = -1;
+
+/* scheduler priorities: calls, ringtones and alarms first, background
+ * last */
+static const uint8_t default_priority[PB_CLASS_LAST] = {
+  [PB_CLASS_NONE] = 2,
+  [PB_CLASS_TEST] = 2,
+  [PB_CLASS_EVENT] = 4,
+  [PB_CLASS_VOIP] = 7,
+  [PB_CLASS_MEDIA] = 2,
+  [PB_CLASS_BACKGROUND] = 0,
+  [PB_CLASS_RINGTONE] = 6,
+  [PB_CLASS_VOICEUI] = 4,
+  [PB_CLASS_CAMERA] = 3,
+  [PB_CLASS_GAME] = 2,
+  [PB_CLASS_ALARM] = 6,
+  [PB_CLASS_FLASH] = 2,
+  [PB_CLASS_SYSTEM] = 4,
+  [PB_CLASS_INPUT] = 4,
+};
+
+static void
+_pb_connection_free(void *data)
+{
+  pb_connection_t *conn = (pb_connection_t *)data;
+
+  _pb_log_ring_free(conn->log);
+  _pb_capture_free(conn->capture);
+  _pb_recorder_free(conn->recorder);
+  _pb_loopback_free(conn->loopback);
+  _pb_policy_free(conn->policy);
+#ifdef HAVE_SD_BUS
+  _pb_sdbus_free(conn->sdbus);
+#endif
+  pb_board_close(conn->board);
+
+  if (conn->peer)
+  {
+    dbus_connection_close(conn->peer);
+    dbus_connection_unref(conn->peer);
+  }
+
+  free(conn->playbacks);
+  free(conn->free_ids);
+  free(conn);
+}
+
+pb_connection_t *
+_pb_connection_get(DBusConnection *connection)
+{
+  pb_connection_t *conn;
+
+  /* The slot is allocated once and kept for the life of the library:
+   * freed, its index would go to the next allocator in the process,
+   * whose set_data would free the context of a live connection.  The
+   * allocator is locked and only checks the slot again, so racing
+   * threads share it and the extra references are never dropped. */
+  if (__atomic_load_n(&connection_slot, __ATOMIC_ACQUIRE) < 0 &&
+      !dbus_connection_allocate_data_slot(&connection_slot))
+    return NULL;
+
+  conn = (pb_connection_t *)dbus_connection_get_data(connection,
+                                                     connection_slot);
+
+  if (!conn)
+  {
+    conn = (pb_connection_t *)calloc(1, sizeof(pb_connection_t));
+
+    if (conn)
+    {
+      conn->connection = connection;
+      memcpy(conn->priority, default_priority, sizeof(conn->priority));
+    }
+
+    if (conn && !dbus_connection_set_data(connection, connection_slot, conn,
+                                          _pb_connection_free))
+    {
+      free(conn);
+      conn = NULL;
+    }
+  }
+
+  return conn;
+}
+
+pb_context_t *
+pb_context_get(DBusConnection *connection)
+{
+  return connection ? _pb_connection_get(connection) : NULL;
+}
+
+DBusConnection *
+pb_context_get_connection(pb_context_t *context)
+{
+  return context ? context->connection : NULL;
+}
+
+/* One pb_context_prepare(): every call in flight holds a reference, the
+ * callback runs when the last one is gone */
+typedef struct pb_prepare_s pb_prepare_t;
+
+struct pb_prepare_s
+{
+  int refcount;
+  DBusConnection *connection;
+  PBContextReady ready_cb;
+  void *data;
+  char *error;
+};
+
+static void
+_prepare_unref(void *data)
+{
+  pb_prepare_t *prepare = (pb_prepare_t *)data;
+  pb_connection_t *conn;
+
+  if (--prepare->refcount > 0)
+    return;
+
+  if (prepare->ready_cb && (conn = _pb_connection_get(prepare->connection)))
+    prepare->ready_cb(conn, prepare->error, prepare->data);
+
+  dbus_connection_unref(prepare->connection);
+  free(prepare->error);
+  free(prepare);
+}
+
+static void
+_prepare_name_reply(DBusPendingCall *pending,
+                    void *user_data)
+{
+  pb_prepare_t *prepare = (pb_prepare_t *)user_data;
+  DBusMessage *reply = dbus_pending_call_steal_reply(pending);
+  pb_connection_t *conn = _pb_connection_get(prepare->connection);
+  DBusError error;
+
+  dbus_error_init(&error);
+
+  if (reply && dbus_set_error_from_message(&error, reply))
+  {
+    PB_LOG_EVENT(conn, PB_LOG_LEVEL_WARNING, PB_LOG_NO_OBJECT,
+                 "unable to own the playback name", error.message, 0, 0);
+    prepare->error = strdup(error.message);
+    dbus_error_free(&error);
+
+    /* asked again by the first playback */
+    if (conn)
+      conn->name_requested = FALSE;
+  }
+
+  if (reply)
+    dbus_message_unref(reply);
+
+  dbus_pending_call_unref(pending);
+}
+
+/* What dbus_bus_request_name() does, without waiting for the bus; the
+ * playbacks do not ask again unless this fails */
+static int
+_prepare_name(pb_prepare_t *prepare,
+              pb_connection_t *conn)
+{
+  const char *name = DBUS_PLAYBACK_SERVICE;
+  dbus_uint32_t flags = 0;
+  DBusPendingCall *pending = NULL;
+  DBusMessage *message;
+
+  message = dbus_message_new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS,
+                                         DBUS_INTERFACE_DBUS, "RequestName");
+
+  if (!message)
+    return FALSE;
+
+  if (!dbus_message_append_args(message,
+                                DBUS_TYPE_STRING, &name,
+                                DBUS_TYPE_UINT32, &flags,
+                                DBUS_TYPE_INVALID) ||
+      !dbus_connection_send_with_reply(prepare->connection, message,
+                                       &pending, -1) ||
+      !pending)
+  {
+    dbus_message_unref(message);
+    return FALSE;
+  }
+
+  dbus_message_unref(message);
+  conn->name_requested = TRUE;
+  prepare->refcount++;
+
+  if (!dbus_pending_call_set_notify(pending, _prepare_name_reply, prepare,
+                                    _prepare_unref))
+  {
+    dbus_pending_call_cancel(pending);
+    dbus_pending_call_unref(pending);
+    conn->name_requested = FALSE;
+    prepare->refcount--;
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+_prepare_settings(int mute,
+                  int privacy_override,
+                  enum pb_bt_override_status_e bluetooth_override,
+                  const char *error,
+                  void *data)
+{
+  _prepare_unref(data);
+}
+
+int
+pb_context_prepare(DBusConnection *connection,
+                   PBContextReady ready_cb,
+                   void *data)
+{
+  pb_connection_t *conn;
+  pb_prepare_t *prepare;
+  int started = FALSE;
+
+  if (!connection || !(conn = _pb_connection_get(connection)))
+    return FALSE;
+
+  if (!(prepare = (pb_prepare_t *)calloc(1, sizeof(pb_prepare_t))))
+    return FALSE;
+
+  prepare->refcount = 1;
+  prepare->connection = dbus_connection_ref(connection);
+  prepare->ready_cb = ready_cb;
+  prepare->data = data;
+
+  /* the same matches the playbacks need, added without a round trip */
+  _pb_settings_watch(connection, conn);
+
+  if (!conn->loopback && !conn->name_requested)
+    started = _prepare_name(prepare, conn);
+
+  prepare->refcount++;
+
+  if (pb_get_manager_settings(connection, _prepare_settings, prepare))
+    started = TRUE;
+  else
+    prepare->refcount--;
+
+  /* the callback never runs from within the call */
+  if (!started)
+    prepare->ready_cb = NULL;
+
+  _prepare_unref(prepare);
+
+  return started;
+}
@@ -0,0 +1,151 @@
+#include <string.h>
+#include <time.h>
+
+#include "playback-private.h"
+
+/* Round trip times of the state requests of a connection: an EWMA with
+ * its mean deviation, as TCP keeps them, and a histogram for the
+ * percentiles.  The histogram has four buckets per power of two and is
+ * halved every LATENCY_WINDOW samples, so it follows the recent
+ * behaviour of the manager. */
+
+#define LATENCY_WINDOW 512
+/* no budget before this many samples */
+#define LATENCY_MIN_SAMPLES 8
+
+uint64_t
+_pb_time_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static unsigned int
+_latency_bucket(uint32_t usec)
+{
+  unsigned int msb;
+
+  if (usec < 4)
+    return usec;
+
+  msb = 31 - __builtin_clz(usec);
+
+  return 4 * (msb - 1) + ((usec >> (msb - 2)) & 3);
+}
+
+/* the highest time of a bucket */
+static uint32_t
+_latency_bucket_max(unsigned int bucket)
+{
+  unsigned int shift;
+
+  if (bucket < 4)
+    return bucket;
+
+  shift = bucket / 4 - 1;
+
+  return ((5U + bucket % 4) << shift) - 1;
+}
+
+void
+_pb_latency_sample(pb_latency_t *latency,
+                   uint64_t usec)
+{
+  int64_t delta;
+  unsigned int i;
+
+  if (usec > UINT32_MAX)
+    usec = UINT32_MAX;
+
+  if (!latency->samples++)
+  {
+    latency->ewma = usec;
+    latency->deviation = usec / 2;
+  }
+  else
+  {
+    delta = (int64_t)usec - latency->ewma;
+    latency->ewma += delta / 8;
+    latency->deviation += ((delta < 0 ? -delta : delta) -
+                           (int64_t)latency->deviation) / 4;
+  }
+
+  latency->histogram[_latency_bucket(usec)]++;
+
+  if (++latency->recent < LATENCY_WINDOW)
+    return;
+
+  latency->recent = 0;
+
+  for (i = 0; i < PB_LATENCY_BUCKETS; i++)
+    latency->recent += latency->histogram[i] /= 2;
+}
+
+uint32_t
+_pb_latency_percentile(const pb_latency_t *latency,
+                       unsigned int percent)
+{
+  uint64_t rank = ((uint64_t)latency->recent * percent + 99) / 100;
+  uint64_t count = 0;
+  unsigned int i;
+
+  if (!latency->recent)
+    return 0;
+
+  for (i = 0; i < PB_LATENCY_BUCKETS - 1; i++)
+  {
+    count += latency->histogram[i];
+
+    if (count >= rank)
+      break;
+  }
+
+  return _latency_bucket_max(i);
+}
+
+uint64_t
+_pb_latency_budget(pb_connection_t *conn)
+{
+  const pb_latency_t *latency = &conn->latency;
+  uint64_t budget = (uint64_t)conn->degraded_min_budget * 1000;
+  uint64_t rto = (uint64_t)latency->ewma + 4 * (uint64_t)latency->deviation;
+  uint64_t p99;
+
+  if (latency->samples < LATENCY_MIN_SAMPLES)
+    return 0;
+
+  p99 = _pb_latency_percentile(latency, 99);
+
+  if (rto > budget)
+    budget = rto;
+
+  return p99 > budget ? p99 : budget;
+}
+
+void
+pb_get_manager_latency(DBusConnection *connection,
+                       pb_manager_latency_t *stats)
+{
+  pb_connection_t *conn;
+
+  if (!stats)
+    return;
+
+  memset(stats, 0, sizeof(*stats));
+
+  if (!connection || !(conn = _pb_connection_get(connection)))
+    return;
+
+  stats->ewma = conn->latency.ewma;
+  stats->deviation = conn->latency.deviation;
+  stats->p50 = _pb_latency_percentile(&conn->latency, 50);
+  stats->p99 = _pb_latency_percentile(&conn->latency, 99);
+  stats->budget = _pb_latency_budget(conn);
+  stats->samples = conn->latency.samples;
+  stats->degraded_grants = conn->degraded_grants;
+  stats->confirmed = conn->degraded_confirmed;
+  stats->reconciled = conn->degraded_reconciled;
+}
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "playback-private.h"
+
+/* The ring overwrites the oldest records when the reader falls behind.
+ * Writers reserve a slot with one atomic add and publish it through the
+ * slot sequence number, the reader copies a slot and checks the sequence
+ * number again to detect records overwritten under its feet. */
+#define LOG_RING_SIZE 256
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+#define LOG_STR_SIZE 32
+
+typedef struct pb_log_entry_s pb_log_entry_t;
+
+struct pb_log_entry_s
+{
+  uint64_t seq;
+  uint64_t time_ns;
+  const char *fmt;
+  long a;
+  long b;
+  uint32_t object_id;
+  uint8_t level;
+  char str[LOG_STR_SIZE];
+};
+
+struct pb_log_ring_s
+{
+  uint64_t head;
+  uint64_t tail;
+  uint64_t lost;
+  int draining;
+  pb_log_entry_t entries[LOG_RING_SIZE];
+};
+
+static int log_level = -1;
+
+static const char *level_names[] =
+{
+  "none",
+  "error",
+  "warning",
+  "info",
+  "debug"
+};
+
+static int
+_pb_log_level_from_env(void)
+{
+  const char *env = getenv("LIBPLAYBACK_LOG");
+  int level = PB_LOG_LEVEL_NONE;
+  int i;
+
+  if (env && *env)
+  {
+    if (*env >= '0' && *env <= '9')
+      level = atoi(env);
+    else
+    {
+      for (i = 0; i < pb_n_elements(level_names); i++)
+      {
+        if (!strcasecmp(env, level_names[i]))
+          level = i;
+      }
+    }
+  }
+
+  if (level > PB_LOG_LEVEL_DEBUG)
+    level = PB_LOG_LEVEL_DEBUG;
+
+  return level;
+}
+
+void
+pb_set_log_level(enum pb_log_level_e level)
+{
+  __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+int
+_pb_log_enabled(enum pb_log_level_e level)
+{
+  int l = __atomic_load_n(&log_level, __ATOMIC_RELAXED);
+
+  if (l < 0)
+  {
+    l = _pb_log_level_from_env();
+    __atomic_store_n(&log_level, l, __ATOMIC_RELAXED);
+  }
+
+  return level != PB_LOG_LEVEL_NONE && level <= l;
+}
+
+static pb_log_ring_t *
+_pb_log_ring(pb_connection_t *conn)
+{
+  pb_log_ring_t *ring = __atomic_load_n(&conn->log, __ATOMIC_ACQUIRE);
+  pb_log_ring_t *expected = NULL;
+
+  if (ring)
+    return ring;
+
+  if (!(ring = (pb_log_ring_t *)calloc(1, sizeof(pb_log_ring_t))))
+    return NULL;
+
+  if (!__atomic_compare_exchange_n(&conn->log, &expected, ring, FALSE,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+  {
+    free(ring);
+    ring = expected;
+  }
+
+  return ring;
+}
+
+void
+_pb_log_record(pb_connection_t *conn,
+               enum pb_log_level_e level,
+               uint32_t object_id,
+               const char *fmt,
+               const char *str,
+               long a,
+               long b)
+{
+  pb_log_ring_t *ring;
+  pb_log_entry_t *e;
+  struct timespec ts;
+  uint64_t pos;
+
+  if (!conn || !(ring = _pb_log_ring(conn)))
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  pos = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+  e = &ring->entries[pos & LOG_RING_MASK];
+
+  __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  e->time_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  e->fmt = fmt;
+  e->a = a;
+  e->b = b;
+  e->object_id = object_id;
+  e->level = level;
+
+  if (str)
+  {
+    strncpy(e->str, str, LOG_STR_SIZE - 1);
+    e->str[LOG_STR_SIZE - 1] = '\0';
+  }
+  else
+    e->str[0] = '\0';
+
+  __atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+void
+_pb_log_ring_free(pb_log_ring_t *ring)
+{
+  free(ring);
+}
+
+static int
+_pb_log_write(int fd,
+              const char *buf,
+              size_t len)
+{
+  while (len)
+  {
+    ssize_t n = write(fd, buf, len);
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      return FALSE;
+    }
+
+    buf += n;
+    len -= n;
+  }
+
+  return TRUE;
+}
+
+static int
+_pb_log_format(const pb_log_entry_t *e,
+               char *buf,
+               size_t size)
+{
+  char msg[128];
+  char obj[32] = "";
+  int len;
+
+  snprintf(msg, sizeof(msg), e->fmt, e->a, e->b);
+
+  if (e->object_id != PB_LOG_NO_OBJECT)
+    snprintf(obj, sizeof(obj), " playback%u", e->object_id);
+
+  len = snprintf(buf, size, "%llu.%06llu %s%s: %s%s%s%s\n",
+                 (unsigned long long)(e->time_ns / 1000000000ULL),
+                 (unsigned long long)(e->time_ns % 1000000000ULL) / 1000,
+                 e->level < pb_n_elements(level_names) ?
+                   level_names[e->level] : "?",
+                 obj, msg,
+                 e->str[0] ? " '" : "", e->str, e->str[0] ? "'" : "");
+
+  return len < size ? len : size - 1;
+}
+
+int
+pb_log_drain(DBusConnection *connection,
+             int fd)
+{
+  pb_connection_t *conn;
+  pb_log_ring_t *ring;
+  uint64_t head;
+  uint64_t lost = 0;
+  char buf[256];
+  int n = 0;
+
+  if (!connection || !(conn = _pb_connection_get(connection)))
+    return -1;
+
+  if (!(ring = __atomic_load_n(&conn->log, __ATOMIC_ACQUIRE)))
+    return 0;
+
+  /* one reader at a time, writers never wait */
+  if (__atomic_exchange_n(&ring->draining, TRUE, __ATOMIC_ACQUIRE))
+    return 0;
+
+  head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+  if (head - ring->tail > LOG_RING_SIZE)
+  {
+    lost += head - ring->tail - LOG_RING_SIZE;
+    ring->tail = head - LOG_RING_SIZE;
+  }
+
+  while (ring->tail < head)
+  {
+    pb_log_entry_t *e = &ring->entries[ring->tail & LOG_RING_MASK];
+    pb_log_entry_t copy;
+    uint64_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+
+    /* still being written, drain it next time */
+    if (seq < ring->tail + 1)
+      break;
+
+    memcpy(&copy, e, sizeof(copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (seq != ring->tail + 1 ||
+        __atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq)
+    {
+      lost++;
+    }
+    else if (_pb_log_write(fd, buf, _pb_log_format(&copy, buf, sizeof(buf))))
+      n++;
+
+    ring->tail++;
+  }
+
+  if (lost)
+  {
+    ring->lost += lost;
+    _pb_log_write(fd, buf,
+                  snprintf(buf, sizeof(buf), "%llu log records lost\n",
+                           (unsigned long long)lost));
+  }
+
+  __atomic_store_n(&ring->draining, FALSE, __ATOMIC_RELEASE);
+
+  return n;
+}
@@ -0,0 +1,611 @@
+#include <dbus/dbus.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libplayback/playback.h"
+#include "playback-dbus.h"
+#include "playback-transport.h"
+
+/* The loopback transport: an engine in this process answers the calls
+ * of a connection.  The engine runs when a call is made, but its
+ * answer is queued, as are the signals of pb_loopback_set_*(), so that
+ * the callbacks of the library run from pb_loopback_dispatch() and
+ * never from within the call, just as with the bus. */
+
+#define ALL_STATES ((1U << PB_STATE_LAST) - 1)
+
+enum loopback_item_e
+{
+  ITEM_REPLY,
+  ITEM_ALLOWED_STATE,
+  ITEM_SETTING,
+  ITEM_SET_STATE
+};
+
+typedef struct pb_loopback_item_s pb_loopback_item_t;
+
+struct pb_loopback_item_s
+{
+  pb_call_t call;
+  pb_loopback_item_t *prev;
+  pb_loopback_item_t *next;
+  pb_loopback_t *loopback;
+  enum loopback_item_e kind;
+  const char *error;
+  char *message;
+  enum pb_state_e states[PB_STATE_LAST];
+  unsigned int n_states;
+  unsigned int settings;
+  int values[PB_SETTING_LAST];
+  enum pb_class_e pb_class;
+  enum pb_setting_e setting;
+  pb_playback_t *pb;
+};
+
+struct pb_loopback_s
+{
+  DBusConnection *connection;
+  pb_engine_t engine;
+  void *data;
+  PBLoopbackWakeup wakeup;
+  void *wakeup_data;
+  uint32_t allowed[PB_CLASS_LAST];
+  int values[PB_SETTING_LAST];
+  pb_loopback_item_t *first;
+  pb_loopback_item_t *last;
+  int takeover;
+};
+
+static pb_loopback_t *
+_loopback_get(DBusConnection *connection)
+{
+  pb_connection_t *conn;
+
+  if (!connection || !(conn = _pb_connection_get(connection)))
+    return NULL;
+
+  return conn->loopback;
+}
+
+static pb_loopback_item_t *
+_loopback_item_new(pb_loopback_t *loopback,
+                   enum loopback_item_e kind)
+{
+  pb_loopback_item_t *item;
+
+  if ((item = (pb_loopback_item_t *)calloc(1, sizeof(pb_loopback_item_t))))
+  {
+    item->loopback = loopback;
+    item->kind = kind;
+  }
+
+  return item;
+}
+
+static void
+_loopback_push(pb_loopback_item_t *item)
+{
+  pb_loopback_t *loopback = item->loopback;
+
+  item->prev = loopback->last;
+
+  if (loopback->last)
+    loopback->last->next = item;
+  else
+    loopback->first = item;
+
+  loopback->last = item;
+
+  if (!item->prev && loopback->wakeup)
+    loopback->wakeup(loopback->connection, loopback->wakeup_data);
+}
+
+static void
+_loopback_unlink(pb_loopback_item_t *item)
+{
+  pb_loopback_t *loopback = item->loopback;
+
+  if (item->prev)
+    item->prev->next = item->next;
+  else
+    loopback->first = item->next;
+
+  if (item->next)
+    item->next->prev = item->prev;
+  else
+    loopback->last = item->prev;
+
+  item->prev = item->next = NULL;
+}
+
+static void
+_loopback_item_free(pb_loopback_item_t *item)
+{
+  if (item->kind == ITEM_REPLY)
+    _pb_call_finish(&item->call);
+  else if (item->kind == ITEM_SET_STATE)
+    _pb_playback_unref(item->pb);
+
+  free(item->message);
+  free(item);
+}
+
+/* Queues the reply @item to a call; FALSE if there is no call to make */
+static int
+_loopback_reply(pb_loopback_item_t *item,
+                pb_call_t **call,
+                PBCallReply reply,
+                void *data,
+                DBusFreeFunction free_data)
+{
+  if (!item)
+    return FALSE;
+
+  _pb_call_init(&item->call, &_pb_loopback_transport, reply, data,
+                free_data);
+  _loopback_push(item);
+
+  if (call)
+    *call = &item->call;
+
+  return TRUE;
+}
+
+static void
+_loopback_signal_setting(pb_loopback_t *loopback,
+                         enum pb_setting_e setting,
+                         int value)
+{
+  pb_loopback_item_t *item = _loopback_item_new(loopback, ITEM_SETTING);
+
+  loopback->values[setting] = value;
+
+  if (item)
+  {
+    item->setting = setting;
+    item->values[setting] = value;
+    _loopback_push(item);
+  }
+}
+
+static void
+_loopback_engine_req(const pb_state_args_t *args,
+                     pb_engine_req_t *req)
+{
+  req->pb = args->pb;
+  req->pb_class = args->pb_class;
+  req->flags = args->flags;
+  req->pb_state = args->pb_state;
+  req->pid = args->pid;
+  req->stream = args->stream;
+}
+
+static int
+_loopback_request_states(DBusConnection *connection,
+                         const pb_state_args_t *args,
+                         unsigned int n,
+                         pb_call_t **call,
+                         PBCallReply reply,
+                         void *data,
+                         DBusFreeFunction free_data)
+{
+  pb_loopback_t *loopback = _loopback_get(connection);
+  pb_loopback_item_t *item;
+  const char *reason = NULL;
+  pb_engine_req_t req;
+  enum pb_state_e state;
+
+  if (!loopback || !(item = _loopback_item_new(loopback, ITEM_REPLY)))
+    return FALSE;
+
+  /* one request at a time keeps the engine simple */
+  if (n != 1)
+  {
+    item->error = DBUS_ERROR_UNKNOWN_METHOD;
+    return _loopback_reply(item, call, reply, data, free_data);
+  }
+
+  _loopback_engine_req(args, &req);
+  state = loopback->engine.request_state ?
+          loopback->engine.request_state(&req, &reason, loopback->data) :
+          args->pb_state;
+
+  if (state == PB_STATE_NONE)
+  {
+    item->error = DBUS_MAEMO_ERROR_DENIED;
+    item->message = strdup(reason ? reason : "Request denied");
+  }
+  else
+  {
+    item->states[0] = state;
+    item->n_states = 1;
+  }
+
+  return _loopback_reply(item, call, reply, data, free_data);
+}
+
+static int
+_loopback_get_allowed_state(DBusConnection *connection,
+                            const pb_state_args_t *args,
+                            pb_call_t **call,
+                            PBCallReply reply,
+                            void *data,
+                            DBusFreeFunction free_data)
+{
+  pb_loopback_t *loopback = _loopback_get(connection);
+  pb_loopback_item_t *item;
+  uint32_t mask = ALL_STATES;
+  int state;
+
+  if (!loopback || !(item = _loopback_item_new(loopback, ITEM_REPLY)))
+    return FALSE;
+
+  if (args->pb_class >= 0 && args->pb_class < PB_CLASS_LAST)
+    mask = loopback->allowed[args->pb_class];
+
+  for (state = PB_STATE_NONE; state < PB_STATE_LAST; state++)
+  {
+    if (mask & 1U << state)
+      item->states[item->n_states++] = state;
+  }
+
+  return _loopback_reply(item, call, reply, data, free_data);
+}
+
+static int
+_loopback_request_setting(DBusConnection *connection,
+                          enum pb_setting_e setting,
+                          int value,
+                          pb_call_t **call,
+                          PBCallReply reply,
+                          void *data,
+                          DBusFreeFunction free_data)
+{
+  pb_loopback_t *loopback = _loopback_get(connection);
+  int (*accept)(int value, void *data);
+  pb_loopback_item_t *item;
+
+  if (!loopback || !(item = _loopback_item_new(loopback, ITEM_REPLY)))
+    return FALSE;
+
+  switch (setting)
+  {
+    case PB_SETTING_MUTE:
+      accept = loopback->engine.request_mute;
+      break;
+    case PB_SETTING_PRIVACY:
+      accept = loopback->engine.request_privacy_override;
+      break;
+    default:
+      accept = loopback->engine.request_bluetooth_override;
+      break;
+  }
+
+  if (accept && !accept(value, loopback->data))
+  {
+    item->error = DBUS_MAEMO_ERROR_DENIED;
+    return _loopback_reply(item, call, reply, data, free_data);
+  }
+
+  /* the manager signals the change before it replies */
+  if (loopback->values[setting] != value)
+    _loopback_signal_setting(loopback, setting, value);
+
+  return _loopback_reply(item, call, reply, data, free_data);
+}
+
+static int
+_loopback_get_settings(DBusConnection *connection,
+                       enum pb_setting_e setting,
+                       pb_call_t **call,
+                       PBCallReply reply,
+                       void *data,
+                       DBusFreeFunction free_data)
+{
+  pb_loopback_t *loopback = _loopback_get(connection);
+  pb_loopback_item_t *item;
+
+  if (!loopback || !(item = _loopback_item_new(loopback, ITEM_REPLY)))
+    return FALSE;
+
+  item->settings = setting < PB_SETTING_LAST ? 1U << setting :
+                                               (1U << PB_SETTING_LAST) - 1;
+  memcpy(item->values, loopback->values, sizeof(item->values));
+
+  return _loopback_reply(item, call, reply, data, free_data);
+}
+
+static void
+_loopback_cancel(pb_call_t *call)
+{
+  pb_loopback_item_t *item = (pb_loopback_item_t *)call;
+
+  _loopback_unlink(item);
+  _loopback_item_free(item);
+}
+
+/* The signals of the engine always reach the connection.  An engine
+ * standing in for a missing manager keeps the matches of the bus up to
+ * date for when it comes back. */
+static void
+_loopback_watch(DBusConnection *connection,
+                unsigned int what)
+{
+  pb_loopback_t *loopback = _loopback_get(connection);
+
+  if (loopback && loopback->takeover)
+    _pb_dbus_transport.watch(connection, what);
+}
+
+static void
+_loopback_unwatch(DBusConnection *connection,
+                  unsigned int what)
+{
+  pb_loopback_t *loopback = _loopback_get(connection);
+
+  if (loopback && loopback->takeover)
+    _pb_dbus_transport.unwatch(connection, what);
+}
+
+static void
+_loopback_announce(DBusConnection *connection,
+                   const pb_state_args_t *args,
+                   enum pb_announce_e what)
+{
+  static const enum pb_engine_event_e events[] =
+  {
+    [PB_ANNOUNCE_HELLO] = PB_ENGINE_HELLO,
+    [PB_ANNOUNCE_STATE] = PB_ENGINE_STATE,
+    [PB_ANNOUNCE_GOODBYE] = PB_ENGINE_GOODBYE
+  };
+  pb_loopback_t *loopback = _loopback_get(connection);
+  pb_engine_req_t req;
+
+  if (!loopback || !loopback->engine.playback_event)
+    return;
+
+  _loopback_engine_req(args, &req);
+  loopback->engine.playback_event(&req, events[what], loopback->data);
+}
+
+const pb_transport_t _pb_loopback_transport =
+{
+  "loopback",
+  _loopback_request_states,
+  _loopback_get_allowed_state,
+  _loopback_request_setting,
+  _loopback_get_settings,
+  _loopback_cancel,
+  _loopback_watch,
+  _loopback_unwatch,
+  _loopback_announce
+};
+
+void
+_pb_loopback_free(pb_loopback_t *loopback)
+{
+  pb_loopback_item_t *item;
+
+  if (!loopback)
+    return;
+
+  while ((item = loopback->first))
+  {
+    _loopback_unlink(item);
+    _loopback_item_free(item);
+  }
+
+  free(loopback);
+}
+
+int
+_pb_loopback_takeover(DBusConnection *connection,
+                      const pb_engine_t *engine,
+                      void *data,
+                      PBLoopbackWakeup wakeup)
+{
+  pb_loopback_t *loopback;
+
+  if (!pb_loopback_attach(connection, engine, data))
+    return FALSE;
+
+  loopback = _loopback_get(connection);
+  loopback->takeover = TRUE;
+  loopback->wakeup = wakeup;
+  loopback->wakeup_data = NULL;
+
+  return TRUE;
+}
+
+int
+pb_loopback_attach(DBusConnection *connection,
+                   const pb_engine_t *engine,
+                   void *data)
+{
+  pb_connection_t *conn;
+  pb_loopback_t *loopback;
+  int i;
+
+  if (!connection || !engine || !(conn = _pb_connection_get(connection)) ||
+      conn->loopback)
+    return FALSE;
+
+  if (!(loopback = (pb_loopback_t *)calloc(1, sizeof(pb_loopback_t))))
+    return FALSE;
+
+  loopback->connection = connection;
+  loopback->engine = *engine;
+  loopback->data = data;
+
+  for (i = 0; i < PB_CLASS_LAST; i++)
+    loopback->allowed[i] = ALL_STATES;
+
+  conn->loopback = loopback;
+  conn->batch_unsupported = TRUE;
+
+  return TRUE;
+}
+
+void
+pb_loopback_detach(DBusConnection *connection)
+{
+  pb_connection_t *conn;
+
+  if (!connection || !(conn = _pb_connection_get(connection)) ||
+      !conn->loopback)
+    return;
+
+  pb_loopback_dispatch(connection);
+  _pb_loopback_free(conn->loopback);
+  conn->loopback = NULL;
+  conn->batch_unsupported = FALSE;
+}
+
+void
+pb_loopback_set_wakeup(DBusConnection *connection,
+                       PBLoopbackWakeup wakeup,
+                       void *data)
+{
+  pb_loopback_t *loopback = _loopback_get(connection);
+
+  if (!loopback)
+    return;
+
+  loopback->wakeup = wakeup;
+  loopback->wakeup_data = data;
+}
+
+int
+pb_loopback_dispatch(DBusConnection *connection)
+{
+  pb_connection_t *conn;
+  pb_loopback_item_t *item;
+  int n = 0;
+
+  if (!connection || !(conn = _pb_connection_get(connection)))
+    return 0;
+
+  /* the callbacks may queue more, or detach the engine */
+  while (conn->loopback && (item = conn->loopback->first))
+  {
+    _loopback_unlink(item);
+    n++;
+
+    switch (item->kind)
+    {
+      case ITEM_REPLY:
+        if (item->call.reply)
+        {
+          pb_reply_t reply;
+
+          reply.error = item->error;
+          reply.message = item->message;
+          reply.states = item->states;
+          reply.n_states = item->n_states;
+          reply.settings = item->settings;
+          memcpy(reply.values, item->values, sizeof(reply.values));
+          item->call.reply(&reply, item->call.data);
+        }
+        break;
+      case ITEM_ALLOWED_STATE:
+      {
+        int allowed_state[PB_STATE_LAST];
+        int state;
+
+        for (state = PB_STATE_NONE; state < PB_STATE_LAST; state++)
+          allowed_state[state] = !!(item->values[0] & 1U << state);
+
+        _pb_manager_allowed_state(connection, item->pb_class, allowed_state);
+        break;
+      }
+      case ITEM_SETTING:
+        _pb_manager_setting(connection, item->setting,
+                            item->values[item->setting]);
+        break;
+      case ITEM_SET_STATE:
+        _pb_playback_set_local(item->pb, item->states[0]);
+        break;
+    }
+
+    _loopback_item_free(item);
+  }
+
+  return n;
+}
+
+void
+pb_loopback_set_allowed_state(DBusConnection *connection,
+                              enum pb_class_e pb_class,
+                              const int allowed_state[])
+{
+  pb_loopback_t *loopback = _loopback_get(connection);
+  pb_loopback_item_t *item;
+  uint32_t mask = 0;
+  int state;
+
+  if (!loopback || !allowed_state || pb_class < 0 ||
+      pb_class >= PB_CLASS_LAST)
+    return;
+
+  for (state = PB_STATE_NONE; state < PB_STATE_LAST; state++)
+  {
+    if (allowed_state[state])
+      mask |= 1U << state;
+  }
+
+  loopback->allowed[pb_class] = mask;
+
+  if ((item = _loopback_item_new(loopback, ITEM_ALLOWED_STATE)))
+  {
+    item->pb_class = pb_class;
+    item->values[0] = mask;
+    _loopback_push(item);
+  }
+}
+
+void
+pb_loopback_set_state(DBusConnection *connection,
+                      pb_playback_t *pb,
+                      enum pb_state_e pb_state)
+{
+  pb_loopback_t *loopback = _loopback_get(connection);
+  pb_loopback_item_t *item;
+
+  if (!loopback || !pb || pb_state == PB_STATE_NONE ||
+      !(item = _loopback_item_new(loopback, ITEM_SET_STATE)))
+    return;
+
+  item->pb = _pb_playback_ref(pb);
+  item->states[0] = pb_state;
+  _loopback_push(item);
+}
+
+void
+pb_loopback_set_mute(DBusConnection *connection,
+                     int mute)
+{
+  pb_loopback_t *loopback = _loopback_get(connection);
+
+  if (loopback)
+    _loopback_signal_setting(loopback, PB_SETTING_MUTE, !!mute);
+}
+
+void
+pb_loopback_set_privacy_override(DBusConnection *connection,
+                                 int override)
+{
+  pb_loopback_t *loopback = _loopback_get(connection);
+
+  if (loopback)
+    _loopback_signal_setting(loopback, PB_SETTING_PRIVACY, !!override);
+}
+
+void
+pb_loopback_set_bluetooth_override(DBusConnection *connection,
+                                   enum pb_bt_override_status_e override)
+{
+  pb_loopback_t *loopback = _loopback_get(connection);
+
+  if (loopback)
+    _loopback_signal_setting(loopback, PB_SETTING_BLUETOOTH, override);
+}
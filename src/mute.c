@@ -1,35 +1,22 @@
 #include <dbus/dbus.h>
-#include <string.h>
 
 #include "libplayback/playback.h"
-#include "playback-dbus.h"
+#include "playback-probes.h"
+#include "playback-transport.h"
 
-static PBMuteCb _mute_cb = NULL;
-static void *_mute_data = NULL;
-
-static DBusHandlerResult
-_mute_filter(DBusConnection *connection, DBusMessage *message, void *user_data)
+void
+_pb_mute_changed(DBusConnection *connection,
+                 int mute)
 {
-  if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_SIGNAL &&
-      !strcmp(dbus_message_get_interface(message),
-              DBUS_PLAYBACK_MANAGER_INTERFACE) &&
-      !strcmp(dbus_message_get_member(message), DBUS_MUTE_SIGNAL))
-  {
-    DBusError error;
-    dbus_bool_t mute;
-
-    dbus_error_init(&error);
-    dbus_message_get_args(message, &error,
-                          DBUS_TYPE_BOOLEAN, &mute,
-                          DBUS_TYPE_INVALID);
+  pb_connection_t *conn = _pb_connection_get(connection);
 
-    if ( dbus_error_is_set(&error) )
-      dbus_error_free(&error);
-    else if ( _mute_cb )
-      _mute_cb(mute == TRUE, NULL, _mute_data);
-  }
+  if (!conn || !conn->mute_cb)
+    return;
 
-  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  PB_PROBE_SETTING(mute, mute);
+  PB_LOG_EVENT(conn, PB_LOG_LEVEL_DEBUG, PB_LOG_NO_OBJECT, "mute %ld", NULL,
+               mute, 0);
+  conn->mute_cb(mute, NULL, conn->mute_data);
 }
 
 void
@@ -37,101 +24,43 @@ pb_set_mute_cb(DBusConnection *connection,
                PBMuteCb mute_cb,
                void *data)
 {
-  if (mute_cb)
+  pb_connection_t *conn;
+
+  if (mute_cb && (conn = _pb_connection_get(connection)))
   {
-    _mute_cb = mute_cb;
-    _mute_data = data;
-    dbus_connection_add_filter(connection, _mute_filter, 0, 0);
+    conn->mute_cb = mute_cb;
+    conn->mute_data = data;
+    _pb_transport(conn)->watch(connection, 0);
   }
 }
 
 static void
-_request_mute_reply(DBusPendingCall *pending, void *user_data)
+_request_mute_error(DBusConnection *connection,
+                    const char *error)
 {
-  DBusMessage *reply;
+  pb_connection_t *conn = _pb_connection_get(connection);
 
-  if (!pending)
-    return;
-
-  reply = dbus_pending_call_steal_reply(pending);
-  dbus_pending_call_unref(pending);
-
-  if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR && _mute_cb)
-    _mute_cb(0, dbus_message_get_error_name(reply), _mute_data);
-
-  dbus_message_unref(reply);
+  if (conn && conn->mute_cb)
+    conn->mute_cb(0, error, conn->mute_data);
 }
 
 int
 pb_req_mute(DBusConnection *connection,
             int mute)
 {
-  dbus_bool_t m = mute ? TRUE :FALSE;
-  DBusMessage *message;
-  DBusPendingCall *pending;
-  int rv = FALSE;
-
-  message = dbus_message_new_method_call(DBUS_PLAYBACK_MANAGER_SERVICE,
-                                         DBUS_PLAYBACK_MANAGER_PATH,
-                                         DBUS_PLAYBACK_MANAGER_INTERFACE,
-                                         DBUS_PLAYBACK_REQ_MUTE_METHOD);
-
-  if (!message)
-    return FALSE;
-
-  dbus_message_append_args(message,
-                           DBUS_TYPE_BOOLEAN, &m,
-                           DBUS_TYPE_INVALID);
-
-  if (dbus_connection_send_with_reply(connection, message, &pending, -1))
-  {
-    dbus_pending_call_set_notify(pending, _request_mute_reply, NULL, NULL);
-    rv = TRUE;
-  }
-
-  dbus_message_unref(message);
-
-  return rv;
+  return _pb_setting_request(connection, PB_SETTING_MUTE, mute,
+                             _request_mute_error);
 }
 
 static void
-_get_mute_reply(DBusPendingCall *pending, void *user_data)
+_get_mute_reply(const pb_reply_t *reply, void *data)
 {
-  DBusMessage *reply;
-
-  if (!pending)
-    return;
-
-  reply = dbus_pending_call_steal_reply(pending);
-  dbus_pending_call_unref(pending);
-
-  if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR && _mute_cb)
-    _mute_cb(0, dbus_message_get_error_name(reply), _mute_data);
-
-  dbus_message_unref(reply);
+  if (reply->error)
+    _request_mute_error((DBusConnection *)data, reply->error);
 }
 
 int
 pb_get_mute(DBusConnection *connection)
 {
-  DBusMessage *message;
-  DBusPendingCall *pending;
-  int rv = FALSE;
-
-  message = dbus_message_new_method_call(DBUS_PLAYBACK_MANAGER_SERVICE,
-                                         DBUS_PLAYBACK_MANAGER_PATH,
-                                         DBUS_PLAYBACK_MANAGER_INTERFACE,
-                                         DBUS_PLAYBACK_GET_MUTE_METHOD);
-  if (!message)
-    return FALSE;
-
-  if (dbus_connection_send_with_reply(connection, message, &pending, -1))
-  {
-    dbus_pending_call_set_notify(pending, _get_mute_reply, NULL, NULL);
-    rv = TRUE;
-  }
-
-  dbus_message_unref(message);
-
-  return rv;
+  return _pb_setting_get(connection, PB_SETTING_MUTE, _get_mute_reply);
 }
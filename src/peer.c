@@ -0,0 +1,229 @@
+#include <dbus/dbus.h>
+#include <stdlib.h>
+
+#include "libplayback/playback.h"
+#include "playback-dbus.h"
+#include "playback-private.h"
+
+/* The peer connection carries the calls to the manager only.  The
+ * manager learns which bus client it serves from RegisterPeer, which is
+ * answered before any call is routed over the peer.  Everything
+ * the manager sends to the client (signals, calls to the playbacks)
+ * stays on the bus. */
+
+static void _peer_drop(DBusConnection *connection);
+
+typedef struct pb_peer_connect_s pb_peer_connect_t;
+
+struct pb_peer_connect_s
+{
+  DBusConnection *connection;
+  DBusConnection *peer;
+  PBPeerCb peer_cb;
+  void *data;
+};
+
+static void
+_peer_connect_free(void *data)
+{
+  pb_peer_connect_t *pc = (pb_peer_connect_t *)data;
+
+  if (pc->peer)
+  {
+    dbus_connection_close(pc->peer);
+    dbus_connection_unref(pc->peer);
+  }
+
+  dbus_connection_unref(pc->connection);
+  free(pc);
+}
+
+static void
+_peer_connect_done(pb_peer_connect_t *pc,
+                   const char *error)
+{
+  pb_connection_t *conn = _pb_connection_get(pc->connection);
+
+  if (!error && !conn)
+    error = "Out of memory";
+
+  if (!error)
+  {
+    pb_peer_disconnect(pc->connection);
+    conn->peer = pc->peer;
+    pc->peer = NULL;
+    PB_LOG_EVENT(conn, PB_LOG_LEVEL_INFO, PB_LOG_NO_OBJECT,
+                 "manager calls go over the peer connection", NULL, 0, 0);
+  }
+  else
+  {
+    PB_LOG_EVENT(conn, PB_LOG_LEVEL_WARNING, PB_LOG_NO_OBJECT,
+                 "no peer connection to the manager", error, 0, 0);
+  }
+
+  if (pc->peer_cb)
+    pc->peer_cb(error ? NULL : conn->peer, error, pc->data);
+}
+
+static DBusHandlerResult
+_peer_filter(DBusConnection *peer,
+             DBusMessage *message,
+             void *user_data)
+{
+  DBusConnection *connection = (DBusConnection *)user_data;
+  pb_connection_t *conn;
+
+  if (dbus_message_is_signal(message, DBUS_INTERFACE_LOCAL, "Disconnected") &&
+      (conn = _pb_connection_get(connection)) && conn->peer == peer)
+  {
+    PB_LOG_EVENT(conn, PB_LOG_LEVEL_WARNING, PB_LOG_NO_OBJECT,
+                 "peer connection lost, back to the bus", NULL, 0, 0);
+    _peer_drop(connection);
+  }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/* RegisterPeer is answered on the peer, which the application does not
+ * dispatch before it gets it from the callback: wait for the reply
+ * here, as dbus_connection_open_private() already did for the connect */
+#define REGISTER_PEER_TIMEOUT 1000
+
+static void
+_peer_address_reply(DBusPendingCall *pending,
+                    void *user_data)
+{
+  pb_peer_connect_t *pc = (pb_peer_connect_t *)user_data;
+  DBusMessage *reply = dbus_pending_call_steal_reply(pending);
+  DBusMessage *message = NULL, *register_reply = NULL;
+  const char *address;
+  const char *name = dbus_bus_get_unique_name(pc->connection);
+  DBusError error;
+
+  dbus_error_init(&error);
+
+  if (dbus_set_error_from_message(&error, reply) ||
+      !dbus_message_get_args(reply, &error,
+                             DBUS_TYPE_STRING, &address,
+                             DBUS_TYPE_INVALID) ||
+      !(pc->peer = dbus_connection_open_private(address, &error)))
+  {
+    _peer_connect_done(pc, error.message);
+    goto out;
+  }
+
+  dbus_connection_set_exit_on_disconnect(pc->peer, FALSE);
+  message = dbus_message_new_method_call(NULL,
+                                         DBUS_PLAYBACK_MANAGER_PATH,
+                                         DBUS_PLAYBACK_MANAGER_INTERFACE,
+                                         DBUS_PLAYBACK_REGISTER_PEER_METHOD);
+
+  if (!name || !message ||
+      !dbus_message_append_args(message,
+                                DBUS_TYPE_STRING, &name,
+                                DBUS_TYPE_INVALID))
+  {
+    _peer_connect_done(pc, "Unable to register with the manager");
+    goto out;
+  }
+
+  if (!(register_reply =
+        dbus_connection_send_with_reply_and_block(pc->peer, message,
+                                                  REGISTER_PEER_TIMEOUT,
+                                                  &error)) ||
+      !dbus_connection_add_filter(pc->peer, _peer_filter, pc->connection,
+                                  NULL))
+  {
+    _peer_connect_done(pc, dbus_error_is_set(&error) ? error.message :
+                                                       "Out of memory");
+    goto out;
+  }
+
+  _peer_connect_done(pc, NULL);
+
+out:
+  if (register_reply)
+    dbus_message_unref(register_reply);
+
+  if (message)
+    dbus_message_unref(message);
+
+  dbus_error_free(&error);
+  dbus_message_unref(reply);
+  dbus_pending_call_unref(pending);
+}
+
+int
+pb_peer_connect(DBusConnection *connection,
+                PBPeerCb peer_cb,
+                void *data)
+{
+  DBusMessage *message;
+  DBusPendingCall *pending;
+  pb_peer_connect_t *pc;
+
+  if (!connection)
+    return FALSE;
+
+  message = dbus_message_new_method_call(DBUS_PLAYBACK_MANAGER_SERVICE,
+                                         DBUS_PLAYBACK_MANAGER_PATH,
+                                         DBUS_PLAYBACK_MANAGER_INTERFACE,
+                                         DBUS_PLAYBACK_GET_PEER_METHOD);
+
+  if (!message)
+    return FALSE;
+
+  if (!(pc = (pb_peer_connect_t *)calloc(1, sizeof(pb_peer_connect_t))) ||
+      !dbus_connection_send_with_reply(connection, message, &pending, -1) ||
+      !pending)
+  {
+    free(pc);
+    dbus_message_unref(message);
+    return FALSE;
+  }
+
+  pc->connection = dbus_connection_ref(connection);
+  pc->peer_cb = peer_cb;
+  pc->data = data;
+  dbus_pending_call_set_notify(pending, _peer_address_reply, pc,
+                               _peer_connect_free);
+  dbus_message_unref(message);
+
+  return TRUE;
+}
+
+static void
+_peer_drop(DBusConnection *connection)
+{
+  pb_connection_t *conn;
+  DBusConnection *peer;
+
+  if (!connection || !(conn = _pb_connection_get(connection)) || !conn->peer)
+    return;
+
+  peer = conn->peer;
+  conn->peer = NULL;
+  dbus_connection_close(peer);
+  dbus_connection_remove_filter(peer, _peer_filter, connection);
+  dbus_connection_unref(peer);
+  _pb_peer_lost(conn);
+}
+
+void
+pb_peer_disconnect(DBusConnection *connection)
+{
+  _peer_drop(connection);
+}
+
+DBusConnection *
+_pb_manager_route(DBusConnection *connection)
+{
+  pb_connection_t *conn = _pb_connection_get(connection);
+
+  /* a lost peer is only dropped once _peer_filter sees it go; meanwhile
+   * the calls go over the bus already */
+  if (conn && conn->peer && dbus_connection_get_is_connected(conn->peer))
+    return conn->peer;
+
+  return connection;
+}
@@ -21,6 +21,8 @@
 #define DBUS_ADMIN_INTERFACE               "org.freedesktop.DBus"
 #define DBUS_PLAYBACK_INTERFACE            "org.maemo.Playback"
 #define DBUS_PLAYBACK_MANAGER_INTERFACE    DBUS_PLAYBACK_INTERFACE ".Manager"
+#define DBUS_PLAYBACK_DEBUG_INTERFACE      DBUS_PLAYBACK_INTERFACE ".Debug"
+#define DBUS_OBJECT_MANAGER_INTERFACE      "org.freedesktop.DBus.ObjectManager"
 
 /* D-Bus signal & method names */
 #define DBUS_POLICY_NEW_SESSION            "NewSession"
@@ -33,8 +35,13 @@
 #define DBUS_PRIVACY_SIGNAL                "PrivacyOverride"
 #define DBUS_BLUETOOTH_SIGNAL              "BluetoothOverride"
 #define DBUS_MUTE_SIGNAL                   "Mute"
+#define DBUS_INTERFACES_ADDED_SIGNAL       "InterfacesAdded"
+#define DBUS_INTERFACES_REMOVED_SIGNAL     "InterfacesRemoved"
+/* sent by a client to itself to run the local policy, see policy.c */
+#define DBUS_DISPATCH_SIGNAL               "Dispatch"
 
 #define DBUS_PLAYBACK_REQ_STATE_METHOD     "RequestState"
+#define DBUS_PLAYBACK_REQ_STATES_METHOD    "RequestStates"
 #define DBUS_PLAYBACK_REQ_PRIVACY_METHOD   "RequestPrivacyOverride"
 #define DBUS_PLAYBACK_REQ_BLUETOOTH_METHOD "RequestBluetoothOverride"
 #define DBUS_PLAYBACK_REQ_MUTE_METHOD      "RequestMute"
@@ -43,6 +50,11 @@
 #define DBUS_PLAYBACK_GET_PRIVACY_METHOD   "GetPrivacyOverride"
 #define DBUS_PLAYBACK_GET_BLUETOOTH_METHOD "GetBluetoothOverride"
 #define DBUS_PLAYBACK_GET_MUTE_METHOD      "GetMute"
+#define DBUS_PLAYBACK_GET_BOARD_METHOD     "GetStateBoard"
+#define DBUS_PLAYBACK_GET_PEER_METHOD      "GetPeerAddress"
+#define DBUS_PLAYBACK_REGISTER_PEER_METHOD "RegisterPeer"
+#define DBUS_PLAYBACK_GET_RECORDER_METHOD  "GetFlightRecorder"
+#define DBUS_GET_MANAGED_OBJECTS_METHOD    "GetManagedObjects"
 
 /* D-Bus property names */
 #define DBUS_PLAYBACK_STATE_PROP           "State"
@@ -52,8 +64,30 @@
 #define DBUS_PLAYBACK_STREAM_PROP          "Stream"
 #define DBUS_PLAYBACK_ALLOWED_STATE_PROP   "AllowedState"
 
+/* D-Bus manager property names */
+#define DBUS_PLAYBACK_MUTE_PROP            "Mute"
+#define DBUS_PLAYBACK_PRIVACY_PROP         "PrivacyOverride"
+#define DBUS_PLAYBACK_BLUETOOTH_PROP       "BluetoothOverride"
+
 /* D-Bus pathes */
 #define DBUS_ADMIN_PATH                  "/org/freedesktop/DBus"
 #define DBUS_PLAYBACK_MANAGER_PATH       "/org/maemo/Playback/Manager"
 
+/* the playback objects, by object id; the root path serves
+ * org.freedesktop.DBus.ObjectManager for all of them */
+#define PLAYBACK_ROOT_PATH "/org/maemo"
+#define PLAYBACK_PATH_PREFIX PLAYBACK_ROOT_PATH "/playback"
+#define PLAYBACK_PATH PLAYBACK_PATH_PREFIX "%u"
+
+/* D-Bus match rules */
+#define MANAGER_SIGNALS_MATCH \
+  "type='signal',interface='org.maemo.Playback.Manager'," \
+  "path='/org/maemo/Playback/Manager'"
+
+#define MANAGER_OWNER_MATCH \
+  "type='signal', " \
+  "sender='org.freedesktop.DBus',path='/org/freedesktop/DBus', " \
+  "interface='org.freedesktop.DBus', " \
+  "member='NameOwnerChanged',arg0='org.maemo.Playback.Manager'"
+
 #endif /* PLAYBACKDBUS_H */
@@ -0,0 +1,209 @@
+#ifndef PLAYBACKPRIVATE_H
+#define PLAYBACKPRIVATE_H
+
+#include <dbus/dbus.h>
+#include <stdint.h>
+
+#include "libplayback/playback.h"
+
+#define PB_INTERNAL __attribute__((visibility("hidden")))
+
+typedef struct pb_log_ring_s pb_log_ring_t;
+typedef struct pb_loopback_s pb_loopback_t;
+typedef struct pb_dbus_call_s pb_dbus_call_t;
+typedef struct pb_sdbus_s pb_sdbus_t;
+typedef struct pb_policy_s pb_policy_t;
+typedef struct pb_capture_s pb_capture_t;
+typedef struct pb_recorder_s pb_recorder_t;
+
+/* Manager settings as last seen on the connection, see settings.c */
+enum pb_setting_e
+{
+  PB_SETTING_MUTE,
+  PB_SETTING_PRIVACY,
+  PB_SETTING_BLUETOOTH,
+  PB_SETTING_LAST
+};
+
+typedef struct pb_setting_state_s pb_setting_state_t;
+
+/* Round trip times to the manager, see latency.c; in microseconds */
+#define PB_LATENCY_BUCKETS 128
+
+typedef struct pb_latency_s pb_latency_t;
+
+struct pb_latency_s
+{
+  uint32_t ewma;
+  uint32_t deviation;
+  unsigned long samples;
+  uint32_t recent;
+  uint32_t histogram[PB_LATENCY_BUCKETS];
+};
+
+struct pb_setting_state_s
+{
+  int known;
+  int value;
+  int in_flight;
+  int target;
+  int queued;
+  int queued_value;
+};
+
+/* Per connection state, attached to the DBusConnection; the
+ * pb_context_t of the API.  All playbacks of a connection are served by
+ * one fallback handler on PLAYBACK_ROOT_PATH, which finds them by object
+ * id in the playbacks table.  Ids are recycled so the table stays dense.
+ * The outgoing state requests of all playbacks share one scheduler, see
+ * playback.c.  Nothing is shared between connections. */
+typedef struct pb_context_s pb_connection_t;
+
+struct pb_context_s
+{
+  DBusConnection *connection;   /* not referenced, it owns us */
+  pb_playback_t **playbacks;
+  uint32_t size;
+  uint32_t *free_ids;
+  uint32_t n_free;
+  int fallback_registered;
+  int object_manager;           /* InterfacesAdded in place of Hello */
+  int name_requested;
+  pb_log_ring_t *log;
+  pb_capture_t *capture;
+  pb_recorder_t *recorder;
+  int settings_watched;
+  pb_setting_state_t settings[PB_SETTING_LAST];
+  PBMuteCb mute_cb;
+  void *mute_data;
+  PBPrivacyCb privacy_cb;
+  void *privacy_data;
+  PBBluetoothCb bluetooth_cb;
+  void *bluetooth_data;
+  unsigned int window;
+  unsigned int in_flight;
+  int batch_unsupported;
+  pb_board_t *board;
+  DBusConnection *peer;
+  pb_dbus_call_t *peer_calls;
+  int signals_filtered;
+  unsigned int signals_watched; /* match rules, see transport-dbus.c */
+  unsigned int owner_watched;
+  pb_loopback_t *loopback;
+  pb_sdbus_t *sdbus;
+  pb_policy_t *policy;
+  uint8_t priority[PB_CLASS_LAST];
+  pb_req_t *ready_first[PB_PRIORITY_MAX + 1];
+  pb_req_t *ready_last[PB_PRIORITY_MAX + 1];
+  pb_latency_t latency;
+  uint32_t degraded_classes;
+  unsigned int degraded_min_budget;
+  PBDegradedTimer degraded_timer;
+  void *degraded_timer_data;
+  uint64_t degraded_armed;
+  unsigned long degraded_grants;
+  unsigned long degraded_confirmed;
+  unsigned long degraded_reconciled;
+};
+
+pb_connection_t *_pb_connection_get(DBusConnection *connection) PB_INTERNAL;
+
+pb_playback_t *_pb_playback_ref(pb_playback_t *pb) PB_INTERNAL;
+void _pb_playback_unref(void *data) PB_INTERNAL;
+
+/* Has the application go to @pb_state, as when the manager sets the
+ * State property, for a decision made in this process: a local policy,
+ * or a degraded grant the manager answered differently. */
+void _pb_playback_set_local(pb_playback_t *pb, enum pb_state_e pb_state)
+                            PB_INTERNAL;
+
+/* The connection the calls to the manager go over: the peer connection
+ * of pb_peer_connect() while it is up, @connection otherwise. */
+DBusConnection *_pb_manager_route(DBusConnection *connection) PB_INTERNAL;
+
+/* Sends the calls waiting for replies on a lost peer connection again,
+ * see transport-dbus.c; called once the peer is no longer the route. */
+void _pb_peer_lost(pb_connection_t *conn) PB_INTERNAL;
+
+/* Frees the loopback of a connection, dropping the replies and signals
+ * it still holds, see loopback.c */
+void _pb_loopback_free(pb_loopback_t *loopback) PB_INTERNAL;
+
+/* Attaches @engine in place of a manager that is not there: unlike
+ * pb_loopback_attach(), the matches of the bus are still kept, and
+ * @wakeup is set for the application */
+int _pb_loopback_takeover(DBusConnection *connection,
+                          const pb_engine_t *engine, void *data,
+                          PBLoopbackWakeup wakeup) PB_INTERNAL;
+
+/* The local policy, see policy.c */
+void _pb_policy_free(pb_policy_t *policy) PB_INTERNAL;
+
+/* Lets go of the sd_bus of a connection, see transport-sdbus.c; only
+ * built with HAVE_SD_BUS */
+void _pb_sdbus_free(pb_sdbus_t *sdbus) PB_INTERNAL;
+
+uint64_t _pb_time_us(void) PB_INTERNAL;
+void _pb_latency_sample(pb_latency_t *latency, uint64_t usec) PB_INTERNAL;
+uint32_t _pb_latency_percentile(const pb_latency_t *latency,
+                                unsigned int percent) PB_INTERNAL;
+/* How long a state request of @conn may wait for the manager before it
+ * is granted locally, 0 until enough round trips have been seen */
+uint64_t _pb_latency_budget(pb_connection_t *conn) PB_INTERNAL;
+
+/* Sends a Request* call for @setting unless @value is already in effect;
+ * while a call is in flight only the last requested value is kept.
+ * @error_cb reports errors from the manager. */
+typedef void (*PBSettingError)(DBusConnection *connection, const char *error);
+
+int _pb_setting_request(DBusConnection *connection, enum pb_setting_e setting,
+                        int value, PBSettingError error_cb) PB_INTERNAL;
+/* Watches the setting signals, from then on their values are cached */
+void _pb_settings_watch(DBusConnection *connection, pb_connection_t *conn)
+                        PB_INTERNAL;
+
+/* Logging: records are stored in binary form in a per connection ring
+ * and only formatted by pb_log_drain().  @fmt must be a static string and
+ * takes the two long arguments; @str, if not NULL, is copied (truncated)
+ * and printed after the message. */
+int _pb_log_enabled(enum pb_log_level_e level) PB_INTERNAL;
+void _pb_log_record(pb_connection_t *conn, enum pb_log_level_e level,
+                    uint32_t object_id, const char *fmt, const char *str,
+                    long a, long b) PB_INTERNAL;
+void _pb_log_ring_free(pb_log_ring_t *ring) PB_INTERNAL;
+
+#define PB_LOG_EVENT(conn, level, object_id, fmt, str, a, b) do{ \
+  if (_pb_log_enabled(level)) \
+    _pb_log_record(conn, level, object_id, fmt, str, a, b); \
+}while(0)
+
+/* Capture, see capture.c: the messages sent and received on the
+ * connection and the playbacks coming and going, while pb_capture_start()
+ * is in effect */
+void _pb_capture_message(pb_connection_t *conn, enum pb_capture_type_e type,
+                         DBusMessage *message) PB_INTERNAL;
+void _pb_capture_data(pb_connection_t *conn, enum pb_capture_type_e type,
+                      const void *data, uint32_t length) PB_INTERNAL;
+/* a pb_capture_playback_t for @pb, see playback.c */
+void _pb_playback_capture(pb_playback_t *pb, enum pb_capture_type_e type)
+                          PB_INTERNAL;
+void _pb_capture_free(pb_capture_t *capture) PB_INTERNAL;
+
+#define PB_CAPTURE(conn, type, message) do{ \
+  if ((conn)->capture) \
+    _pb_capture_message(conn, type, message); \
+}while(0)
+
+/* The flight recorder, see recorder.c; the playbacks record their
+ * transitions through _playback_record() in playback.c */
+void _pb_recorder_record(pb_connection_t *conn, uint32_t object_id,
+                         enum pb_class_e pb_class, uint32_t flags,
+                         enum pb_recorder_event_e event,
+                         enum pb_state_e pb_state, enum pb_state_e old_state,
+                         uint32_t arg) PB_INTERNAL;
+void _pb_recorder_free(pb_recorder_t *recorder) PB_INTERNAL;
+
+/* object id of records not related to a playback */
+#define PB_LOG_NO_OBJECT UINT32_MAX
+
+#endif /* PLAYBACKPRIVATE_H */
@@ -0,0 +1,28 @@
+#ifndef PLAYBACKPROBES_H
+#define PLAYBACKPROBES_H
+
+/* Static tracepoints (USDT) under the "libplayback" provider.  They are
+ * nops unless a tracer attaches, see bench/pb-latency.bt.
+ *
+ * Playback probes carry: object id, class, state, request pointer.
+ * Setting probes (mute, privacy_override, bluetooth_override) carry the
+ * new value. */
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define PB_PROBE(name, pb, state, req) \
+  DTRACE_PROBE4(libplayback, name, (pb)->object_id, (int)(pb)->pb_class, \
+                (int)(state), (req))
+#define PB_PROBE_SETTING(name, value) \
+  DTRACE_PROBE1(libplayback, name, (int)(value))
+
+#else
+
+#define PB_PROBE(name, pb, state, req) do{}while(0)
+#define PB_PROBE_SETTING(name, value) do{}while(0)
+
+#endif /* HAVE_SYS_SDT_H */
+
+#endif /* PLAYBACKPROBES_H */
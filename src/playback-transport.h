@@ -0,0 +1,152 @@
+#ifndef PLAYBACKTRANSPORT_H
+#define PLAYBACKTRANSPORT_H
+
+#include <sys/types.h>
+
+#include "playback-private.h"
+
+/* The calls to the manager and the signals from it go through the
+ * transport of the connection: libdbus to the manager (transport-dbus.c),
+ * an sd_bus given to pb_sdbus_attach() when built with SDBUS=1
+ * (transport-sdbus.c), or an engine in the same process attached with
+ * pb_loopback_attach() (loopback.c), which is also how the local policy
+ * stands in for a missing manager (policy.c).  Replies and signals reach
+ * the library decoded, so the callers never see a DBusMessage.
+ *
+ * A call ends exactly once: either its reply callback runs, from the
+ * dispatch of the transport and never from within the call itself, or
+ * it is cancelled and no callback runs.  The free function of its data
+ * runs in both cases, and the call is gone afterwards.  A call that
+ * could not be made returns FALSE and leaves the data to the caller. */
+
+typedef struct pb_call_s pb_call_t;
+typedef struct pb_reply_s pb_reply_t;
+typedef struct pb_state_args_s pb_state_args_t;
+typedef struct pb_transport_s pb_transport_t;
+
+struct pb_reply_s
+{
+  const char *error;            /* D-Bus error name, NULL on success */
+  const char *message;          /* error message, may be NULL */
+  const enum pb_state_e *states; /* granted states, or the allowed ones */
+  unsigned int n_states;
+  unsigned int settings;        /* 1 << pb_setting_e of the values found */
+  int values[PB_SETTING_LAST];
+};
+
+typedef void (*PBCallReply)(const pb_reply_t *reply, void *data);
+
+/* Common head of the calls of all transports */
+struct pb_call_s
+{
+  const pb_transport_t *transport;
+  PBCallReply reply;
+  void *data;
+  DBusFreeFunction free_data;
+};
+
+/* What the manager needs to know about a playback */
+struct pb_state_args_s
+{
+  pb_playback_t *pb;
+  uint32_t object_id;
+  enum pb_class_e pb_class;
+  uint32_t flags;
+  enum pb_state_e pb_state;
+  pid_t pid;
+  const char *stream;
+};
+
+/* Signals to watch, see pb_transport_s.watch */
+#define PB_WATCH_SIGNALS 0x1    /* the manager's broadcasts */
+#define PB_WATCH_OWNER   0x2    /* the manager coming and going */
+#define PB_WATCH_ASYNC   0x4    /* do not wait for the bus to confirm */
+
+/* Playback announcements, see pb_transport_s.announce */
+enum pb_announce_e
+{
+  PB_ANNOUNCE_HELLO,
+  PB_ANNOUNCE_STATE,
+  PB_ANNOUNCE_GOODBYE
+};
+
+struct pb_transport_s
+{
+  const char *name;
+
+  /* RequestState for one playback, RequestStates for several; the reply
+   * has one state per playback */
+  int (*request_states)(DBusConnection *connection,
+                        const pb_state_args_t *args, unsigned int n,
+                        pb_call_t **call, PBCallReply reply, void *data,
+                        DBusFreeFunction free_data);
+  int (*get_allowed_state)(DBusConnection *connection,
+                           const pb_state_args_t *args, pb_call_t **call,
+                           PBCallReply reply, void *data,
+                           DBusFreeFunction free_data);
+  int (*request_setting)(DBusConnection *connection,
+                         enum pb_setting_e setting, int value,
+                         pb_call_t **call, PBCallReply reply, void *data,
+                         DBusFreeFunction free_data);
+  /* one setting, or all of them for PB_SETTING_LAST */
+  int (*get_settings)(DBusConnection *connection, enum pb_setting_e setting,
+                      pb_call_t **call, PBCallReply reply, void *data,
+                      DBusFreeFunction free_data);
+  void (*cancel)(pb_call_t *call);
+
+  /* The signals are delivered to the _pb_manager_* functions below;
+   * watch() with no flags only makes sure they are decoded */
+  void (*watch)(DBusConnection *connection, unsigned int what);
+  void (*unwatch)(DBusConnection *connection, unsigned int what);
+
+  /* Hello, Notify and Goodbye of a playback */
+  void (*announce)(DBusConnection *connection, const pb_state_args_t *args,
+                   enum pb_announce_e what);
+};
+
+extern const pb_transport_t _pb_dbus_transport PB_INTERNAL;
+extern const pb_transport_t _pb_loopback_transport PB_INTERNAL;
+#ifdef HAVE_SD_BUS
+extern const pb_transport_t _pb_sdbus_transport PB_INTERNAL;
+#endif
+
+const pb_transport_t *_pb_transport(pb_connection_t *conn) PB_INTERNAL;
+void _pb_call_cancel(pb_call_t *call) PB_INTERNAL;
+void _pb_call_init(pb_call_t *call, const pb_transport_t *transport,
+                   PBCallReply reply, void *data, DBusFreeFunction free_data)
+                   PB_INTERNAL;
+/* Runs the free function of the data of a call that has ended */
+void _pb_call_finish(pb_call_t *call) PB_INTERNAL;
+
+/* Signals from the manager, whatever the transport */
+void _pb_manager_allowed_state(DBusConnection *connection,
+                               enum pb_class_e pb_class,
+                               const int allowed_state[]) PB_INTERNAL;
+void _pb_manager_setting(DBusConnection *connection,
+                         enum pb_setting_e setting, int value) PB_INTERNAL;
+/* the manager went away (@present FALSE) or a new one took over */
+void _pb_manager_owner(DBusConnection *connection, int present) PB_INTERNAL;
+
+/* Sends Hello for all the playbacks of @conn, on its transport */
+void _pb_connection_hello(pb_connection_t *conn) PB_INTERNAL;
+
+/* Switches between the manager and the local policy, if there is one,
+ * when the manager comes or goes; TRUE if the transport changed, see
+ * policy.c */
+int _pb_policy_manager(DBusConnection *connection, int present) PB_INTERNAL;
+
+/* Forgets the settings of a manager that went away, see settings.c */
+void _pb_settings_forget(DBusConnection *connection) PB_INTERNAL;
+/* Get call for one setting whose @reply gets the connection as data */
+int _pb_setting_get(DBusConnection *connection, enum pb_setting_e setting,
+                    PBCallReply reply) PB_INTERNAL;
+
+/* Per setting callbacks of the applications, see mute.c, privacy.c and
+ * bluetooth.c */
+void _pb_mute_changed(DBusConnection *connection, int mute) PB_INTERNAL;
+void _pb_privacy_changed(DBusConnection *connection, int override)
+                         PB_INTERNAL;
+void _pb_bluetooth_changed(DBusConnection *connection, int override)
+                           PB_INTERNAL;
+
+#endif /* PLAYBACKTRANSPORT_H */
@@ -5,19 +5,28 @@
 
 #include "libplayback/playback.h"
 #include "playback-dbus.h"
+#include "playback-probes.h"
+#include "playback-transport.h"
 
-#define PLAYBACK_PATH "/org/maemo/playback%u"
 
 static DBusHandlerResult _dbus_playback_message(DBusConnection *connection,
                                                 DBusMessage *message,
                                                 void *user_data);
 
-static uint32_t object_id = 0;
-static int name_requested = FALSE;
+static void _pb_request_free(pb_req_t *req);
+static void _sched_release(pb_req_t *req);
+static void _degraded_arm(pb_req_t *req);
+static void _playback_announce_object(pb_playback_t *pb,
+                                      enum pb_announce_e what);
+
+static DBusHandlerResult _dbus_playback_fallback(DBusConnection *connection,
+                                                 DBusMessage *message,
+                                                 void *user_data);
+
 static DBusObjectPathVTable _dbus_playback_table =
 {
   NULL,
-  _dbus_playback_message,
+  _dbus_playback_fallback,
   NULL,
   NULL,
   NULL,
@@ -38,11 +47,18 @@ struct pbreq_listhead_s
 {
   struct pb_req_list_s *first;
   struct pb_req_list_s *last;
+  unsigned int length;
 };
 
 struct pb_playback_s
 {
+  int refcount;
+  int destroyed;
+  int registered;
+  int signals_matched;
+  int object_announced;         /* with InterfacesAdded, not Hello */
   DBusConnection *connection;
+  pb_connection_t *conn;
   uint32_t object_id;
   enum pb_class_e pb_class;
   enum pb_state_e pb_state;
@@ -55,17 +71,46 @@ struct pb_playback_s
   pid_t pid;
   char *stream;
   pbreq_listhead_t req_list;
+  unsigned int queue_capacity;
+  enum pb_queue_policy_e queue_policy;
+  unsigned int queue_max_depth;
+  unsigned long queue_rejected;
+  unsigned long queue_dropped;
 };
 
+typedef struct pb_batch_s pb_batch_t;
+
 struct pb_req_s
 {
   pb_playback_t *pb;
   DBusMessage *message;
-  DBusPendingCall *pending;
+  pb_call_t *call;
   PBStateReply state_reply;
   enum pb_state_e pb_state;
   int finished;
   void *data;
+  int scheduled;
+  int priority;
+  int in_flight;
+  pb_req_t *sched_next;
+  pb_batch_t *batch;
+  unsigned int batch_index;
+  uint64_t sent;
+  int local;
+};
+
+/* One RequestStates call for the first requests of several playbacks.
+ * Owned by its call; requests freed before the reply leave an empty
+ * slot. */
+struct pb_batch_s
+{
+  pb_call_t *call;
+  pb_connection_t *conn;
+  int replied;
+  uint64_t sent;
+  unsigned int live;
+  unsigned int n;
+  pb_req_t *reqs[];
 };
 
 static int
@@ -95,20 +140,22 @@ pb_list_append(pbreq_listhead_t *head,
       head->last = item;
     }
 
+    head->length++;
+
     return TRUE;
   }
 
   return FALSE;
 }
 
-static void
+static int
 pb_list_remove(pbreq_listhead_t *head,
                void *data)
 {
   pb_req_list_t *l, *prev = NULL;
 
   if (!data)
-    return;
+    return FALSE;
 
   for(l = head->first; l; l = l->next)
   {
@@ -128,12 +175,16 @@ pb_list_remove(pbreq_listhead_t *head,
       if (head->first == l)
         head->first = l->next;
 
+      head->length--;
       free(l);
-      break;
+
+      return TRUE;
     }
 
     prev = l;
   }
+
+  return FALSE;
 }
 
 static void
@@ -149,152 +200,331 @@ pb_list_free(pbreq_listhead_t *head)
 
     head->first = NULL;
     head->last = NULL;
+    head->length = 0;
 }
 
 static int
-_add_property(DBusMessageIter *iter,
-              const char *name,
-              const char *val)
+_pb_connection_alloc_id(pb_connection_t *conn,
+                        uint32_t *id)
 {
-  DBusMessageIter valIter;
-  DBusMessageIter dictIter;
+  if (conn->n_free)
+  {
+    *id = conn->free_ids[--conn->n_free];
+    return TRUE;
+  }
 
-  if (!dbus_message_iter_open_container(iter, DBUS_TYPE_DICT_ENTRY, NULL,
-                                        &dictIter))
+  if (!(conn->size & (conn->size - 1)))
   {
-    return FALSE;
+    uint32_t size = conn->size ? 2 * conn->size : 8;
+    pb_playback_t **playbacks;
+    uint32_t *free_ids;
+
+    playbacks = (pb_playback_t **)realloc(conn->playbacks,
+                                          size * sizeof(pb_playback_t *));
+
+    if (!playbacks)
+      return FALSE;
+
+    conn->playbacks = playbacks;
+    free_ids = (uint32_t *)realloc(conn->free_ids, size * sizeof(uint32_t));
+
+    if (!free_ids)
+      return FALSE;
+
+    conn->free_ids = free_ids;
   }
 
-  if (!dbus_message_iter_append_basic(&dictIter, DBUS_TYPE_STRING, &name))
-    return FALSE;
+  conn->playbacks[conn->size] = NULL;
+  *id = conn->size++;
+
+  return TRUE;
+}
+
+static void
+_pb_connection_release_id(pb_connection_t *conn,
+                          uint32_t id)
+{
+  conn->playbacks[id] = NULL;
+  conn->free_ids[conn->n_free++] = id;
+}
 
-  if (!dbus_message_iter_open_container(&dictIter, DBUS_TYPE_VARIANT,
-                                        DBUS_TYPE_STRING_AS_STRING, &valIter))
+static pb_playback_t *
+_pb_connection_lookup(pb_connection_t *conn,
+                      const char *path)
+{
+  const char *p;
+  uint32_t id = 0;
+
+  if (!path || strncmp(path, PLAYBACK_PATH_PREFIX,
+                       sizeof(PLAYBACK_PATH_PREFIX) - 1))
   {
-    return FALSE;
+    return NULL;
   }
 
-  if (!dbus_message_iter_append_basic(&valIter, DBUS_TYPE_STRING, &val))
-    return FALSE;
+  p = path + sizeof(PLAYBACK_PATH_PREFIX) - 1;
 
-  dbus_message_iter_close_container(&dictIter, &valIter);
-  dbus_message_iter_close_container(iter, &dictIter);
+  /* the canonical "%u" form only: no sign, no leading zeros */
+  if (*p < '0' || *p > '9' || (*p == '0' && p[1]))
+    return NULL;
 
-  return TRUE;
+  for (; *p; p++)
+  {
+    if (*p < '0' || *p > '9')
+      return NULL;
+
+    id = id * 10 + (*p - '0');
+
+    if (id >= conn->size)
+      return NULL;
+  }
+
+  return conn->playbacks[id];
+}
+
+pb_playback_t *
+_pb_playback_ref(pb_playback_t *pb)
+{
+  pb->refcount++;
+
+  return pb;
+}
+
+void
+_pb_playback_unref(void *data)
+{
+  pb_playback_t *pb = (pb_playback_t *)data;
+
+  if (--pb->refcount > 0)
+    return;
+
+  free(pb->stream);
+  dbus_connection_unref(pb->connection);
+  free(pb);
 }
 
 static void
-_playback_hello(pb_playback_t *pb)
+_playback_args(pb_playback_t *pb,
+               enum pb_state_e pb_state,
+               pb_state_args_t *args)
 {
-  DBusMessage *message;
-  char path[256];
+  args->pb = pb;
+  args->object_id = pb->object_id;
+  args->pb_class = pb->pb_class;
+  args->flags = pb->flags;
+  args->pb_state = pb_state;
+  args->pid = pb->pid;
+  args->stream = pb->stream;
+}
 
-  assert(pb != ((void *)0));
+/* Records a transition of @pb in the flight recorder, see recorder.c */
+static void
+_playback_record(pb_playback_t *pb,
+                 enum pb_recorder_event_e event,
+                 enum pb_state_e pb_state,
+                 uint32_t arg)
+{
+  _pb_recorder_record(pb->conn, pb->object_id, pb->pb_class, pb->flags,
+                      event, pb_state, pb->pb_state, arg);
+}
 
-  snprintf(path, sizeof(path), PLAYBACK_PATH, pb->object_id);
-  message = dbus_message_new_signal(path,
-                                    DBUS_PLAYBACK_INTERFACE,
-                                    DBUS_HELLO_SIGNAL);
+static void
+_playback_announce(pb_playback_t *pb,
+                   enum pb_announce_e what)
+{
+  pb_state_args_t args;
 
-  if (message)
+  /* a playback is retired the way it was announced, whatever the mode
+   * of the connection is by then; the loopback engine has no use for
+   * the objects */
+  if (what == PB_ANNOUNCE_HELLO)
+    pb->object_announced = pb->conn->object_manager && !pb->conn->loopback;
+
+  if (what != PB_ANNOUNCE_STATE && pb->object_announced &&
+      !pb->conn->loopback)
   {
-    dbus_connection_send(pb->connection, message, NULL);
-    dbus_message_unref(message);
+    _playback_announce_object(pb, what);
+    return;
   }
+
+  _playback_args(pb, pb->pb_state, &args);
+  _pb_transport(pb->conn)->announce(pb->connection, &args, what);
 }
 
-static DBusHandlerResult
-_nameowner_filter(DBusConnection *connection,
-                  DBusMessage *message,
-                  void *user_data)
+static void
+_allowed_states_changed(pb_playback_t *pb)
 {
-  pb_playback_t *pb = (pb_playback_t *)user_data;
+  uint32_t mask = pb->allowed_state[PB_STATE_STOP] << PB_STATE_STOP |
+                  pb->allowed_state[PB_STATE_PLAY] << PB_STATE_PLAY;
 
+  /* the state argument is the allowed set as a bit mask */
+  PB_PROBE(allowed_state, pb, mask, NULL);
+  _playback_record(pb, PB_RECORDER_ALLOWED_STATE, pb->pb_state, mask);
+  PB_LOG_EVENT(pb->conn, PB_LOG_LEVEL_DEBUG, pb->object_id,
+               "allowed states stop %ld play %ld", NULL,
+               pb->allowed_state[PB_STATE_STOP],
+               pb->allowed_state[PB_STATE_PLAY]);
 
-  if (!user_data)
-    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  if (pb->state_hint_handler)
+    pb->state_hint_handler(pb, pb->allowed_state, pb->state_hint_handler_data);
+}
+
+static void
+_update_allowed_states(pb_playback_t *pb,
+                       const int allowed_state[])
+{
+  pb->allowed_state[PB_STATE_NONE] = allowed_state[PB_STATE_NONE];
+  pb->allowed_state[PB_STATE_STOP] = allowed_state[PB_STATE_STOP];
+  pb->allowed_state[PB_STATE_PLAY] = allowed_state[PB_STATE_PLAY];
+  _allowed_states_changed(pb);
+}
+
+void
+_pb_manager_allowed_state(DBusConnection *connection,
+                          enum pb_class_e pb_class,
+                          const int allowed_state[])
+{
+  pb_connection_t *conn = _pb_connection_get(connection);
+  uint32_t id;
+
+  if (!conn)
+    return;
 
-  if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_SIGNAL &&
-      !strcmp(dbus_message_get_interface(message), DBUS_ADMIN_INTERFACE) &&
-      !strcmp(dbus_message_get_member(message), DBUS_NAME_OWNER_CHANGED_SIGNAL))
+  /* the hint handlers may destroy playbacks, but ids are only reused by
+   * new ones */
+  for (id = 0; id < conn->size; id++)
   {
-    const char *name, *old, *new;
-    DBusError error;
+    pb_playback_t *pb = conn->playbacks[id];
 
-    dbus_error_init(&error);
-    dbus_message_get_args(message, &error,
-                          DBUS_TYPE_STRING, &name,
-                          DBUS_TYPE_STRING, &old,
-                          DBUS_TYPE_STRING, &new,
-                          DBUS_TYPE_INVALID);
+    if (pb && pb->pb_class == pb_class)
+      _update_allowed_states(pb, allowed_state);
+  }
+}
 
-    if (dbus_error_is_set(&error))
-      dbus_error_free(&error);
-    else if (name && old && new && *new &&
-             !strcmp(name, DBUS_PLAYBACK_MANAGER_SERVICE))
-    {
-      _playback_hello(pb);
-    }
+void
+_pb_connection_hello(pb_connection_t *conn)
+{
+  uint32_t id;
+
+  for (id = 0; id < conn->size; id++)
+  {
+    if (conn->playbacks[id])
+      _playback_announce(conn->playbacks[id], PB_ANNOUNCE_HELLO);
   }
+}
 
-  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+void
+_pb_manager_owner(DBusConnection *connection,
+                  int present)
+{
+  pb_connection_t *conn = _pb_connection_get(connection);
+  int switched;
+
+  /* a new manager may not share the old one's settings */
+  _pb_settings_forget(connection);
+
+  if (!conn)
+    return;
+
+  switched = _pb_policy_manager(connection, present);
+
+  if (!present && !switched)
+    return;
+
+  if (present)
+    conn->batch_unsupported = FALSE;
+
+  _pb_connection_hello(conn);
 }
 
 static void
-_update_allowed_states(pb_playback_t *pb,
-                       char **allowed_states,
-                       int len)
+_playback_subscribe(pb_playback_t *pb)
 {
-  int i;
+  if (pb->signals_matched)
+    return;
 
-  pb->allowed_state[PB_STATE_NONE] = FALSE;
-  pb->allowed_state[PB_STATE_STOP] = FALSE;
-  pb->allowed_state[PB_STATE_PLAY] = FALSE;
+  _pb_transport(pb->conn)->watch(pb->connection, PB_WATCH_SIGNALS);
+  pb->signals_matched = TRUE;
+}
 
-  for (i = 0; i < len; i++)
-    pb->allowed_state[pb_string_to_state(allowed_states[i])] = TRUE;
+void
+_pb_playback_capture(pb_playback_t *pb,
+                     enum pb_capture_type_e type)
+{
+  pb_capture_playback_t record;
 
-  if (pb->state_hint_handler)
-    pb->state_hint_handler(pb, pb->allowed_state, pb->state_hint_handler_data);
+  if (!pb->conn->capture)
+    return;
+
+  record.object_id = pb->object_id;
+  record.pb_class = pb->pb_class;
+  record.flags = pb->flags | (pb->registered ? 0 : PB_FLAG_LAZY);
+  record.pb_state = pb->pb_state;
+  _pb_capture_data(pb->conn, type, &record, sizeof(record));
 }
 
-static DBusHandlerResult
-_allowed_state_filter(DBusConnection *connection,
-                      DBusMessage *message,
-                      void *user_data)
+static void
+_playback_send(pb_playback_t *pb,
+               DBusMessage *message)
 {
-  pb_playback_t *pb = (pb_playback_t *)user_data;
+  dbus_connection_send(pb->connection, message, NULL);
+  PB_CAPTURE(pb->conn, PB_CAPTURE_SENT, message);
+}
 
-  if (!pb)
-    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+/* Refreshes the allowed states of an unsubscribed playback from the
+ * state board; TRUE if the board had them. */
+static int
+_playback_read_board(pb_playback_t *pb)
+{
+  return !pb->signals_matched && pb->conn->board &&
+         pb_board_read_allowed_state(pb->conn->board, pb->pb_class,
+                                     pb->allowed_state);
+}
 
-  if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_SIGNAL &&
-      !strcmp(dbus_message_get_interface(message),
-              DBUS_PLAYBACK_MANAGER_INTERFACE) &&
-      !strcmp(dbus_message_get_member(message),
-              DBUS_PLAYBACK_ALLOWED_STATE_PROP))
+static void
+_connection_register_fallback(DBusConnection *connection,
+                              pb_connection_t *conn)
+{
+  if (!conn->fallback_registered)
   {
-    DBusError error;
-    const char *cls;
-    int len;
-    char **states;
+    conn->fallback_registered =
+        dbus_connection_register_fallback(connection, PLAYBACK_ROOT_PATH,
+                                          &_dbus_playback_table, conn);
+  }
+}
+
+/* Makes the playback visible on the bus: the manager learns about it
+ * from the Hello signal and may call it from then on. */
+static void
+_playback_register(pb_playback_t *pb)
+{
+  DBusConnection *connection = pb->connection;
+  DBusError error;
+
+  if (pb->registered)
+    return;
+
+  pb->registered = TRUE;
 
+  /* the name is only of use to a manager on the bus */
+  if (!pb->conn->name_requested && !pb->conn->loopback)
+  {
     dbus_error_init(&error);
-    dbus_message_get_args(message, &error,
-                          DBUS_TYPE_STRING, &cls,
-                          DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &states, &len,
-                          DBUS_TYPE_INVALID);
 
-    if (dbus_error_is_set(&error))
+    if (dbus_bus_request_name(connection, DBUS_PLAYBACK_SERVICE, 0, &error) < 0)
       dbus_error_free(&error);
-    else if (pb->pb_class == pb_string_to_class(cls))
-    {
-      _update_allowed_states(pb, states, len);
-      dbus_free_string_array(states);
-    }
+    else
+      pb->conn->name_requested = TRUE;
   }
 
-  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  /* with a state board, the broadcasts only wake up the playbacks that
+   * ask for them */
+  if (!pb->conn->board)
+    _playback_subscribe(pb);
+
+  _pb_transport(pb->conn)->watch(connection, PB_WATCH_OWNER);
+  _connection_register_fallback(connection, pb->conn);
+  pb->conn->playbacks[pb->object_id] = pb;
+  _playback_announce(pb, PB_ANNOUNCE_HELLO);
 }
 
 pb_playback_t *
@@ -306,8 +536,6 @@ pb_playback_new_2(DBusConnection *connection,
                   void *data)
 {
   pb_playback_t *pb;
-  char path[256];
-  DBusError error;
 
   assert(connection != ((void *)0) && state_req_handler != ((void *)0));
 
@@ -316,58 +544,45 @@ pb_playback_new_2(DBusConnection *connection,
   if (!pb)
     return NULL;
 
+  if (!(pb->conn = _pb_connection_get(connection)) ||
+      !_pb_connection_alloc_id(pb->conn, &pb->object_id))
+  {
+    free(pb);
+    return NULL;
+  }
+
+  pb->refcount = 1;
   pb->pb_state = pb_state;
   pb->pb_class = pb_class;
   pb->state_req_handler = state_req_handler;
-  pb->object_id = object_id;
   pb->state_req_handler_data = data;
   pb->stream = NULL;
-  pb->connection = connection;
-  pb->flags = flags;
+  pb->connection = dbus_connection_ref(connection);
+  pb->flags = flags & ~PB_FLAG_LAZY;
   pb->allowed_state[PB_STATE_NONE] = TRUE;
   pb->allowed_state[PB_STATE_STOP] = TRUE;
   pb->allowed_state[PB_STATE_PLAY] = TRUE;
   pb->pid = getpid();
 
-  object_id += 1;
-
-  if (!name_requested)
-  {
-    dbus_error_init(&error);
-
-    if (dbus_bus_request_name(connection, DBUS_PLAYBACK_SERVICE, 0, &error) < 0)
-      dbus_error_free(&error);
-    else
-      name_requested = TRUE;
-  }
-
-  dbus_error_init(&error);
-  dbus_bus_add_match(connection,
-                     "type='signal',interface='org.maemo.Playback.Manager',path='/org/maemo/Playback/Manager'",
-                     &error);
+  if (!(flags & PB_FLAG_LAZY))
+    _playback_register(pb);
 
-  if (dbus_error_is_set(&error))
-    dbus_error_free(&error);
+  _pb_playback_capture(pb, PB_CAPTURE_PLAYBACK);
 
-  dbus_error_init(&error);
-  dbus_bus_add_match(connection,
-                     "type='signal', "
-                     "sender='org.freedesktop.DBus',path='/org/freedesktop/DBus', "
-                     "interface='org.freedesktop.DBus', "
-                     "member='NameOwnerChanged',arg0='org.maemo.Playback.Manager'",
-                     &error);
+  return pb;
+}
 
-  if (dbus_error_is_set(&error))
-    dbus_error_free(&error);
+void
+pb_set_object_manager(DBusConnection *connection,
+                      int enable)
+{
+  pb_connection_t *conn;
 
-  dbus_connection_add_filter(connection, _nameowner_filter, pb, NULL);
-  dbus_connection_add_filter(connection, _allowed_state_filter, pb, NULL);
-  snprintf(path, sizeof(path), PLAYBACK_PATH, pb->object_id);
-  dbus_connection_register_object_path(
-        connection, path, &_dbus_playback_table, pb);
-  _playback_hello(pb);
+  if (!connection || !(conn = _pb_connection_get(connection)))
+    return;
 
-  return pb;
+  conn->object_manager = !!enable;
+  _connection_register_fallback(connection, conn);
 }
 
 pb_playback_t *
@@ -384,32 +599,40 @@ pb_playback_new(DBusConnection *connection,
 void
 pb_playback_destroy(pb_playback_t *pb)
 {
+  const pb_transport_t *transport;
   pb_req_t *req;
-  DBusMessage *message;
-  char path[256];
+  pb_req_list_t *l;
 
   if (!pb)
     return;
 
-  dbus_connection_remove_filter(pb->connection, _nameowner_filter, pb);
-  dbus_connection_remove_filter(pb->connection, _allowed_state_filter, pb);
+  /* recorded first, a replay has no use for what destroying sends */
+  _pb_playback_capture(pb, PB_CAPTURE_DESTROY);
+
   req = pb_playback_req_state(pb, PB_STATE_STOP, NULL, NULL);
   pb_playback_req_completed(pb, req);
-  snprintf(path, sizeof(path), PLAYBACK_PATH, pb->object_id);
-  dbus_connection_unregister_object_path(pb->connection, path);
-  message = dbus_message_new_signal(path,
-                                    DBUS_PLAYBACK_INTERFACE,
-                                    DBUS_GOODBYE_SIGNAL);
 
-  if (message)
+  /* From here on nothing may call back into the application, and the
+   * requests still queued are owned by us. */
+  pb->destroyed = TRUE;
+
+  for (l = pb->req_list.first; l; l = l->next)
+    _pb_request_free((pb_req_t *)l->data);
+
+  pb_list_free(&pb->req_list);
+  _pb_connection_release_id(pb->conn, pb->object_id);
+
+  if (!pb->registered)
   {
-    dbus_connection_send(pb->connection, message, 0);
-    dbus_message_unref(message);
+    _pb_playback_unref(pb);
+    return;
   }
 
-  free(pb->stream);
-  pb->stream = NULL;
-  pb_list_free(&pb->req_list);
+  transport = _pb_transport(pb->conn);
+  transport->unwatch(pb->connection, pb->signals_matched ?
+                     PB_WATCH_SIGNALS | PB_WATCH_OWNER : PB_WATCH_OWNER);
+  _playback_announce(pb, PB_ANNOUNCE_GOODBYE);
+  _pb_playback_unref(pb);
 }
 
 static pb_req_t *
@@ -422,16 +645,41 @@ _pb_request_new(pb_playback_t *pb)
   req = (pb_req_t *)calloc(sizeof(pb_req_t), 1);
 
   if (req)
-    req->pb = pb;
+    req->pb = _pb_playback_ref(pb);
 
   return req;
 }
 
+static void
+_pb_request_free(pb_req_t *req)
+{
+  pb_batch_t *batch = req->batch;
+
+  _sched_release(req);
+
+  if (batch)
+  {
+    batch->reqs[req->batch_index] = NULL;
+
+    if (!--batch->live && !batch->replied)
+      _pb_call_cancel(batch->call);
+  }
+
+  _pb_call_cancel(req->call);
+
+  if (req->message)
+    dbus_message_unref(req->message);
+
+  _pb_playback_unref(req->pb);
+  free(req);
+}
+
 void
 pb_playback_set_stream(pb_playback_t *pb,
                        char *stream)
 {
-  printf("> set_stream '%s'\n", stream);
+  PB_LOG_EVENT(pb->conn, PB_LOG_LEVEL_DEBUG, pb->object_id, "set_stream", stream,
+               0, 0);
 
   if (stream)
   {
@@ -448,193 +696,842 @@ pb_playback_set_pid(pb_playback_t *pb,
 }
 
 static void
-_request_state_reply(DBusPendingCall *pending,
-                     void *user_data)
+_request_reply_error(pb_req_t *req,
+                     const char *name,
+                     const char *message)
 {
-  pb_req_t *req = (pb_req_t *)user_data;
-  DBusMessage *reply;
-  DBusError error;
-  const char *state;
+  _playback_record(req->pb, strcmp(name, DBUS_ERROR_SERVICE_UNKNOWN) ?
+                   PB_RECORDER_DENIED : PB_RECORDER_GRANTED,
+                   req->pb_state, 0);
 
-  if (!pending || !req || req->pending != pending)
+  if (!req->state_reply)
     return;
 
-  reply = dbus_pending_call_steal_reply(pending);
-  dbus_error_init(&error);
-
-  if (dbus_set_error_from_message(&error, reply))
+  if (!strcmp(name, DBUS_ERROR_SERVICE_UNKNOWN))
   {
-    if (req->state_reply)
-    {
-      if (dbus_error_has_name(&error, DBUS_ERROR_SERVICE_UNKNOWN))
-      {
-        req->finished = TRUE;
-        req->state_reply(req->pb, req->pb_state, NULL, req, req->data);
-      }
-      else
-        req->state_reply(req->pb, PB_STATE_NONE, error.message, req, req->data);
-    }
-
-    dbus_error_free(&error);
+    PB_LOG_EVENT(req->pb->conn, PB_LOG_LEVEL_INFO, req->pb->object_id,
+                 "no manager, state %ld granted locally", NULL,
+                 req->pb_state, 0);
+    req->finished = TRUE;
+    req->state_reply(req->pb, req->pb_state, NULL, req, req->data);
   }
   else
   {
-    if (dbus_message_get_args(reply, &error,
-                              DBUS_TYPE_STRING, &state,
-                              DBUS_TYPE_INVALID))
-    {
-      if (req->state_reply)
-      {
-        req->finished = TRUE;
-        req->state_reply(
-              req->pb, pb_string_to_state(state), NULL, req, req->data);
-      }
-    }
-    else if (req->state_reply)
-    {
-        req->state_reply(req->pb, PB_STATE_NONE, "Invalid reply arguments",
-                         req, req->data);
-    }
+    PB_LOG_EVENT(req->pb->conn, PB_LOG_LEVEL_WARNING, req->pb->object_id,
+                 "state %ld request failed", name, req->pb_state, 0);
+    req->state_reply(req->pb, PB_STATE_NONE, message, req, req->data);
   }
-
-  dbus_message_unref(reply);
 }
 
-pb_req_t *
-pb_playback_req_state(pb_playback_t *pb,
-                      enum pb_state_e pb_state,
-                      PBStateReply state_reply,
-                      void *data)
+/* Measures the round trip of a state request that the manager answered */
+static void
+_manager_rtt(pb_connection_t *conn,
+             uint64_t sent,
+             const pb_reply_t *reply)
 {
-  pb_req_t *req = NULL;
-  const char *pb_state_string;
-  const char *stream;
-  char _path[256];
-  const char *path = _path;
-  char _pid[64];
-  const char *pid = _pid;
-  DBusMessage *message;
+  if (reply->error && (!strcmp(reply->error, DBUS_ERROR_SERVICE_UNKNOWN) ||
+                       !strcmp(reply->error, DBUS_ERROR_NO_REPLY)))
+    return;
 
-  if (!pb || !state_reply)
-    return NULL;
+  _pb_latency_sample(&conn->latency, _pb_time_us() - sent);
+}
 
-  message = dbus_message_new_method_call(DBUS_PLAYBACK_MANAGER_SERVICE,
-                                         DBUS_PLAYBACK_MANAGER_PATH,
-                                         DBUS_PLAYBACK_MANAGER_INTERFACE,
-                                         DBUS_PLAYBACK_REQ_STATE_METHOD);
+/* @state is NULL if the reply had no state for @req */
+static void
+_request_reply_state(pb_req_t *req,
+                     const enum pb_state_e *state)
+{
+  if (state && *state != PB_STATE_NONE)
+    _playback_record(req->pb, PB_RECORDER_GRANTED, *state, 0);
+  else
+    _playback_record(req->pb, PB_RECORDER_DENIED, req->pb_state, 0);
 
-  if (!message)
-    return NULL;
+  if (!req->state_reply)
+    return;
 
-  if (!(req = _pb_request_new(pb)))
+  if (state)
   {
-    state_reply(pb, PB_STATE_NONE,
-                "Unable to create the request handler", NULL, data);
-    dbus_message_unref(message);
-    return NULL;
+    req->finished = TRUE;
+    req->state_reply(req->pb, *state, NULL, req, req->data);
   }
+  else
+  {
+    req->state_reply(req->pb, PB_STATE_NONE, "Invalid reply arguments", req,
+                     req->data);
+  }
+}
 
-  snprintf(_pid, sizeof(_pid), "%ld", (long)pb->pid);
-  pb_state_string = pb_state_to_string(pb_state);
-  stream = pb->stream;
+static void
+_request_state_reply(const pb_reply_t *reply,
+                     void *data)
+{
+  pb_req_t *req = (pb_req_t *)data;
 
-  if (!stream)
-    stream = "";
+  /* the call ends with this reply */
+  req->call = NULL;
+  _manager_rtt(req->pb->conn, req->sent, reply);
+  PB_PROBE(request_reply, req->pb, req->pb_state, req);
+  _sched_release(req);
 
-  snprintf(_path, sizeof(_path), PLAYBACK_PATH, pb->object_id);
-  dbus_message_append_args(message,
-                           DBUS_TYPE_OBJECT_PATH, &path,
-                           DBUS_TYPE_STRING, &pb_state_string,
-                           DBUS_TYPE_STRING, &pid,
-                           DBUS_TYPE_STRING, &stream,
-                           DBUS_TYPE_INVALID);
-  req->pb_state = pb_state;
-  req->state_reply = state_reply;
-  req->data = data;
-  req->finished = FALSE;
+  if (reply->error)
+    _request_reply_error(req, reply->error, reply->message);
+  else
+    _request_reply_state(req, reply->n_states ? reply->states : NULL);
+}
 
-  if (pb_list_empty(&pb->req_list))
-  {
-    DBusPendingCall *pending;
+static int
+_request_send(pb_req_t *req)
+{
+  pb_playback_t *pb = req->pb;
+  pb_state_args_t args;
 
-    pb_list_append(&pb->req_list, req);
+  _playback_args(pb, req->pb_state, &args);
+  req->sent = _pb_time_us();
 
-    if (dbus_connection_send_with_reply(pb->connection, message, &pending, -1))
+  if (!_pb_transport(pb->conn)->request_states(pb->connection, &args, 1,
+                                               &req->call,
+                                               _request_state_reply, req,
+                                               NULL))
+    return FALSE;
+
+  PB_PROBE(request_send, pb, req->pb_state, req);
+
+  return TRUE;
+}
+
+static void
+_request_send_failed(pb_req_t *req)
+{
+  PB_LOG_EVENT(req->pb->conn, PB_LOG_LEVEL_ERROR, req->pb->object_id,
+               "unable to send queued state %ld request", NULL,
+               req->pb_state, 0);
+
+  if (req->state_reply)
+    req->state_reply(req->pb, PB_STATE_NONE,
+                     "Failed to send a queued state request", req, req->data);
+}
+
+/* The scheduler: at most conn->window RequestState calls of a connection
+ * are waiting for the manager (no limit if 0).  The first request of
+ * each playback that does not fit waits in a FIFO per priority and goes
+ * out, highest priority first, as replies come in. */
+
+static int
+_sched_has_room(pb_connection_t *conn)
+{
+  return !conn->window || conn->in_flight < conn->window;
+}
+
+static int
+_sched_send(pb_req_t *req)
+{
+  if (!_request_send(req))
+    return FALSE;
+
+  req->in_flight = TRUE;
+  req->pb->conn->in_flight++;
+  _degraded_arm(req);
+
+  return TRUE;
+}
+
+static pb_req_t *
+_sched_pop(pb_connection_t *conn)
+{
+  int priority;
+
+  for (priority = PB_PRIORITY_MAX; priority >= 0; priority--)
+  {
+    pb_req_t *req = conn->ready_first[priority];
+
+    if (req)
+    {
+      if (!(conn->ready_first[priority] = req->sched_next))
+        conn->ready_last[priority] = NULL;
+
+      req->sched_next = NULL;
+      req->scheduled = FALSE;
+
+      return req;
+    }
+  }
+
+  return NULL;
+}
+
+static void
+_sched_run(pb_connection_t *conn)
+{
+  pb_req_t *req;
+
+  while (_sched_has_room(conn) && (req = _sched_pop(conn)))
+  {
+    PB_LOG_EVENT(conn, PB_LOG_LEVEL_DEBUG, req->pb->object_id,
+                 "scheduled state %ld request, %ld in flight", NULL,
+                 req->pb_state, conn->in_flight);
+
+    if (!_sched_send(req))
+      _request_send_failed(req);
+  }
+}
+
+/* Sends @req now if the window allows, queues it otherwise.  Returns
+ * FALSE only if sending failed. */
+static int
+_sched_submit(pb_req_t *req)
+{
+  pb_connection_t *conn = req->pb->conn;
+  int priority;
+
+  if (_sched_has_room(conn))
+    return _sched_send(req);
+
+  priority = req->priority = conn->priority[req->pb->pb_class];
+  req->scheduled = TRUE;
+
+  if (conn->ready_last[priority])
+    conn->ready_last[priority]->sched_next = req;
+  else
+    conn->ready_first[priority] = req;
+
+  conn->ready_last[priority] = req;
+
+  return TRUE;
+}
+
+/* Takes @req out of the scheduler, and lets the next request go if @req
+ * was on the wire. */
+static void
+_sched_release(pb_req_t *req)
+{
+  pb_connection_t *conn = req->pb->conn;
+
+  if (req->scheduled)
+  {
+    int priority = req->priority;
+    pb_req_t *r, *prev = NULL;
+
+    for (r = conn->ready_first[priority]; r != req; r = r->sched_next)
+      prev = r;
+
+    if (prev)
+      prev->sched_next = req->sched_next;
+    else
+      conn->ready_first[priority] = req->sched_next;
+
+    if (conn->ready_last[priority] == req)
+      conn->ready_last[priority] = prev;
+
+    req->sched_next = NULL;
+    req->scheduled = FALSE;
+  }
+
+  if (req->in_flight)
+  {
+    req->in_flight = FALSE;
+    conn->in_flight--;
+    _sched_run(conn);
+  }
+}
+
+void
+pb_set_request_window(DBusConnection *connection,
+                      unsigned int window)
+{
+  pb_connection_t *conn;
+
+  if (!connection || !(conn = _pb_connection_get(connection)))
+    return;
+
+  conn->window = window;
+  _sched_run(conn);
+}
+
+void
+pb_set_class_priority(DBusConnection *connection,
+                      enum pb_class_e pb_class,
+                      unsigned int priority)
+{
+  pb_connection_t *conn;
+
+  if (!connection || pb_class < 0 || pb_class >= PB_CLASS_LAST ||
+      priority > PB_PRIORITY_MAX || !(conn = _pb_connection_get(connection)))
+    return;
+
+  /* requests already waiting keep their place */
+  conn->priority[pb_class] = priority;
+}
+
+/* Degraded grants: a request of an allowed class that is on the wire
+ * longer than the latency budget of its connection is granted locally.
+ * Its call is handed over to a pb_grant_t, which keeps the playback and
+ * the window slot of the request until the manager answers. */
+
+typedef struct pb_grant_s pb_grant_t;
+
+struct pb_grant_s
+{
+  pb_playback_t *pb;
+  enum pb_state_e granted;
+  enum pb_state_e previous;
+  uint64_t sent;
+};
+
+static int
+_degraded_eligible(pb_req_t *req)
+{
+  pb_playback_t *pb = req->pb;
+
+  return (pb->conn->degraded_classes & (1U << pb->pb_class)) &&
+         req->in_flight && req->call && !req->finished && req->state_reply &&
+         req->pb_state != PB_STATE_NONE && pb->allowed_state[req->pb_state];
+}
+
+/* Asks for a timer if @req is due before the one already asked for */
+static void
+_degraded_arm(pb_req_t *req)
+{
+  pb_connection_t *conn = req->pb->conn;
+  uint64_t budget, deadline, now;
+
+  if (!conn->degraded_timer || !_degraded_eligible(req) ||
+      !(budget = _pb_latency_budget(conn)))
+    return;
+
+  deadline = req->sent + budget;
+
+  if (conn->degraded_armed && conn->degraded_armed <= deadline)
+    return;
+
+  conn->degraded_armed = deadline;
+  now = _pb_time_us();
+  conn->degraded_timer(req->pb->connection,
+                       deadline > now ? (deadline - now + 999) / 1000 : 0,
+                       conn->degraded_timer_data);
+}
+
+static void
+_degraded_reply(const pb_reply_t *reply,
+                void *data)
+{
+  pb_grant_t *grant = (pb_grant_t *)data;
+  pb_playback_t *pb = grant->pb;
+  pb_connection_t *conn = pb->conn;
+  enum pb_state_e answer;
+
+  _manager_rtt(conn, grant->sent, reply);
+
+  if (!reply->error)
+    answer = reply->n_states ? reply->states[0] : grant->granted;
+  else if (!strcmp(reply->error, DBUS_ERROR_SERVICE_UNKNOWN))
+    answer = grant->granted;
+  else
+    answer = grant->previous;
+
+  if (answer == grant->granted)
+  {
+    conn->degraded_confirmed++;
+    return;
+  }
+
+  conn->degraded_reconciled++;
+  PB_PROBE(degraded_reconcile, pb, answer, NULL);
+  PB_LOG_EVENT(conn, PB_LOG_LEVEL_WARNING, pb->object_id,
+               "manager answered state %ld to degraded grant of %ld",
+               reply->error, answer, grant->granted);
+
+  /* later requests of the application have the last word */
+  if (pb->destroyed || answer == PB_STATE_NONE ||
+      pb->pb_state != grant->granted || !pb_list_empty(&pb->req_list))
+    return;
+
+  _pb_playback_set_local(pb, answer);
+}
+
+static void
+_degraded_free(void *data)
+{
+  pb_grant_t *grant = (pb_grant_t *)data;
+  pb_connection_t *conn = grant->pb->conn;
+
+  conn->in_flight--;
+  _sched_run(conn);
+  _pb_playback_unref(grant->pb);
+  free(grant);
+}
+
+static void
+_degraded_grant(pb_req_t *req)
+{
+  pb_playback_t *pb = req->pb;
+  pb_grant_t *grant;
+
+  if (!(grant = (pb_grant_t *)malloc(sizeof(pb_grant_t))))
+    return;
+
+  grant->pb = _pb_playback_ref(pb);
+  grant->granted = req->pb_state;
+  grant->previous = pb->pb_state;
+  grant->sent = req->sent;
+  _pb_call_init(req->call, req->call->transport, _degraded_reply, grant,
+                _degraded_free);
+  req->call = NULL;
+  req->in_flight = FALSE;
+  pb->conn->degraded_grants++;
+  PB_PROBE(degraded_grant, pb, req->pb_state, req);
+  _playback_record(pb, PB_RECORDER_GRANTED, req->pb_state, TRUE);
+  PB_LOG_EVENT(pb->conn, PB_LOG_LEVEL_INFO, pb->object_id,
+               "manager slow, state %ld granted locally after %ld us", NULL,
+               req->pb_state, _pb_time_us() - req->sent);
+  req->finished = TRUE;
+  req->state_reply(pb, req->pb_state, NULL, req, req->data);
+}
+
+void
+pb_set_degraded_grants(DBusConnection *connection,
+                       uint32_t classes,
+                       unsigned int min_budget,
+                       PBDegradedTimer timer,
+                       void *data)
+{
+  pb_connection_t *conn;
+
+  if (!connection || !(conn = _pb_connection_get(connection)))
+    return;
+
+  conn->degraded_classes = timer ? classes : 0;
+  conn->degraded_min_budget = min_budget;
+  conn->degraded_timer = timer;
+  conn->degraded_timer_data = data;
+  conn->degraded_armed = 0;
+}
+
+int
+pb_degraded_dispatch(DBusConnection *connection)
+{
+  pb_connection_t *conn;
+  uint64_t budget, now, next = 0;
+  uint32_t id;
+
+  if (!connection || !(conn = _pb_connection_get(connection)))
+    return -1;
+
+  conn->degraded_armed = 0;
+
+  if (!conn->degraded_classes || !(budget = _pb_latency_budget(conn)))
+    return -1;
+
+  now = _pb_time_us();
+
+  /* the reply handlers may destroy playbacks, but ids are only reused by
+   * new ones */
+  for (id = 0; id < conn->size; id++)
+  {
+    pb_playback_t *pb = conn->playbacks[id];
+    pb_req_t *req;
+
+    if (!pb || pb_list_empty(&pb->req_list))
+      continue;
+
+    req = (pb_req_t *)pb->req_list.first->data;
+
+    if (!_degraded_eligible(req))
+      continue;
+
+    if (req->sent + budget <= now)
+      _degraded_grant(req);
+    else if (!next || req->sent + budget < next)
+      next = req->sent + budget;
+  }
+
+  if (!next)
+    return -1;
+
+  conn->degraded_armed = next;
+  now = _pb_time_us();
+  next = next > now ? (next - now + 999) / 1000 : 0;
+  conn->degraded_timer(connection, next, conn->degraded_timer_data);
+
+  return next;
+}
+
+/* Takes a request out of the full queue of @pb to make room, according
+ * to the queue policy.  The request on the wire is never taken. */
+static pb_req_t *
+_playback_queue_evict(pb_playback_t *pb)
+{
+  pb_req_list_t *first = pb->req_list.first;
+  pb_req_t *req;
+
+  if (pb->queue_policy == PB_QUEUE_REJECT || !first || !first->next)
+    return NULL;
+
+  if (pb->queue_policy == PB_QUEUE_DROP_OLDEST)
+    req = (pb_req_t *)first->next->data;
+  else
+    req = (pb_req_t *)pb->req_list.last->data;
+
+  pb_list_remove(&pb->req_list, req);
+  pb->queue_dropped++;
+  PB_PROBE(request_dropped, pb, req->pb_state, req);
+  PB_LOG_EVENT(pb->conn, PB_LOG_LEVEL_WARNING, pb->object_id,
+               "queued state %ld request dropped", NULL, req->pb_state, 0);
+
+  return req;
+}
+
+/* Admits, creates and queues a state request of @pb, without sending
+ * it.  A request dropped to make room is returned in @dropped and must
+ * be passed to _playback_req_dropped() once the new request is sent. */
+static pb_req_t *
+_playback_req_queue(pb_playback_t *pb,
+                    enum pb_state_e pb_state,
+                    PBStateReply state_reply,
+                    void *data,
+                    pb_req_t **dropped)
+{
+  pb_req_t *req;
+
+  *dropped = NULL;
+
+  if (pb->queue_capacity && pb->req_list.length >= pb->queue_capacity &&
+      !(*dropped = _playback_queue_evict(pb)))
+  {
+    pb->queue_rejected++;
+    PB_PROBE(request_rejected, pb, pb_state, NULL);
+    PB_LOG_EVENT(pb->conn, PB_LOG_LEVEL_WARNING, pb->object_id,
+                 "state %ld request rejected, %ld queued", NULL, pb_state,
+                 pb->req_list.length);
+    state_reply(pb, PB_STATE_NONE, "Request queue full", NULL, data);
+    return NULL;
+  }
+
+  _playback_register(pb);
+
+  if (!(req = _pb_request_new(pb)))
+  {
+    state_reply(pb, PB_STATE_NONE,
+                "Unable to create the request handler", NULL, data);
+    return NULL;
+  }
+
+  req->pb_state = pb_state;
+  req->state_reply = state_reply;
+  req->data = data;
+  req->finished = FALSE;
+  PB_PROBE(request_new, pb, pb_state, req);
+  _playback_record(pb, PB_RECORDER_REQUESTED, pb_state, 0);
+  PB_LOG_EVENT(pb->conn, PB_LOG_LEVEL_DEBUG, pb->object_id,
+               "request state %ld, queued %ld", NULL, pb_state,
+               pb->req_list.length);
+  pb_list_append(&pb->req_list, req);
+
+  if (pb->req_list.length > pb->queue_max_depth)
+    pb->queue_max_depth = pb->req_list.length;
+
+  return req;
+}
+
+static void
+_playback_req_send_failed(pb_req_t *req)
+{
+  PB_LOG_EVENT(req->pb->conn, PB_LOG_LEVEL_ERROR, req->pb->object_id,
+               "unable to send state %ld request", NULL, req->pb_state, 0);
+  req->state_reply(
+        req->pb, PB_STATE_NONE, "Error while sending the message call "
+        DBUS_PLAYBACK_MANAGER_INTERFACE"."DBUS_PLAYBACK_REQ_STATE_METHOD,
+        req, req->data);
+}
+
+/* Replies to the request @dropped from the queue of @pb; returns @req,
+ * or NULL if the reply handler destroyed @pb. */
+static pb_req_t *
+_playback_req_dropped(pb_playback_t *pb,
+                      pb_req_t *req,
+                      pb_req_t *dropped)
+{
+  if (!dropped)
+    return pb->destroyed ? NULL : req;
+
+  /* nothing may call back into the application after destroy */
+  if (pb->destroyed)
+  {
+    _pb_request_free(dropped);
+    return NULL;
+  }
+
+  _pb_playback_ref(pb);
+  dropped->state_reply(pb, PB_STATE_NONE,
+                       "Request dropped from a full queue", dropped,
+                       dropped->data);
+
+  if (pb->destroyed)
+    req = NULL;
+
+  _pb_playback_unref(pb);
+
+  return req;
+}
+
+pb_req_t *
+pb_playback_req_state(pb_playback_t *pb,
+                      enum pb_state_e pb_state,
+                      PBStateReply state_reply,
+                      void *data)
+{
+  pb_req_t *req;
+  pb_req_t *dropped;
+
+  if (!pb || !state_reply)
+    return NULL;
+
+  req = _playback_req_queue(pb, pb_state, state_reply, data, &dropped);
+
+  /* later requests follow from process_request_list() */
+  if (req && pb->req_list.length == 1 && !_sched_submit(req))
+  {
+    _playback_req_send_failed(req);
+    req = NULL;
+  }
+
+  return _playback_req_dropped(pb, req, dropped);
+}
+
+static void
+_batch_reply(const pb_reply_t *reply,
+             void *data)
+{
+  pb_batch_t *batch = (pb_batch_t *)data;
+  int unsupported;
+  unsigned int i;
+
+  batch->replied = TRUE;
+  unsupported = reply->error &&
+                !strcmp(reply->error, DBUS_ERROR_UNKNOWN_METHOD);
+
+  if (!unsupported)
+    _manager_rtt(batch->conn, batch->sent, reply);
+
+  /* reply handlers may free any request of the batch, so each one is
+   * detached just before its reply */
+  for (i = 0; i < batch->n; i++)
+  {
+    pb_req_t *req = batch->reqs[i];
+
+    if (!req)
+      continue;
+
+    batch->reqs[i] = NULL;
+    batch->live--;
+    req->batch = NULL;
+    PB_PROBE(request_reply, req->pb, req->pb_state, req);
+    _sched_release(req);
+
+    if (unsupported)
+    {
+      req->pb->conn->batch_unsupported = TRUE;
+
+      if (!_sched_submit(req))
+        _request_send_failed(req);
+    }
+    else if (reply->error)
+      _request_reply_error(req, reply->error, reply->message);
+    else
+      _request_reply_state(req, i < reply->n_states ? &reply->states[i] :
+                           NULL);
+  }
+}
+
+/* Sends the first requests of several playbacks of @connection in one
+ * RequestStates call.  The requests count against the scheduler window
+ * but are not held back by it. */
+static int
+_batch_send(DBusConnection *connection,
+            pb_batch_t *batch)
+{
+  pb_state_args_t *args;
+  unsigned int i;
+  int sent;
+
+  if (!(args = (pb_state_args_t *)malloc(batch->n * sizeof(pb_state_args_t))))
+    return FALSE;
+
+  for (i = 0; i < batch->n; i++)
+    _playback_args(batch->reqs[i]->pb, batch->reqs[i]->pb_state, &args[i]);
+
+  batch->conn = _pb_connection_get(connection);
+  batch->sent = _pb_time_us();
+  sent = _pb_transport(batch->conn)->request_states(
+        connection, args, batch->n, &batch->call, _batch_reply, batch, free);
+  free(args);
+
+  if (!sent)
+    return FALSE;
+
+  for (i = 0; i < batch->n; i++)
+  {
+    pb_req_t *req = batch->reqs[i];
+
+    req->batch = batch;
+    req->batch_index = i;
+    req->in_flight = TRUE;
+    req->pb->conn->in_flight++;
+    PB_PROBE(request_send, req->pb, req->pb_state, req);
+  }
+
+  batch->live = batch->n;
+
+  return TRUE;
+}
+
+int
+pb_playback_req_state_many(pb_state_req_t *reqs,
+                           unsigned int n)
+{
+  DBusConnection *connection = NULL;
+  pb_batch_t *batch = NULL;
+  pb_req_t **dropped;
+  unsigned int i;
+  int count = 0;
+
+  if (!reqs || !n)
+    return 0;
+
+  if (!(dropped = (pb_req_t **)calloc(n, sizeof(pb_req_t *))))
+    return 0;
+
+  for (i = 0; i < n; i++)
+  {
+    pb_playback_t *pb = reqs[i].pb;
+
+    reqs[i].req = NULL;
+
+    /* reply handlers called from here on may destroy the playbacks */
+    if (pb)
+      _pb_playback_ref(pb);
+
+    if (pb && !pb->destroyed && reqs[i].state_reply)
+    {
+      reqs[i].req = _playback_req_queue(pb, reqs[i].pb_state,
+                                        reqs[i].state_reply, reqs[i].data,
+                                        &dropped[i]);
+
+      if (!connection && !pb->conn->batch_unsupported)
+      {
+        connection = pb->connection;
+        batch = (pb_batch_t *)calloc(1, sizeof(pb_batch_t) +
+                                     n * sizeof(pb_req_t *));
+      }
+    }
+  }
+
+  /* the first request of each playback of the connection goes in the
+   * batch, the others wait in their playback queue as usual */
+  for (i = 0; i < n; i++)
+  {
+    pb_req_t *req = reqs[i].req;
+
+    if (req && req->pb->req_list.first->data == req)
+    {
+      if (batch && req->pb->connection == connection)
+        batch->reqs[batch->n++] = req;
+      else if (!_sched_submit(req))
+      {
+        _playback_req_send_failed(req);
+        reqs[i].req = NULL;
+      }
+    }
+  }
+
+  if (batch && batch->n == 1)
+  {
+    if (_sched_submit(batch->reqs[0]))
+      batch->n = 0;
+  }
+  else if (batch && batch->n > 1 && _batch_send(connection, batch))
+    batch = NULL;
+
+  for (i = 0; i < n; i++)
+  {
+    pb_req_t *req = reqs[i].req;
+    unsigned int j;
+
+    if (batch)
     {
-      req->pending = pending;
-      dbus_pending_call_set_notify(pending, _request_state_reply, req, NULL);
+      for (j = 0; j < batch->n && batch->reqs[j] != req; j++)
+        ;
+
+      if (req && j < batch->n)
+      {
+        _playback_req_send_failed(req);
+        reqs[i].req = req = NULL;
+      }
     }
-    else
+
+    if (reqs[i].pb)
     {
-      state_reply(
-            pb, PB_STATE_NONE, "Error while sending the message call "
-            DBUS_PLAYBACK_MANAGER_INTERFACE"."DBUS_PLAYBACK_REQ_STATE_METHOD,
-            req, data);
-      req = NULL;
+      reqs[i].req = _playback_req_dropped(reqs[i].pb, req, dropped[i]);
+      _pb_playback_unref(reqs[i].pb);
     }
+
+    if (reqs[i].req)
+      count++;
   }
-  else
-    pb_list_append(&pb->req_list, req);
 
-  dbus_message_unref(message);
+  free(batch);
+  free(dropped);
 
-  return req;
+  return count;
 }
 
-static void
-_playback_signal_state(pb_playback_t *pb)
+void
+pb_playback_set_queue_limit(pb_playback_t *pb,
+                            unsigned int capacity,
+                            enum pb_queue_policy_e policy)
 {
-  const char *state_string = pb_state_to_string(pb->pb_state);
-  DBusMessage *message;
-  const char *prop = DBUS_PLAYBACK_STATE_PROP;
-  const char *iface = DBUS_PLAYBACK_INTERFACE;
-  char path[256];
+  if (!pb)
+    return;
 
-  snprintf(path, sizeof(path), PLAYBACK_PATH, pb->object_id);
-  message = dbus_message_new_signal(path,
-                                    DBUS_INTERFACE_PROPERTIES,
-                                    DBUS_NOTIFY_SIGNAL);
+  pb->queue_capacity = capacity;
+  pb->queue_policy = policy;
+}
 
-  if (message)
-  {
-    dbus_message_append_args(message,
-                             DBUS_TYPE_STRING, &iface,
-                             DBUS_TYPE_STRING, &prop,
-                             DBUS_TYPE_STRING, &state_string,
-                             DBUS_TYPE_INVALID);
-    dbus_connection_send(pb->connection, message, NULL);
-    dbus_message_unref(message);
-  }
+void
+pb_playback_get_queue_stats(pb_playback_t *pb,
+                            pb_queue_stats_t *stats)
+{
+  if (!pb || !stats)
+    return;
+
+  stats->depth = pb->req_list.length;
+  stats->max_depth = pb->queue_max_depth;
+  stats->rejected = pb->queue_rejected;
+  stats->dropped = pb->queue_dropped;
 }
 
 static void
-_get_allowed_state_reply(DBusPendingCall *pending,
-                         void *user_data)
+_playback_signal_state(pb_playback_t *pb)
 {
-  DBusMessage *message;
-  DBusError error;
-  char **states;
-  int len;
+  if (!pb->destroyed)
+    _playback_announce(pb, PB_ANNOUNCE_STATE);
+}
 
-  if (!pending || !user_data)
-    return;
+static void
+_get_allowed_state_reply(const pb_reply_t *reply,
+                         void *data)
+{
+  pb_playback_t *pb = (pb_playback_t *)data;
+  int allowed_state[PB_STATE_LAST] = {FALSE};
+  unsigned int i;
 
-  dbus_error_init(&error);
-  message = dbus_pending_call_steal_reply(pending);
+  /* the playback is only kept alive by this call after destroy */
+  if (reply->error || pb->destroyed)
+    return;
 
-  if (!dbus_set_error_from_message(&error, message) &&
-      dbus_message_get_args(message, &error,
-                            DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &states, &len,
-                            DBUS_TYPE_INVALID))
-  {
-    _update_allowed_states(user_data, states, len);
-    dbus_free_string_array(states);
-  }
-  else
-    dbus_error_free(&error);
+  for (i = 0; i < reply->n_states; i++)
+    allowed_state[reply->states[i]] = TRUE;
 
-  dbus_message_unref(message);
-  dbus_pending_call_unref(pending);
+  _update_allowed_states(pb, allowed_state);
 }
 
 void
@@ -642,36 +1539,32 @@ pb_playback_set_state_hint(pb_playback_t *pb,
                            PBStateHint state_hint_handler,
                            void *data)
 {
-  DBusMessage *message;
-  DBusPendingCall *pending;
+  pb_state_args_t args;
 
   if (!pb || !state_hint_handler)
     return;
 
   pb->state_hint_handler = state_hint_handler;
   pb->state_hint_handler_data = data;
+  _playback_register(pb);
+  _playback_subscribe(pb);
 
-  message = dbus_message_new_method_call(
-        DBUS_PLAYBACK_MANAGER_SERVICE,
-        DBUS_PLAYBACK_MANAGER_PATH,
-        DBUS_PLAYBACK_MANAGER_INTERFACE,
-        DBUS_PLAYBACK_GET_ALLOWED_METHOD);
-
-  if (message)
+  if (pb->conn->board &&
+      pb_board_read_allowed_state(pb->conn->board, pb->pb_class,
+                                  pb->allowed_state))
   {
-    char _path[256];
-    const char *path = _path;
-
-    snprintf(_path, sizeof(_path), PLAYBACK_PATH, pb->object_id);
-    dbus_message_append_args(message,
-                             DBUS_TYPE_OBJECT_PATH, &path,
-                             DBUS_TYPE_INVALID);
+    _allowed_states_changed(pb);
+    return;
+  }
 
-    if (dbus_connection_send_with_reply(pb->connection, message, &pending, -1))
-      dbus_pending_call_set_notify(pending, _get_allowed_state_reply, pb, NULL);
+  _playback_args(pb, pb->pb_state, &args);
+  _pb_playback_ref(pb);
 
-    dbus_message_unref(message);
-  }
+  if (!_pb_transport(pb->conn)->get_allowed_state(pb->connection, &args,
+                                                  NULL,
+                                                  _get_allowed_state_reply,
+                                                  pb, _pb_playback_unref))
+    _pb_playback_unref(pb);
 }
 
 static DBusHandlerResult
@@ -690,6 +1583,8 @@ _dbus_error_reply(DBusConnection *connection,
   if (err_msg)
   {
     dbus_connection_send(connection, err_msg, NULL);
+    _pb_capture_message(_pb_connection_get(connection), PB_CAPTURE_SENT,
+                        err_msg);
     return DBUS_HANDLER_RESULT_HANDLED;
   }
 
@@ -702,49 +1597,9 @@ process_request_list(pb_playback_t *pb)
   if (!pb_list_empty(&pb->req_list))
   {
     pb_req_t *req = (pb_req_t *)pb->req_list.first->data;
-    DBusMessage *message =
-        dbus_message_new_method_call(DBUS_PLAYBACK_MANAGER_SERVICE,
-                                     DBUS_PLAYBACK_MANAGER_PATH,
-                                     DBUS_PLAYBACK_MANAGER_INTERFACE,
-                                     DBUS_PLAYBACK_REQ_STATE_METHOD);
-
-    if (message)
-    {
-      const char *stream = pb->stream;
-      const char *new_state = pb_state_to_string(req->pb_state);
-      char _path[256];
-      const char *path = _path;
-      char _pid[64];
-      const char *pid = _pid;
-
-      snprintf(_path, sizeof(_path), PLAYBACK_PATH, pb->object_id);
-      snprintf(_pid, sizeof(_pid), "%ld", (long)pb->pid);
-
-      if (!stream)
-        stream = "";
-
-      dbus_message_append_args(message,
-                               DBUS_TYPE_OBJECT_PATH, &path,
-                               DBUS_TYPE_STRING, &new_state,
-                               DBUS_TYPE_STRING, &pid,
-                               DBUS_TYPE_STRING, &stream,
-                               DBUS_TYPE_INVALID);
-
-      if (dbus_connection_send_with_reply(
-            pb->connection, message, &req->pending, -1))
-      {
-        dbus_pending_call_set_notify(
-              req->pending, _request_state_reply, req, NULL);
-        dbus_message_unref(message);
-        return;
-      }
-
-      dbus_message_unref(message);
-    }
 
-    if (req->state_reply)
-      req->state_reply(req->pb, PB_STATE_NONE,
-                       "Failed to send a queued state request", req, req->data);
+    if (!_sched_submit(req))
+      _request_send_failed(req);
   }
 }
 
@@ -756,34 +1611,36 @@ pb_playback_req_discarded(pb_playback_t *pb,
   if (!pb || !req)
     return TRUE;
 
+  if (req->pb == pb)
+    _playback_record(pb, PB_RECORDER_DISCARDED, req->pb_state, 0);
+
   pb->pb_state = PB_STATE_NONE;
 
   if (req->pb != pb)
     return FALSE;
 
+  PB_PROBE(request_discarded, pb, req->pb_state, req);
+  PB_LOG_EVENT(pb->conn, PB_LOG_LEVEL_DEBUG, pb->object_id,
+               "state %ld request discarded", reason, req->pb_state, 0);
+
   if (req->message)
   {
     _dbus_error_reply(pb->connection, req->message,
                       DBUS_MAEMO_ERROR_DISCARDED, reason);
+    dbus_message_unref(req->message);
     req->message = NULL;
     _playback_signal_state(pb);
   }
-  else
+  else if (pb_list_remove(&pb->req_list, req))
   {
+    /* requests dropped from a full queue were never sent */
     _playback_signal_state(pb);
-    pb_list_remove(&pb->req_list, req);
     process_request_list(pb);
   }
+  else if (req->local)
+    _playback_signal_state(pb);
 
-  if (req->pending)
-  {
-    if (!dbus_pending_call_get_completed(req->pending))
-      dbus_pending_call_cancel(req->pending);
-
-    dbus_pending_call_unref(req->pending);
-  }
-
-  free(req);
+  _pb_request_free(req);
 
   return TRUE;
 }
@@ -798,6 +1655,10 @@ pb_playback_req_completed(pb_playback_t *pb,
   if (req->pb != pb)
     return FALSE;
 
+  PB_PROBE(request_completed, pb, req->pb_state, req);
+  _playback_record(pb, PB_RECORDER_COMPLETED,
+                   req->finished ? req->pb_state : pb->pb_state, 0);
+
   if (req->finished)
     pb->pb_state = req->pb_state;
 
@@ -807,153 +1668,453 @@ pb_playback_req_completed(pb_playback_t *pb,
 
     if (message)
     {
-      dbus_connection_send(pb->connection, message, 0);
+      _playback_send(pb, message);
       dbus_message_unref(message);
     }
 
+    dbus_message_unref(req->message);
     req->message = NULL;
     _playback_signal_state(pb);
   }
-  else
+  else if (pb_list_remove(&pb->req_list, req))
   {
+    /* requests dropped from a full queue were never sent */
     _playback_signal_state(pb);
-    pb_list_remove(&pb->req_list, req);
     process_request_list(pb);
   }
+  else if (req->local)
+    _playback_signal_state(pb);
+
+  _pb_request_free(req);
+
+  return TRUE;
+}
+
+/* The properties of the playback interface:
+ * X(id, name, D-Bus type, access) */
+#define PLAYBACK_PROPERTIES(X) \
+  X(STATE,         DBUS_PLAYBACK_STATE_PROP,         "s",  "readwrite") \
+  X(ALLOWED_STATE, DBUS_PLAYBACK_ALLOWED_STATE_PROP, "as", "readwrite") \
+  X(CLASS,         DBUS_PLAYBACK_CLASS_PROP,         "s",  "read")      \
+  X(FLAGS,         DBUS_PLAYBACK_FLAGS_PROP,         "s",  "read")      \
+  X(PID,           DBUS_PLAYBACK_PID_PROP,           "s",  "read")      \
+  X(STREAM,        DBUS_PLAYBACK_STREAM_PROP,        "s",  "read")
+
+/* The methods served on the playback objects:
+ * X(interface, member, handler) */
+#define PLAYBACK_METHODS(X) \
+  X(DBUS_INTERFACE_INTROSPECTABLE, "Introspect", _playback_introspect) \
+  X(DBUS_INTERFACE_PROPERTIES,     "Get",        _playback_get)        \
+  X(DBUS_INTERFACE_PROPERTIES,     "Set",        _playback_set)        \
+  X(DBUS_INTERFACE_PROPERTIES,     "GetAll",     _playback_get_all)    \
+  X(DBUS_PLAYBACK_DEBUG_INTERFACE, DBUS_PLAYBACK_GET_RECORDER_METHOD,     \
+    _playback_get_flight_recorder)
+
+#define PROPERTY_ENUM(id, name, type, access) PROP_##id,
+#define PROPERTY_ENTRY(id, name, type, access) {name, sizeof(name) - 1, type},
+#define PROPERTY_XML(id, name, type, access) \
+  " <property name=\"" name "\" type=\"" type "\" access=\"" access "\"/>\n"
+
+enum pb_property_e
+{
+  PLAYBACK_PROPERTIES(PROPERTY_ENUM)
+  PROP_LAST
+};
+
+static const struct
+{
+  const char *name;
+  size_t len;
+  const char *type;
+}
+property_table[] =
+{
+  PLAYBACK_PROPERTIES(PROPERTY_ENTRY)
+};
+
+static const char *introspect =
+DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
+"<node>\n"
+ "<interface name=\"" DBUS_PLAYBACK_INTERFACE "\">\n"
+  PLAYBACK_PROPERTIES(PROPERTY_XML)
+  " <signal name=\"" DBUS_HELLO_SIGNAL "\"/>\n"
+  " <signal name=\"" DBUS_NOTIFY_SIGNAL "\"/>\n"
+ "</interface>\n"
+ "<interface name=\"" DBUS_PLAYBACK_DEBUG_INTERFACE "\">\n"
+  " <method name=\"" DBUS_PLAYBACK_GET_RECORDER_METHOD "\">\n"
+  "  <arg name=\"events\" type=\"as\" direction=\"out\"/>\n"
+  " </method>\n"
+ "</interface>\n"
+"</node>";
+
+static int
+_name_is(const char *s,
+         size_t len,
+         const char *name,
+         size_t name_len)
+{
+  return len == name_len && !memcmp(s, name, len);
+}
+
+#define NAME_IS(s, len, literal) _name_is(s, len, literal, sizeof(literal) - 1)
+
+static enum pb_property_e
+_playback_property_lookup(const char *name)
+{
+  size_t len = strlen(name);
+  int i;
+
+  for (i = 0; i < PROP_LAST; i++)
+  {
+    if (_name_is(name, len, property_table[i].name, property_table[i].len))
+      return i;
+  }
+
+  return PROP_LAST;
+}
+
+/* Appends the bare value of @prop, Get replies it without a variant. */
+static int
+_playback_append_value(pb_playback_t *pb,
+                       enum pb_property_e prop,
+                       DBusMessageIter *iter)
+{
+  char buf[64];
+  const char *s = buf;
 
-  if (req->pending)
+  switch (prop)
   {
-    if (!dbus_pending_call_get_completed(req->pending))
-      dbus_pending_call_cancel(req->pending);
+    case PROP_STATE:
+      s = pb_state_to_string(pb->pb_state);
+      break;
+    case PROP_CLASS:
+      s = pb_class_to_string(pb->pb_class);
+      break;
+    case PROP_FLAGS:
+      snprintf(buf, sizeof(buf), "%u", pb->flags);
+      break;
+    case PROP_PID:
+      snprintf(buf, sizeof(buf), "%ld", (long)pb->pid);
+      break;
+    case PROP_STREAM:
+      s = pb->stream ? pb->stream : "";
+      break;
+    case PROP_ALLOWED_STATE:
+    {
+      DBusMessageIter states_it;
+      int i;
 
-    dbus_pending_call_unref(req->pending);
+      _playback_read_board(pb);
+
+      if (!dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
+                                            DBUS_TYPE_STRING_AS_STRING,
+                                            &states_it))
+      {
+        return FALSE;
+      }
+
+      for (i = 0; i < PB_STATE_LAST; i++)
+      {
+        if (pb->allowed_state[i] == TRUE)
+        {
+          s = pb_state_to_string(i);
+
+          if (!dbus_message_iter_append_basic(&states_it, DBUS_TYPE_STRING,
+                                              &s))
+          {
+            dbus_message_iter_abandon_container(iter, &states_it);
+            return FALSE;
+          }
+        }
+      }
+
+      return dbus_message_iter_close_container(iter, &states_it);
+    }
+    default:
+      return FALSE;
   }
 
-  free(req);
+  return dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &s);
+}
 
-  return TRUE;
+static DBusHandlerResult
+_playback_introspect(pb_playback_t *pb, DBusMessage *message)
+{
+  DBusMessage *msg;
+
+  if (!dbus_message_has_signature(message, DBUS_TYPE_INVALID_AS_STRING))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  msg = dbus_message_new_method_return(message);
+
+  if (!msg)
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+  dbus_message_append_args(msg,
+                           DBUS_TYPE_STRING, &introspect,
+                           DBUS_TYPE_INVALID);
+  _playback_send(pb, msg);
+  dbus_message_unref(msg);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* The flight recorder of the whole connection, one line per event; it
+ * is served on the root object and, for the tools that only know a
+ * playback, on every playback object too */
+static DBusHandlerResult
+_connection_get_flight_recorder(pb_connection_t *conn, DBusMessage *message)
+{
+  pb_recorder_event_t *events;
+  DBusMessageIter iter;
+  DBusMessageIter array;
+  DBusMessage *msg = NULL;
+  char line[128];
+  const char *s = line;
+  int i, n;
+
+  if (!dbus_message_has_signature(message, DBUS_TYPE_INVALID_AS_STRING))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  events = (pb_recorder_event_t *)malloc(PB_RECORDER_SIZE *
+                                         sizeof(pb_recorder_event_t));
+
+  if (!events || (n = pb_recorder_read(conn->connection, events)) < 0 ||
+      !(msg = dbus_message_new_method_return(message)))
+    goto err;
+
+  dbus_message_iter_init_append(msg, &iter);
+
+  if (!dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "s", &array))
+    goto err;
+
+  for (i = 0; i < n; i++)
+  {
+    int len = pb_recorder_format(&events[i], line, sizeof(line));
+
+    /* without the newline */
+    if (len && line[len - 1] == '\n')
+      line[len - 1] = '\0';
+
+    if (!dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING, &s))
+    {
+      dbus_message_iter_abandon_container(&iter, &array);
+      goto err;
+    }
+  }
+
+  if (!dbus_message_iter_close_container(&iter, &array))
+    goto err;
+
+  dbus_connection_send(conn->connection, msg, NULL);
+  PB_CAPTURE(conn, PB_CAPTURE_SENT, msg);
+  dbus_message_unref(msg);
+  free(events);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+
+err:
+
+  if (msg)
+    dbus_message_unref(msg);
+
+  free(events);
+
+  return _dbus_error_reply(conn->connection, message,
+                           DBUS_MAEMO_ERROR_INTERNAL_ERR, "");
+}
+
+static DBusHandlerResult
+_playback_get_flight_recorder(pb_playback_t *pb, DBusMessage *message)
+{
+  return _connection_get_flight_recorder(pb->conn, message);
+}
+
+static DBusHandlerResult
+_playback_get(pb_playback_t *pb, DBusMessage *message)
+{
+  DBusError error;
+  DBusMessage *msg;
+  DBusMessageIter iter;
+  enum pb_property_e prop;
+  char *prop_name;
+  char *iface;
+
+  dbus_error_init(&error);
+  dbus_message_get_args(message, &error,
+                        DBUS_TYPE_STRING, &iface,
+                        DBUS_TYPE_STRING, &prop_name,
+                        DBUS_TYPE_INVALID);
+
+  if (dbus_error_is_set(&error))
+  {
+    _dbus_error_reply(pb->connection, message, DBUS_MAEMO_ERROR_INVALID_ARGS,
+                      error.message);
+    dbus_error_free(&error);
+    return DBUS_HANDLER_RESULT_HANDLED;
+  }
+
+  if (!NAME_IS(iface, strlen(iface), DBUS_PLAYBACK_INTERFACE))
+  {
+    return _dbus_error_reply(pb->connection, message,
+                             DBUS_MAEMO_ERROR_INVALID_IFACE, "");
+  }
+
+  if ((prop = _playback_property_lookup(prop_name)) == PROP_LAST)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  msg = dbus_message_new_method_return(message);
+
+  if (!msg)
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+  dbus_message_iter_init_append(msg, &iter);
+
+  if (!_playback_append_value(pb, prop, &iter))
+  {
+    dbus_message_unref(msg);
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+  }
+
+  _playback_send(pb, msg);
+  dbus_message_unref(msg);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult
+_playback_set_state(pb_playback_t *pb,
+                    DBusMessage *message,
+                    DBusMessageIter *iter)
+{
+  DBusMessage *msg;
+  enum pb_state_e state;
+  const char *s;
+
+  if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_STRING)
+  {
+    _dbus_error_reply(pb->connection, message,
+                      DBUS_MAEMO_ERROR_INVALID_ARGS, "");
+    return DBUS_HANDLER_RESULT_HANDLED;
+  }
+
+  dbus_message_iter_get_basic(iter, &s);
+  dbus_message_iter_next(iter);
+  state = pb_string_to_state(s);
+
+  if (state == PB_STATE_NONE)
+  {
+    return _dbus_error_reply(pb->connection, message,
+                             DBUS_MAEMO_ERROR_INVALID_ARGS,
+                             "Bad state value");
+  }
+
+  if (state != pb->pb_state)
+  {
+    pb_req_t *req = _pb_request_new(pb);
+
+    if (!req)
+    {
+      return _dbus_error_reply(pb->connection, message,
+                               DBUS_MAEMO_ERROR_INTERNAL_ERR, "");
+    }
+
+    req->message = dbus_message_ref(message);
+    req->pb_state = state;
+    req->finished = TRUE;
+    PB_PROBE(manager_set, pb, state, req);
+    _playback_record(pb, PB_RECORDER_SET, state, 0);
+    PB_LOG_EVENT(pb->conn, PB_LOG_LEVEL_DEBUG, pb->object_id,
+                 "manager sets state %ld", NULL, state, 0);
+    pb->state_req_handler(pb, state, req, pb->state_req_handler_data);
+    return DBUS_HANDLER_RESULT_HANDLED;
+  }
+
+  msg = dbus_message_new_method_return(message);
+
+  if (msg)
+  {
+    _playback_send(pb, msg);
+    dbus_message_unref(msg);
+  }
+
+  _playback_signal_state(pb);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
 }
 
-static DBusHandlerResult
-_playback_get_string_reply(pb_playback_t *pb,
-                           DBusMessage *message,
-                           const char *s)
+void
+_pb_playback_set_local(pb_playback_t *pb,
+                       enum pb_state_e pb_state)
 {
-  DBusMessage *msg = dbus_message_new_method_return(message);
-
-  if (!msg)
-    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+  pb_req_t *req;
 
-  dbus_message_append_args(msg,
-                           DBUS_TYPE_STRING, &s,
-                           DBUS_TYPE_INVALID);
-  dbus_connection_send(pb->connection, msg, 0);
-  dbus_message_unref(msg);
+  if (pb->destroyed || pb_state == pb->pb_state ||
+      !(req = _pb_request_new(pb)))
+    return;
 
-  return DBUS_HANDLER_RESULT_HANDLED;
+  req->pb_state = pb_state;
+  req->finished = TRUE;
+  req->local = TRUE;
+  PB_PROBE(manager_set, pb, pb_state, req);
+  _playback_record(pb, PB_RECORDER_SET_LOCAL, pb_state, 0);
+  PB_LOG_EVENT(pb->conn, PB_LOG_LEVEL_DEBUG, pb->object_id,
+               "state %ld set locally", NULL, pb_state, 0);
+  pb->state_req_handler(pb, pb_state, req, pb->state_req_handler_data);
 }
 
 static DBusHandlerResult
-_playback_get(pb_playback_t *pb, DBusMessage *message)
+_playback_set_allowed_state(pb_playback_t *pb,
+                            DBusMessage *message)
 {
   DBusError error;
-  char *prop;
-  char *iface;
+  DBusMessage *msg;
+  const char *iface;
+  const char *prop;
+  char **states;
+  int allowed_state[PB_STATE_LAST] = {FALSE};
+  int i, len;
 
   dbus_error_init(&error);
   dbus_message_get_args(message, &error,
                         DBUS_TYPE_STRING, &iface,
                         DBUS_TYPE_STRING, &prop,
+                        DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &states, &len,
                         DBUS_TYPE_INVALID);
 
   if (dbus_error_is_set(&error))
   {
-    _dbus_error_reply(pb->connection, message, DBUS_MAEMO_ERROR_INVALID_ARGS,
-                      error.message);
-    dbus_error_free(&error);
-    return DBUS_HANDLER_RESULT_HANDLED;
-  }
-
-  if (strcmp(iface, DBUS_PLAYBACK_INTERFACE))
-  {
-    return _dbus_error_reply(pb->connection, message,
-                             DBUS_MAEMO_ERROR_INVALID_IFACE, "");
-  }
-
-  if (!strcmp(prop, DBUS_PLAYBACK_STATE_PROP))
-  {
-    return _playback_get_string_reply(pb, message,
-                                      pb_state_to_string(pb->pb_state));
-  }
-  else if (!strcmp(prop, DBUS_PLAYBACK_CLASS_PROP))
-  {
-    return _playback_get_string_reply(pb, message,
-                                      pb_class_to_string(pb->pb_class));
-  }
-  else if (!strcmp(prop, DBUS_PLAYBACK_PID_PROP))
-  {
-    char pid[64];
-
-    snprintf(pid, sizeof(pid), "%ld", (long)pb->pid);
-    return _playback_get_string_reply(pb, message, pid);
-  }
-  else if (!strcmp(prop, DBUS_PLAYBACK_FLAGS_PROP))
-  {
-    char flags[64];
+    DBusHandlerResult rv = _dbus_error_reply(pb->connection, message,
+                                             DBUS_MAEMO_ERROR_INVALID_ARGS,
+                                             error.message);
 
-    snprintf(flags, sizeof(flags), "%u", pb->flags);
-    return _playback_get_string_reply(pb, message, flags);
+    dbus_error_free(&error);
+    return rv;
   }
-  else if (!strcmp(prop, DBUS_PLAYBACK_STREAM_PROP))
-  {
-    const char *stream = pb->stream;
-
-    if (!stream)
-      stream = "";
 
-    return _playback_get_string_reply(pb, message, stream);
-  }
-  else if (!strcmp(prop, DBUS_PLAYBACK_ALLOWED_STATE_PROP))
-  {
-    DBusMessage *msg = dbus_message_new_method_return(message);
-    int len = 0;
-    int i;
-    const char *_states[3];
-    const char **states = _states;
+  for (i = 0; i < len; i++)
+    allowed_state[pb_string_to_state(states[i])] = TRUE;
 
-    if (!msg)
-      return DBUS_HANDLER_RESULT_NEED_MEMORY;
+  _update_allowed_states(pb, allowed_state);
+  dbus_free_string_array(states);
+  msg = dbus_message_new_method_return(message);
 
-    for (i = 0; i < PB_STATE_LAST; i++)
-    {
-      if (pb->allowed_state[i] == TRUE)
-      {
-        _states[len] = pb_state_to_string(i);
-        len ++;
-      }
-    }
+  if (!msg)
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
 
-    dbus_message_append_args(msg,
-                             DBUS_TYPE_ARRAY,
-                             DBUS_TYPE_STRING, &states, len,
-                             DBUS_TYPE_INVALID);
-    dbus_connection_send(pb->connection, msg, 0);
-    dbus_message_unref(msg);
-    return DBUS_HANDLER_RESULT_HANDLED;
-  }
+  _playback_send(pb, msg);
+  dbus_message_unref(msg);
 
-  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  return DBUS_HANDLER_RESULT_HANDLED;
 }
 
 static DBusHandlerResult
 _playback_set(pb_playback_t *pb, DBusMessage *message)
 {
-  DBusError error;
   DBusMessageIter iter;
   const char *iface;
   const char *prop;
 
-  dbus_error_init(&error);
   dbus_message_iter_init(message, &iter);
 
   if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
@@ -966,7 +2127,7 @@ _playback_set(pb_playback_t *pb, DBusMessage *message)
   dbus_message_iter_get_basic(&iter, &iface);
   dbus_message_iter_next(&iter);
 
-  if (strcmp(iface, DBUS_PLAYBACK_INTERFACE))
+  if (!NAME_IS(iface, strlen(iface), DBUS_PLAYBACK_INTERFACE))
   {
     return _dbus_error_reply(pb->connection, message,
                              DBUS_MAEMO_ERROR_INVALID_IFACE, "");
@@ -982,93 +2143,53 @@ _playback_set(pb_playback_t *pb, DBusMessage *message)
   dbus_message_iter_get_basic(&iter, &prop);
   dbus_message_iter_next(&iter);
 
-  if (!strcmp(prop, DBUS_PLAYBACK_STATE_PROP))
+  switch (_playback_property_lookup(prop))
   {
-    DBusMessage *msg;
-    enum pb_state_e state;
-    const char *s;
-
-    if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
-    {
-      _dbus_error_reply(pb->connection, message,
-                        DBUS_MAEMO_ERROR_INVALID_ARGS, "");
-      return DBUS_HANDLER_RESULT_HANDLED;
-    }
-
-    dbus_message_iter_get_basic(&iter, &s);
-    dbus_message_iter_next(&iter);
-    state = pb_string_to_state(s);
-
-    if (state == PB_STATE_NONE)
-    {
-      return _dbus_error_reply(pb->connection, message,
-                               DBUS_MAEMO_ERROR_INVALID_ARGS,
-                               "Bad state value");
-    }
-
-    if (state != pb->pb_state)
-    {
-      pb_req_t *req = _pb_request_new(pb);
-
-      if (!req)
-      {
-        return _dbus_error_reply(pb->connection, message,
-                                 DBUS_MAEMO_ERROR_INTERNAL_ERR, "");
-      }
-
-      req->message = message;
-      req->pb_state = state;
-      req->finished = TRUE;
-      pb->state_req_handler(pb, state, req, pb->state_req_handler_data);
-      return DBUS_HANDLER_RESULT_HANDLED;
-    }
-
-    msg = dbus_message_new_method_return(message);
-
-    if (msg)
-    {
-      dbus_connection_send(pb->connection, msg, 0);
-      dbus_message_unref(msg);
-    }
-
-    _playback_signal_state(pb);
+    case PROP_STATE:
+      return _playback_set_state(pb, message, &iter);
+    case PROP_ALLOWED_STATE:
+      return _playback_set_allowed_state(pb, message);
+    default:
+      return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  }
+}
 
-    return DBUS_HANDLER_RESULT_HANDLED;
+/* Appends the a{sv} of GetAll, also the value of the playback interface
+ * in the ObjectManager dictionaries */
+static int
+_playback_append_properties(pb_playback_t *pb,
+                            DBusMessageIter *iter)
+{
+  DBusMessageIter prop_it;
+  int i;
 
-  }
-  else if (!strcmp(prop, DBUS_PLAYBACK_ALLOWED_STATE_PROP))
+  if (!dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "{sv}",
+                                        &prop_it))
   {
-    DBusMessage *msg;
-    const char *iface;
-    char **states;
-    int len;
-
-    dbus_message_get_args(message, &error,
-                          DBUS_TYPE_STRING, &iface,
-                          DBUS_TYPE_STRING, &prop,
-                          DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &states, &len,
-                          DBUS_TYPE_INVALID);
+    return FALSE;
+  }
 
-    if (dbus_error_is_set(&error))
+  for (i = 0; i < PROP_LAST; i++)
+  {
+    DBusMessageIter dict_it;
+    DBusMessageIter val_it;
+
+    if (!dbus_message_iter_open_container(&prop_it, DBUS_TYPE_DICT_ENTRY,
+                                          NULL, &dict_it) ||
+        !dbus_message_iter_append_basic(&dict_it, DBUS_TYPE_STRING,
+                                        &property_table[i].name) ||
+        !dbus_message_iter_open_container(&dict_it, DBUS_TYPE_VARIANT,
+                                          property_table[i].type, &val_it) ||
+        !_playback_append_value(pb, i, &val_it) ||
+        !dbus_message_iter_close_container(&dict_it, &val_it) ||
+        !dbus_message_iter_close_container(&prop_it, &dict_it))
     {
-      return _dbus_error_reply(pb->connection, message,
-                               DBUS_MAEMO_ERROR_INVALID_ARGS, error.message);
+      dbus_message_iter_abandon_container(iter, &prop_it);
+      return FALSE;
     }
-
-    _update_allowed_states(pb, states, len);
-    dbus_free_string_array(states);
-    msg = dbus_message_new_method_return(message);
-
-    if (!msg)
-      return DBUS_HANDLER_RESULT_NEED_MEMORY;
-
-    dbus_connection_send(pb->connection, msg, 0);
-    dbus_message_unref(msg);
-
-    return DBUS_HANDLER_RESULT_HANDLED;
   }
 
-  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  return dbus_message_iter_close_container(iter, &prop_it);
 }
 
 static DBusHandlerResult
@@ -1076,15 +2197,8 @@ _playback_get_all(pb_playback_t *pb, DBusMessage *message)
 {
   DBusError error;
   DBusMessageIter iter;
-  DBusMessageIter prop_it;
-  DBusMessageIter array_it;
-  DBusMessageIter val_it;
-  DBusMessageIter states_it;
   const char *iface;
-  const char *stream = "";
-  const char *prop = DBUS_PLAYBACK_ALLOWED_STATE_PROP;
   DBusMessage *msg;
-  char buf[64];
 
   dbus_error_init(&error);
   dbus_message_get_args(message, &error,
@@ -1099,7 +2213,7 @@ _playback_get_all(pb_playback_t *pb, DBusMessage *message)
     return DBUS_HANDLER_RESULT_HANDLED;
   }
 
-  if (strcmp(iface, DBUS_PLAYBACK_INTERFACE))
+  if (!NAME_IS(iface, strlen(iface), DBUS_PLAYBACK_INTERFACE))
   {
     return _dbus_error_reply(pb->connection, message,
                              DBUS_MAEMO_ERROR_INVALID_IFACE, "");
@@ -1112,143 +2226,318 @@ _playback_get_all(pb_playback_t *pb, DBusMessage *message)
 
   dbus_message_iter_init_append(msg, &iter);
 
-  if (!!dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}",
-                                         &prop_it) ||
-      !_add_property(&prop_it, DBUS_PLAYBACK_STATE_PROP,
-                     pb_state_to_string(pb->pb_state)) ||
-      !_add_property(&prop_it, DBUS_PLAYBACK_CLASS_PROP,
-                     pb_class_to_string(pb->pb_class)))
-  {
+  if (!_playback_append_properties(pb, &iter))
     goto err;
+
+  _playback_send(pb, msg);
+  dbus_message_unref(msg);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+
+err:
+
+  if (msg)
+    dbus_message_unref(msg);
+
+  return _dbus_error_reply(pb->connection, message,
+                           DBUS_MAEMO_ERROR_INTERNAL_ERR, "");
+}
+
+/* Appends the a{sa{sv}} of the interfaces of @pb, of which only the
+ * playback interface has properties */
+static int
+_playback_append_interfaces(pb_playback_t *pb,
+                            DBusMessageIter *iter)
+{
+  const char *iface = DBUS_PLAYBACK_INTERFACE;
+  DBusMessageIter array;
+  DBusMessageIter entry;
+
+  if (!dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, "{sa{sv}}",
+                                        &array))
+    return FALSE;
+
+  if (!dbus_message_iter_open_container(&array, DBUS_TYPE_DICT_ENTRY, NULL,
+                                        &entry) ||
+      !dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &iface) ||
+      !_playback_append_properties(pb, &entry) ||
+      !dbus_message_iter_close_container(&array, &entry))
+  {
+    dbus_message_iter_abandon_container(iter, &array);
+    return FALSE;
+  }
+
+  return dbus_message_iter_close_container(iter, &array);
+}
+
+/* InterfacesAdded and InterfacesRemoved, from the root path, in place
+ * of Hello and Goodbye */
+static void
+_playback_announce_object(pb_playback_t *pb,
+                          enum pb_announce_e what)
+{
+  const char *iface = DBUS_PLAYBACK_INTERFACE;
+  DBusMessageIter iter;
+  DBusMessageIter array;
+  DBusMessage *message;
+  char path[256];
+  const char *p = path;
+  int ok;
+
+  snprintf(path, sizeof(path), PLAYBACK_PATH, pb->object_id);
+  message = dbus_message_new_signal(PLAYBACK_ROOT_PATH,
+                                    DBUS_OBJECT_MANAGER_INTERFACE,
+                                    what == PB_ANNOUNCE_HELLO ?
+                                    DBUS_INTERFACES_ADDED_SIGNAL :
+                                    DBUS_INTERFACES_REMOVED_SIGNAL);
+
+  if (!message)
+    return;
+
+  dbus_message_iter_init_append(message, &iter);
+  ok = dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH, &p);
+
+  if (ok && what == PB_ANNOUNCE_HELLO)
+    ok = _playback_append_interfaces(pb, &iter);
+  else if (ok)
+  {
+    ok = dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+                                          DBUS_TYPE_STRING_AS_STRING,
+                                          &array) &&
+         dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING, &iface) &&
+         dbus_message_iter_close_container(&iter, &array);
   }
 
-  snprintf(buf, sizeof(buf), "%ld", (long)pb->pid);
+  if (ok)
+    _playback_send(pb, message);
 
-  if (!_add_property(&prop_it, DBUS_PLAYBACK_PID_PROP, buf))
-    goto err;
+  dbus_message_unref(message);
+}
 
-  snprintf(buf, sizeof(buf), "%u", pb->flags);
+static const char *root_introspect =
+DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
+"<node>\n"
+ "<interface name=\"" DBUS_OBJECT_MANAGER_INTERFACE "\">\n"
+  " <method name=\"" DBUS_GET_MANAGED_OBJECTS_METHOD "\">\n"
+  "  <arg name=\"objects\" type=\"a{oa{sa{sv}}}\" direction=\"out\"/>\n"
+  " </method>\n"
+  " <signal name=\"" DBUS_INTERFACES_ADDED_SIGNAL "\">\n"
+  "  <arg name=\"object\" type=\"o\"/>\n"
+  "  <arg name=\"interfaces\" type=\"a{sa{sv}}\"/>\n"
+  " </signal>\n"
+  " <signal name=\"" DBUS_INTERFACES_REMOVED_SIGNAL "\">\n"
+  "  <arg name=\"object\" type=\"o\"/>\n"
+  "  <arg name=\"interfaces\" type=\"as\"/>\n"
+  " </signal>\n"
+ "</interface>\n"
+ "<interface name=\"" DBUS_PLAYBACK_DEBUG_INTERFACE "\">\n"
+  " <method name=\"" DBUS_PLAYBACK_GET_RECORDER_METHOD "\">\n"
+  "  <arg name=\"events\" type=\"as\" direction=\"out\"/>\n"
+  " </method>\n"
+ "</interface>\n";
 
-  if (!_add_property(&prop_it, DBUS_PLAYBACK_FLAGS_PROP, buf))
-    goto err;
+static DBusHandlerResult
+_root_introspect(pb_connection_t *conn, DBusMessage *message)
+{
+  DBusMessage *msg = NULL;
+  char *xml = NULL, *p;
+  size_t size;
+  uint32_t id;
+
+  if (!dbus_message_has_signature(message, DBUS_TYPE_INVALID_AS_STRING))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
-  if (pb->stream)
-    stream = pb->stream;
+  /* a child node per playback, with ten digits at most */
+  size = strlen(root_introspect) + conn->size * 40 + sizeof("</node>");
 
-  if (!_add_property(&prop_it, DBUS_PLAYBACK_STREAM_PROP, stream) ||
-      !dbus_message_iter_open_container(&prop_it, DBUS_TYPE_DICT_ENTRY,
-                                        NULL, &val_it))
+  if (!(xml = (char *)malloc(size)))
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+  p = xml + sprintf(xml, "%s", root_introspect);
+
+  for (id = 0; id < conn->size; id++)
   {
-    goto err;
+    if (conn->playbacks[id])
+      p += sprintf(p, "<node name=\"playback%u\"/>\n", id);
   }
 
-  if (dbus_message_iter_append_basic(&val_it, DBUS_TYPE_STRING, &prop) &&
-      dbus_message_iter_open_container(&val_it, DBUS_TYPE_VARIANT,
-                                       "as", &array_it) &&
-      dbus_message_iter_open_container(&array_it, DBUS_TYPE_ARRAY,
-                                       DBUS_TYPE_STRING_AS_STRING, &states_it))
+  strcpy(p, "</node>");
+
+  if (!(msg = dbus_message_new_method_return(message)) ||
+      !dbus_message_append_args(msg,
+                                DBUS_TYPE_STRING, &xml,
+                                DBUS_TYPE_INVALID))
   {
-    int i;
+    if (msg)
+      dbus_message_unref(msg);
 
-    for (i = 0; i < PB_STATE_LAST; i++)
-    {
-      if (pb->allowed_state[i] == TRUE)
-      {
-        const char *s = pb_state_to_string(i);
+    free(xml);
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+  }
 
-        if (!dbus_message_iter_append_basic(&states_it, DBUS_TYPE_STRING, &s))
-          goto err;
-      }
-    }
+  dbus_connection_send(conn->connection, msg, NULL);
+  PB_CAPTURE(conn, PB_CAPTURE_SENT, msg);
+  dbus_message_unref(msg);
+  free(xml);
 
-    dbus_message_iter_close_container(&array_it, &states_it);
-    dbus_message_iter_close_container(&val_it, &array_it);
-    dbus_message_iter_close_container(&prop_it, &val_it);
-    dbus_message_iter_close_container(&iter, &prop_it);
-    dbus_connection_send(pb->connection, msg, 0);
-    dbus_message_unref(msg);
-    return DBUS_HANDLER_RESULT_HANDLED;
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+/* Every registered playback with its properties, in one reply */
+static DBusHandlerResult
+_root_get_managed_objects(pb_connection_t *conn, DBusMessage *message)
+{
+  DBusMessageIter iter;
+  DBusMessageIter objects;
+  DBusMessage *msg;
+  char path[256];
+  const char *p = path;
+  uint32_t id;
+
+  if (!dbus_message_has_signature(message, DBUS_TYPE_INVALID_AS_STRING))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (!(msg = dbus_message_new_method_return(message)))
+    return DBUS_HANDLER_RESULT_NEED_MEMORY;
+
+  dbus_message_iter_init_append(msg, &iter);
+
+  if (!dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+                                        "{oa{sa{sv}}}", &objects))
+    goto err;
+
+  for (id = 0; id < conn->size; id++)
+  {
+    pb_playback_t *pb = conn->playbacks[id];
+    DBusMessageIter entry;
+
+    if (!pb)
+      continue;
+
+    snprintf(path, sizeof(path), PLAYBACK_PATH, id);
+
+    if (!dbus_message_iter_open_container(&objects, DBUS_TYPE_DICT_ENTRY,
+                                          NULL, &entry) ||
+        !dbus_message_iter_append_basic(&entry, DBUS_TYPE_OBJECT_PATH, &p) ||
+        !_playback_append_interfaces(pb, &entry) ||
+        !dbus_message_iter_close_container(&objects, &entry))
+    {
+      dbus_message_iter_abandon_container(&iter, &objects);
+      goto err;
+    }
   }
 
+  if (!dbus_message_iter_close_container(&iter, &objects))
+    goto err;
+
+  dbus_connection_send(conn->connection, msg, NULL);
+  PB_CAPTURE(conn, PB_CAPTURE_SENT, msg);
+  dbus_message_unref(msg);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+
 err:
 
-  if (msg)
-    dbus_message_unref(msg);
+  dbus_message_unref(msg);
 
-  return _dbus_error_reply(pb->connection, message,
+  return _dbus_error_reply(conn->connection, message,
                            DBUS_MAEMO_ERROR_INTERNAL_ERR, "");
 }
 
-static const char *introspect =
-DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE
-"<node>\n"
- "<interface name=\"org.maemo.Playback\">\n"
-  " <property name=\"State\" type=\"s\" access=\"readwrite\"/>\n"
-  " <property name=\"AllowedState\" type=\"as\" access=\"readwrite\"/>\n"
-  " <property name=\"Class\" type=\"s\" access=\"read\"/>\n"
-  " <property name=\"Flags\" type=\"s\" access=\"read\"/>\n"
-  " <property name=\"Pid\" type=\"s\" access=\"read\"/>\n"
-  " <property name=\"Stream\" type=\"s\" access=\"read\"/>\n"
-  " <signal name=\"Hello\"/>\n"
-  " <signal name=\"Notify\"/>\n"
- "</interface>\n"
-"</node>";
+static DBusHandlerResult
+_dbus_root_message(pb_connection_t *conn,
+                   DBusMessage *message)
+{
+  if (dbus_message_is_method_call(message, DBUS_OBJECT_MANAGER_INTERFACE,
+                                  DBUS_GET_MANAGED_OBJECTS_METHOD))
+    return _root_get_managed_objects(conn, message);
+
+  if (dbus_message_is_method_call(message, DBUS_INTERFACE_INTROSPECTABLE,
+                                  "Introspect"))
+    return _root_introspect(conn, message);
+
+  if (dbus_message_is_method_call(message, DBUS_PLAYBACK_DEBUG_INTERFACE,
+                                  DBUS_PLAYBACK_GET_RECORDER_METHOD))
+    return _connection_get_flight_recorder(conn, message);
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+#define METHOD_ENTRY(iface, member, handler) \
+  {iface, sizeof(iface) - 1, member, sizeof(member) - 1, handler},
+
+static const struct
+{
+  const char *iface;
+  size_t iface_len;
+  const char *member;
+  size_t member_len;
+  DBusHandlerResult (*handler)(pb_playback_t *pb, DBusMessage *message);
+}
+method_table[] =
+{
+  PLAYBACK_METHODS(METHOD_ENTRY)
+};
 
 static DBusHandlerResult
 _dbus_playback_message(DBusConnection *connection,
                        DBusMessage *message,
                        void *user_data)
 {
-  pb_playback_t *pb;
-  DBusError error;
+  pb_playback_t *pb = (pb_playback_t *)user_data;
   const char *iface;
   const char *member;
+  size_t iface_len;
+  size_t member_len;
+  int i;
 
-  pb = (pb_playback_t *)user_data;
-  dbus_error_init(&error);
-
-  if (dbus_set_error_from_message(&error, message))
-  {
-    dbus_error_free(&error);
-    return DBUS_HANDLER_RESULT_HANDLED;
-  }
+  if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
   iface = dbus_message_get_interface(message);
   member = dbus_message_get_member(message);
 
-  if (!strcmp(DBUS_INTERFACE_INTROSPECTABLE, iface) &&
-      !strcmp("Introspect", member))
-  {
-    DBusMessage *msg;
+  /* the interface is optional in method calls */
+  if (!iface || !member)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
-    if (!dbus_message_has_signature(message, DBUS_TYPE_INVALID_AS_STRING))
-      return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  iface_len = strlen(iface);
+  member_len = strlen(member);
 
-    msg = dbus_message_new_method_return(message);
+  for (i = 0; i < pb_n_elements(method_table); i++)
+  {
+    if (_name_is(member, member_len,
+                 method_table[i].member, method_table[i].member_len) &&
+        _name_is(iface, iface_len,
+                 method_table[i].iface, method_table[i].iface_len))
+    {
+      return method_table[i].handler(pb, message);
+    }
+  }
 
-    if (!msg)
-      return DBUS_HANDLER_RESULT_NEED_MEMORY;
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
 
-    dbus_message_append_args(msg,
-                             DBUS_TYPE_STRING, &introspect,
-                             DBUS_TYPE_INVALID);
-    dbus_connection_send(pb->connection, msg, NULL);
-    dbus_message_unref(msg);
-    return DBUS_HANDLER_RESULT_HANDLED;
-  }
+static DBusHandlerResult
+_dbus_playback_fallback(DBusConnection *connection,
+                        DBusMessage *message,
+                        void *user_data)
+{
+  pb_connection_t *conn = (pb_connection_t *)user_data;
+  pb_playback_t *pb;
+  DBusHandlerResult rv;
 
-  if (strcmp(iface, DBUS_INTERFACE_PROPERTIES))
-    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  if (dbus_message_has_path(message, PLAYBACK_ROOT_PATH))
+    return _dbus_root_message(conn, message);
 
-  if (!strcmp(member, "Get"))
-    return _playback_get(pb, message);
+  pb = _pb_connection_lookup(conn, dbus_message_get_path(message));
 
-  if (!strcmp(member, "Set"))
-    return _playback_set(pb, message);
+  if (!pb)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
-  if (!strcmp(member, "GetAll"))
-    return _playback_get_all(pb, message);
+  _pb_playback_ref(pb);
+  rv = _dbus_playback_message(connection, message, pb);
+  _pb_playback_unref(pb);
 
-  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  return rv;
 }
-
@@ -0,0 +1,398 @@
+#include <dbus/dbus.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libplayback/playback.h"
+#include "playback-dbus.h"
+#include "playback-transport.h"
+
+/* The local policy: while there is no manager on the bus, the state
+ * requests of a connection are decided in this process, from a table of
+ * class priorities and preemptions, by an engine on the loopback
+ * transport.  It takes over when the manager goes away, or is not there
+ * when the policy is set, and steps back as soon as a manager appears.
+ *
+ * A playback may go to PLAY unless a playing playback of a higher
+ * priority class preempts its class.  When it does, the playing
+ * playbacks of the classes it preempts, with the same or a lower
+ * priority, are set to STOP as the manager would. */
+
+#define CLASS_BIT(pb_class) (1U << (pb_class))
+
+/* the built-in table; the priorities are those of the scheduler */
+#define MEDIA_CLASSES \
+  (CLASS_BIT(PB_CLASS_MEDIA) | CLASS_BIT(PB_CLASS_GAME) | \
+   CLASS_BIT(PB_CLASS_FLASH) | CLASS_BIT(PB_CLASS_BACKGROUND))
+
+static const uint32_t default_preempts[PB_CLASS_LAST] = {
+  [PB_CLASS_VOIP] = MEDIA_CLASSES | CLASS_BIT(PB_CLASS_RINGTONE) |
+                    CLASS_BIT(PB_CLASS_ALARM) | CLASS_BIT(PB_CLASS_EVENT) |
+                    CLASS_BIT(PB_CLASS_VOICEUI),
+  [PB_CLASS_RINGTONE] = MEDIA_CLASSES,
+  [PB_CLASS_ALARM] = MEDIA_CLASSES,
+  [PB_CLASS_MEDIA] = MEDIA_CLASSES,
+  [PB_CLASS_GAME] = MEDIA_CLASSES,
+  [PB_CLASS_FLASH] = MEDIA_CLASSES,
+};
+
+typedef struct pb_policy_entry_s pb_policy_entry_t;
+
+struct pb_policy_entry_s
+{
+  pb_playback_t *pb;
+  enum pb_class_e pb_class;
+  enum pb_state_e pb_state;
+};
+
+struct pb_policy_s
+{
+  DBusConnection *connection;
+  uint8_t priority[PB_CLASS_LAST];
+  uint32_t preempts[PB_CLASS_LAST];
+  int filtered;
+  int active;
+  pb_policy_entry_t *entries;
+  unsigned int n_entries;
+  unsigned int size;
+};
+
+static pb_policy_entry_t *
+_policy_entry(pb_policy_t *policy,
+              const pb_engine_req_t *req,
+              int create)
+{
+  pb_policy_entry_t *entry;
+  unsigned int i;
+
+  for (i = 0; i < policy->n_entries; i++)
+  {
+    if (policy->entries[i].pb == req->pb)
+      return &policy->entries[i];
+  }
+
+  if (!create)
+    return NULL;
+
+  if (policy->n_entries == policy->size)
+  {
+    unsigned int size = policy->size ? 2 * policy->size : 8;
+
+    entry = (pb_policy_entry_t *)realloc(policy->entries,
+                                         size * sizeof(pb_policy_entry_t));
+
+    if (!entry)
+      return NULL;
+
+    policy->entries = entry;
+    policy->size = size;
+  }
+
+  entry = &policy->entries[policy->n_entries++];
+  entry->pb = req->pb;
+  entry->pb_class = req->pb_class;
+  entry->pb_state = PB_STATE_NONE;
+
+  return entry;
+}
+
+static enum pb_state_e
+_policy_request_state(const pb_engine_req_t *req,
+                      const char **reason,
+                      void *data)
+{
+  pb_policy_t *policy = (pb_policy_t *)data;
+  pb_policy_entry_t *entry = _policy_entry(policy, req, TRUE);
+  uint8_t priority = policy->priority[req->pb_class];
+  unsigned int i;
+
+  if (!entry)
+  {
+    *reason = "Out of memory";
+    return PB_STATE_NONE;
+  }
+
+  if (req->pb_state != PB_STATE_PLAY)
+  {
+    entry->pb_state = req->pb_state;
+    return req->pb_state;
+  }
+
+  for (i = 0; i < policy->n_entries; i++)
+  {
+    pb_policy_entry_t *e = &policy->entries[i];
+
+    if (e != entry && e->pb_state == PB_STATE_PLAY &&
+        (policy->preempts[e->pb_class] & CLASS_BIT(req->pb_class)) &&
+        policy->priority[e->pb_class] > priority)
+    {
+      *reason = "Preempted by a higher priority playback";
+      return PB_STATE_NONE;
+    }
+  }
+
+  for (i = 0; i < policy->n_entries; i++)
+  {
+    pb_policy_entry_t *e = &policy->entries[i];
+
+    if (e != entry && e->pb_state == PB_STATE_PLAY &&
+        (policy->preempts[req->pb_class] & CLASS_BIT(e->pb_class)) &&
+        policy->priority[e->pb_class] <= priority)
+    {
+      e->pb_state = PB_STATE_STOP;
+      pb_loopback_set_state(policy->connection, e->pb, PB_STATE_STOP);
+    }
+  }
+
+  entry->pb_state = PB_STATE_PLAY;
+
+  return PB_STATE_PLAY;
+}
+
+static void
+_policy_playback_event(const pb_engine_req_t *req,
+                       enum pb_engine_event_e event,
+                       void *data)
+{
+  pb_policy_t *policy = (pb_policy_t *)data;
+  pb_policy_entry_t *entry;
+
+  entry = _policy_entry(policy, req, event != PB_ENGINE_GOODBYE);
+
+  if (!entry)
+    return;
+
+  if (event == PB_ENGINE_GOODBYE)
+    *entry = policy->entries[--policy->n_entries];
+  else
+    entry->pb_state = req->pb_state;
+}
+
+static const pb_engine_t policy_engine =
+{
+  _policy_request_state,
+  NULL,
+  NULL,
+  NULL,
+  _policy_playback_event
+};
+
+/* The replies of the engine are queued on the loopback; a signal to
+ * ourselves has the main loop deliver them, for the applications that
+ * do not call pb_loopback_dispatch() */
+static void
+_policy_wakeup(DBusConnection *connection,
+               void *data)
+{
+  DBusMessage *message;
+
+  message = dbus_message_new_signal(PLAYBACK_ROOT_PATH,
+                                    DBUS_PLAYBACK_INTERFACE,
+                                    DBUS_DISPATCH_SIGNAL);
+
+  if (!message)
+    return;
+
+  if (dbus_message_set_destination(message,
+                                   dbus_bus_get_unique_name(connection)))
+    dbus_connection_send(connection, message, NULL);
+
+  dbus_message_unref(message);
+}
+
+static DBusHandlerResult
+_policy_filter(DBusConnection *connection,
+               DBusMessage *message,
+               void *user_data)
+{
+  const char *sender;
+
+  if (!dbus_message_is_signal(message, DBUS_PLAYBACK_INTERFACE,
+                              DBUS_DISPATCH_SIGNAL) ||
+      !(sender = dbus_message_get_sender(message)) ||
+      strcmp(sender, dbus_bus_get_unique_name(connection)))
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  pb_loopback_dispatch(connection);
+
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static int
+_policy_takeover(pb_connection_t *conn)
+{
+  pb_policy_t *policy = conn->policy;
+
+  if (!_pb_loopback_takeover(policy->connection, &policy_engine, policy,
+                             _policy_wakeup))
+    return FALSE;
+
+  policy->active = TRUE;
+  PB_LOG_EVENT(conn, PB_LOG_LEVEL_INFO, PB_LOG_NO_OBJECT,
+               "no manager, local policy takes over", NULL, 0, 0);
+
+  return TRUE;
+}
+
+int
+_pb_policy_manager(DBusConnection *connection,
+                   int present)
+{
+  pb_connection_t *conn = _pb_connection_get(connection);
+  pb_policy_t *policy;
+
+  if (!conn || !(policy = conn->policy) || present != policy->active)
+    return FALSE;
+
+  if (!present)
+    return _policy_takeover(conn);
+
+  /* what the engine answered is delivered first */
+  pb_loopback_detach(connection);
+  policy->active = FALSE;
+  policy->n_entries = 0;
+  PB_LOG_EVENT(conn, PB_LOG_LEVEL_INFO, PB_LOG_NO_OBJECT,
+               "manager back, local policy steps back", NULL, 0, 0);
+
+  return TRUE;
+}
+
+void
+_pb_policy_free(pb_policy_t *policy)
+{
+  if (!policy)
+    return;
+
+  free(policy->entries);
+  free(policy);
+}
+
+static int
+_policy_class(const char *name)
+{
+  enum pb_class_e pb_class = pb_string_to_class(name);
+
+  if (pb_class == PB_CLASS_NONE && strcmp(name, "None"))
+    return -1;
+
+  return pb_class;
+}
+
+/* Reads lines of "class priority [preempted classes...]", with the
+ * class names of pb_class_to_string(); a class not listed keeps its
+ * entry.  Nothing is changed unless the whole file is valid. */
+static int
+_policy_load(pb_connection_t *conn,
+             pb_policy_t *policy,
+             const char *path)
+{
+  uint8_t priority[PB_CLASS_LAST];
+  uint32_t preempts[PB_CLASS_LAST];
+  char line[256];
+  long lineno = 0;
+  FILE *file;
+  int ok = TRUE;
+
+  if (!(file = fopen(path, "r")))
+    return FALSE;
+
+  memcpy(priority, policy->priority, sizeof(priority));
+  memcpy(preempts, policy->preempts, sizeof(preempts));
+
+  while (ok && fgets(line, sizeof(line), file))
+  {
+    char *save, *word, *end;
+    int pb_class, other;
+    long value;
+
+    lineno++;
+
+    if (!(word = strtok_r(line, " \t\r\n", &save)) || *word == '#')
+      continue;
+
+    if ((pb_class = _policy_class(word)) < 0 ||
+        !(word = strtok_r(NULL, " \t\r\n", &save)))
+    {
+      ok = FALSE;
+      break;
+    }
+
+    value = strtol(word, &end, 10);
+
+    if (*end || value < 0 || value > PB_PRIORITY_MAX)
+    {
+      ok = FALSE;
+      break;
+    }
+
+    priority[pb_class] = value;
+    preempts[pb_class] = 0;
+
+    while ((word = strtok_r(NULL, " \t\r\n", &save)) && *word != '#')
+    {
+      if ((other = _policy_class(word)) < 0)
+      {
+        ok = FALSE;
+        break;
+      }
+
+      preempts[pb_class] |= CLASS_BIT(other);
+    }
+  }
+
+  fclose(file);
+
+  if (!ok)
+  {
+    PB_LOG_EVENT(conn, PB_LOG_LEVEL_WARNING, PB_LOG_NO_OBJECT,
+                 "policy table, error at line %ld", path, lineno, 0);
+    return FALSE;
+  }
+
+  memcpy(policy->priority, priority, sizeof(priority));
+  memcpy(policy->preempts, preempts, sizeof(preempts));
+
+  return TRUE;
+}
+
+int
+pb_set_local_policy(DBusConnection *connection,
+                    const char *path)
+{
+  pb_connection_t *conn;
+  pb_policy_t *policy;
+
+  if (!connection || !(conn = _pb_connection_get(connection)))
+    return FALSE;
+
+  if (!(policy = conn->policy))
+  {
+    if (!(policy = (pb_policy_t *)calloc(1, sizeof(pb_policy_t))))
+      return FALSE;
+
+    policy->connection = connection;
+    memcpy(policy->priority, conn->priority, sizeof(policy->priority));
+    memcpy(policy->preempts, default_preempts, sizeof(policy->preempts));
+    conn->policy = policy;
+  }
+
+  if (path && !_policy_load(conn, policy, path))
+    return FALSE;
+
+  if (!policy->filtered)
+  {
+    if (!dbus_connection_add_filter(connection, _policy_filter, NULL, NULL))
+      return FALSE;
+
+    policy->filtered = TRUE;
+    _pb_dbus_transport.watch(connection, PB_WATCH_OWNER);
+  }
+
+  if (!policy->active &&
+      !dbus_bus_name_has_owner(connection, DBUS_PLAYBACK_MANAGER_SERVICE,
+                               NULL) &&
+      _policy_takeover(conn))
+    _pb_connection_hello(conn);
+
+  return TRUE;
+}
@@ -1,37 +1,22 @@
 #include <dbus/dbus.h>
-#include <string.h>
 
 #include "libplayback/playback.h"
-#include "playback-dbus.h"
+#include "playback-probes.h"
+#include "playback-transport.h"
 
-
-static PBPrivacyCb _privacy_cb = NULL;
-static void *_privacy_data = NULL;
-
-static DBusHandlerResult
-_privacy_override_filter(DBusConnection *connection, DBusMessage *message,
-                         void *user_data)
+void
+_pb_privacy_changed(DBusConnection *connection,
+                    int override)
 {
-  DBusError error;
-  dbus_bool_t override;
-
-  if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_SIGNAL &&
-      !strcmp(dbus_message_get_interface(message),
-              DBUS_PLAYBACK_MANAGER_INTERFACE) &&
-      !strcmp(dbus_message_get_member(message), DBUS_PRIVACY_SIGNAL))
-  {
-    dbus_error_init(&error);
-    dbus_message_get_args(message, &error,
-                          DBUS_TYPE_BOOLEAN, &override,
-                          DBUS_TYPE_INVALID);
+  pb_connection_t *conn = _pb_connection_get(connection);
 
-    if (dbus_error_is_set(&error))
-      dbus_error_free(&error);
-    else if (_privacy_cb)
-      _privacy_cb(override == TRUE, NULL, _privacy_data);
-  }
+  if (!conn || !conn->privacy_cb)
+    return;
 
-  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  PB_PROBE_SETTING(privacy_override, override);
+  PB_LOG_EVENT(conn, PB_LOG_LEVEL_DEBUG, PB_LOG_NO_OBJECT,
+               "privacy override %ld", NULL, override, 0);
+  conn->privacy_cb(override, NULL, conn->privacy_data);
 }
 
 void
@@ -39,101 +24,44 @@ pb_set_privacy_override_cb(DBusConnection *connection,
                            PBPrivacyCb privacy_cb,
                            void *data)
 {
-  if (privacy_cb)
+  pb_connection_t *conn;
+
+  if (privacy_cb && (conn = _pb_connection_get(connection)))
   {
-    _privacy_cb = privacy_cb;
-    _privacy_data = data;
-    dbus_connection_add_filter(
-          connection, _privacy_override_filter, NULL, NULL);
+    conn->privacy_cb = privacy_cb;
+    conn->privacy_data = data;
+    _pb_transport(conn)->watch(connection, 0);
   }
 }
 
 static void
-_request_override_reply(DBusPendingCall *pending, void *user_data)
+_request_override_error(DBusConnection *connection,
+                        const char *error)
 {
-  DBusMessage *reply;
+  pb_connection_t *conn = _pb_connection_get(connection);
 
-  if (!pending)
-    return;
-
-  reply = dbus_pending_call_steal_reply(pending);
-  dbus_pending_call_unref(pending);
-
-  if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR && _privacy_cb)
-    _privacy_cb(FALSE, dbus_message_get_error_name(reply), _privacy_data);
-
-  dbus_message_unref(reply);
+  if (conn && conn->privacy_cb)
+    conn->privacy_cb(FALSE, error, conn->privacy_data);
 }
 
 int
 pb_req_privacy_override(DBusConnection *connection,
                         int override)
 {
-  DBusMessage *message;
-  DBusPendingCall *pending;
-  dbus_bool_t ovr = override ? TRUE : FALSE;
-  int rv = FALSE;
-
-  message = dbus_message_new_method_call(DBUS_PLAYBACK_MANAGER_SERVICE,
-                                         DBUS_PLAYBACK_MANAGER_PATH,
-                                         DBUS_PLAYBACK_MANAGER_INTERFACE,
-                                         DBUS_PLAYBACK_REQ_PRIVACY_METHOD);
-  if (!message)
-    return FALSE;
-
-  dbus_message_append_args(message,
-                           DBUS_TYPE_BOOLEAN, &ovr,
-                           DBUS_TYPE_INVALID);
-
-  if (dbus_connection_send_with_reply(connection, message, &pending, -1))
-  {
-    dbus_pending_call_set_notify( pending, _request_override_reply, NULL, NULL);
-    rv = TRUE;
-  }
-
-  dbus_message_unref(message);
-
-  return rv;
+  return _pb_setting_request(connection, PB_SETTING_PRIVACY, override,
+                             _request_override_error);
 }
 
 static void
-_get_override_reply(DBusPendingCall *pending, void *user_data)
+_get_override_reply(const pb_reply_t *reply, void *data)
 {
-  DBusMessage *reply;
-
-  if (!pending)
-    return;
-
-  reply = dbus_pending_call_steal_reply(pending);
-  dbus_pending_call_unref(pending);
-
-  if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR && _privacy_cb)
-    _privacy_cb(FALSE, dbus_message_get_error_name(reply), _privacy_data);
-
-    dbus_message_unref(reply);
+  if (reply->error)
+    _request_override_error((DBusConnection *)data, reply->error);
 }
 
 int
 pb_get_privacy_override(DBusConnection *connection)
 {
-  DBusMessage *message;
-  DBusPendingCall *pending;
-  int rv = FALSE;
-
-  message = dbus_message_new_method_call(DBUS_PLAYBACK_MANAGER_SERVICE,
-                                         DBUS_PLAYBACK_MANAGER_PATH,
-                                         DBUS_PLAYBACK_MANAGER_INTERFACE,
-                                         DBUS_PLAYBACK_GET_PRIVACY_METHOD);
-  if (message)
-  {
-    if (dbus_connection_send_with_reply(connection, message, &pending, -1))
-    {
-      dbus_pending_call_set_notify(pending, _get_override_reply, NULL, NULL);
-      rv = TRUE;
-    }
-
-    dbus_message_unref(message);
-  }
-
-  return rv;
+  return _pb_setting_get(connection, PB_SETTING_PRIVACY,
+                         _get_override_reply);
 }
@@ -0,0 +1,390 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libplayback/playback.h"
+#include "playback-private.h"
+
+/* The flight recorder: the last PB_RECORDER_SIZE state transitions of a
+ * connection, always recorded.  Writers take a slot with one atomic add
+ * and publish it through its sequence number as in log.c; unlike the
+ * log, reading does not consume, and nothing on the read side takes a
+ * lock or allocates, so that a signal handler can dump it. */
+#define RECORDER_MASK (PB_RECORDER_SIZE - 1)
+
+struct pb_recorder_s
+{
+  uint64_t head;
+  int signal_used;              /* ever given to pb_recorder_dump_on_signal() */
+  pb_recorder_event_t events[PB_RECORDER_SIZE];
+};
+
+/* the recorder dumped by the handler of pb_recorder_dump_on_signal() */
+static pb_recorder_t *signal_recorder;
+static int signal_fd = -1;
+
+static const char *event_names[] =
+{
+  [PB_RECORDER_REQUESTED] = "requested",
+  [PB_RECORDER_GRANTED] = "granted",
+  [PB_RECORDER_DENIED] = "denied",
+  [PB_RECORDER_SET] = "set",
+  [PB_RECORDER_SET_LOCAL] = "set locally",
+  [PB_RECORDER_COMPLETED] = "completed",
+  [PB_RECORDER_DISCARDED] = "discarded",
+  [PB_RECORDER_ALLOWED_STATE] = "allowed"
+};
+
+static pb_recorder_t *
+_recorder_get(pb_connection_t *conn)
+{
+  pb_recorder_t *recorder = __atomic_load_n(&conn->recorder,
+                                            __ATOMIC_ACQUIRE);
+  pb_recorder_t *expected = NULL;
+
+  if (recorder)
+    return recorder;
+
+  if (!(recorder = (pb_recorder_t *)calloc(1, sizeof(pb_recorder_t))))
+    return NULL;
+
+  if (!__atomic_compare_exchange_n(&conn->recorder, &expected, recorder,
+                                   FALSE, __ATOMIC_ACQ_REL,
+                                   __ATOMIC_ACQUIRE))
+  {
+    free(recorder);
+    recorder = expected;
+  }
+
+  return recorder;
+}
+
+void
+_pb_recorder_record(pb_connection_t *conn,
+                    uint32_t object_id,
+                    enum pb_class_e pb_class,
+                    uint32_t flags,
+                    enum pb_recorder_event_e event,
+                    enum pb_state_e pb_state,
+                    enum pb_state_e old_state,
+                    uint32_t arg)
+{
+  pb_recorder_t *recorder;
+  pb_recorder_event_t *e;
+  struct timespec ts;
+  uint64_t pos;
+
+  if (!conn || !(recorder = _recorder_get(conn)))
+    return;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  pos = __atomic_fetch_add(&recorder->head, 1, __ATOMIC_RELAXED);
+  e = &recorder->events[pos & RECORDER_MASK];
+
+  __atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  e->time_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  e->object_id = object_id;
+  e->event = event;
+  e->pb_class = pb_class;
+  e->pb_state = pb_state;
+  e->old_state = old_state;
+  e->arg = arg;
+  e->flags = flags;
+  __atomic_store_n(&e->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static int
+_recorder_read(pb_recorder_t *recorder,
+               pb_recorder_event_t *events)
+{
+  uint64_t head = __atomic_load_n(&recorder->head, __ATOMIC_ACQUIRE);
+  uint64_t pos = head > PB_RECORDER_SIZE ? head - PB_RECORDER_SIZE : 0;
+  int n = 0;
+
+  for (; pos < head; pos++)
+  {
+    pb_recorder_event_t *e = &recorder->events[pos & RECORDER_MASK];
+    uint64_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+
+    /* being written, or already overwritten */
+    if (seq != pos + 1)
+      continue;
+
+    memcpy(&events[n], e, sizeof(*e));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq)
+      n++;
+  }
+
+  return n;
+}
+
+int
+pb_recorder_read(DBusConnection *connection,
+                 pb_recorder_event_t *events)
+{
+  pb_connection_t *conn;
+  pb_recorder_t *recorder;
+
+  if (!connection || !events || !(conn = _pb_connection_get(connection)))
+    return -1;
+
+  if (!(recorder = __atomic_load_n(&conn->recorder, __ATOMIC_ACQUIRE)))
+    return 0;
+
+  return _recorder_read(recorder, events);
+}
+
+/* snprintf() is not async-signal-safe, so the text is put together by
+ * hand */
+static size_t
+_format_string(char *buf,
+               size_t size,
+               size_t len,
+               const char *s)
+{
+  while (*s && len + 1 < size)
+    buf[len++] = *s++;
+
+  return len;
+}
+
+static size_t
+_format_number(char *buf,
+               size_t size,
+               size_t len,
+               uint64_t value,
+               int width)
+{
+  char digits[21];
+  int n = 0;
+
+  do
+  {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  }
+  while (value || n < width);
+
+  while (n && len + 1 < size)
+    buf[len++] = digits[--n];
+
+  return len;
+}
+
+static size_t
+_format_state(char *buf,
+              size_t size,
+              size_t len,
+              unsigned int pb_state)
+{
+  len = _format_string(buf, size, len, " ");
+
+  return _format_string(buf, size, len,
+                        pb_state < PB_STATE_LAST ?
+                          pb_state_to_string(pb_state) : "?");
+}
+
+int
+pb_recorder_format(const pb_recorder_event_t *event,
+                   char *buf,
+                   size_t size)
+{
+  size_t len = 0;
+  unsigned int i;
+
+  if (!size)
+    return 0;
+
+  len = _format_number(buf, size, len, event->time_ns / 1000000000ULL, 1);
+  len = _format_string(buf, size, len, ".");
+  len = _format_number(buf, size, len,
+                       event->time_ns % 1000000000ULL / 1000, 6);
+  len = _format_string(buf, size, len, " playback");
+  len = _format_number(buf, size, len, event->object_id, 1);
+  len = _format_string(buf, size, len, " ");
+  len = _format_string(buf, size, len, pb_class_to_string(event->pb_class));
+  len = _format_string(buf, size, len, " ");
+  len = _format_string(buf, size, len,
+                       event->event < pb_n_elements(event_names) &&
+                       event_names[event->event] ?
+                         event_names[event->event] : "?");
+
+  switch (event->event)
+  {
+    case PB_RECORDER_ALLOWED_STATE:
+      for (i = PB_STATE_STOP; i < PB_STATE_LAST; i++)
+      {
+        if (event->arg & 1 << i)
+          len = _format_state(buf, size, len, i);
+      }
+
+      if (!(event->arg & ~(1 << PB_STATE_NONE)))
+        len = _format_string(buf, size, len, " nothing");
+      break;
+    case PB_RECORDER_REQUESTED:
+    case PB_RECORDER_DENIED:
+      len = _format_state(buf, size, len, event->pb_state);
+      break;
+    case PB_RECORDER_GRANTED:
+      len = _format_state(buf, size, len, event->pb_state);
+
+      if (event->arg)
+        len = _format_string(buf, size, len, " (degraded)");
+      break;
+    default:
+      len = _format_state(buf, size, len, event->pb_state);
+      len = _format_string(buf, size, len, ", was");
+      len = _format_state(buf, size, len, event->old_state);
+      break;
+  }
+
+  buf[len] = '\0';
+
+  if (len + 1 < size)
+  {
+    buf[len++] = '\n';
+    buf[len] = '\0';
+  }
+
+  return len;
+}
+
+static int
+_recorder_write(int fd,
+                const char *buf,
+                size_t len)
+{
+  while (len)
+  {
+    ssize_t n = write(fd, buf, len);
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      return FALSE;
+    }
+
+    buf += n;
+    len -= n;
+  }
+
+  return TRUE;
+}
+
+/* Formats one event at a time, the stack has no room for a copy of the
+ * whole recorder in a signal handler */
+static int
+_recorder_dump(pb_recorder_t *recorder,
+               int fd)
+{
+  uint64_t head = __atomic_load_n(&recorder->head, __ATOMIC_ACQUIRE);
+  uint64_t pos = head > PB_RECORDER_SIZE ? head - PB_RECORDER_SIZE : 0;
+  pb_recorder_event_t copy;
+  char buf[128];
+  int n = 0;
+
+  for (; pos < head; pos++)
+  {
+    pb_recorder_event_t *e = &recorder->events[pos & RECORDER_MASK];
+    uint64_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+
+    if (seq != pos + 1)
+      continue;
+
+    memcpy(&copy, e, sizeof(copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != seq)
+      continue;
+
+    if (!_recorder_write(fd, buf, pb_recorder_format(&copy, buf,
+                                                     sizeof(buf))))
+      return -1;
+
+    n++;
+  }
+
+  return n;
+}
+
+int
+pb_recorder_dump(DBusConnection *connection,
+                 int fd)
+{
+  pb_connection_t *conn;
+  pb_recorder_t *recorder;
+
+  if (!connection || fd < 0 || !(conn = _pb_connection_get(connection)))
+    return -1;
+
+  if (!(recorder = __atomic_load_n(&conn->recorder, __ATOMIC_ACQUIRE)))
+    return 0;
+
+  return _recorder_dump(recorder, fd);
+}
+
+static void
+_recorder_signal(int signum)
+{
+  pb_recorder_t *recorder = __atomic_load_n(&signal_recorder,
+                                            __ATOMIC_ACQUIRE);
+  int saved_errno = errno;
+
+  if (recorder)
+    _recorder_dump(recorder, __atomic_load_n(&signal_fd, __ATOMIC_RELAXED));
+
+  errno = saved_errno;
+}
+
+int
+pb_recorder_dump_on_signal(DBusConnection *connection,
+                           int signum,
+                           int fd)
+{
+  pb_connection_t *conn;
+  pb_recorder_t *recorder;
+  struct sigaction action;
+
+  if (!connection || fd < 0 || !(conn = _pb_connection_get(connection)) ||
+      !(recorder = _recorder_get(conn)))
+    return FALSE;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = _recorder_signal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+
+  __atomic_store_n(&recorder->signal_used, TRUE, __ATOMIC_RELAXED);
+  __atomic_store_n(&signal_fd, fd, __ATOMIC_RELAXED);
+  __atomic_store_n(&signal_recorder, recorder, __ATOMIC_RELEASE);
+
+  return !sigaction(signum, &action, NULL);
+}
+
+void
+_pb_recorder_free(pb_recorder_t *recorder)
+{
+  pb_recorder_t *expected = recorder;
+
+  if (!recorder)
+    return;
+
+  __atomic_compare_exchange_n(&signal_recorder, &expected, NULL, FALSE,
+                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+
+  /* A handler running on another thread may have loaded it before it
+   * was cleared, or replaced, and still be reading the ring; there is
+   * no telling when it is done, so such a recorder is never freed. */
+  if (__atomic_load_n(&recorder->signal_used, __ATOMIC_RELAXED))
+    return;
+
+  free(recorder);
+}
@@ -0,0 +1,378 @@
+#include <dbus/dbus.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libplayback/playback.h"
+#include "playback-dbus.h"
+#include "playback-transport.h"
+
+#define SETTING_ALL ((1U << PB_SETTING_LAST) - 1)
+
+/* One pb_get_manager_settings() call.  Every call in flight holds a
+ * reference, the callback runs when the last one is gone. */
+typedef struct pb_settings_req_s pb_settings_req_t;
+
+struct pb_settings_req_s
+{
+  int refcount;
+  DBusConnection *connection;
+  PBManagerSettingsCb cb;
+  void *data;
+  unsigned int received;
+  char *error;
+  int values[PB_SETTING_LAST];
+};
+
+typedef struct pb_setting_call_s pb_setting_call_t;
+
+struct pb_setting_call_s
+{
+  DBusConnection *connection;
+  enum pb_setting_e setting;
+  PBSettingError error_cb;
+};
+
+/* The known values are only trusted while the manager signals reach us,
+ * so they are learned once the settings are watched. */
+static void
+_settings_seed(pb_settings_req_t *sreq)
+{
+  pb_connection_t *conn = _pb_connection_get(sreq->connection);
+  int i;
+
+  if (!conn || !conn->settings_watched)
+    return;
+
+  for (i = 0; i < PB_SETTING_LAST; i++)
+  {
+    conn->settings[i].known = TRUE;
+    conn->settings[i].value = sreq->values[i];
+  }
+}
+
+static void
+_settings_req_unref(void *data)
+{
+  pb_settings_req_t *sreq = (pb_settings_req_t *)data;
+
+  if (--sreq->refcount > 0)
+    return;
+
+  if (sreq->received == SETTING_ALL)
+  {
+    _settings_seed(sreq);
+    sreq->cb(sreq->values[PB_SETTING_MUTE], sreq->values[PB_SETTING_PRIVACY],
+             sreq->values[PB_SETTING_BLUETOOTH], NULL, sreq->data);
+  }
+  else
+  {
+    sreq->cb(FALSE, FALSE, BT_OVERRIDE_OFF,
+             sreq->error ? sreq->error : DBUS_MAEMO_ERROR_FAILED, sreq->data);
+  }
+
+  dbus_connection_unref(sreq->connection);
+  free(sreq->error);
+  free(sreq);
+}
+
+static void
+_settings_store(pb_settings_req_t *sreq,
+                const pb_reply_t *reply)
+{
+  int i;
+
+  if (reply->error)
+  {
+    if (!sreq->error)
+      sreq->error = strdup(reply->error);
+
+    return;
+  }
+
+  for (i = 0; i < PB_SETTING_LAST; i++)
+  {
+    if (reply->settings & 1U << i)
+      sreq->values[i] = reply->values[i];
+  }
+
+  sreq->received |= reply->settings;
+}
+
+static void
+_get_setting_reply(const pb_reply_t *reply,
+                   void *data)
+{
+  _settings_store((pb_settings_req_t *)data, reply);
+}
+
+static int
+_settings_call(pb_settings_req_t *sreq,
+               enum pb_setting_e setting,
+               PBCallReply reply)
+{
+  DBusConnection *connection = sreq->connection;
+
+  if (!_pb_transport(_pb_connection_get(connection))->get_settings(
+        connection, setting, NULL, reply, sreq, _settings_req_unref))
+    return FALSE;
+
+  sreq->refcount++;
+
+  return TRUE;
+}
+
+/* Managers without the properties interface: one call per setting. */
+static void
+_settings_fallback(pb_settings_req_t *sreq)
+{
+  int i;
+
+  for (i = 0; i < PB_SETTING_LAST; i++)
+  {
+    if (sreq->received & 1U << i)
+      continue;
+
+    if (!_settings_call(sreq, i, _get_setting_reply))
+      break;
+  }
+}
+
+static void
+_get_all_reply(const pb_reply_t *reply,
+               void *data)
+{
+  pb_settings_req_t *sreq = (pb_settings_req_t *)data;
+
+  /* no point in asking three times for an absent manager */
+  if (reply->error &&
+      (!strcmp(reply->error, DBUS_ERROR_SERVICE_UNKNOWN) ||
+       !strcmp(reply->error, DBUS_ERROR_NO_REPLY)))
+  {
+    _settings_store(sreq, reply);
+    return;
+  }
+
+  if (!reply->error)
+    _settings_store(sreq, reply);
+
+  if (sreq->received != SETTING_ALL)
+  {
+    PB_LOG_EVENT(_pb_connection_get(sreq->connection), PB_LOG_LEVEL_INFO,
+                 PB_LOG_NO_OBJECT, "manager settings: GetAll unsupported",
+                 NULL, 0, 0);
+    _settings_fallback(sreq);
+  }
+}
+
+int
+pb_get_manager_settings(DBusConnection *connection,
+                        PBManagerSettingsCb settings_cb,
+                        void *data)
+{
+  pb_settings_req_t *sreq;
+
+  if (!connection || !settings_cb)
+    return FALSE;
+
+  if (!(sreq = (pb_settings_req_t *)calloc(1, sizeof(pb_settings_req_t))))
+    return FALSE;
+
+  sreq->refcount = 1;
+  sreq->connection = dbus_connection_ref(connection);
+  sreq->cb = settings_cb;
+  sreq->data = data;
+
+  if (!_settings_call(sreq, PB_SETTING_LAST, _get_all_reply))
+  {
+    /* the caller learns it from the return value, not the callback */
+    dbus_connection_unref(sreq->connection);
+    free(sreq);
+    return FALSE;
+  }
+
+  _settings_req_unref(sreq);
+
+  return TRUE;
+}
+
+void
+_pb_settings_forget(DBusConnection *connection)
+{
+  pb_connection_t *conn = _pb_connection_get(connection);
+  int i;
+
+  if (!conn)
+    return;
+
+  for (i = 0; i < PB_SETTING_LAST; i++)
+    conn->settings[i].known = FALSE;
+}
+
+void
+_pb_manager_setting(DBusConnection *connection,
+                    enum pb_setting_e setting,
+                    int value)
+{
+  pb_connection_t *conn = _pb_connection_get(connection);
+
+  if (conn && conn->settings_watched)
+  {
+    conn->settings[setting].known = TRUE;
+    conn->settings[setting].value = value;
+  }
+
+  switch (setting)
+  {
+    case PB_SETTING_MUTE:
+      _pb_mute_changed(connection, value);
+      break;
+    case PB_SETTING_PRIVACY:
+      _pb_privacy_changed(connection, value);
+      break;
+    default:
+      _pb_bluetooth_changed(connection, value);
+      break;
+  }
+}
+
+void
+_pb_settings_watch(DBusConnection *connection,
+                   pb_connection_t *conn)
+{
+  if (conn->settings_watched)
+    return;
+
+  _pb_transport(conn)->watch(connection, PB_WATCH_SIGNALS | PB_WATCH_OWNER |
+                                         PB_WATCH_ASYNC);
+  conn->settings_watched = TRUE;
+}
+
+static int _setting_send(DBusConnection *connection, pb_connection_t *conn,
+                         enum pb_setting_e setting, int value,
+                         PBSettingError error_cb);
+
+static void
+_setting_request_reply(const pb_reply_t *reply,
+                       void *data)
+{
+  pb_setting_call_t *call = (pb_setting_call_t *)data;
+  pb_connection_t *conn = _pb_connection_get(call->connection);
+  pb_setting_state_t *state;
+
+  if (!conn)
+    return;
+
+  state = &conn->settings[call->setting];
+  state->in_flight = FALSE;
+
+  if (reply->error)
+  {
+    if (call->error_cb)
+      call->error_cb(call->connection, reply->error);
+  }
+  else
+  {
+    state->known = TRUE;
+    state->value = state->target;
+  }
+
+  if (state->queued)
+  {
+    state->queued = FALSE;
+
+    if (!state->known || state->value != state->queued_value)
+    {
+      _setting_send(call->connection, conn, call->setting,
+                    state->queued_value, call->error_cb);
+    }
+  }
+}
+
+static int
+_setting_send(DBusConnection *connection,
+              pb_connection_t *conn,
+              enum pb_setting_e setting,
+              int value,
+              PBSettingError error_cb)
+{
+  pb_setting_call_t *call;
+
+  if (!(call = (pb_setting_call_t *)malloc(sizeof(pb_setting_call_t))))
+    return FALSE;
+
+  call->connection = connection;
+  call->setting = setting;
+  call->error_cb = error_cb;
+
+  if (!_pb_transport(conn)->request_setting(connection, setting, value, NULL,
+                                            _setting_request_reply, call,
+                                            free))
+  {
+    free(call);
+    return FALSE;
+  }
+
+  conn->settings[setting].in_flight = TRUE;
+  conn->settings[setting].target = value ? TRUE : FALSE;
+
+  return TRUE;
+}
+
+int
+_pb_setting_request(DBusConnection *connection,
+                    enum pb_setting_e setting,
+                    int value,
+                    PBSettingError error_cb)
+{
+  pb_connection_t *conn = _pb_connection_get(connection);
+  pb_setting_state_t *state;
+
+  if (!conn)
+    return FALSE;
+
+  _pb_settings_watch(connection, conn);
+  state = &conn->settings[setting];
+  value = value ? TRUE : FALSE;
+
+  if (state->in_flight)
+  {
+    state->queued = TRUE;
+    state->queued_value = value;
+    PB_LOG_EVENT(conn, PB_LOG_LEVEL_DEBUG, PB_LOG_NO_OBJECT,
+                 "setting %ld request %ld coalesced", NULL, setting, value);
+    return TRUE;
+  }
+
+  if (state->known && state->value == value)
+  {
+    PB_LOG_EVENT(conn, PB_LOG_LEVEL_DEBUG, PB_LOG_NO_OBJECT,
+                 "setting %ld already %ld", NULL, setting, value);
+    return TRUE;
+  }
+
+  return _setting_send(connection, conn, setting, value, error_cb);
+}
+
+int
+_pb_setting_get(DBusConnection *connection,
+                enum pb_setting_e setting,
+                PBCallReply reply)
+{
+  pb_connection_t *conn = _pb_connection_get(connection);
+
+  if (!conn)
+    return FALSE;
+
+  /* the reply goes to the callbacks of the connection */
+  dbus_connection_ref(connection);
+
+  if (!_pb_transport(conn)->get_settings(
+        connection, setting, NULL, reply, connection,
+        (DBusFreeFunction)dbus_connection_unref))
+  {
+    dbus_connection_unref(connection);
+    return FALSE;
+  }
+
+  return TRUE;
+}
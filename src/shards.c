@@ -0,0 +1,558 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libplayback/playback.h"
+#include "playback-private.h"
+
+/* Each shard runs a main loop of its own on its connection: the watches
+ * and timeouts of libdbus, plus a pipe that wakes it up for the calls of
+ * pb_shards_call() and when libdbus has something to dispatch.  Blocking
+ * in dbus_connection_read_write() instead would hold the I/O path of the
+ * connection, and a message sent from another thread would wait for the
+ * poll to time out. */
+
+typedef struct pb_shard_s pb_shard_t;
+typedef struct pb_shard_job_s pb_shard_job_t;
+typedef struct pb_shard_timeout_s pb_shard_timeout_t;
+
+struct pb_shard_job_s
+{
+  PBShardFunc func;
+  void *data;
+  pb_shard_job_t *next;
+};
+
+struct pb_shard_timeout_s
+{
+  DBusTimeout *timeout;
+  uint64_t deadline;
+};
+
+struct pb_shard_s
+{
+  DBusConnection *connection;
+  pthread_t thread;
+  int running;
+  int wake[2];
+
+  /* the calls queued by pb_shards_call() */
+  pthread_mutex_t lock;
+  pb_shard_job_t *first;
+  pb_shard_job_t *last;
+  int stopping;
+
+  /* only used by the thread of the shard */
+  DBusWatch **watches;
+  unsigned int n_watches;
+  pb_shard_timeout_t *timeouts;
+  unsigned int n_timeouts;
+  struct pollfd *fds;
+};
+
+struct pb_shards_s
+{
+  unsigned int n;
+  enum pb_shard_policy_e policy;
+  pb_shard_t *shards;
+};
+
+static void
+_shard_wakeup(void *data)
+{
+  pb_shard_t *shard = (pb_shard_t *)data;
+  char c = 0;
+
+  /* a full pipe is as good as a wakeup */
+  if (write(shard->wake[1], &c, 1) < 0 && errno != EAGAIN)
+    return;
+}
+
+static void
+_shard_dispatch_status(DBusConnection *connection,
+                       DBusDispatchStatus status,
+                       void *data)
+{
+  if (status == DBUS_DISPATCH_DATA_REMAINS)
+    _shard_wakeup(data);
+}
+
+static dbus_bool_t
+_shard_add_watch(DBusWatch *watch,
+                 void *data)
+{
+  pb_shard_t *shard = (pb_shard_t *)data;
+  DBusWatch **watches;
+  struct pollfd *fds;
+
+  watches = (DBusWatch **)realloc(shard->watches, (shard->n_watches + 1) *
+                                                  sizeof(DBusWatch *));
+
+  if (!watches)
+    return FALSE;
+
+  shard->watches = watches;
+
+  /* the wake pipe comes first */
+  fds = (struct pollfd *)realloc(shard->fds, (shard->n_watches + 2) *
+                                             sizeof(struct pollfd));
+
+  if (!fds)
+    return FALSE;
+
+  shard->fds = fds;
+  shard->watches[shard->n_watches++] = watch;
+  _shard_wakeup(shard);
+
+  return TRUE;
+}
+
+static void
+_shard_remove_watch(DBusWatch *watch,
+                    void *data)
+{
+  pb_shard_t *shard = (pb_shard_t *)data;
+  unsigned int i;
+
+  for (i = 0; i < shard->n_watches; i++)
+  {
+    if (shard->watches[i] == watch)
+    {
+      shard->watches[i] = shard->watches[--shard->n_watches];
+      break;
+    }
+  }
+}
+
+static void
+_shard_toggle_watch(DBusWatch *watch,
+                    void *data)
+{
+  _shard_wakeup(data);
+}
+
+static void
+_shard_timeout_arm(pb_shard_timeout_t *t)
+{
+  t->deadline = dbus_timeout_get_enabled(t->timeout) ?
+      _pb_time_us() + (uint64_t)dbus_timeout_get_interval(t->timeout) * 1000 :
+      UINT64_MAX;
+}
+
+static dbus_bool_t
+_shard_add_timeout(DBusTimeout *timeout,
+                   void *data)
+{
+  pb_shard_t *shard = (pb_shard_t *)data;
+  pb_shard_timeout_t *timeouts;
+
+  timeouts = (pb_shard_timeout_t *)realloc(
+        shard->timeouts, (shard->n_timeouts + 1) * sizeof(pb_shard_timeout_t));
+
+  if (!timeouts)
+    return FALSE;
+
+  shard->timeouts = timeouts;
+  timeouts[shard->n_timeouts].timeout = timeout;
+  _shard_timeout_arm(&timeouts[shard->n_timeouts++]);
+  _shard_wakeup(shard);
+
+  return TRUE;
+}
+
+static void
+_shard_remove_timeout(DBusTimeout *timeout,
+                      void *data)
+{
+  pb_shard_t *shard = (pb_shard_t *)data;
+  unsigned int i;
+
+  for (i = 0; i < shard->n_timeouts; i++)
+  {
+    if (shard->timeouts[i].timeout == timeout)
+    {
+      shard->timeouts[i] = shard->timeouts[--shard->n_timeouts];
+      break;
+    }
+  }
+}
+
+static void
+_shard_toggle_timeout(DBusTimeout *timeout,
+                      void *data)
+{
+  pb_shard_t *shard = (pb_shard_t *)data;
+  unsigned int i;
+
+  for (i = 0; i < shard->n_timeouts; i++)
+  {
+    if (shard->timeouts[i].timeout == timeout)
+      _shard_timeout_arm(&shard->timeouts[i]);
+  }
+
+  _shard_wakeup(shard);
+}
+
+/* Runs the calls queued so far; FALSE once the shard is stopping and
+ * none are left */
+static int
+_shard_run_jobs(pb_shard_t *shard)
+{
+  pb_shard_job_t *job;
+  int stopping;
+
+  pthread_mutex_lock(&shard->lock);
+  job = shard->first;
+  shard->first = shard->last = NULL;
+  stopping = shard->stopping;
+  pthread_mutex_unlock(&shard->lock);
+
+  if (!job)
+    return !stopping;
+
+  while (job)
+  {
+    pb_shard_job_t *next = job->next;
+
+    job->func(shard->connection, job->data);
+    free(job);
+    job = next;
+  }
+
+  return TRUE;
+}
+
+/* Handles the timeouts that are due; handling one may remove others, so
+ * the scan starts over after each */
+static int
+_shard_run_timeouts(pb_shard_t *shard)
+{
+  uint64_t now = _pb_time_us(), next = UINT64_MAX;
+  unsigned int i;
+
+again:
+  for (i = 0; i < shard->n_timeouts; i++)
+  {
+    pb_shard_timeout_t *t = &shard->timeouts[i];
+
+    if (t->deadline <= now)
+    {
+      DBusTimeout *timeout = t->timeout;
+
+      _shard_timeout_arm(t);
+      dbus_timeout_handle(timeout);
+      goto again;
+    }
+
+    if (t->deadline < next)
+      next = t->deadline;
+  }
+
+  if (next == UINT64_MAX)
+    return -1;
+
+  return (next - now + 999) / 1000;
+}
+
+static void
+_shard_handle_watch(pb_shard_t *shard,
+                    DBusWatch *watch,
+                    short revents)
+{
+  unsigned int flags = 0, i;
+
+  /* an earlier handler may have removed it */
+  for (i = 0; i < shard->n_watches && shard->watches[i] != watch; i++)
+    ;
+
+  if (i == shard->n_watches)
+    return;
+
+  if (revents & POLLIN)
+    flags |= DBUS_WATCH_READABLE;
+
+  if (revents & POLLOUT)
+    flags |= DBUS_WATCH_WRITABLE;
+
+  if (revents & POLLHUP)
+    flags |= DBUS_WATCH_HANGUP;
+
+  if (revents & POLLERR)
+    flags |= DBUS_WATCH_ERROR;
+
+  dbus_watch_handle(watch, flags);
+}
+
+static void *
+_shard_thread(void *data)
+{
+  pb_shard_t *shard = (pb_shard_t *)data;
+  DBusWatch *polled[64];
+  char buf[64];
+
+  pb_context_prepare(shard->connection, NULL, NULL);
+
+  while (_shard_run_jobs(shard))
+  {
+    unsigned int n = 0, i;
+    int timeout;
+
+    while (dbus_connection_dispatch(shard->connection) ==
+           DBUS_DISPATCH_DATA_REMAINS)
+      ;
+
+    timeout = _shard_run_timeouts(shard);
+    shard->fds[0].fd = shard->wake[0];
+    shard->fds[0].events = POLLIN;
+
+    for (i = 0; i < shard->n_watches && n < pb_n_elements(polled); i++)
+    {
+      DBusWatch *watch = shard->watches[i];
+      unsigned int flags = dbus_watch_get_flags(watch);
+
+      if (!dbus_watch_get_enabled(watch))
+        continue;
+
+      shard->fds[n + 1].fd = dbus_watch_get_unix_fd(watch);
+      shard->fds[n + 1].events = (flags & DBUS_WATCH_READABLE ? POLLIN : 0) |
+                                 (flags & DBUS_WATCH_WRITABLE ? POLLOUT : 0);
+      polled[n++] = watch;
+    }
+
+    if (poll(shard->fds, n + 1, timeout) <= 0)
+      continue;
+
+    if (shard->fds[0].revents)
+    {
+      while (read(shard->wake[0], buf, sizeof(buf)) == sizeof(buf))
+        ;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+      if (shard->fds[i + 1].revents)
+        _shard_handle_watch(shard, polled[i], shard->fds[i + 1].revents);
+    }
+  }
+
+  return NULL;
+}
+
+static int
+_shard_start(pb_shard_t *shard,
+             DBusBusType type)
+{
+  if (pipe(shard->wake))
+  {
+    shard->wake[0] = shard->wake[1] = -1;
+    return FALSE;
+  }
+
+  fcntl(shard->wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(shard->wake[1], F_SETFL, O_NONBLOCK);
+  fcntl(shard->wake[0], F_SETFD, FD_CLOEXEC);
+  fcntl(shard->wake[1], F_SETFD, FD_CLOEXEC);
+  pthread_mutex_init(&shard->lock, NULL);
+
+  if (!(shard->fds = (struct pollfd *)malloc(sizeof(struct pollfd))) ||
+      !(shard->connection = dbus_bus_get_private(type, NULL)))
+    return FALSE;
+
+  dbus_connection_set_exit_on_disconnect(shard->connection, FALSE);
+
+  if (!dbus_connection_set_watch_functions(shard->connection,
+                                           _shard_add_watch,
+                                           _shard_remove_watch,
+                                           _shard_toggle_watch, shard, NULL) ||
+      !dbus_connection_set_timeout_functions(shard->connection,
+                                             _shard_add_timeout,
+                                             _shard_remove_timeout,
+                                             _shard_toggle_timeout, shard,
+                                             NULL))
+    return FALSE;
+
+  dbus_connection_set_wakeup_main_function(shard->connection, _shard_wakeup,
+                                           shard, NULL);
+  dbus_connection_set_dispatch_status_function(shard->connection,
+                                               _shard_dispatch_status, shard,
+                                               NULL);
+
+  shard->running = !pthread_create(&shard->thread, NULL, _shard_thread,
+                                   shard);
+
+  return shard->running;
+}
+
+static void
+_shard_stop(pb_shard_t *shard)
+{
+  pb_shard_job_t *job;
+
+  if (shard->running)
+  {
+    pthread_mutex_lock(&shard->lock);
+    shard->stopping = TRUE;
+    pthread_mutex_unlock(&shard->lock);
+    _shard_wakeup(shard);
+    pthread_join(shard->thread, NULL);
+  }
+
+  if (shard->connection)
+  {
+    /* the Goodbye signals of the playbacks */
+    dbus_connection_flush(shard->connection);
+    dbus_connection_close(shard->connection);
+    dbus_connection_unref(shard->connection);
+  }
+
+  /* only left if the thread never ran */
+  while ((job = shard->first))
+  {
+    shard->first = job->next;
+    free(job);
+  }
+
+  if (shard->wake[0] >= 0)
+  {
+    close(shard->wake[0]);
+    close(shard->wake[1]);
+    pthread_mutex_destroy(&shard->lock);
+  }
+
+  free(shard->watches);
+  free(shard->timeouts);
+  free(shard->fds);
+}
+
+pb_shards_t *
+pb_shards_new(DBusBusType type,
+              unsigned int n_shards,
+              enum pb_shard_policy_e policy)
+{
+  pb_shards_t *shards;
+  unsigned int i;
+
+  if (!n_shards || !dbus_threads_init_default())
+    return NULL;
+
+  if (!(shards = (pb_shards_t *)calloc(1, sizeof(pb_shards_t))))
+    return NULL;
+
+  if (!(shards->shards = (pb_shard_t *)calloc(n_shards, sizeof(pb_shard_t))))
+  {
+    free(shards);
+    return NULL;
+  }
+
+  shards->policy = policy;
+
+  for (i = 0; i < n_shards; i++)
+  {
+    shards->shards[i].wake[0] = shards->shards[i].wake[1] = -1;
+    shards->n++;
+
+    if (!_shard_start(&shards->shards[i], type))
+    {
+      pb_shards_free(shards);
+      return NULL;
+    }
+  }
+
+  return shards;
+}
+
+void
+pb_shards_free(pb_shards_t *shards)
+{
+  unsigned int i;
+
+  if (!shards)
+    return;
+
+  for (i = 0; i < shards->n; i++)
+    _shard_stop(&shards->shards[i]);
+
+  free(shards->shards);
+  free(shards);
+}
+
+unsigned int
+pb_shards_size(pb_shards_t *shards)
+{
+  return shards ? shards->n : 0;
+}
+
+DBusConnection *
+pb_shards_get_connection(pb_shards_t *shards,
+                         unsigned int shard)
+{
+  if (!shards || shard >= shards->n)
+    return NULL;
+
+  return shards->shards[shard].connection;
+}
+
+unsigned int
+pb_shards_pick(pb_shards_t *shards,
+               enum pb_class_e pb_class,
+               uint32_t key)
+{
+  if (!shards)
+    return 0;
+
+  if (shards->policy == PB_SHARD_BY_CLASS)
+    return (unsigned int)pb_class % shards->n;
+
+  /* Fibonacci hashing, consecutive keys land on different shards */
+  return (uint32_t)(key * 2654435761U) % shards->n;
+}
+
+int
+pb_shards_call(pb_shards_t *shards,
+               unsigned int shard,
+               PBShardFunc func,
+               void *data)
+{
+  pb_shard_t *s;
+  pb_shard_job_t *job;
+  int stopping;
+
+  if (!shards || shard >= shards->n || !func)
+    return FALSE;
+
+  if (!(job = (pb_shard_job_t *)malloc(sizeof(pb_shard_job_t))))
+    return FALSE;
+
+  job->func = func;
+  job->data = data;
+  job->next = NULL;
+  s = &shards->shards[shard];
+
+  pthread_mutex_lock(&s->lock);
+
+  if (!(stopping = s->stopping))
+  {
+    if (s->last)
+      s->last->next = job;
+    else
+      s->first = job;
+
+    s->last = job;
+  }
+
+  pthread_mutex_unlock(&s->lock);
+
+  if (stopping)
+  {
+    free(job);
+    return FALSE;
+  }
+
+  _shard_wakeup(s);
+
+  return TRUE;
+}
@@ -0,0 +1,761 @@
+#include <dbus/dbus.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libplayback/playback.h"
+#include "playback-dbus.h"
+#include "playback-transport.h"
+
+/* The libdbus transport: calls to org.maemo.Playback.Manager over the
+ * bus, or over the peer connection of pb_peer_connect() while it is up.
+ * A call that went over the peer keeps its message, so that it can be
+ * sent again on the bus if the peer goes away before the reply. */
+
+enum dbus_call_kind_e
+{
+  CALL_STATE,
+  CALL_STATES,
+  CALL_ALLOWED,
+  CALL_SET,
+  CALL_GET,
+  CALL_GET_ALL
+};
+
+struct pb_dbus_call_s
+{
+  pb_call_t call;
+  DBusConnection *connection;
+  DBusPendingCall *pending;
+  enum dbus_call_kind_e kind;
+  enum pb_setting_e setting;
+  DBusMessage *message;
+  pb_dbus_call_t *prev;
+  pb_dbus_call_t *next;
+};
+
+static const struct
+{
+  const char *request;
+  const char *get;
+  const char *signal;
+  const char *prop;
+  int type;
+}
+settings_table[PB_SETTING_LAST] =
+{
+  {DBUS_PLAYBACK_REQ_MUTE_METHOD, DBUS_PLAYBACK_GET_MUTE_METHOD,
+   DBUS_MUTE_SIGNAL, DBUS_PLAYBACK_MUTE_PROP, DBUS_TYPE_BOOLEAN},
+  {DBUS_PLAYBACK_REQ_PRIVACY_METHOD, DBUS_PLAYBACK_GET_PRIVACY_METHOD,
+   DBUS_PRIVACY_SIGNAL, DBUS_PLAYBACK_PRIVACY_PROP, DBUS_TYPE_BOOLEAN},
+  {DBUS_PLAYBACK_REQ_BLUETOOTH_METHOD, DBUS_PLAYBACK_GET_BLUETOOTH_METHOD,
+   DBUS_BLUETOOTH_SIGNAL, DBUS_PLAYBACK_BLUETOOTH_PROP, DBUS_TYPE_INT32}
+};
+
+static void _dbus_notify(DBusPendingCall *pending, void *user_data);
+
+static DBusMessage *
+_dbus_method(const char *interface,
+             const char *method)
+{
+  return dbus_message_new_method_call(DBUS_PLAYBACK_MANAGER_SERVICE,
+                                      DBUS_PLAYBACK_MANAGER_PATH,
+                                      interface, method);
+}
+
+static void
+_dbus_peer_unlink(pb_dbus_call_t *dcall)
+{
+  pb_connection_t *conn;
+
+  if (!dcall->message)
+    return;
+
+  if ((conn = _pb_connection_get(dcall->connection)))
+  {
+    if (dcall->prev)
+      dcall->prev->next = dcall->next;
+    else if (conn->peer_calls == dcall)
+      conn->peer_calls = dcall->next;
+
+    if (dcall->next)
+      dcall->next->prev = dcall->prev;
+  }
+
+  dbus_message_unref(dcall->message);
+  dcall->message = NULL;
+  dcall->prev = dcall->next = NULL;
+}
+
+static void
+_dbus_call_free(pb_dbus_call_t *dcall)
+{
+  _dbus_peer_unlink(dcall);
+
+  if (dcall->pending)
+    dbus_pending_call_unref(dcall->pending);
+
+  _pb_call_finish(&dcall->call);
+  dbus_connection_unref(dcall->connection);
+  free(dcall);
+}
+
+/* Sends @message on the current route of @dcall->connection */
+static int
+_dbus_call_send(pb_dbus_call_t *dcall,
+                DBusMessage *message)
+{
+  DBusConnection *route = _pb_manager_route(dcall->connection);
+  pb_connection_t *conn = _pb_connection_get(dcall->connection);
+
+  if (!dbus_connection_send_with_reply(route, message, &dcall->pending, -1) ||
+      !dcall->pending)
+    return FALSE;
+
+  dbus_pending_call_set_notify(dcall->pending, _dbus_notify, dcall, NULL);
+
+  if (conn)
+    PB_CAPTURE(conn, PB_CAPTURE_SENT, message);
+
+  if (route != dcall->connection && conn)
+  {
+    dcall->message = dbus_message_ref(message);
+    dcall->next = conn->peer_calls;
+
+    if (dcall->next)
+      dcall->next->prev = dcall;
+
+    conn->peer_calls = dcall;
+  }
+
+  return TRUE;
+}
+
+/* Takes @message, which may be NULL if building it failed */
+static int
+_dbus_call(DBusConnection *connection,
+           DBusMessage *message,
+           enum dbus_call_kind_e kind,
+           enum pb_setting_e setting,
+           pb_call_t **call,
+           PBCallReply reply,
+           void *data,
+           DBusFreeFunction free_data)
+{
+  pb_dbus_call_t *dcall;
+
+  if (!message)
+    return FALSE;
+
+  if (!(dcall = (pb_dbus_call_t *)calloc(1, sizeof(pb_dbus_call_t))))
+  {
+    dbus_message_unref(message);
+    return FALSE;
+  }
+
+  _pb_call_init(&dcall->call, &_pb_dbus_transport, reply, data, free_data);
+  dcall->connection = dbus_connection_ref(connection);
+  dcall->kind = kind;
+  dcall->setting = setting;
+
+  if (!_dbus_call_send(dcall, message))
+  {
+    dbus_connection_unref(dcall->connection);
+    free(dcall);
+    dbus_message_unref(message);
+    return FALSE;
+  }
+
+  dbus_message_unref(message);
+
+  if (call)
+    *call = &dcall->call;
+
+  return TRUE;
+}
+
+/* Reads an array of state names; returns the number of states */
+static unsigned int
+_dbus_read_states(DBusMessageIter *iter,
+                  enum pb_state_e **states)
+{
+  DBusMessageIter array;
+  unsigned int n = 0;
+
+  *states = NULL;
+
+  if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY ||
+      dbus_message_iter_get_element_type(iter) != DBUS_TYPE_STRING)
+    return 0;
+
+  if (!(*states = (enum pb_state_e *)malloc(
+            dbus_message_iter_get_element_count(iter) *
+            sizeof(enum pb_state_e) + 1)))
+    return 0;
+
+  dbus_message_iter_recurse(iter, &array);
+
+  while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRING)
+  {
+    const char *state;
+
+    dbus_message_iter_get_basic(&array, &state);
+    (*states)[n++] = pb_string_to_state(state);
+    dbus_message_iter_next(&array);
+  }
+
+  return n;
+}
+
+/* Stores the value of @setting found at @iter in @reply */
+static void
+_dbus_read_setting(DBusMessageIter *iter,
+                   enum pb_setting_e setting,
+                   pb_reply_t *reply)
+{
+  if (dbus_message_iter_get_arg_type(iter) != settings_table[setting].type)
+    return;
+
+  /* both types are 32 bits wide */
+  dbus_message_iter_get_basic(iter, &reply->values[setting]);
+
+  if (settings_table[setting].type == DBUS_TYPE_BOOLEAN)
+    reply->values[setting] = reply->values[setting] == TRUE;
+
+  reply->settings |= 1U << setting;
+}
+
+static void
+_dbus_read_properties(DBusMessageIter *iter,
+                      pb_reply_t *reply)
+{
+  DBusMessageIter array, entry, value;
+  const char *name;
+  char *signature;
+  int setting, ok;
+
+  /* the keys are read as strings and the values recursed into */
+  signature = dbus_message_iter_get_signature(iter);
+  ok = signature && !strcmp(signature, "a{sv}");
+  dbus_free(signature);
+
+  if (!ok)
+    return;
+
+  dbus_message_iter_recurse(iter, &array);
+
+  while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_DICT_ENTRY)
+  {
+    dbus_message_iter_recurse(&array, &entry);
+    dbus_message_iter_get_basic(&entry, &name);
+    dbus_message_iter_next(&entry);
+    dbus_message_iter_recurse(&entry, &value);
+
+    for (setting = 0; setting < PB_SETTING_LAST; setting++)
+    {
+      if (!strcmp(name, settings_table[setting].prop))
+        _dbus_read_setting(&value, setting, reply);
+    }
+
+    dbus_message_iter_next(&array);
+  }
+}
+
+static void
+_dbus_notify(DBusPendingCall *pending,
+             void *user_data)
+{
+  pb_dbus_call_t *dcall = (pb_dbus_call_t *)user_data;
+  DBusMessage *message = dbus_pending_call_steal_reply(pending);
+  enum pb_state_e *states = NULL;
+  enum pb_state_e state;
+  DBusMessageIter iter;
+  pb_reply_t reply;
+  DBusError error;
+
+  memset(&reply, 0, sizeof(reply));
+  dbus_error_init(&error);
+  _pb_capture_message(_pb_connection_get(dcall->connection),
+                      PB_CAPTURE_RECEIVED, message);
+
+  if (dbus_set_error_from_message(&error, message))
+  {
+    reply.error = error.name;
+    reply.message = error.message;
+  }
+  else if (dbus_message_iter_init(message, &iter))
+  {
+    switch (dcall->kind)
+    {
+      case CALL_STATE:
+        if (dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_STRING)
+        {
+          const char *name;
+
+          dbus_message_iter_get_basic(&iter, &name);
+          state = pb_string_to_state(name);
+          reply.states = &state;
+          reply.n_states = 1;
+        }
+        break;
+      case CALL_STATES:
+      case CALL_ALLOWED:
+        reply.n_states = _dbus_read_states(&iter, &states);
+        reply.states = states;
+        break;
+      case CALL_GET:
+        _dbus_read_setting(&iter, dcall->setting, &reply);
+        break;
+      case CALL_GET_ALL:
+        _dbus_read_properties(&iter, &reply);
+        break;
+      default:
+        break;
+    }
+  }
+
+  /* the reply callback may free the data, but not the call */
+  _dbus_peer_unlink(dcall);
+
+  if (dcall->call.reply)
+    dcall->call.reply(&reply, dcall->call.data);
+
+  free(states);
+  dbus_error_free(&error);
+  dbus_message_unref(message);
+  _dbus_call_free(dcall);
+}
+
+static void
+_dbus_cancel(pb_call_t *call)
+{
+  pb_dbus_call_t *dcall = (pb_dbus_call_t *)call;
+
+  dbus_pending_call_cancel(dcall->pending);
+  _dbus_call_free(dcall);
+}
+
+static int
+_dbus_append_state(DBusMessageIter *iter,
+                   const pb_state_args_t *args)
+{
+  const char *state = pb_state_to_string(args->pb_state);
+  const char *stream = args->stream ? args->stream : "";
+  char _path[256];
+  const char *path = _path;
+  char _pid[64];
+  const char *pid = _pid;
+
+  snprintf(_path, sizeof(_path), PLAYBACK_PATH, args->object_id);
+  snprintf(_pid, sizeof(_pid), "%ld", (long)args->pid);
+
+  return dbus_message_iter_append_basic(iter, DBUS_TYPE_OBJECT_PATH, &path) &&
+         dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &state) &&
+         dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &pid) &&
+         dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &stream);
+}
+
+static int
+_dbus_request_states(DBusConnection *connection,
+                     const pb_state_args_t *args,
+                     unsigned int n,
+                     pb_call_t **call,
+                     PBCallReply reply,
+                     void *data,
+                     DBusFreeFunction free_data)
+{
+  DBusMessage *message;
+  DBusMessageIter iter, array, entry;
+  unsigned int i;
+
+  message = _dbus_method(DBUS_PLAYBACK_MANAGER_INTERFACE,
+                         n == 1 ? DBUS_PLAYBACK_REQ_STATE_METHOD :
+                                  DBUS_PLAYBACK_REQ_STATES_METHOD);
+
+  if (!message)
+    return FALSE;
+
+  dbus_message_iter_init_append(message, &iter);
+
+  if (n == 1)
+  {
+    if (!_dbus_append_state(&iter, args))
+      goto fail;
+
+    return _dbus_call(connection, message, CALL_STATE, 0, call, reply, data,
+                      free_data);
+  }
+
+  if (!dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(osss)",
+                                        &array))
+    goto fail;
+
+  for (i = 0; i < n; i++)
+  {
+    if (!dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL,
+                                          &entry) ||
+        !_dbus_append_state(&entry, &args[i]) ||
+        !dbus_message_iter_close_container(&array, &entry))
+    {
+      dbus_message_iter_abandon_container_if_open(&array, &entry);
+      dbus_message_iter_abandon_container(&iter, &array);
+      goto fail;
+    }
+  }
+
+  if (!dbus_message_iter_close_container(&iter, &array))
+    goto fail;
+
+  return _dbus_call(connection, message, CALL_STATES, 0, call, reply, data,
+                    free_data);
+
+fail:
+  dbus_message_unref(message);
+
+  return FALSE;
+}
+
+static int
+_dbus_get_allowed_state(DBusConnection *connection,
+                        const pb_state_args_t *args,
+                        pb_call_t **call,
+                        PBCallReply reply,
+                        void *data,
+                        DBusFreeFunction free_data)
+{
+  DBusMessage *message;
+  char _path[256];
+  const char *path = _path;
+
+  message = _dbus_method(DBUS_PLAYBACK_MANAGER_INTERFACE,
+                         DBUS_PLAYBACK_GET_ALLOWED_METHOD);
+  snprintf(_path, sizeof(_path), PLAYBACK_PATH, args->object_id);
+
+  if (message &&
+      !dbus_message_append_args(message,
+                                DBUS_TYPE_OBJECT_PATH, &path,
+                                DBUS_TYPE_INVALID))
+  {
+    dbus_message_unref(message);
+    message = NULL;
+  }
+
+  return _dbus_call(connection, message, CALL_ALLOWED, 0, call, reply, data,
+                    free_data);
+}
+
+static int
+_dbus_request_setting(DBusConnection *connection,
+                      enum pb_setting_e setting,
+                      int value,
+                      pb_call_t **call,
+                      PBCallReply reply,
+                      void *data,
+                      DBusFreeFunction free_data)
+{
+  dbus_bool_t v = value ? TRUE : FALSE;
+  DBusMessage *message;
+
+  message = _dbus_method(DBUS_PLAYBACK_MANAGER_INTERFACE,
+                         settings_table[setting].request);
+
+  if (message &&
+      !dbus_message_append_args(message,
+                                DBUS_TYPE_BOOLEAN, &v,
+                                DBUS_TYPE_INVALID))
+  {
+    dbus_message_unref(message);
+    message = NULL;
+  }
+
+  return _dbus_call(connection, message, CALL_SET, setting, call, reply, data,
+                    free_data);
+}
+
+static int
+_dbus_get_settings(DBusConnection *connection,
+                   enum pb_setting_e setting,
+                   pb_call_t **call,
+                   PBCallReply reply,
+                   void *data,
+                   DBusFreeFunction free_data)
+{
+  const char *iface = DBUS_PLAYBACK_MANAGER_INTERFACE;
+  DBusMessage *message;
+
+  if (setting < PB_SETTING_LAST)
+  {
+    message = _dbus_method(DBUS_PLAYBACK_MANAGER_INTERFACE,
+                           settings_table[setting].get);
+
+    return _dbus_call(connection, message, CALL_GET, setting, call, reply,
+                      data, free_data);
+  }
+
+  message = _dbus_method(DBUS_INTERFACE_PROPERTIES, "GetAll");
+
+  if (message &&
+      !dbus_message_append_args(message,
+                                DBUS_TYPE_STRING, &iface,
+                                DBUS_TYPE_INVALID))
+  {
+    dbus_message_unref(message);
+    message = NULL;
+  }
+
+  return _dbus_call(connection, message, CALL_GET_ALL, 0, call, reply, data,
+                    free_data);
+}
+
+static void
+_dbus_owner_signal(DBusConnection *connection,
+                   DBusMessage *message)
+{
+  const char *name, *old, *new;
+
+  if (dbus_message_get_args(message, NULL,
+                            DBUS_TYPE_STRING, &name,
+                            DBUS_TYPE_STRING, &old,
+                            DBUS_TYPE_STRING, &new,
+                            DBUS_TYPE_INVALID) &&
+      !strcmp(name, DBUS_PLAYBACK_MANAGER_SERVICE))
+    _pb_manager_owner(connection, *new != '\0');
+}
+
+static void
+_dbus_allowed_state_signal(DBusConnection *connection,
+                           DBusMessage *message)
+{
+  int allowed_state[PB_STATE_LAST] = {FALSE};
+  const char *cls;
+  char **states;
+  int i, len;
+
+  if (!dbus_message_get_args(message, NULL,
+                             DBUS_TYPE_STRING, &cls,
+                             DBUS_TYPE_ARRAY, DBUS_TYPE_STRING, &states, &len,
+                             DBUS_TYPE_INVALID))
+    return;
+
+  for (i = 0; i < len; i++)
+    allowed_state[pb_string_to_state(states[i])] = TRUE;
+
+  dbus_free_string_array(states);
+  _pb_manager_allowed_state(connection, pb_string_to_class(cls),
+                            allowed_state);
+}
+
+static DBusHandlerResult
+_dbus_filter(DBusConnection *connection,
+             DBusMessage *message,
+             void *user_data)
+{
+  DBusMessageIter iter;
+  int setting;
+
+  if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL)
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if (dbus_message_is_signal(message, DBUS_ADMIN_INTERFACE,
+                             DBUS_NAME_OWNER_CHANGED_SIGNAL))
+  {
+    _dbus_owner_signal(connection, message);
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  }
+
+  if (dbus_message_is_signal(message, DBUS_PLAYBACK_MANAGER_INTERFACE,
+                             DBUS_PLAYBACK_ALLOWED_STATE_PROP))
+  {
+    _dbus_allowed_state_signal(connection, message);
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+  }
+
+  for (setting = 0; setting < PB_SETTING_LAST; setting++)
+  {
+    pb_reply_t values;
+
+    if (!dbus_message_is_signal(message, DBUS_PLAYBACK_MANAGER_INTERFACE,
+                                settings_table[setting].signal) ||
+        !dbus_message_iter_init(message, &iter))
+      continue;
+
+    values.settings = 0;
+    _dbus_read_setting(&iter, setting, &values);
+
+    if (values.settings)
+      _pb_manager_setting(connection, setting, values.values[setting]);
+  }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+static void
+_dbus_add_match(DBusConnection *connection,
+                const char *rule,
+                int async)
+{
+  DBusError error;
+
+  /* without an error the match rules are added without blocking */
+  if (async)
+  {
+    dbus_bus_add_match(connection, rule, NULL);
+    return;
+  }
+
+  dbus_error_init(&error);
+  dbus_bus_add_match(connection, rule, &error);
+
+  if (dbus_error_is_set(&error))
+    dbus_error_free(&error);
+}
+
+/* Every playback watches the signals, but the bus only needs to hear
+ * about a rule once: the first watch adds it and the last unwatch
+ * removes it.  Only the first playback of a connection waits for the
+ * bus, or none after pb_context_prepare(). */
+static void
+_dbus_watch(DBusConnection *connection,
+            unsigned int what)
+{
+  pb_connection_t *conn = _pb_connection_get(connection);
+
+  if (!conn)
+    return;
+
+  if (!conn->signals_filtered)
+  {
+    conn->signals_filtered =
+        dbus_connection_add_filter(connection, _dbus_filter, NULL, NULL);
+  }
+
+  if ((what & PB_WATCH_SIGNALS) && !conn->signals_watched++)
+    _dbus_add_match(connection, MANAGER_SIGNALS_MATCH, what & PB_WATCH_ASYNC);
+
+  if ((what & PB_WATCH_OWNER) && !conn->owner_watched++)
+    _dbus_add_match(connection, MANAGER_OWNER_MATCH, what & PB_WATCH_ASYNC);
+}
+
+static void
+_dbus_unwatch(DBusConnection *connection,
+              unsigned int what)
+{
+  pb_connection_t *conn = _pb_connection_get(connection);
+
+  if (!conn)
+    return;
+
+  if ((what & PB_WATCH_SIGNALS) && conn->signals_watched &&
+      !--conn->signals_watched)
+    dbus_bus_remove_match(connection, MANAGER_SIGNALS_MATCH, NULL);
+
+  if ((what & PB_WATCH_OWNER) && conn->owner_watched &&
+      !--conn->owner_watched)
+    dbus_bus_remove_match(connection, MANAGER_OWNER_MATCH, NULL);
+}
+
+static void
+_dbus_announce(DBusConnection *connection,
+               const pb_state_args_t *args,
+               enum pb_announce_e what)
+{
+  DBusMessage *message;
+  char path[256];
+
+  snprintf(path, sizeof(path), PLAYBACK_PATH, args->object_id);
+
+  if (what == PB_ANNOUNCE_STATE)
+  {
+    const char *iface = DBUS_PLAYBACK_INTERFACE;
+    const char *prop = DBUS_PLAYBACK_STATE_PROP;
+    const char *state = pb_state_to_string(args->pb_state);
+
+    message = dbus_message_new_signal(path, DBUS_INTERFACE_PROPERTIES,
+                                      DBUS_NOTIFY_SIGNAL);
+
+    if (message &&
+        !dbus_message_append_args(message,
+                                  DBUS_TYPE_STRING, &iface,
+                                  DBUS_TYPE_STRING, &prop,
+                                  DBUS_TYPE_STRING, &state,
+                                  DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref(message);
+      message = NULL;
+    }
+  }
+  else
+  {
+    message = dbus_message_new_signal(path, DBUS_PLAYBACK_INTERFACE,
+                                      what == PB_ANNOUNCE_HELLO ?
+                                      DBUS_HELLO_SIGNAL :
+                                      DBUS_GOODBYE_SIGNAL);
+  }
+
+  if (message)
+  {
+    dbus_connection_send(connection, message, NULL);
+    _pb_capture_message(_pb_connection_get(connection), PB_CAPTURE_SENT,
+                        message);
+    dbus_message_unref(message);
+  }
+}
+
+void
+_pb_peer_lost(pb_connection_t *conn)
+{
+  pb_dbus_call_t *dcall;
+  long n = 0;
+
+  while ((dcall = conn->peer_calls))
+  {
+    DBusMessage *message = dbus_message_copy(dcall->message);
+
+    _dbus_peer_unlink(dcall);
+    dbus_pending_call_cancel(dcall->pending);
+    dbus_pending_call_unref(dcall->pending);
+    dcall->pending = NULL;
+    n++;
+
+    if (message && _dbus_call_send(dcall, message))
+    {
+      dbus_message_unref(message);
+      continue;
+    }
+
+    if (message)
+      dbus_message_unref(message);
+
+    /* as if the manager had not answered */
+    if (dcall->call.reply)
+    {
+      pb_reply_t reply;
+
+      memset(&reply, 0, sizeof(reply));
+      reply.error = DBUS_ERROR_NO_REPLY;
+      reply.message = "Peer connection lost";
+      dcall->call.reply(&reply, dcall->call.data);
+    }
+
+    _dbus_call_free(dcall);
+  }
+
+  if (n)
+  {
+    PB_LOG_EVENT(conn, PB_LOG_LEVEL_INFO, PB_LOG_NO_OBJECT,
+                 "%ld calls lost with the peer, sent on the bus", NULL, n, 0);
+  }
+}
+
+const pb_transport_t _pb_dbus_transport =
+{
+  "dbus",
+  _dbus_request_states,
+  _dbus_get_allowed_state,
+  _dbus_request_setting,
+  _dbus_get_settings,
+  _dbus_cancel,
+  _dbus_watch,
+  _dbus_unwatch,
+  _dbus_announce
+};
@@ -0,0 +1,712 @@
+#include <dbus/dbus.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <systemd/sd-bus.h>
+
+#include "libplayback/playback.h"
+#include "libplayback/playback-sdbus.h"
+#include "playback-dbus.h"
+#include "playback-transport.h"
+
+/* The sd-bus transport, built with SDBUS=1: the calls to the manager and
+ * its signals go over an sd_bus of the application, see
+ * pb_sdbus_attach().  The playback objects stay on the DBusConnection,
+ * and so do their Hello, Notify and Goodbye signals: the manager calls
+ * back the sender of Hello. */
+
+enum sdbus_call_kind_e
+{
+  CALL_STATE,
+  CALL_STATES,
+  CALL_ALLOWED,
+  CALL_SET,
+  CALL_GET,
+  CALL_GET_ALL
+};
+
+/* Shared by the connection and its calls in flight, so that detaching
+ * does not take the bus from under them */
+struct pb_sdbus_s
+{
+  int refcount;
+  sd_bus *bus;
+  DBusConnection *connection;
+  sd_bus_slot *signals_slot;
+  sd_bus_slot *owner_slot;
+  unsigned int signals_watched;
+  unsigned int owner_watched;
+};
+
+typedef struct pb_sdbus_call_s pb_sdbus_call_t;
+
+struct pb_sdbus_call_s
+{
+  pb_call_t call;
+  pb_sdbus_t *sdbus;
+  DBusConnection *connection;
+  sd_bus_slot *slot;
+  enum sdbus_call_kind_e kind;
+  enum pb_setting_e setting;
+};
+
+static const struct
+{
+  const char *request;
+  const char *get;
+  const char *signal;
+  const char *prop;
+  const char *type;
+}
+settings_table[PB_SETTING_LAST] =
+{
+  {DBUS_PLAYBACK_REQ_MUTE_METHOD, DBUS_PLAYBACK_GET_MUTE_METHOD,
+   DBUS_MUTE_SIGNAL, DBUS_PLAYBACK_MUTE_PROP, "b"},
+  {DBUS_PLAYBACK_REQ_PRIVACY_METHOD, DBUS_PLAYBACK_GET_PRIVACY_METHOD,
+   DBUS_PRIVACY_SIGNAL, DBUS_PLAYBACK_PRIVACY_PROP, "b"},
+  {DBUS_PLAYBACK_REQ_BLUETOOTH_METHOD, DBUS_PLAYBACK_GET_BLUETOOTH_METHOD,
+   DBUS_BLUETOOTH_SIGNAL, DBUS_PLAYBACK_BLUETOOTH_PROP, "i"}
+};
+
+static pb_sdbus_t *
+_sdbus_get(DBusConnection *connection)
+{
+  pb_connection_t *conn = _pb_connection_get(connection);
+
+  return conn ? conn->sdbus : NULL;
+}
+
+static void
+_sdbus_unref(pb_sdbus_t *sdbus)
+{
+  if (--sdbus->refcount > 0)
+    return;
+
+  sd_bus_slot_unref(sdbus->signals_slot);
+  sd_bus_slot_unref(sdbus->owner_slot);
+  sd_bus_unref(sdbus->bus);
+  free(sdbus);
+}
+
+void
+_pb_sdbus_free(pb_sdbus_t *sdbus)
+{
+  if (!sdbus)
+    return;
+
+  /* no more signals for a connection that is going away, nor a
+   * RegisterPeer reply */
+  sdbus->connection = NULL;
+  sdbus->signals_slot = sd_bus_slot_unref(sdbus->signals_slot);
+  sdbus->owner_slot = sd_bus_slot_unref(sdbus->owner_slot);
+  _sdbus_unref(sdbus);
+}
+
+static void
+_sdbus_call_free(pb_sdbus_call_t *scall)
+{
+  sd_bus_slot_unref(scall->slot);
+  _pb_call_finish(&scall->call);
+  _sdbus_unref(scall->sdbus);
+  dbus_connection_unref(scall->connection);
+  free(scall);
+}
+
+/* A manager that does not know RegisterPeer would take the calls from
+ * @sdbus for another client than the one serving the playbacks, so it
+ * gets them over libdbus instead.  An absent manager is not an answer,
+ * the next one is told when it appears. */
+static int
+_sdbus_registered(sd_bus_message *m,
+                  void *userdata,
+                  sd_bus_error *ret_error)
+{
+  pb_sdbus_t *sdbus = (pb_sdbus_t *)userdata;
+  DBusConnection *connection = sdbus->connection;
+  pb_connection_t *conn;
+  const sd_bus_error *error;
+
+  if (connection && sd_bus_message_is_method_error(m, NULL) &&
+      (conn = _pb_connection_get(connection)) && conn->sdbus == sdbus)
+  {
+    error = sd_bus_message_get_error(m);
+
+    if (strcmp(error->name, DBUS_ERROR_SERVICE_UNKNOWN) &&
+        strcmp(error->name, DBUS_ERROR_NAME_HAS_NO_OWNER))
+    {
+      PB_LOG_EVENT(conn, PB_LOG_LEVEL_WARNING, PB_LOG_NO_OBJECT,
+                   "RegisterPeer failed, manager calls go over libdbus",
+                   error->name, 0, 0);
+      pb_sdbus_detach(connection);
+    }
+  }
+
+  _sdbus_unref(sdbus);
+
+  return 0;
+}
+
+/* Tells the manager which bus client the calls from @sdbus are for, as
+ * pb_peer_connect() does for the peer: the playback objects and their
+ * Hello are on the DBusConnection.  Messages from one sender arrive in
+ * order, so the calls do not wait for the reply. */
+static void
+_sdbus_register(pb_sdbus_t *sdbus)
+{
+  const char *name = dbus_bus_get_unique_name(sdbus->connection);
+
+  if (name &&
+      sd_bus_call_method_async(sdbus->bus, NULL, DBUS_PLAYBACK_MANAGER_SERVICE,
+                               DBUS_PLAYBACK_MANAGER_PATH,
+                               DBUS_PLAYBACK_MANAGER_INTERFACE,
+                               DBUS_PLAYBACK_REGISTER_PEER_METHOD,
+                               _sdbus_registered, sdbus, "s", name) >= 0)
+    sdbus->refcount++;
+}
+
+static void
+_sdbus_free_strv(char **strv)
+{
+  char **s;
+
+  for (s = strv; s && *s; s++)
+    free(*s);
+
+  free(strv);
+}
+
+/* Converts an array of state names, freeing it; returns the number of
+ * states */
+static unsigned int
+_sdbus_states(char **strv,
+              enum pb_state_e **states)
+{
+  unsigned int n = 0;
+
+  while (strv && strv[n])
+    n++;
+
+  if ((*states = (enum pb_state_e *)malloc(n * sizeof(enum pb_state_e) + 1)))
+  {
+    for (n = 0; strv && strv[n]; n++)
+      (*states)[n] = pb_string_to_state(strv[n]);
+  }
+  else
+    n = 0;
+
+  _sdbus_free_strv(strv);
+
+  return n;
+}
+
+/* Reads the value of @setting, of the type of the settings table */
+static void
+_sdbus_read_setting(sd_bus_message *m,
+                    enum pb_setting_e setting,
+                    pb_reply_t *reply)
+{
+  int value;
+
+  if (sd_bus_message_read(m, settings_table[setting].type, &value) > 0)
+  {
+    reply->values[setting] = value;
+    reply->settings |= 1U << setting;
+  }
+}
+
+static void
+_sdbus_read_properties(sd_bus_message *m,
+                       pb_reply_t *reply)
+{
+  const char *name;
+  int setting;
+
+  if (sd_bus_message_enter_container(m, SD_BUS_TYPE_ARRAY, "{sv}") <= 0)
+    return;
+
+  while (sd_bus_message_enter_container(m, SD_BUS_TYPE_DICT_ENTRY, "sv") > 0)
+  {
+    if (sd_bus_message_read(m, "s", &name) <= 0)
+      return;
+
+    for (setting = 0; setting < PB_SETTING_LAST; setting++)
+    {
+      if (!strcmp(name, settings_table[setting].prop))
+        break;
+    }
+
+    if (setting < PB_SETTING_LAST &&
+        sd_bus_message_enter_container(m, SD_BUS_TYPE_VARIANT,
+                                       settings_table[setting].type) > 0)
+    {
+      _sdbus_read_setting(m, setting, reply);
+      sd_bus_message_exit_container(m);
+    }
+    else if (sd_bus_message_skip(m, "v") < 0)
+      return;
+
+    sd_bus_message_exit_container(m);
+  }
+
+  sd_bus_message_exit_container(m);
+}
+
+static int
+_sdbus_reply(sd_bus_message *m,
+             void *userdata,
+             sd_bus_error *ret_error)
+{
+  pb_sdbus_call_t *scall = (pb_sdbus_call_t *)userdata;
+  enum pb_state_e *states = NULL;
+  enum pb_state_e state;
+  const sd_bus_error *error;
+  const char *name;
+  char **strv = NULL;
+  pb_reply_t reply;
+
+  memset(&reply, 0, sizeof(reply));
+
+  if (sd_bus_message_is_method_error(m, NULL))
+  {
+    error = sd_bus_message_get_error(m);
+    reply.error = error->name;
+    reply.message = error->message;
+  }
+  else
+  {
+    switch (scall->kind)
+    {
+      case CALL_STATE:
+        if (sd_bus_message_read(m, "s", &name) > 0)
+        {
+          state = pb_string_to_state(name);
+          reply.states = &state;
+          reply.n_states = 1;
+        }
+        break;
+      case CALL_STATES:
+      case CALL_ALLOWED:
+        if (sd_bus_message_read_strv(m, &strv) >= 0)
+        {
+          reply.n_states = _sdbus_states(strv, &states);
+          reply.states = states;
+        }
+        break;
+      case CALL_GET:
+        _sdbus_read_setting(m, scall->setting, &reply);
+        break;
+      case CALL_GET_ALL:
+        _sdbus_read_properties(m, &reply);
+        break;
+      default:
+        break;
+    }
+  }
+
+  if (scall->call.reply)
+    scall->call.reply(&reply, scall->call.data);
+
+  free(states);
+  _sdbus_call_free(scall);
+
+  return 0;
+}
+
+/* Takes @m, which may be NULL if building it failed */
+static int
+_sdbus_call(DBusConnection *connection,
+            sd_bus_message *m,
+            enum sdbus_call_kind_e kind,
+            enum pb_setting_e setting,
+            pb_call_t **call,
+            PBCallReply reply,
+            void *data,
+            DBusFreeFunction free_data)
+{
+  pb_sdbus_t *sdbus = _sdbus_get(connection);
+  pb_sdbus_call_t *scall;
+
+  if (!m)
+    return FALSE;
+
+  if (!sdbus ||
+      !(scall = (pb_sdbus_call_t *)calloc(1, sizeof(pb_sdbus_call_t))))
+  {
+    sd_bus_message_unref(m);
+    return FALSE;
+  }
+
+  /* a timeout of 0 is the bus default, as with libdbus */
+  if (sd_bus_call_async(sdbus->bus, &scall->slot, m, _sdbus_reply, scall,
+                        0) < 0)
+  {
+    free(scall);
+    sd_bus_message_unref(m);
+    return FALSE;
+  }
+
+  sd_bus_message_unref(m);
+  _pb_call_init(&scall->call, &_pb_sdbus_transport, reply, data, free_data);
+  scall->sdbus = sdbus;
+  sdbus->refcount++;
+  scall->connection = dbus_connection_ref(connection);
+  scall->kind = kind;
+  scall->setting = setting;
+
+  if (call)
+    *call = &scall->call;
+
+  return TRUE;
+}
+
+static sd_bus_message *
+_sdbus_method(DBusConnection *connection,
+              const char *interface,
+              const char *method)
+{
+  pb_sdbus_t *sdbus = _sdbus_get(connection);
+  sd_bus_message *m = NULL;
+
+  if (!sdbus ||
+      sd_bus_message_new_method_call(sdbus->bus, &m,
+                                     DBUS_PLAYBACK_MANAGER_SERVICE,
+                                     DBUS_PLAYBACK_MANAGER_PATH,
+                                     interface, method) < 0)
+    return NULL;
+
+  return m;
+}
+
+static int
+_sdbus_append_state(sd_bus_message *m,
+                    const pb_state_args_t *args)
+{
+  char path[256];
+  char pid[64];
+
+  snprintf(path, sizeof(path), PLAYBACK_PATH, args->object_id);
+  snprintf(pid, sizeof(pid), "%ld", (long)args->pid);
+
+  return sd_bus_message_append(m, "osss", path,
+                               pb_state_to_string(args->pb_state), pid,
+                               args->stream ? args->stream : "") >= 0;
+}
+
+static int
+_sdbus_request_states(DBusConnection *connection,
+                      const pb_state_args_t *args,
+                      unsigned int n,
+                      pb_call_t **call,
+                      PBCallReply reply,
+                      void *data,
+                      DBusFreeFunction free_data)
+{
+  sd_bus_message *m;
+  unsigned int i;
+
+  m = _sdbus_method(connection, DBUS_PLAYBACK_MANAGER_INTERFACE,
+                    n == 1 ? DBUS_PLAYBACK_REQ_STATE_METHOD :
+                             DBUS_PLAYBACK_REQ_STATES_METHOD);
+
+  if (!m)
+    return FALSE;
+
+  if (n == 1)
+  {
+    if (!_sdbus_append_state(m, args))
+      goto fail;
+
+    return _sdbus_call(connection, m, CALL_STATE, 0, call, reply, data,
+                       free_data);
+  }
+
+  if (sd_bus_message_open_container(m, SD_BUS_TYPE_ARRAY, "(osss)") < 0)
+    goto fail;
+
+  for (i = 0; i < n; i++)
+  {
+    if (sd_bus_message_open_container(m, SD_BUS_TYPE_STRUCT, "osss") < 0 ||
+        !_sdbus_append_state(m, &args[i]) ||
+        sd_bus_message_close_container(m) < 0)
+      goto fail;
+  }
+
+  if (sd_bus_message_close_container(m) < 0)
+    goto fail;
+
+  return _sdbus_call(connection, m, CALL_STATES, 0, call, reply, data,
+                     free_data);
+
+fail:
+  sd_bus_message_unref(m);
+
+  return FALSE;
+}
+
+static int
+_sdbus_get_allowed_state(DBusConnection *connection,
+                         const pb_state_args_t *args,
+                         pb_call_t **call,
+                         PBCallReply reply,
+                         void *data,
+                         DBusFreeFunction free_data)
+{
+  sd_bus_message *m;
+  char path[256];
+
+  m = _sdbus_method(connection, DBUS_PLAYBACK_MANAGER_INTERFACE,
+                    DBUS_PLAYBACK_GET_ALLOWED_METHOD);
+  snprintf(path, sizeof(path), PLAYBACK_PATH, args->object_id);
+
+  if (m && sd_bus_message_append(m, "o", path) < 0)
+    m = sd_bus_message_unref(m);
+
+  return _sdbus_call(connection, m, CALL_ALLOWED, 0, call, reply, data,
+                     free_data);
+}
+
+static int
+_sdbus_request_setting(DBusConnection *connection,
+                       enum pb_setting_e setting,
+                       int value,
+                       pb_call_t **call,
+                       PBCallReply reply,
+                       void *data,
+                       DBusFreeFunction free_data)
+{
+  sd_bus_message *m;
+
+  m = _sdbus_method(connection, DBUS_PLAYBACK_MANAGER_INTERFACE,
+                    settings_table[setting].request);
+
+  /* all the Request methods take a boolean, as with libdbus */
+  if (m && sd_bus_message_append(m, "b", value ? 1 : 0) < 0)
+    m = sd_bus_message_unref(m);
+
+  return _sdbus_call(connection, m, CALL_SET, setting, call, reply, data,
+                     free_data);
+}
+
+static int
+_sdbus_get_settings(DBusConnection *connection,
+                    enum pb_setting_e setting,
+                    pb_call_t **call,
+                    PBCallReply reply,
+                    void *data,
+                    DBusFreeFunction free_data)
+{
+  sd_bus_message *m;
+
+  if (setting < PB_SETTING_LAST)
+  {
+    m = _sdbus_method(connection, DBUS_PLAYBACK_MANAGER_INTERFACE,
+                      settings_table[setting].get);
+
+    return _sdbus_call(connection, m, CALL_GET, setting, call, reply, data,
+                       free_data);
+  }
+
+  m = _sdbus_method(connection, DBUS_INTERFACE_PROPERTIES, "GetAll");
+
+  if (m && sd_bus_message_append(m, "s", DBUS_PLAYBACK_MANAGER_INTERFACE) < 0)
+    m = sd_bus_message_unref(m);
+
+  return _sdbus_call(connection, m, CALL_GET_ALL, 0, call, reply, data,
+                     free_data);
+}
+
+static void
+_sdbus_cancel(pb_call_t *call)
+{
+  /* dropping the slot cancels the call */
+  _sdbus_call_free((pb_sdbus_call_t *)call);
+}
+
+static int
+_sdbus_signal(sd_bus_message *m,
+              void *userdata,
+              sd_bus_error *ret_error)
+{
+  pb_sdbus_t *sdbus = (pb_sdbus_t *)userdata;
+  DBusConnection *connection = sdbus->connection;
+  const char *name, *old, *new;
+  int setting;
+
+  if (sd_bus_message_is_signal(m, DBUS_ADMIN_INTERFACE,
+                               DBUS_NAME_OWNER_CHANGED_SIGNAL))
+  {
+    if (sd_bus_message_read(m, "sss", &name, &old, &new) > 0 &&
+        !strcmp(name, DBUS_PLAYBACK_MANAGER_SERVICE))
+    {
+      /* a new manager has not heard of us */
+      if (*new)
+        _sdbus_register(sdbus);
+
+      _pb_manager_owner(connection, *new != '\0');
+    }
+
+    return 0;
+  }
+
+  if (sd_bus_message_is_signal(m, DBUS_PLAYBACK_MANAGER_INTERFACE,
+                               DBUS_PLAYBACK_ALLOWED_STATE_PROP))
+  {
+    int allowed_state[PB_STATE_LAST] = {FALSE};
+    char **strv = NULL, **s;
+
+    if (sd_bus_message_read(m, "s", &name) > 0 &&
+        sd_bus_message_read_strv(m, &strv) >= 0)
+    {
+      for (s = strv; s && *s; s++)
+        allowed_state[pb_string_to_state(*s)] = TRUE;
+
+      _pb_manager_allowed_state(connection, pb_string_to_class(name),
+                                allowed_state);
+    }
+
+    _sdbus_free_strv(strv);
+
+    return 0;
+  }
+
+  for (setting = 0; setting < PB_SETTING_LAST; setting++)
+  {
+    int value;
+
+    if (sd_bus_message_is_signal(m, DBUS_PLAYBACK_MANAGER_INTERFACE,
+                                 settings_table[setting].signal) &&
+        sd_bus_message_read(m, settings_table[setting].type, &value) > 0)
+      _pb_manager_setting(connection, setting, value);
+  }
+
+  return 0;
+}
+
+/* The match rules of the bus are counted per watch, as in the libdbus
+ * transport; here one slot stands for all of them */
+static void
+_sdbus_watch(DBusConnection *connection,
+             unsigned int what)
+{
+  pb_sdbus_t *sdbus = _sdbus_get(connection);
+
+  if (!sdbus)
+    return;
+
+  /* sd-bus only adds match rules asynchronously */
+  if ((what & PB_WATCH_SIGNALS) && !sdbus->signals_watched++)
+  {
+    sd_bus_add_match_async(sdbus->bus, &sdbus->signals_slot,
+                           MANAGER_SIGNALS_MATCH, _sdbus_signal, NULL, sdbus);
+  }
+
+  if ((what & PB_WATCH_OWNER) && !sdbus->owner_watched++)
+  {
+    sd_bus_add_match_async(sdbus->bus, &sdbus->owner_slot,
+                           MANAGER_OWNER_MATCH, _sdbus_signal, NULL, sdbus);
+  }
+}
+
+static void
+_sdbus_unwatch(DBusConnection *connection,
+               unsigned int what)
+{
+  pb_sdbus_t *sdbus = _sdbus_get(connection);
+
+  if (!sdbus)
+    return;
+
+  if ((what & PB_WATCH_SIGNALS) && sdbus->signals_watched &&
+      !--sdbus->signals_watched)
+    sdbus->signals_slot = sd_bus_slot_unref(sdbus->signals_slot);
+
+  if ((what & PB_WATCH_OWNER) && sdbus->owner_watched &&
+      !--sdbus->owner_watched)
+    sdbus->owner_slot = sd_bus_slot_unref(sdbus->owner_slot);
+}
+
+static void
+_sdbus_announce(DBusConnection *connection,
+                const pb_state_args_t *args,
+                enum pb_announce_e what)
+{
+  _pb_dbus_transport.announce(connection, args, what);
+}
+
+/* Moves the watches taken by the playbacks from one transport to the
+ * other, one by one, so that their unwatch() on destroy finds them */
+static void
+_sdbus_move_watches(DBusConnection *connection,
+                    const pb_transport_t *from,
+                    const pb_transport_t *to,
+                    unsigned int signals,
+                    unsigned int owner)
+{
+  for (; signals; signals--)
+  {
+    to->watch(connection, PB_WATCH_SIGNALS | PB_WATCH_ASYNC);
+    from->unwatch(connection, PB_WATCH_SIGNALS);
+  }
+
+  for (; owner; owner--)
+  {
+    to->watch(connection, PB_WATCH_OWNER | PB_WATCH_ASYNC);
+    from->unwatch(connection, PB_WATCH_OWNER);
+  }
+}
+
+const pb_transport_t _pb_sdbus_transport =
+{
+  "sd-bus",
+  _sdbus_request_states,
+  _sdbus_get_allowed_state,
+  _sdbus_request_setting,
+  _sdbus_get_settings,
+  _sdbus_cancel,
+  _sdbus_watch,
+  _sdbus_unwatch,
+  _sdbus_announce
+};
+
+int
+pb_sdbus_attach(DBusConnection *connection,
+                sd_bus *bus)
+{
+  pb_connection_t *conn;
+  pb_sdbus_t *sdbus;
+
+  if (!connection || !bus || !(conn = _pb_connection_get(connection)) ||
+      conn->sdbus)
+    return FALSE;
+
+  if (!(sdbus = (pb_sdbus_t *)calloc(1, sizeof(pb_sdbus_t))))
+    return FALSE;
+
+  sdbus->refcount = 1;
+  sdbus->bus = sd_bus_ref(bus);
+  sdbus->connection = connection;
+  conn->sdbus = sdbus;
+  _sdbus_move_watches(connection, &_pb_dbus_transport, &_pb_sdbus_transport,
+                      conn->signals_watched, conn->owner_watched);
+  _sdbus_register(sdbus);
+  PB_LOG_EVENT(conn, PB_LOG_LEVEL_INFO, PB_LOG_NO_OBJECT,
+               "manager calls go over sd-bus", NULL, 0, 0);
+
+  return TRUE;
+}
+
+void
+pb_sdbus_detach(DBusConnection *connection)
+{
+  pb_connection_t *conn;
+
+  if (!connection || !(conn = _pb_connection_get(connection)) ||
+      !conn->sdbus)
+    return;
+
+  _sdbus_move_watches(connection, &_pb_sdbus_transport, &_pb_dbus_transport,
+                      conn->sdbus->signals_watched,
+                      conn->sdbus->owner_watched);
+  _pb_sdbus_free(conn->sdbus);
+  conn->sdbus = NULL;
+}
@@ -0,0 +1,44 @@
+#include <dbus/dbus.h>
+
+#include "playback-transport.h"
+
+const pb_transport_t *
+_pb_transport(pb_connection_t *conn)
+{
+  if (conn && conn->loopback)
+    return &_pb_loopback_transport;
+
+#ifdef HAVE_SD_BUS
+  if (conn && conn->sdbus)
+    return &_pb_sdbus_transport;
+#endif
+
+  return &_pb_dbus_transport;
+}
+
+void
+_pb_call_init(pb_call_t *call,
+              const pb_transport_t *transport,
+              PBCallReply reply,
+              void *data,
+              DBusFreeFunction free_data)
+{
+  call->transport = transport;
+  call->reply = reply;
+  call->data = data;
+  call->free_data = free_data;
+}
+
+void
+_pb_call_cancel(pb_call_t *call)
+{
+  if (call)
+    call->transport->cancel(call);
+}
+
+void
+_pb_call_finish(pb_call_t *call)
+{
+  if (call->free_data)
+    call->free_data(call->data);
+}